@@ -7,6 +7,8 @@ typedef enum {
     VEMU_ECALL_START_TRACE,
     VEMU_ECALL_TRACE_RESULT,
     VEMU_ECALL_TEST_ASSERT,
+    VEMU_ECALL_CHECKPOINT,
+    VEMU_ECALL_TIME,
 } vemu_ecall_t;
 
 #endif
@@ -0,0 +1,12 @@
+#ifndef VEMU_COMMON_MMIO_H
+#define VEMU_COMMON_MMIO_H
+
+/* The console that vemu --console maps: each byte stored to its data
+   register is printed, and its count register reads how many have been
+   so far */
+#define VEMU_MMIO_CONSOLE_BASE      0xF0000000
+#define VEMU_MMIO_CONSOLE_SIZE      0x1000
+#define VEMU_MMIO_CONSOLE_DATA      0x0
+#define VEMU_MMIO_CONSOLE_COUNT     0x4
+
+#endif
@@ -59,3 +59,5 @@ do {                                                \
 #define START_TRACE()           ECALL0(VEMU_ECALL_START_TRACE)
 #define TRACE_RESULT(res)       ECALL0_RET(VEMU_ECALL_TRACE_RESULT, res)
 #define TEST_ASSERT(x, y)       ECALL3(VEMU_ECALL_TEST_ASSERT, __LINE__, x, y)
+#define CHECKPOINT(index)       ECALL0_RET(VEMU_ECALL_CHECKPOINT, index)
+#define GET_TIME(us)            ECALL0_RET(VEMU_ECALL_TIME, us)
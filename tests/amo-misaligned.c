@@ -0,0 +1,26 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* A misaligned atomic faults and stops the hart: the run ends with a
+   misaligned access fault at the address of word + 1, after printing 1
+   and before anything else */
+static uint32_t word[2] __attribute__((aligned(8)));
+
+int _start() {
+    uint32_t old;
+
+    asm volatile("amoadd.w %0, %2, (%1)"
+                 : "=r"(old) : "r"(word), "r"(1) : "memory");
+    TEST_ASSERT(old, 0);
+    TEST_ASSERT(word[0], 1);
+    PRINT_INT(1);
+
+    asm volatile("amoadd.w %0, %2, (%1)"
+                 : "=r"(old) : "r"((uintptr_t)word + 1), "r"(1) : "memory");
+
+    /* Never reached */
+    TEST_ASSERT(0, 1);
+    PRINT_INT(2);
+
+    return 0;
+}
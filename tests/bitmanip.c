@@ -0,0 +1,70 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* Operands go through volatiles so the compiler emits the Zba, Zbb and
+   Zbs instructions instead of folding them. Built with MARCH=rv32imafd
+   the same code becomes shift-and-mask sequences, which makes the loop
+   at the end a benchmark of one against the other. */
+static volatile uint32_t vu[] = {
+    0, 1, 0x80000000u, 0xFFFFFFFFu, 0x12345678u, 0x00F000A0u, 31, 33
+};
+
+static uint32_t rol(uint32_t x, uint32_t n) {
+    return (x << (n & 31)) | (x >> (-n & 31));
+}
+
+static uint32_t ror(uint32_t x, uint32_t n) {
+    return (x >> (n & 31)) | (x << (-n & 31));
+}
+
+int _start() {
+    uint32_t zero = vu[0], one = vu[1], top = vu[2], ones = vu[3];
+    uint32_t x = vu[4], sparse = vu[5];
+
+    /* Counts are defined for zero */
+    TEST_ASSERT(__builtin_clz(one), 31);
+    TEST_ASSERT(__builtin_ctz(top), 31);
+    TEST_ASSERT(zero ? __builtin_clz(zero) : 32, 32);
+    TEST_ASSERT(__builtin_popcount(x), 13);
+    TEST_ASSERT(__builtin_popcount(ones), 32);
+    TEST_ASSERT(__builtin_ctz(sparse), 5);
+
+    TEST_ASSERT(__builtin_bswap32(x), 0x78563412u);
+    TEST_ASSERT(rol(x, vu[7]), 0x2468ACF0u);
+    TEST_ASSERT(ror(x, vu[6]), 0x2468ACF0u);
+    TEST_ASSERT(ror(x, 8), 0x78123456u);
+
+    TEST_ASSERT(x & ~sparse, 0x12045658u);
+    TEST_ASSERT(x | ~sparse, 0xFF3FFF7Fu);
+    TEST_ASSERT(~(x ^ sparse), 0xED3BA927u);
+
+    TEST_ASSERT((int32_t)top < (int32_t)one ? top : one, top);
+    TEST_ASSERT(top < one ? top : one, one);
+    TEST_ASSERT((int32_t)(int8_t)vu[4], 0x78);
+    TEST_ASSERT((int32_t)(int16_t)vu[3], -1);
+    TEST_ASSERT((uint16_t)vu[3], 0xFFFF);
+
+    /* Single bits, with the bit number taken modulo 32 */
+    TEST_ASSERT(x & ~(1u << (vu[7] & 31)), 0x12345678u & ~2u);
+    TEST_ASSERT((x >> (vu[6] & 31)) & 1, 0);
+    TEST_ASSERT(x ^ (1u << 31), 0x92345678u);
+    TEST_ASSERT(sparse | (1u << (vu[1] & 31)), 0x00F000A2u);
+
+    /* An address into an array of words is an sh2add */
+    static uint32_t words[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    uint32_t volatile index = 6;
+    TEST_ASSERT(words[index], 6);
+
+    uint32_t state = 12345, sum = 0;
+    for (uint32_t i = 0; i < 2000000; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        sum += (uint32_t)__builtin_popcount(state) * 4
+             + (uint32_t)__builtin_clz(state | 1)
+             + (__builtin_bswap32(state) & ~state);
+    }
+    PRINT_INT(sum);
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* Run with --clones N: the table is filled once before the checkpoint,
+   then every clone adds its index to it and must only ever see its own
+   writes. */
+#define N 100000
+
+static uint32_t table[N];
+
+int _start() {
+    for (uint32_t i = 0; i < N; i++) {
+        table[i] = i;
+    }
+
+    uint32_t index;
+    CHECKPOINT(index);
+
+    for (uint32_t i = 0; i < N; i++) {
+        table[i] += index;
+    }
+
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < N; i++) {
+        mismatches += table[i] != i + index;
+    }
+    TEST_ASSERT(mismatches, 0);
+
+    PRINT_INT(index);
+
+    return mismatches;
+}
@@ -0,0 +1,58 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* Compressed forms written out by hand, since which ones the compiler
+   picks depends on register allocation. Each block computes the same as
+   the C next to it. */
+static uint32_t words[4] = { 10, 20, 30, 40 };
+
+static uint32_t c_alu(uint32_t x, uint32_t y) {
+    __asm__ ("c.sub %0, %1\n"
+             "c.xor %0, %1\n"
+             "c.or %0, %1\n"
+             "c.and %0, %1\n"
+             "c.srai %0, 1\n"
+             "c.andi %0, -2\n"
+             : "+cr"(x) : "cr"(y));
+    return x;
+}
+
+static uint32_t c_load_store(uint32_t *p, uint32_t x) {
+    uint32_t y;
+    __asm__ volatile ("c.sw %1, 8(%2)\n"
+                      "c.lw %0, 4(%2)\n"
+                      : "=&cr"(y) : "cr"(x), "cr"(p) : "memory");
+    return y;
+}
+
+static uint32_t c_branch(uint32_t x) {
+    uint32_t r = 1;
+    __asm__ ("c.beqz %1, 1f\n"
+             "c.li %0, 2\n"
+             "c.bnez %1, 1f\n"
+             "c.li %0, 3\n"
+             "1:\n"
+             : "+cr"(r) : "cr"(x));
+    return r;
+}
+
+int _start() {
+    volatile uint32_t v = 0x1234;
+
+    TEST_ASSERT(c_alu(v, 0xFF), ((((((0x1234 - 0xFF) ^ 0xFF) | 0xFF) & 0xFF)
+                                  >> 1) & ~1u));
+    TEST_ASSERT(c_load_store(words, v), 20);
+    TEST_ASSERT(words[2], 0x1234);
+    TEST_ASSERT(c_branch(0), 1);
+    TEST_ASSERT(c_branch(v), 2);
+
+    /* The rest is whatever the compiler compresses */
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < 3000000; i++) {
+        sum += (i & 7) + words[i & 3];
+        sum ^= sum << 3;
+    }
+    PRINT_INT(sum);
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#include "ecalls.h"
+#include "mmio.h"
+#include <stdint.h>
+
+/* Needs vemu --console */
+static volatile uint32_t *const console = 
+    (volatile uint32_t *)VEMU_MMIO_CONSOLE_BASE;
+
+static void console_puts(char const *s) {
+    while (*s != '\0') {
+        console[VEMU_MMIO_CONSOLE_DATA / 4] = (uint8_t)*s++;
+    }
+}
+
+int _start() {
+    /* Often enough to get the stores translated */
+    for (int i = 0; i < 100; i++) {
+        console_puts("hi :)\n");
+    }
+
+    TEST_ASSERT(console[VEMU_MMIO_CONSOLE_COUNT / 4], 600);
+
+    return 0;
+}
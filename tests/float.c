@@ -0,0 +1,87 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* Operands go through volatiles so the compiler emits the F and D
+   instructions instead of folding them. The accrued flags are read and
+   cleared with fsflags after each group of checks. */
+static volatile float vf[] = { 0.0f, 1.0f, 3.0f, 0.1f, 1e38f, -2.5f };
+static volatile double vd[] = { 0.0, 1.0, 3.0, 0.1, 1e308, -2.5 };
+static volatile uint32_t vu[] = { 0x7F800001u, 0x00000001u };
+
+#define NV 0x10
+#define DZ 0x08
+#define OF 0x04
+#define UF 0x02
+#define NX 0x01
+
+static uint32_t fflags(void) {
+    uint32_t flags;
+    asm volatile("fsflags %0, zero" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static uint32_t bits(float f) {
+    union { float f; uint32_t u; } x = { .f = f };
+    return x.u;
+}
+
+static float from_bits(uint32_t u) {
+    union { uint32_t u; float f; } x = { .u = u };
+    return x.f;
+}
+
+int _start() {
+    float zero = vf[0], one = vf[1], three = vf[2];
+    double dzero = vd[0], done = vd[1], dthree = vd[2];
+
+    fflags();
+
+    /* Exact results raise nothing */
+    TEST_ASSERT(bits(one + three), 0x40800000u);
+    TEST_ASSERT((int32_t)(vd[5] * 4.0), -10);
+    TEST_ASSERT(fflags(), 0);
+
+    /* Inexact, division by zero, overflow and underflow */
+    TEST_ASSERT(bits(one / three), 0x3EAAAAABu);
+    TEST_ASSERT(fflags(), NX);
+    TEST_ASSERT(done / dzero > vd[4], 1);
+    TEST_ASSERT(fflags(), DZ);
+    TEST_ASSERT(bits(vf[4] * vf[4]), 0x7F800000u);
+    TEST_ASSERT(fflags(), OF | NX);
+    TEST_ASSERT(bits(from_bits(vu[1]) * vf[3]), 0);
+    TEST_ASSERT(fflags(), UF | NX);
+
+    /* Invalid operations give the canonical NaN */
+    TEST_ASSERT(bits(zero / zero), 0x7FC00000u);
+    TEST_ASSERT(fflags(), NV);
+    TEST_ASSERT(bits(from_bits(vu[0]) + one), 0x7FC00000u);
+    TEST_ASSERT(fflags(), NV);
+    TEST_ASSERT(dzero / dzero == dzero / dzero, 0);
+    TEST_ASSERT(fflags(), NV);
+
+    /* Conversions round toward zero in C and saturate */
+    TEST_ASSERT((int32_t)vf[5], -2);
+    TEST_ASSERT(fflags(), NX);
+    TEST_ASSERT((int32_t)vd[4], 2147483647);
+    TEST_ASSERT((uint32_t)vf[5], 0);
+    TEST_ASSERT(fflags(), NV);
+    TEST_ASSERT(bits((float)vd[3]), 0x3DCCCCCDu);
+    TEST_ASSERT((double)vf[3] == vd[3], 0);
+
+    /* frm picks the rounding of instructions that ask for the dynamic
+       mode */
+    asm volatile("fsrmi 3" ::: "memory");
+    TEST_ASSERT(bits(vf[1] / vf[2]), 0x3EAAAAABu);
+    asm volatile("fsrmi 1" ::: "memory");
+    TEST_ASSERT(bits(vf[1] / vf[2]), 0x3EAAAAAAu);
+    asm volatile("fsrmi 0" ::: "memory");
+    fflags();
+
+    double sum = 0.0;
+    for (uint32_t i = 1; i <= 1000000; i++) {
+        sum += dthree / (double)i * done;
+    }
+    PRINT_INT((int32_t)sum);
+
+    return 0;
+}
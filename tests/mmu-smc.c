@@ -0,0 +1,78 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+#define SATP_SV32   0x80000000u
+#define PTE_V       0x01u
+#define PTE_R       0x02u
+#define PTE_W       0x04u
+#define PTE_X       0x08u
+
+/* Where the page of code shows up a second time */
+#define ALIAS       0x00400000u
+
+/* addi a0, zero, imm; ret */
+#define ADDI_A0(imm)    (0x00000513 | ((uint32_t)(imm) << 20))
+#define RET             0x00008067
+
+typedef int (*func_t)(void);
+
+static uint32_t root[1024] __attribute__((aligned(4096)));
+static uint32_t leaves[1024] __attribute__((aligned(4096)));
+static uint32_t code[1024] __attribute__((aligned(4096)));
+
+static uint32_t pte(void *page, uint32_t perms) {
+    return ((uintptr_t)page >> 12 << 10) | perms | PTE_V;
+}
+
+static void set_satp(uint32_t satp) {
+    __asm__ volatile("csrw satp, %0\n\tsfence.vma" : : "r"(satp) : "memory");
+}
+
+/* Writes the code through the alias, so that the store never touches the
+   addresses it runs from */
+static void patch(int value) {
+    volatile uint32_t *alias = (volatile uint32_t *)ALIAS;
+    alias[0] = ADDI_A0(value);
+    alias[1] = RET;
+    __asm__ volatile("fence.i" ::: "memory");
+}
+
+static int call_hot(func_t f, int n) {
+    int sum = 0;
+
+    for (int i = 0; i < n; i++) {
+        sum += f();
+    }
+
+    return sum;
+}
+
+int _start() {
+    func_t f = (func_t)(uintptr_t)code;
+
+    root[0] = PTE_R | PTE_W | PTE_X | PTE_V;
+    root[ALIAS >> 22] = pte(leaves, 0);
+    leaves[0] = pte(code, PTE_R | PTE_W);
+
+    set_satp(SATP_SV32 | ((uintptr_t)root >> 12));
+
+    patch(7);
+    TEST_ASSERT(call_hot(f, 1000), 7000);
+
+    /* Rewrite the code after it has gone hot */
+    patch(11);
+    TEST_ASSERT(call_hot(f, 1000), 11000);
+
+    int sum = 0;
+    for (int i = 0; i < 100; i++) {
+        patch(i);
+        sum += f();
+    }
+    TEST_ASSERT(sum, 4950);
+
+    set_satp(0);
+
+    PRINT_INT(sum);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+#define SATP_SV32   0x80000000u
+#define PTE_V       0x01u
+#define PTE_R       0x02u
+#define PTE_W       0x04u
+#define PTE_X       0x08u
+
+/* Where the page of data shows up a second time */
+#define ALIAS       0x00400000u
+
+static uint32_t root[1024] __attribute__((aligned(4096)));
+static uint32_t leaves[1024] __attribute__((aligned(4096)));
+static uint32_t data[1024] __attribute__((aligned(4096)));
+
+static uint32_t pte(void *page, uint32_t perms) {
+    return ((uintptr_t)page >> 12 << 10) | perms | PTE_V;
+}
+
+static void set_satp(uint32_t satp) {
+    __asm__ volatile("csrw satp, %0\n\tsfence.vma" : : "r"(satp) : "memory");
+}
+
+int _start() {
+    /* The program keeps running from the same addresses in the first
+       megapage */
+    root[0] = PTE_R | PTE_W | PTE_X | PTE_V;
+    root[ALIAS >> 22] = pte(leaves, 0);
+    leaves[0] = pte(data, PTE_R | PTE_W);
+
+    set_satp(SATP_SV32 | ((uintptr_t)root >> 12));
+
+    volatile uint32_t *alias = (volatile uint32_t *)ALIAS;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < 1024; i++) {
+        alias[i] = i;
+        sum += ((volatile uint32_t *)data)[i];
+    }
+    TEST_ASSERT(sum, 523776);
+
+    set_satp(0);
+
+    TEST_ASSERT(data[1000], 1000);
+    TEST_ASSERT(leaves[0] & 0xC0, 0xC0);
+
+    return 0;
+}
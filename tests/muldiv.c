@@ -0,0 +1,48 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+#define MIN (-2147483647 - 1)
+
+/* Operands go through volatiles so the compiler emits the M instructions
+   instead of folding them. Built with MARCH=rv32iafd the same checks run
+   on libgcc's software routines, which makes the loop at the end a
+   benchmark of one against the other. */
+static volatile int32_t vs[] = { 0, 1, -1, 2, -2, 7, -7, MIN, 2147483647 };
+static volatile uint32_t vu[] = { 0, 1, 2, 7, 0x80000000u, 0xFFFFFFFFu };
+
+int _start() {
+    int32_t zero = vs[0], minus_one = vs[2], min = vs[7];
+
+    /* Division by zero and overflow have results instead of traps */
+    TEST_ASSERT(vs[5] / zero, -1);
+    TEST_ASSERT(vs[5] % zero, 7);
+    TEST_ASSERT(vu[3] / vu[0], 0xFFFFFFFFu);
+    TEST_ASSERT(vu[3] % vu[0], 7);
+    TEST_ASSERT(min / minus_one, MIN);
+    TEST_ASSERT(min % minus_one, 0);
+
+    TEST_ASSERT(vs[6] / vs[3], -3);
+    TEST_ASSERT(vs[6] % vs[3], -1);
+    TEST_ASSERT(vs[5] / vs[4], -3);
+    TEST_ASSERT(vs[5] % vs[4], 1);
+    TEST_ASSERT(vu[5] / vu[3], 0x24924924u);
+    TEST_ASSERT(vu[5] % vu[3], 3);
+
+    /* Upper halves of signed, unsigned and mixed products */
+    TEST_ASSERT((int32_t)(((int64_t)min * min) >> 32), 0x40000000);
+    TEST_ASSERT((int32_t)(((int64_t)minus_one * vs[5]) >> 32), -1);
+    TEST_ASSERT((uint32_t)(((uint64_t)vu[5] * vu[5]) >> 32), 0xFFFFFFFEu);
+    TEST_ASSERT((int32_t)(((int64_t)minus_one * (uint64_t)vu[5]) >> 32), -1);
+    TEST_ASSERT((int32_t)(((int64_t)vs[3] * (uint64_t)vu[4]) >> 32), 1);
+    TEST_ASSERT(vs[8] * vs[8], 1);
+
+    uint32_t x = 12345, sum = 0;
+    for (uint32_t i = 0; i < 1000000; i++) {
+        x = x * 1103515245u + 12345;
+        uint32_t d = (x >> 16) | vu[1];
+        sum += x / d + x % d;
+    }
+    PRINT_INT(sum);
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* Run with --harts N: every hart sums a slice of the range, hart 0
+   waits for the others and checks the total. This checks results only;
+   how the run time scales with N has not been measured. */
+#define N 10000000u
+
+static volatile uint32_t total;
+static volatile uint32_t done;
+static volatile uint32_t lock;
+static volatile uint32_t counter;
+
+static uint32_t hartid(void) {
+    uint32_t id;
+    asm volatile("csrr %0, mhartid" : "=r"(id));
+    return id;
+}
+
+static void locked_increment(void) {
+    while (__atomic_exchange_n(&lock, 1, __ATOMIC_ACQUIRE) != 0) {
+    }
+    counter = counter + 1;
+    __atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
+}
+
+int _start(uint32_t id, uint32_t n_harts) {
+    TEST_ASSERT(hartid(), id);
+
+    uint32_t sum = 0;
+    for (uint32_t i = id; i < N; i += n_harts) {
+        sum += i;
+    }
+    __atomic_fetch_add(&total, sum, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < 1000; i++) {
+        locked_increment();
+    }
+
+    __atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+    if (id != 0) {
+        return 0;
+    }
+
+    while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) != n_harts) {
+    }
+
+    TEST_ASSERT(total, (uint32_t)((uint64_t)N * (N - 1) / 2));
+    TEST_ASSERT(counter, 1000 * n_harts);
+
+    PRINT_INT(total);
+
+    return 0;
+}
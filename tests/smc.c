@@ -0,0 +1,50 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* addi a0, zero, imm; ret */
+#define ADDI_A0(imm)    (0x00000513 | ((uint32_t)(imm) << 20))
+#define RET             0x00008067
+
+typedef int (*func_t)(void);
+
+static uint32_t code[2];
+
+static void patch(int value) {
+    code[0] = ADDI_A0(value);
+    code[1] = RET;
+    asm volatile("fence.i" ::: "memory");
+}
+
+/* Calls the generated function often enough to get it translated */
+static int call_hot(func_t f, int n) {
+    int sum = 0;
+
+    for (int i = 0; i < n; i++) {
+        sum += f();
+    }
+
+    return sum;
+}
+
+int _start() {
+    func_t f = (func_t)(uintptr_t)code;
+
+    patch(7);
+    TEST_ASSERT(call_hot(f, 1000), 7000);
+
+    /* Rewrite the code after it has gone hot */
+    patch(11);
+    TEST_ASSERT(call_hot(f, 1000), 11000);
+
+    /* Rewrite it between every call */
+    int sum = 0;
+    for (int i = 0; i < 100; i++) {
+        patch(i);
+        sum += f();
+    }
+    TEST_ASSERT(sum, 4950);
+
+    PRINT_INT(sum);
+
+    return 0;
+}
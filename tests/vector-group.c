@@ -0,0 +1,23 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* With LMUL = 2 register groups start at even registers, and an op on
+   one that does not is an illegal instruction that stops the hart: the
+   run prints 1 and nothing else */
+int _start() {
+    uint32_t vl;
+
+    __asm__ volatile ("vsetvli %0, %1, e32, m2, ta, ma"
+                      : "=r"(vl) : "r"(16));
+    TEST_ASSERT(vl, 16);
+    __asm__ volatile ("vadd.vv v8, v10, v12" ::: "v8", "v9");
+    PRINT_INT(1);
+
+    __asm__ volatile ("vadd.vv v9, v10, v12" ::: "v8", "v9", "v10");
+
+    /* Never reached */
+    TEST_ASSERT(0, 1);
+    PRINT_INT(2);
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* A vector op while vill is set is an illegal instruction and stops the
+   hart: the run prints 1 and nothing else */
+int _start() {
+    uint32_t vl;
+
+    /* e64 is more than Zve32x has */
+    __asm__ volatile ("vsetvli %0, %1, e64, m1, ta, ma"
+                      : "=r"(vl) : "r"(4));
+    TEST_ASSERT(vl, 0);
+    PRINT_INT(1);
+
+    __asm__ volatile ("vadd.vv v8, v8, v8" ::: "v8");
+
+    /* Never reached */
+    TEST_ASSERT(0, 1);
+    PRINT_INT(2);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "ecalls.h"
+#include <stdint.h>
+
+/* The loops are plain C that the compiler vectorizes with Zve32x, the
+   asm blocks pin down the instructions it may not pick on its own. Built
+   without _zve32x in MARCH the loops stay scalar, which makes the last
+   one a benchmark of one against the other. */
+#define N 1000
+
+static int32_t a[N], b[N], c[N];
+static uint8_t bytes[N];
+static uint16_t halves[N];
+
+static uint32_t vsetvli_e32m1(uint32_t avl) {
+    uint32_t vl;
+    __asm__ volatile ("vsetvli %0, %1, e32, m1, ta, ma"
+                      : "=r"(vl) : "r"(avl));
+    return vl;
+}
+
+static uint32_t vsetvli_e8m8(uint32_t avl) {
+    uint32_t vl;
+    __asm__ volatile ("vsetvli %0, %1, e8, m8, ta, ma"
+                      : "=r"(vl) : "r"(avl));
+    return vl;
+}
+
+/* Sums 8 words with a reduction, then leaves the lowest index of one
+   equal to key in *first */
+static int32_t sum8(const int32_t *p, int32_t key, int32_t *first) {
+    int32_t sum;
+    __asm__ volatile ("vsetivli zero, 8, e32, m1, ta, ma\n"
+                      "vle32.v v8, (%2)\n"
+                      "vmv.s.x v9, zero\n"
+                      "vredsum.vs v9, v8, v9\n"
+                      "vmv.x.s %0, v9\n"
+                      "vmseq.vx v0, v8, %3\n"
+                      "vfirst.m %1, v0\n"
+                      : "=&r"(sum), "=&r"(*first)
+                      : "r"(p), "r"(key)
+                      : "v0", "v8", "v9", "memory");
+    return sum;
+}
+
+int _start() {
+    /* VLEN is 256 bits */
+    TEST_ASSERT(vsetvli_e32m1(100), 8);
+    TEST_ASSERT(vsetvli_e32m1(5), 5);
+    TEST_ASSERT(vsetvli_e8m8(1000), 256);
+
+    for (int32_t i = 0; i < N; i++) {
+        a[i] = i * 3 - 500;
+        b[i] = 7 - i;
+    }
+    int32_t first;
+    TEST_ASSERT(sum8(a, -494, &first), 8 * -500 + 3 * 28);
+    TEST_ASSERT(first, 2);
+    sum8(b, 1000, &first);
+    TEST_ASSERT(first, -1);
+
+    /* Element-wise arithmetic, compares and selects */
+    for (int32_t i = 0; i < N; i++) {
+        c[i] = a[i] * b[i] + (a[i] < b[i] ? a[i] : b[i]) - (a[i] >> 2);
+    }
+    int32_t check = 0;
+    for (int32_t i = 0; i < N; i++) {
+        check += c[i] ^ i;
+    }
+    int32_t expected = 0;
+    for (int32_t i = 0; i < N; i++) {
+        int32_t x = i * 3 - 500, y = 7 - i;
+        expected += (x * y + (x < y ? x : y) - (x >> 2)) ^ i;
+    }
+    TEST_ASSERT(check, expected);
+
+    /* Narrow elements wrap around */
+    for (int32_t i = 0; i < N; i++) {
+        bytes[i] = (uint8_t)(i * 7);
+        halves[i] = (uint16_t)(i * 300);
+    }
+    uint32_t bsum = 0, hsum = 0;
+    for (int32_t i = 0; i < N; i++) {
+        bytes[i] += 200;
+        halves[i] -= 1000;
+    }
+    for (int32_t i = 0; i < N; i++) {
+        bsum += bytes[i];
+        hsum += halves[i];
+    }
+    uint32_t bexp = 0, hexp = 0;
+    for (int32_t i = 0; i < N; i++) {
+        bexp += (uint8_t)(i * 7 + 200);
+        hexp += (uint16_t)(i * 300 - 1000);
+    }
+    TEST_ASSERT(bsum, bexp);
+    TEST_ASSERT(hsum, hexp);
+
+    uint32_t sum = 0;
+    for (uint32_t round = 0; round < 2000; round++) {
+        for (int32_t i = 0; i < N; i++) {
+            c[i] = (a[i] + (int32_t)round) * b[i] ^ c[i];
+        }
+        for (int32_t i = 0; i < N; i++) {
+            sum += (uint32_t)c[i];
+        }
+    }
+    PRINT_INT(sum);
+
+    return 0;
+}
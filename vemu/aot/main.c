@@ -0,0 +1,268 @@
+#include "aot.h"
+#include "elf-file.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <argp.h>
+#include <string.h>
+#include <libgen.h>
+
+#define VEMU_AOT_OPT_CC     256
+
+#ifndef VEMU_AOT_CFLAGS
+#define VEMU_AOT_CFLAGS     ""
+#endif
+
+#ifndef VEMU_AOT_LIB
+#define VEMU_AOT_LIB        "libvemu.a"
+#endif
+
+static struct argp_option options[] = {
+    { "verbose", 'v', 0, 0, "Print what was recovered and the compiler "
+      "command", 0 },
+    { "output", 'o', "FILE", 0, "Write the executable to FILE "
+      "(default: a.out)", 0 },
+    { "emit-c", 'S', 0, 0, "Write the generated C to the output file and "
+      "stop", 0 },
+    { "cc", VEMU_AOT_OPT_CC, "CC", 0, "Host C compiler (default: $CC or "
+      "cc)", 0 },
+    { 0 }
+};
+
+typedef struct {
+    char *filename;
+    char const *output;
+    char const *cc;
+    int verbose;
+    int emit_c;
+} vemu_aot_args_t;
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    vemu_aot_args_t *args = state->input;
+
+    switch (key) {
+        case 'v':
+            args->verbose = 1;
+            break;
+
+        case 'o':
+            args->output = arg;
+            break;
+
+        case 'S':
+            args->emit_c = 1;
+            break;
+
+        case VEMU_AOT_OPT_CC:
+            args->cc = arg;
+            break;
+
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                args->filename = arg;
+            } else {
+                argp_usage(state);
+            }
+            break;
+
+        case ARGP_KEY_END:
+            if (state->arg_num < 1) {
+                argp_usage(state);
+            }
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static char const doc[] = "Compiles an RV32 ELF executable ahead of time "
+    "into a native one";
+
+static struct argp argp = { options, parse_opt, "ELF", doc, NULL, NULL,
+                            NULL };
+
+/* Size of guest memory the loadable segments need */
+static size_t vemu_aot_image_size(vemu_elf_t *elf) {
+    size_t size = 0;
+
+    for (size_t i = 0; i < elf->h.e_phnum; i++) {
+        vemu_elf_program_header_t *ph = &elf->phdrs[i];
+        if (ph->p_type == ELF_PT_LOAD
+                && (size_t)ph->p_vaddr + ph->p_memsz > size) {
+            size = (size_t)ph->p_vaddr + ph->p_memsz;
+        }
+    }
+
+    return size;
+}
+
+static bool vemu_aot_add_segments(vemu_aot_t *aot, vemu_elf_t *elf) {
+    for (size_t i = 0; i < elf->h.e_phnum; i++) {
+        vemu_elf_program_header_t *ph = &elf->phdrs[i];
+        if (ph->p_type != ELF_PT_LOAD) {
+            continue;
+        }
+
+        if (!vemu_aot_add_segment(aot, ph->p_vaddr, ph->p_filesz, 
+                                  ph->p_memsz, ph->p_flags & ELF_PF_X)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Function symbols catch code only reached through pointers */
+static bool vemu_aot_add_symbols(vemu_aot_t *aot, vemu_elf_t *elf) {
+    for (size_t i = 0; i < elf->h.e_shnum; i++) {
+        vemu_elf_section_header_t sh;
+        if (!vemu_read_section_header(elf->file, &elf->h, &sh, i)) {
+            return false;
+        }
+
+        if (sh.sh_type != ELF_SHT_SYMTAB) {
+            continue;
+        }
+
+        vemu_elf_symbol_t *syms = (vemu_elf_symbol_t *)
+            vemu_load_section_content(elf->file, &sh);
+        if (syms == NULL) {
+            continue;
+        }
+
+        bool ok = true;
+        size_t n = sh.sh_size / sizeof(vemu_elf_symbol_t);
+        for (size_t j = 0; j < n && ok; j++) {
+            if (ELF_ST_TYPE(syms[j].st_info) == ELF_STT_FUNC) {
+                ok = vemu_aot_add_root(aot, syms[j].st_value);
+            }
+        }
+
+        free(syms);
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool vemu_aot_compile(vemu_aot_args_t *args, char const *source) {
+    char const *cc = args->cc;
+    if (cc == NULL) {
+        cc = getenv("CC");
+    }
+    if (cc == NULL) {
+        cc = "cc";
+    }
+
+    size_t size = strlen(cc) + strlen(VEMU_AOT_CFLAGS) + strlen(source)
+                + strlen(args->output) + strlen(VEMU_AOT_LIB) + 64;
+    char *cmd = malloc(size);
+    if (cmd == NULL) {
+        return false;
+    }
+
+    snprintf(cmd, size, "%s -O2 %s -o '%s' '%s' %s", cc, VEMU_AOT_CFLAGS,
+             args->output, source, VEMU_AOT_LIB);
+    if (args->verbose) {
+        fprintf(stderr, "%s\n", cmd);
+    }
+
+    int res = system(cmd);
+    free(cmd);
+
+    if (res != 0) {
+        fprintf(stderr, "host compiler failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    vemu_aot_args_t args = { 0 };
+    args.output = "a.out";
+    argp_parse(&argp, argc, argv, 0, 0, &args);
+
+    int res = 1;
+    uint8_t *ram = NULL;
+    char *source = NULL;
+
+    vemu_cpu_t cpu;
+    vemu_cpu_init(&cpu, &ram);
+
+    vemu_aot_t aot;
+    vemu_aot_init(&aot, &cpu);
+
+    vemu_elf_t elf;
+    vemu_elf_init(&elf);
+
+    if (!vemu_elf_open(&elf, args.filename)) {
+        goto end;
+    }
+    size_t ram_size = vemu_aot_image_size(&elf);
+
+    /* Room for an instruction running off the end of the last segment */
+    ram = calloc(ram_size + 8, 1);
+    if (ram == NULL || !vemu_elf_load(&elf, ram, ram_size + 8)) {
+        goto end;
+    }
+
+    if (!vemu_aot_add_segments(&aot, &elf)
+            || !vemu_aot_add_root(&aot, elf.h.e_entry)
+            || !vemu_aot_add_symbols(&aot, &elf)
+            || !vemu_aot_discover(&aot)) {
+        fprintf(stderr, "could not recover control flow\n");
+        goto end;
+    }
+
+    if (args.emit_c) {
+        source = strdup(args.output);
+    } else if (asprintf(&source, "%s.c", args.output) < 0) {
+        source = NULL;
+    }
+    if (source == NULL) {
+        goto end;
+    }
+
+    FILE *file = fopen(source, "w");
+    if (file == NULL) {
+        fprintf(stderr, "could not open file: '%s'\n", source);
+        goto end;
+    }
+
+    bool ok = vemu_aot_emit(&aot, file, basename(args.filename),
+                            elf.h.e_entry);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "could not write '%s'\n", source);
+        goto end;
+    }
+
+    if (args.verbose) {
+        fprintf(stderr, "%" PRIu32 " blocks, %" PRIu64 " instructions, %"
+                PRIu32 " indirect jumps\n", aot.n_blocks, aot.n_instrs,
+                aot.n_indirect);
+    }
+
+    if (!args.emit_c) {
+        ok = vemu_aot_compile(&args, source);
+        remove(source);
+        if (!ok) {
+            goto end;
+        }
+    }
+
+    res = 0;
+
+end:
+    free(source);
+    vemu_elf_destruct(&elf);
+    vemu_aot_destruct(&aot);
+    vemu_cpu_destruct(&cpu);
+    free(ram);
+
+    return res;
+}
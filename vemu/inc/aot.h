@@ -0,0 +1,103 @@
+#ifndef VEMU_AOT_H
+#define VEMU_AOT_H
+
+#include "cpu.h"
+#include "muldiv.h"
+#include "bitmanip.h"
+#include "fp.h"
+#include "vec.h"
+#include "ram.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define VEMU_AOT_MAX_SEGMENTS   16
+
+/* A loaded segment of the guest program. The generator reads code from
+   exec segments; compiled programs copy data back into guest RAM. */
+typedef struct {
+    uint32_t vaddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    bool exec;
+    uint8_t const *data;
+} vemu_aot_segment_t;
+
+typedef void (*vemu_aot_run_t)(vemu_cpu_t *cpu, uint64_t *fallbacks);
+
+/* Everything a compiled program carries in place of the ELF file */
+typedef struct {
+    char const *name;
+    uint32_t entry;
+    uint32_t n_blocks;
+
+    size_t n_segments;
+    vemu_aot_segment_t const *segments;
+
+    vemu_aot_run_t run;
+} vemu_aot_image_t;
+
+typedef struct {
+    vemu_cpu_t *cpu;
+
+    size_t n_segments;
+    vemu_aot_segment_t segments[VEMU_AOT_MAX_SEGMENTS];
+    /* One bit per halfword of each exec segment, set at block starts */
+    uint8_t *leaders[VEMU_AOT_MAX_SEGMENTS];
+
+    uint32_t *work;
+    size_t n_work;
+    size_t work_size;
+
+    uint32_t n_blocks;
+    uint64_t n_instrs;
+    uint32_t n_indirect;
+} vemu_aot_t;
+
+void vemu_aot_init(vemu_aot_t *aot, vemu_cpu_t *cpu);
+
+void vemu_aot_destruct(vemu_aot_t *aot);
+
+bool vemu_aot_add_segment(vemu_aot_t *aot, uint32_t vaddr, uint32_t filesz,
+                          uint32_t memsz, bool exec);
+
+bool vemu_aot_add_root(vemu_aot_t *aot, uint32_t ip);
+
+bool vemu_aot_discover(vemu_aot_t *aot);
+
+bool vemu_aot_emit(vemu_aot_t *aot, FILE *file, char const *name, 
+                   uint32_t entry);
+
+/* The runtime compiled programs link against */
+int vemu_aot_main(int argc, char **argv, vemu_aot_image_t const *image);
+
+/* Guest memory accessors for generated code */
+static inline uint32_t vemu_aot_load_byte(uint8_t *ram, uint32_t addr) {
+    return vemu_ram_load_byte(ram, addr);
+}
+
+static inline uint32_t vemu_aot_load_half(uint8_t *ram, uint32_t addr) {
+    return vemu_ram_load_half(ram, addr);
+}
+
+static inline uint32_t vemu_aot_load_word(uint8_t *ram, uint32_t addr) {
+    return vemu_ram_load_word(ram, addr);
+}
+
+static inline void vemu_aot_store_byte(uint8_t *ram, uint32_t addr, 
+                                       uint32_t value) {
+    vemu_ram_store_byte(ram, addr, value);
+}
+
+static inline void vemu_aot_store_half(uint8_t *ram, uint32_t addr,
+                                       uint32_t value) {
+    vemu_ram_store_half(ram, addr, value);
+}
+
+static inline void vemu_aot_store_word(uint8_t *ram, uint32_t addr,
+                                       uint32_t value) {
+    vemu_ram_store_word(ram, addr, value);
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef VEMU_BATCH_H
+#define VEMU_BATCH_H
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A job's input file is loaded here, and the guest starts with its
+   address in a2 and its size in a3 */
+#define VEMU_BATCH_INPUT_ADDR   0x20000000
+#define VEMU_BATCH_INPUT_MAX    0x10000000
+
+typedef struct {
+    char *elf;
+    char *input;
+
+    /* What the guest printed, assertion failures included */
+    char *output;
+    size_t output_size;
+
+    bool loaded;
+    uint32_t stop_ip;
+    uint32_t exit_code;
+    uint64_t instret;
+} vemu_batch_job_t;
+
+/* Job indices [top, bottom) of jobs[], packed into one word so that the
+   owner popping at the bottom and thieves taking from the top agree with
+   a single compare-and-swap. No job is ever pushed once workers start. */
+typedef struct {
+    uint64_t range;
+    uint32_t *jobs;
+} vemu_batch_deque_t;
+
+/* Sets up the caches and options of a fresh hart for a job */
+typedef bool (*vemu_batch_setup_t)(vemu_cpu_t *cpu, void *arg);
+
+/* Runs the programs of a manifest as independent single-hart VMs, each
+   with its own memory and caches, on a pool of host threads. Every
+   worker starts with its own share of the jobs and steals from the
+   others once it runs out. */
+typedef struct {
+    vemu_batch_job_t *jobs;
+    size_t n_jobs;
+    size_t jobs_size;
+
+    vemu_batch_deque_t *deques;
+    uint32_t n_workers;
+
+    vemu_batch_setup_t setup;
+    void *setup_arg;
+
+    /* Guest memory of each job */
+    size_t ram_size;
+
+    uint64_t steals;
+    double seconds;
+} vemu_batch_t;
+
+void vemu_batch_init(vemu_batch_t *batch);
+
+void vemu_batch_destruct(vemu_batch_t *batch);
+
+/* Reads a manifest of one job per line, "ELF [INPUT]", skipping blank
+   lines and lines starting with '#' */
+bool vemu_batch_load(vemu_batch_t *batch, char const *manifest);
+
+bool vemu_batch_run(vemu_batch_t *batch, uint32_t n_workers,
+                    vemu_batch_setup_t setup, void *setup_arg);
+
+/* Whether the job's program returned 0 from _start */
+bool vemu_batch_job_ok(vemu_batch_job_t *job);
+
+/* Prints each job's status and output in manifest order */
+void vemu_batch_print(vemu_batch_t *batch, FILE *file);
+
+void vemu_batch_print_stats(vemu_batch_t *batch, FILE *file);
+
+#endif
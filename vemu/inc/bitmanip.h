@@ -0,0 +1,58 @@
+#ifndef VEMU_BITMANIP_H
+#define VEMU_BITMANIP_H
+
+#include <stdint.h>
+
+/* Zba, Zbb and Zbs operations that are more than a C operator, shared by
+   the interpreter, constant folding and compiled programs. The counts
+   are defined for zero, which the compiler builtins are not. Rotate and
+   single-bit amounts use the low 5 bits, like shifts. */
+
+static inline uint32_t vemu_clz(uint32_t x) {
+    return x == 0 ? 32 : (uint32_t)__builtin_clz(x);
+}
+
+static inline uint32_t vemu_ctz(uint32_t x) {
+    return x == 0 ? 32 : (uint32_t)__builtin_ctz(x);
+}
+
+static inline uint32_t vemu_cpop(uint32_t x) {
+    return (uint32_t)__builtin_popcount(x);
+}
+
+static inline uint32_t vemu_rev8(uint32_t x) {
+    return __builtin_bswap32(x);
+}
+
+/* Each byte becomes all ones if any of its bits is set */
+static inline uint32_t vemu_orc_b(uint32_t x) {
+    uint32_t low7 = (x & 0x7F7F7F7Fu) + 0x7F7F7F7Fu;
+    uint32_t set = (low7 | x) & 0x80808080u;
+    return (set >> 7) * 0xFF;
+}
+
+static inline uint32_t vemu_rol(uint32_t x, uint32_t n) {
+    return (x << (n & 0x1F)) | (x >> (-n & 0x1F));
+}
+
+static inline uint32_t vemu_ror(uint32_t x, uint32_t n) {
+    return (x >> (n & 0x1F)) | (x << (-n & 0x1F));
+}
+
+static inline uint32_t vemu_min(uint32_t x, uint32_t y) {
+    return (int32_t)x < (int32_t)y ? x : y;
+}
+
+static inline uint32_t vemu_minu(uint32_t x, uint32_t y) {
+    return x < y ? x : y;
+}
+
+static inline uint32_t vemu_max(uint32_t x, uint32_t y) {
+    return (int32_t)x < (int32_t)y ? y : x;
+}
+
+static inline uint32_t vemu_maxu(uint32_t x, uint32_t y) {
+    return x < y ? y : x;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef VEMU_BLOCK_H
+#define VEMU_BLOCK_H
+
+#include "instr.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VEMU_BLOCK_MAX_INSTRS   64
+#define VEMU_BLOCK_CACHE_BITS   14
+
+#define VEMU_BLOCK_NO_SUCC      0xFFFFFFFF
+
+#define VEMU_BLOCK_SUCC_TAKEN   0
+#define VEMU_BLOCK_SUCC_NEXT    1
+
+/* A branch or jump inside a superblock. end is the index one past the op
+   that transfers control; execution only stays in the superblock when it
+   continues at expect. n_instrs counts the instructions retired from the
+   start of the superblock up to and including the branch. link caches
+   the block the exit leads to. */
+typedef struct {
+    uint32_t end;
+    uint32_t term_ip;
+    uint32_t next_ip;
+    uint32_t expect;
+    uint32_t n_instrs;
+
+    uint64_t taken;
+    struct vemu_block *link;
+} vemu_trace_exit_t;
+
+/* A straight-line run of guest instructions ending at the first branch,
+   jump, ecall or illegal instruction. Only the final op (the terminator)
+   observes ip and next_ip, so the body runs without ip bookkeeping.
+   Blocks ending in an indirect jump use the taken successor as a
+   single-entry cache of the last target instead of a static link.
+
+   A superblock (trace) has the same layout, with the ops of several 
+   blocks laid end to end and exits describing the branches between them.
+   It is owned by the block at its head and never sits in the cache 
+   itself.
+
+   A block whose guest code has been overwritten is taken out of the
+   cache and marked invalid, but stays allocated until the next flush:
+   it may still be running, and links to it are only dropped lazily. */
+typedef struct vemu_block {
+    uint32_t ip;
+    uint32_t end;
+    uint32_t term_ip;
+    bool has_term;
+    bool indirect;
+    bool invalid;
+
+    uint32_t n_instrs;
+
+    uint32_t succ_ip[2];
+    struct vemu_block *succ[2];
+
+    uint32_t heat;
+    uint8_t *native;
+
+    uint32_t succ_hits[2];
+    uint32_t trace_heat;
+    struct vemu_block *trace;
+
+    bool superblock;
+    uint32_t n_exits;
+    vemu_trace_exit_t *exits;
+    uint64_t entries;
+
+    uint32_t n_ops;
+    vemu_decoded_t ops[];
+} vemu_block_t;
+
+typedef struct {
+    vemu_block_t **slots;
+    uint32_t mask;
+    uint32_t count;
+
+    vemu_block_t **retired;
+    uint32_t n_retired;
+    uint32_t retired_size;
+
+    uint64_t translated;
+    uint64_t executed;
+    uint64_t lookups;
+    uint64_t flushes;
+
+    /* Totals of superblocks that have been flushed */
+    uint64_t traces;
+    uint64_t trace_entries;
+    uint64_t trace_side_exits;
+    uint64_t trace_instrs;
+} vemu_block_cache_t;
+
+void vemu_block_cache_init(vemu_block_cache_t *cache);
+
+bool vemu_block_cache_alloc(vemu_block_cache_t *cache, size_t bits);
+
+void vemu_block_cache_flush(vemu_block_cache_t *cache);
+
+void vemu_block_cache_destruct(vemu_block_cache_t *cache);
+
+vemu_block_t *vemu_block_cache_find(vemu_block_cache_t *cache, uint32_t ip);
+
+void vemu_block_cache_insert(vemu_block_cache_t *cache, vemu_block_t *block);
+
+bool vemu_block_cache_retire(vemu_block_cache_t *cache, vemu_block_t *block);
+
+bool vemu_block_cache_retire_trace(vemu_block_cache_t *cache, 
+                                   vemu_block_t *head);
+
+vemu_block_t *vemu_block_alloc(uint32_t n_ops);
+
+void vemu_block_free(vemu_block_t *block);
+
+#endif
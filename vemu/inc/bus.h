@@ -0,0 +1,86 @@
+#ifndef VEMU_BUS_H
+#define VEMU_BUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VEMU_BUS_PAGE_BITS      12
+#define VEMU_BUS_PAGE_SIZE      (1u << VEMU_BUS_PAGE_BITS)
+#define VEMU_BUS_N_PAGES        (1u << (32 - VEMU_BUS_PAGE_BITS))
+
+/* Page permissions, the low bits of a page's entry */
+#define VEMU_BUS_R              0x1
+#define VEMU_BUS_W              0x2
+#define VEMU_BUS_X              0x4
+#define VEMU_BUS_RWX            0x7
+
+/* The rest of the entry is the number of the device behind the page,
+   plus one, or 0 for guest memory */
+#define VEMU_BUS_DEVICE_SHIFT   3
+#define VEMU_BUS_DEVICE_MASK    0xF8
+#define VEMU_BUS_MAX_DEVICES    31
+
+/* A device takes the loads and stores to [base, base + size) with their
+   offset from base and len of 1, 2 or 4 bytes. Loads return the value
+   zero-extended. Harts on other threads may call in at the same time. */
+typedef struct {
+    char const *name;
+    uint32_t base;
+    uint32_t size;
+
+    uint32_t (*load)(void *arg, uint32_t offset, uint32_t len);
+    void (*store)(void *arg, uint32_t offset, uint32_t len, uint32_t value);
+    void *arg;
+} vemu_device_t;
+
+/* Maps every page of the guest's address space to guest memory with its
+   permissions, to a device, or to nothing. Guest memory keeps its fast
+   path: the host's protection of each page mirrors its write permission,
+   so loads and stores to it stay single host accesses and only a store
+   the guest may not make faults. Execute permission is checked when an
+   instruction is decoded. Devices sit outside of guest memory, on pages
+   the host never maps; only while there are any does a load or store
+   look up its page, see vemu_bus_is_device(). */
+typedef struct {
+    uint8_t *pages;
+
+    vemu_device_t devices[VEMU_BUS_MAX_DEVICES];
+    uint32_t n_devices;
+} vemu_bus_t;
+
+void vemu_bus_init(vemu_bus_t *bus);
+
+/* Sets up the first ram_size bytes as guest memory any access may go to */
+bool vemu_bus_alloc(vemu_bus_t *bus, size_t ram_size);
+
+void vemu_bus_destruct(vemu_bus_t *bus);
+
+/* Sets the permissions of n pages from first on. Keeping the host's
+   protection in line is up to the caller. */
+void vemu_bus_protect(vemu_bus_t *bus, uint32_t first, uint32_t n,
+                      uint8_t perms);
+
+/* Maps device's range, which must be whole pages no other device has.
+   Guest memory is left to the caller to keep out of the way. */
+bool vemu_bus_add_device(vemu_bus_t *bus, vemu_device_t const *device);
+
+/* Slow paths of a load or store of len bytes at addr on a device page */
+uint32_t vemu_bus_load(vemu_bus_t *bus, uint32_t addr, uint32_t len);
+
+void vemu_bus_store(vemu_bus_t *bus, uint32_t addr, uint32_t len,
+                    uint32_t value);
+
+/* Fast path for every load and store: whether addr is on a device page.
+   Only the page of the first byte is looked up; an access that runs on
+   into a device page faults. */
+static inline bool vemu_bus_is_device(vemu_bus_t *bus, uint32_t addr) {
+    return bus->n_devices != 0
+        && (bus->pages[addr >> VEMU_BUS_PAGE_BITS] & VEMU_BUS_DEVICE_MASK);
+}
+
+static inline uint8_t vemu_bus_perms(vemu_bus_t *bus, uint32_t addr) {
+    return bus->pages[addr >> VEMU_BUS_PAGE_BITS] & VEMU_BUS_RWX;
+}
+
+#endif
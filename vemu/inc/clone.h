@@ -0,0 +1,75 @@
+#ifndef VEMU_CLONE_H
+#define VEMU_CLONE_H
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* What a clone reports back to the parent, in memory shared with it */
+typedef struct {
+    bool finished;
+    uint32_t stop_ip;
+    uint32_t exit_code;
+    uint64_t instret;
+} vemu_clone_result_t;
+
+typedef struct {
+    pid_t pid;
+    FILE *file;
+
+    /* Whether the process is gone, and its host wait status */
+    bool done;
+    int status;
+
+    /* What the clone's guest printed, assertion failures included */
+    char *output;
+    size_t output_size;
+} vemu_clone_t;
+
+/* Clones of a single-hart VM that has run up to its checkpoint ecall.
+   Each clone is a forked copy of the emulator, so it shares guest
+   memory, decoded code, blocks and JIT code with the parent copy-on-
+   write and starts right after the ecall with nothing to reload or
+   retranslate. The ecall returns the clone's index to each clone, and
+   the parent stops there once all of them are done. */
+typedef struct {
+    vemu_clone_t *clones;
+    vemu_clone_result_t *results;
+    uint32_t n_clones;
+    uint32_t n_spawned;
+    uint32_t jobs;
+    vemu_cpu_t *cpu;
+
+    /* The index of this process's clone, or -1 in the parent */
+    int64_t index;
+
+    uint64_t warmup_instret;
+    double fork_seconds;
+    double seconds;
+} vemu_clone_set_t;
+
+void vemu_clone_init(vemu_clone_set_t *set);
+
+void vemu_clone_destruct(vemu_clone_set_t *set);
+
+/* Makes the cpu spawn n_clones clones at its checkpoint ecall, at most
+   jobs of them running at a time */
+bool vemu_clone_alloc(vemu_clone_set_t *set, uint32_t n_clones,
+                      uint32_t jobs, vemu_cpu_t *cpu);
+
+bool vemu_clone_is_child(vemu_clone_set_t *set);
+
+/* Reports the clone's result to the parent and exits the process */
+void vemu_clone_exit(vemu_clone_set_t *set, vemu_cpu_t *cpu);
+
+bool vemu_clone_ok(vemu_clone_set_t *set, uint32_t i);
+
+/* Prints each clone's status and output in index order */
+void vemu_clone_print(vemu_clone_set_t *set, FILE *file);
+
+void vemu_clone_print_stats(vemu_clone_set_t *set, FILE *file);
+
+#endif
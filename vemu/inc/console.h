@@ -0,0 +1,21 @@
+#ifndef VEMU_CONSOLE_H
+#define VEMU_CONSOLE_H
+
+#include "system.h"
+#include "mmio.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A device at VEMU_MMIO_CONSOLE_BASE, for guests that print by storing to
+   memory rather than through an ecall */
+typedef struct {
+    FILE *out;
+    uint32_t count;
+} vemu_console_t;
+
+void vemu_console_init(vemu_console_t *console, FILE *out);
+
+bool vemu_console_add(vemu_console_t *console, vemu_system_t *sys);
+
+#endif
@@ -2,160 +2,177 @@
 #define VEMU_CPU_H
 
 #include "registers.h"
+#include "instr.h"
+#include "decode-cache.h"
+#include "block.h"
+#include "jit.h"
+#include "ir.h"
+#include "smc.h"
+#include "bus.h"
+#include "mmu.h"
+#include "replay.h"
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
-#define VEMU_MAX_OPCODES    128
-#define VEMU_MAX_FUNCT3     8
+/* Hart 0 starts with its stack below VEMU_CPU_STACK_TOP; hart n > 0 gets
+   the n-th slice of VEMU_CPU_HART_STACK_SIZE bytes above 
+   VEMU_CPU_HART_STACKS, so its stack pointer starts at the top of it. */
+#define VEMU_CPU_STACK_TOP          0x20000
+#define VEMU_CPU_HART_STACKS        0x30000000
+#define VEMU_CPU_HART_STACK_SIZE    0x100000
 
-#define VEMU_IS_COMPRESSED(instr) (((instr) & 0x3) != 0x3)
+#define VEMU_CPU_NO_STOP            0xFFFFFFFF
 
-typedef enum {
-    VEMU_OPCODE_ILLEGAL,
-    VEMU_OPCODE_NOP,
-
-    VEMU_OPCODE_LUI,
-    VEMU_OPCODE_AUIPC,
-    VEMU_OPCODE_JAL,
-    VEMU_OPCODE_JALR,
-    VEMU_OPCODE_BEQ,
-    VEMU_OPCODE_BNE,
-    VEMU_OPCODE_BLT,
-    VEMU_OPCODE_BGE,
-    VEMU_OPCODE_BLTU,
-    VEMU_OPCODE_BGEU,
-    VEMU_OPCODE_LB,
-    VEMU_OPCODE_LH,
-    VEMU_OPCODE_LW,
-    VEMU_OPCODE_LBU,
-    VEMU_OPCODE_LHU,
-    VEMU_OPCODE_SB,
-    VEMU_OPCODE_SH,
-    VEMU_OPCODE_SW,
-    VEMU_OPCODE_ADDI,
-    VEMU_OPCODE_SLTI,
-    VEMU_OPCODE_SLTIU,
-    VEMU_OPCODE_XORI,
-    VEMU_OPCODE_ORI,
-    VEMU_OPCODE_ANDI,
-    VEMU_OPCODE_SRLI,
-    VEMU_OPCODE_SLLI,
-    VEMU_OPCODE_SRAI,
-    VEMU_OPCODE_ADD,
-    VEMU_OPCODE_SUB,
-    VEMU_OPCODE_SLL,
-    VEMU_OPCODE_SLT,
-    VEMU_OPCODE_SLTU,
-    VEMU_OPCODE_XOR,
-    VEMU_OPCODE_SRL,
-    VEMU_OPCODE_SRA,
-    VEMU_OPCODE_OR,
-    VEMU_OPCODE_AND,
-    VEMU_OPCODE_FENCE,
-    VEMU_OPCODE_FENCE_TSO,
-    VEMU_OPCODE_PAUSE,
-    VEMU_OPCODE_ECALL,
-    VEMU_OPCODE_EBREAK,
-} vemu_opcode_t;
-
-typedef enum {
-    VEMU_FUNCT_BEQ          = 0x0,
-    VEMU_FUNCT_BNE          = 0x1,
-    VEMU_FUNCT_BLT          = 0x4,
-    VEMU_FUNCT_BGE          = 0x5,
-    VEMU_FUNCT_BLTU         = 0x6,
-    VEMU_FUNCT_BGEU         = 0x7,
-
-    VEMU_FUNCT_LB           = 0x0,
-    VEMU_FUNCT_LH           = 0x1,
-    VEMU_FUNCT_LW           = 0x2,
-    VEMU_FUNCT_LBU          = 0x4,
-    VEMU_FUNCT_LHU          = 0x5,
-
-    VEMU_FUNCT_SB           = 0x0,
-    VEMU_FUNCT_SH           = 0x1,
-    VEMU_FUNCT_SW           = 0x2,
-
-    VEMU_FUNCT_ADDI         = 0x0,
-    VEMU_FUNCT_SLTI         = 0x2,
-    VEMU_FUNCT_SLTIU        = 0x3,
-    VEMU_FUNCT_XORI         = 0x4,
-    VEMU_FUNCT_ORI          = 0x6,
-    VEMU_FUNCT_ANDI         = 0x7,
-    VEMU_FUNCT_SLLI         = 0x1,
-    VEMU_FUNCT_SRLI_SRAI    = 0x5,
-
-    VEMU_FUNCT_ADD_SUB      = 0x0,
-    VEMU_FUNCT_SLL          = 0x1,
-    VEMU_FUNCT_SLT          = 0x2,
-    VEMU_FUNCT_SLTU         = 0x3,
-    VEMU_FUNCT_XOR          = 0x4,
-    VEMU_FUNCT_SRL_SRA      = 0x5,
-    VEMU_FUNCT_OR           = 0x6,
-    VEMU_FUNCT_AND          = 0x7,
-} vemu_funct_t;
-
-typedef enum {
-    /* Quadrant 0 */
-    VEMU_OPCODE_C_ADDI4SPN,
-
-    /* Quadrant 1 */
-    VEMU_OPCODE_C_ADDI,
-    VEMU_OPCODE_C_LI,
-
-    /* Quadrant 2 */
-    VEMU_OPCODE_C_LWSP      = 0x2,
-    VEMU_OPCODE_C_SWSP      = 0x6,
-} vemu_compressed_opcode_t;
+/* Bytes in a vector register */
+#define VEMU_CPU_VLENB              32
 
 typedef enum {
-    VEMU_OPCODE_R_LUI       = 0x37,
-    VEMU_OPCODE_R_AUIPC     = 0x17,
-    VEMU_OPCODE_R_JALR      = 0x67,
-    VEMU_OPCODE_R_JAL       = 0x6F,
-    VEMU_OPCODE_R_B         = 0x63,
-    VEMU_OPCODE_R_L         = 0x03,
-    VEMU_OPCODE_R_S         = 0x23,
-    VEMU_OPCODE_R_I         = 0x13,
-    VEMU_OPCODE_R_R         = 0x33,
-    VEMU_OPCODE_R_FENCE     = 0x0F,
-    VEMU_OPCODE_R_ECALL     = 0x73, /* TODO: ECALL / EBREAK */
-} vemu_regular_opcode_t;
-
-typedef enum {
-    VEMU_FORMAT_R,
-    VEMU_FORMAT_I,
-    VEMU_FORMAT_S,
-    VEMU_FORMAT_B,
-    VEMU_FORMAT_U,
-    VEMU_FORMAT_J,
-} vemu_instruction_format_t;
+    VEMU_EXEC_INTERP,
+    VEMU_EXEC_BLOCK,
+    VEMU_EXEC_JIT,
+} vemu_exec_mode_t;
 
 typedef struct {
     uint32_t regs[VEMU_N_REGS];
     uint32_t ip;
     uint32_t next_ip;
 
+    /* Singles are NaN-boxed in the low half. The exception flags in fcsr
+       lag behind the host's while the hart runs, see vemu_fp_enter(). */
+    uint64_t fregs[VEMU_N_REGS];
+    uint32_t fcsr;
+
+    /* Vector registers follow each other, so that a register group is
+       contiguous, see vec.h */
+    uint8_t vregs[VEMU_N_REGS][VEMU_CPU_VLENB];
+    uint32_t vl;
+    uint32_t vtype;
+    uint32_t vstart;
+
     bool terminated;
 
-    uint32_t trace;
+    /* Where the guest stopped and its a0 at that point. A guest that
+       returned from _start stops at 0 with its exit code in a0. Stays
+       VEMU_CPU_NO_STOP when the emulator gave up on the guest. */
+    uint32_t stop_ip;
+    uint32_t exit_code;
+
+    /* Where the guest's ecalls print to */
+    FILE *out;
+    FILE *err;
+
+    /* Called by the checkpoint ecall with what goes into a0; returning
+       false stops the guest there. Without it the ecall returns 0. */
+    bool (*checkpoint)(void *arg, uint32_t *res);
+    void *checkpoint_arg;
+
+    /* Logs or feeds back whatever ecalls bring in from outside */
+    vemu_replay_t *replay;
+
+    /* Harts start with a0 = hartid and a1 = n_harts */
+    uint32_t hartid;
+    uint32_t n_harts;
+
+    /* Set by lr.w and checked by sc.w */
+    bool reserved;
+    uint32_t reservation;
+    uint32_t reserved_value;
+
+    uint64_t instret;
+    uint64_t trace_start;
 
     uint8_t **ram;
+    vemu_bus_t *bus;
+    vemu_mmu_t mmu;
+
+    vemu_exec_mode_t mode;
+    bool fusion;
+    bool traces;
+    uint32_t passes;
+    vemu_decode_cache_t dcache;
+    vemu_block_cache_t blocks;
+    vemu_jit_t jit;
+    vemu_ir_stats_t ir_stats;
+    vemu_smc_t smc;
 } vemu_cpu_t;
 
-typedef struct {
-    vemu_opcode_t opcode;
-    uint8_t rd;
-    uint8_t rs1;
-    uint8_t rs2;
-    uint32_t imm;
-    bool c;
-} vemu_decoded_t;
+void vemu_cpu_init(vemu_cpu_t *cpu, uint8_t **ram);
 
-void vemu_disassemble(vemu_decoded_t *dec, uint32_t instr, uint32_t ip);
+void vemu_cpu_destruct(vemu_cpu_t *cpu);
 
-void vemu_cpu_init(vemu_cpu_t *cpu, uint8_t **ram);
+void vemu_cpu_reset(vemu_cpu_t *cpu, uint32_t entry);
 
 void vemu_cpu_run(vemu_cpu_t *cpu, uint32_t entry);
 
+/* Runs from cpu->ip on, with the registers as they are */
+void vemu_cpu_resume(vemu_cpu_t *cpu);
+
+/* Calls run(cpu, arg) with faults on guest memory outside of guest RAM
+   caught: instead of taking down the host, such a fault stops the hart
+   at cpu->ip, which may be the start of the block that faulted. */
+void vemu_cpu_run_guarded(vemu_cpu_t *cpu, 
+                          void (*run)(vemu_cpu_t *cpu, void *arg), void *arg);
+
+/* Entry points for code that runs guest programs outside of 
+   vemu_cpu_run(), such as ahead-of-time compiled binaries. */
+uint8_t vemu_cpu_decode(vemu_cpu_t *cpu, uint32_t ip, vemu_decoded_t *dec);
+
+bool vemu_cpu_is_terminator(vemu_opcode_t opcode);
+
+void vemu_cpu_ecall(vemu_cpu_t *cpu);
+
+/* Slow path of a store of len bytes at addr to a page holding decoded
+   code: drops whatever was decoded from the bytes written */
+void vemu_cpu_code_store(vemu_cpu_t *cpu, uint32_t addr, uint32_t len);
+
+/* Slow paths of the loads and stores of the base ISA, taken while
+   addresses are translated or when they hit a device page, see 
+   vemu_bus_is_device(). Devices only take these accesses. The load 
+   returns what goes into rd. */
+uint32_t vemu_cpu_load(vemu_cpu_t *cpu, uint32_t addr, vemu_opcode_t opcode);
+
+void vemu_cpu_store(vemu_cpu_t *cpu, uint32_t addr, uint32_t len,
+                    uint32_t value);
+
+/* The physical address of an access of len bytes at addr. One that may
+   not be made, or that runs on into a page elsewhere in memory, stops
+   the hart the way vemu_cpu_run_guarded() does and does not return. */
+uint32_t vemu_cpu_translate(vemu_cpu_t *cpu, uint32_t addr, uint32_t len,
+                            vemu_mmu_access_t access);
+
+/* Stops the hart at an instruction that only turns out to be illegal
+   when it runs, such as a vector op under the vtype of the moment, the
+   way an illegal instruction does. Leaves like a fault, so that no op
+   after it in a block runs, and does not return. */
+void vemu_cpu_illegal(vemu_cpu_t *cpu) __attribute__((noreturn));
+
+/* Where in guest memory the other loads and stores go */
+static inline uint32_t vemu_cpu_data_addr(vemu_cpu_t *cpu, uint32_t addr,
+                                          uint32_t len,
+                                          vemu_mmu_access_t access) {
+    return vemu_mmu_on(&cpu->mmu) ? vemu_cpu_translate(cpu, addr, len, access)
+                                  : addr;
+}
+
+/* Executes an A extension op on the word at addr with rs2 = value, and 
+   returns what goes into rd */
+uint32_t vemu_cpu_amo(vemu_cpu_t *cpu, vemu_opcode_t opcode, uint32_t addr,
+                      uint32_t value);
+
+uint32_t vemu_cpu_read_csr(vemu_cpu_t *cpu, uint32_t csr);
+
+/* csrrw, csrrs or csrrc, by the funct3 in bits 13:12 of csr_op, on the
+   CSR in its low 12 bits. Returns the old value. */
+uint32_t vemu_cpu_write_csr(vemu_cpu_t *cpu, uint32_t csr_op, uint32_t value);
+
+/* Drops all decoded code and translations of it */
+void vemu_cpu_flush_code(vemu_cpu_t *cpu);
+
+/* Interprets from cpu->ip through the next block terminator and returns
+   the ip execution continues at */
+uint32_t vemu_cpu_interp_block(vemu_cpu_t *cpu);
+
+void vemu_cpu_print_stats(vemu_cpu_t *cpu, FILE *file, double seconds);
+
 #endif
@@ -0,0 +1,42 @@
+#ifndef VEMU_DECODE_CACHE_H
+#define VEMU_DECODE_CACHE_H
+
+#include "instr.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VEMU_DECODE_CACHE_BITS  16
+#define VEMU_DECODE_CACHE_EMPTY 0xFFFFFFFF
+
+/* Instructions are at least 2-byte aligned, so bit 0 of the ip never
+   contributes to the index and an odd tag can never match. */
+#define VEMU_DECODE_CACHE_INDEX(cache, ip) (((ip) >> 1) & (cache)->mask)
+
+typedef struct {
+    uint32_t ip;
+    uint8_t len;
+    vemu_decoded_t dec;
+} vemu_decode_cache_entry_t;
+
+typedef struct {
+    vemu_decode_cache_entry_t *entries;
+    uint32_t mask;
+
+    uint64_t misses;
+} vemu_decode_cache_t;
+
+void vemu_decode_cache_init(vemu_decode_cache_t *cache);
+
+bool vemu_decode_cache_alloc(vemu_decode_cache_t *cache, size_t bits);
+
+void vemu_decode_cache_flush(vemu_decode_cache_t *cache);
+
+void vemu_decode_cache_destruct(vemu_decode_cache_t *cache);
+
+static inline vemu_decode_cache_entry_t *
+vemu_decode_cache_slot(vemu_decode_cache_t *cache, uint32_t ip) {
+    return &cache->entries[VEMU_DECODE_CACHE_INDEX(cache, ip)];
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <inttypes.h>
 
 typedef struct {
@@ -54,6 +55,10 @@ typedef struct {
 
 #define ELF_PT_LOAD     1
 
+#define ELF_PF_X        0x1
+#define ELF_PF_W        0x2
+#define ELF_PF_R        0x4
+
 typedef struct {
     uint32_t sh_name;
     uint32_t sh_type;
@@ -67,17 +72,41 @@ typedef struct {
     uint32_t sh_entsize;
 } vemu_elf_section_header_t;
 
+#define ELF_SHT_SYMTAB  2
+
+typedef struct {
+    uint32_t st_name;
+    uint32_t st_value;
+    uint32_t st_size;
+    uint8_t  st_info;
+    uint8_t  st_other;
+    uint16_t st_shndx;
+} vemu_elf_symbol_t;
+
+#define ELF_ST_TYPE(info)   ((info) & 0xF)
+#define ELF_STT_FUNC    2
+
 typedef struct {
     FILE *file;
     uint8_t *strtab;
     vemu_elf_header_t h;
+
+    /* All e_phnum program headers, read once on open */
+    vemu_elf_program_header_t *phdrs;
 } vemu_elf_t;
 
 void vemu_elf_init(vemu_elf_t *elf);
 
 bool vemu_elf_open(vemu_elf_t *elf, char const *filename);
 
-bool vemu_elf_load(vemu_elf_t *elf, uint8_t *ram);
+/* Loads the program's segments into ram, which is ram_size bytes of
+   zeroed guest memory */
+bool vemu_elf_load(vemu_elf_t *elf, uint8_t *ram, size_t ram_size);
+
+/* Like vemu_elf_load(), but maps the pages the segments fill from the
+   file into ram rather than copying them, see vemu_map_program(). ram
+   has to be a mapping of its own, at a host page boundary. */
+bool vemu_elf_map(vemu_elf_t *elf, uint8_t *ram, size_t ram_size);
 
 void vemu_elf_destruct(vemu_elf_t *elf);
 
@@ -85,13 +114,20 @@ bool vemu_read_elf_header(FILE *file, vemu_elf_header_t *elf);
 
 bool vemu_validate_elf_header(vemu_elf_header_t *elf);
 
-bool vemu_read_program_header(FILE *file, vemu_elf_header_t *elf, 
-                              vemu_elf_program_header_t *ph,
-                              size_t i);
+/* The whole program header table, in one read */
+vemu_elf_program_header_t *vemu_read_program_headers(FILE *file, 
+                                                     vemu_elf_header_t *elf);
 
 bool vemu_load_program(FILE *file, vemu_elf_program_header_t *ph,
                        uint8_t *ram);
 
+/* Maps the pages of ram that lie wholly within the segment's file
+   contents straight from the file, private and copy-on-write, and reads
+   in what is left of the contents. Reads all of it where the segment's
+   offset and address are not the same distance into a host page. */
+bool vemu_map_program(FILE *file, vemu_elf_program_header_t *ph,
+                      uint8_t *ram);
+
 bool vemu_read_section_header(FILE *file, vemu_elf_header_t *elf, 
                               vemu_elf_section_header_t *sh,
                               size_t i);
@@ -0,0 +1,125 @@
+#ifndef VEMU_FP_H
+#define VEMU_FP_H
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* F and D extension instructions. They all decode to VEMU_OPCODE_FP with
+   one of these in the low byte of imm2, see VEMU_FP_OP(). */
+typedef enum {
+    VEMU_FP_FLW,
+    VEMU_FP_FSW,
+    VEMU_FP_FMADD_S,
+    VEMU_FP_FMSUB_S,
+    VEMU_FP_FNMSUB_S,
+    VEMU_FP_FNMADD_S,
+    VEMU_FP_FADD_S,
+    VEMU_FP_FSUB_S,
+    VEMU_FP_FMUL_S,
+    VEMU_FP_FDIV_S,
+    VEMU_FP_FSQRT_S,
+    VEMU_FP_FSGNJ_S,
+    VEMU_FP_FSGNJN_S,
+    VEMU_FP_FSGNJX_S,
+    VEMU_FP_FMIN_S,
+    VEMU_FP_FMAX_S,
+    VEMU_FP_FCVT_W_S,
+    VEMU_FP_FCVT_WU_S,
+    VEMU_FP_FMV_X_W,
+    VEMU_FP_FEQ_S,
+    VEMU_FP_FLT_S,
+    VEMU_FP_FLE_S,
+    VEMU_FP_FCLASS_S,
+    VEMU_FP_FCVT_S_W,
+    VEMU_FP_FCVT_S_WU,
+    VEMU_FP_FMV_W_X,
+
+    VEMU_FP_FLD,
+    VEMU_FP_FSD,
+    VEMU_FP_FMADD_D,
+    VEMU_FP_FMSUB_D,
+    VEMU_FP_FNMSUB_D,
+    VEMU_FP_FNMADD_D,
+    VEMU_FP_FADD_D,
+    VEMU_FP_FSUB_D,
+    VEMU_FP_FMUL_D,
+    VEMU_FP_FDIV_D,
+    VEMU_FP_FSQRT_D,
+    VEMU_FP_FSGNJ_D,
+    VEMU_FP_FSGNJN_D,
+    VEMU_FP_FSGNJX_D,
+    VEMU_FP_FMIN_D,
+    VEMU_FP_FMAX_D,
+    VEMU_FP_FCVT_S_D,
+    VEMU_FP_FCVT_D_S,
+    VEMU_FP_FEQ_D,
+    VEMU_FP_FLT_D,
+    VEMU_FP_FLE_D,
+    VEMU_FP_FCLASS_D,
+    VEMU_FP_FCVT_W_D,
+    VEMU_FP_FCVT_WU_D,
+    VEMU_FP_FCVT_D_W,
+    VEMU_FP_FCVT_D_WU,
+} vemu_fp_opcode_t;
+
+#define VEMU_FP_N_OPS       (VEMU_FP_FCVT_D_WU + 1)
+
+/* Rounding modes, as in the rm field and frm */
+typedef enum {
+    VEMU_FP_RNE,
+    VEMU_FP_RTZ,
+    VEMU_FP_RDN,
+    VEMU_FP_RUP,
+    VEMU_FP_RMM,
+    VEMU_FP_DYN             = 7,
+} vemu_fp_rm_t;
+
+/* Accrued exception flags, as in fflags */
+#define VEMU_FP_NX          0x01
+#define VEMU_FP_UF          0x02
+#define VEMU_FP_OF          0x04
+#define VEMU_FP_DZ          0x08
+#define VEMU_FP_NV          0x10
+#define VEMU_FP_FLAGS       0x1F
+
+#define VEMU_FP_FRM_SHIFT   5
+#define VEMU_FP_FCSR_MASK   0xFF
+
+/* An FP instruction packed into a word: the op, its floating-point
+   registers and its rounding mode. The integer register it reads, if
+   any, is dec->rs1 and the one it writes is dec->rd; both are x0 for
+   instructions without one. */
+#define VEMU_FP_OP(op, rd, rs1, rs2, rs3, rm)                               \
+    ((uint32_t)(op) | (uint32_t)(rd) << 8 | (uint32_t)(rs1) << 13           \
+     | (uint32_t)(rs2) << 18 | (uint32_t)(rs3) << 23 | (uint32_t)(rm) << 28)
+
+#define VEMU_FP_OPCODE(op)  ((vemu_fp_opcode_t)((op) & 0xFF))
+
+/* Decodes the LOAD-FP, STORE-FP, FMA and OP-FP major opcodes. Leaves dec
+   alone for encodings that are not valid instructions. */
+void vemu_fp_decode(uint32_t instr, vemu_decoded_t *dec);
+
+/* Executes a packed FP instruction. x is the integer operand: the
+   address for loads and stores, x[rs1] for moves and conversions from
+   integers. Returns what goes into x[rd], or 0. */
+uint32_t vemu_fp_exec(vemu_cpu_t *cpu, uint32_t op, uint32_t x);
+
+bool vemu_fp_is_csr(uint32_t csr);
+
+uint32_t vemu_fp_read_csr(vemu_cpu_t *cpu, uint32_t csr);
+
+void vemu_fp_write_csr(vemu_cpu_t *cpu, uint32_t csr, uint32_t value);
+
+/* Guest rounding modes and exception flags live in the host's floating
+   point environment while a hart runs, so that FP ops need neither set
+   nor collect them. Host code that computes with floating point in
+   between, such as ecall handlers, runs between vemu_fp_leave() and
+   vemu_fp_enter(). */
+void vemu_fp_enter(vemu_cpu_t *cpu);
+
+void vemu_fp_leave(vemu_cpu_t *cpu);
+
+void vemu_fp_disassemble(vemu_decoded_t *dec);
+
+#endif
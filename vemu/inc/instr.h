@@ -0,0 +1,343 @@
+#ifndef VEMU_INSTR_H
+#define VEMU_INSTR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VEMU_MAX_OPCODES    128
+#define VEMU_MAX_FUNCT3     8
+
+#define VEMU_IS_COMPRESSED(instr) (((instr) & 0x3) != 0x3)
+#define VEMU_C_OPCODE(instr)      (((instr) & 0x3) << 3 | ((instr) >> 13 & 0x7))
+
+typedef enum {
+    VEMU_OPCODE_ILLEGAL,
+    VEMU_OPCODE_NOP,
+
+    VEMU_OPCODE_LUI,
+    VEMU_OPCODE_AUIPC,
+    VEMU_OPCODE_JAL,
+    VEMU_OPCODE_JALR,
+    VEMU_OPCODE_BEQ,
+    VEMU_OPCODE_BNE,
+    VEMU_OPCODE_BLT,
+    VEMU_OPCODE_BGE,
+    VEMU_OPCODE_BLTU,
+    VEMU_OPCODE_BGEU,
+    VEMU_OPCODE_LB,
+    VEMU_OPCODE_LH,
+    VEMU_OPCODE_LW,
+    VEMU_OPCODE_LBU,
+    VEMU_OPCODE_LHU,
+    VEMU_OPCODE_SB,
+    VEMU_OPCODE_SH,
+    VEMU_OPCODE_SW,
+    VEMU_OPCODE_ADDI,
+    VEMU_OPCODE_SLTI,
+    VEMU_OPCODE_SLTIU,
+    VEMU_OPCODE_XORI,
+    VEMU_OPCODE_ORI,
+    VEMU_OPCODE_ANDI,
+    VEMU_OPCODE_SRLI,
+    VEMU_OPCODE_SLLI,
+    VEMU_OPCODE_SRAI,
+    VEMU_OPCODE_ADD,
+    VEMU_OPCODE_SUB,
+    VEMU_OPCODE_SLL,
+    VEMU_OPCODE_SLT,
+    VEMU_OPCODE_SLTU,
+    VEMU_OPCODE_XOR,
+    VEMU_OPCODE_SRL,
+    VEMU_OPCODE_SRA,
+    VEMU_OPCODE_OR,
+    VEMU_OPCODE_AND,
+    VEMU_OPCODE_FENCE,
+    VEMU_OPCODE_FENCE_TSO,
+    VEMU_OPCODE_FENCE_I,
+    VEMU_OPCODE_PAUSE,
+    VEMU_OPCODE_ECALL,
+    VEMU_OPCODE_EBREAK,
+    VEMU_OPCODE_SFENCE_VMA,
+
+    /* Zicsr, limited to reading read-only CSRs and to the FP, vector and
+       translation CSRs. Writes to satp end the block, which has to be
+       fetched again with the new translation. */
+    VEMU_OPCODE_CSRR,
+    VEMU_OPCODE_CSRRW,
+    VEMU_OPCODE_CSRRW_SATP,
+
+    /* A extension */
+    VEMU_OPCODE_LR_W,
+    VEMU_OPCODE_SC_W,
+    VEMU_OPCODE_AMOSWAP_W,
+    VEMU_OPCODE_AMOADD_W,
+    VEMU_OPCODE_AMOXOR_W,
+    VEMU_OPCODE_AMOAND_W,
+    VEMU_OPCODE_AMOOR_W,
+    VEMU_OPCODE_AMOMIN_W,
+    VEMU_OPCODE_AMOMAX_W,
+    VEMU_OPCODE_AMOMINU_W,
+    VEMU_OPCODE_AMOMAXU_W,
+
+    /* M extension */
+    VEMU_OPCODE_MUL,
+    VEMU_OPCODE_MULH,
+    VEMU_OPCODE_MULHSU,
+    VEMU_OPCODE_MULHU,
+    VEMU_OPCODE_DIV,
+    VEMU_OPCODE_DIVU,
+    VEMU_OPCODE_REM,
+    VEMU_OPCODE_REMU,
+
+    /* Zba, Zbb and Zbs */
+    VEMU_OPCODE_SH1ADD,
+    VEMU_OPCODE_SH2ADD,
+    VEMU_OPCODE_SH3ADD,
+    VEMU_OPCODE_ANDN,
+    VEMU_OPCODE_ORN,
+    VEMU_OPCODE_XNOR,
+    VEMU_OPCODE_CLZ,
+    VEMU_OPCODE_CTZ,
+    VEMU_OPCODE_CPOP,
+    VEMU_OPCODE_MAX,
+    VEMU_OPCODE_MAXU,
+    VEMU_OPCODE_MIN,
+    VEMU_OPCODE_MINU,
+    VEMU_OPCODE_SEXT_B,
+    VEMU_OPCODE_SEXT_H,
+    VEMU_OPCODE_ZEXT_H,
+    VEMU_OPCODE_ROL,
+    VEMU_OPCODE_ROR,
+    VEMU_OPCODE_RORI,
+    VEMU_OPCODE_ORC_B,
+    VEMU_OPCODE_REV8,
+    VEMU_OPCODE_BCLR,
+    VEMU_OPCODE_BCLRI,
+    VEMU_OPCODE_BEXT,
+    VEMU_OPCODE_BEXTI,
+    VEMU_OPCODE_BINV,
+    VEMU_OPCODE_BINVI,
+    VEMU_OPCODE_BSET,
+    VEMU_OPCODE_BSETI,
+
+    /* F and D extensions, see fp.h */
+    VEMU_OPCODE_FP,
+
+    /* V extension, see vec.h */
+    VEMU_OPCODE_VEC,
+
+    /* Fused pairs, each retiring two instructions */
+    VEMU_OPCODE_LUI_ADDI,
+    VEMU_OPCODE_AUIPC_LW,
+    VEMU_OPCODE_AUIPC_JALR,
+    VEMU_OPCODE_SLT_BNEZ,
+    VEMU_OPCODE_SLT_BEQZ,
+    VEMU_OPCODE_SLTU_BNEZ,
+    VEMU_OPCODE_SLTU_BEQZ,
+} vemu_opcode_t;
+
+#define VEMU_N_OPCODES      (VEMU_OPCODE_SLTU_BEQZ + 1)
+
+typedef enum {
+    VEMU_FUNCT_BEQ          = 0x0,
+    VEMU_FUNCT_BNE          = 0x1,
+    VEMU_FUNCT_BLT          = 0x4,
+    VEMU_FUNCT_BGE          = 0x5,
+    VEMU_FUNCT_BLTU         = 0x6,
+    VEMU_FUNCT_BGEU         = 0x7,
+
+    VEMU_FUNCT_LB           = 0x0,
+    VEMU_FUNCT_LH           = 0x1,
+    VEMU_FUNCT_LW           = 0x2,
+    VEMU_FUNCT_LBU          = 0x4,
+    VEMU_FUNCT_LHU          = 0x5,
+
+    VEMU_FUNCT_SB           = 0x0,
+    VEMU_FUNCT_SH           = 0x1,
+    VEMU_FUNCT_SW           = 0x2,
+
+    VEMU_FUNCT_ADDI         = 0x0,
+    VEMU_FUNCT_SLTI         = 0x2,
+    VEMU_FUNCT_SLTIU        = 0x3,
+    VEMU_FUNCT_XORI         = 0x4,
+    VEMU_FUNCT_ORI          = 0x6,
+    VEMU_FUNCT_ANDI         = 0x7,
+    VEMU_FUNCT_SLLI         = 0x1,
+    VEMU_FUNCT_SRLI_SRAI    = 0x5,
+
+    VEMU_FUNCT_ADD_SUB      = 0x0,
+    VEMU_FUNCT_SLL          = 0x1,
+    VEMU_FUNCT_SLT          = 0x2,
+    VEMU_FUNCT_SLTU         = 0x3,
+    VEMU_FUNCT_XOR          = 0x4,
+    VEMU_FUNCT_SRL_SRA      = 0x5,
+    VEMU_FUNCT_OR           = 0x6,
+    VEMU_FUNCT_AND          = 0x7,
+
+    VEMU_FUNCT_FENCE        = 0x0,
+    VEMU_FUNCT_FENCE_I      = 0x1,
+
+    VEMU_FUNCT_PRIV         = 0x0,
+    VEMU_FUNCT_CSRRW        = 0x1,
+    VEMU_FUNCT_CSRRS        = 0x2,
+    VEMU_FUNCT_CSRRC        = 0x3,
+    VEMU_FUNCT_CSRRWI       = 0x5,
+    VEMU_FUNCT_CSRRSI       = 0x6,
+    VEMU_FUNCT_CSRRCI       = 0x7,
+
+    VEMU_FUNCT_AMO_W        = 0x2,
+
+    VEMU_FUNCT_MUL          = 0x0,
+    VEMU_FUNCT_MULH         = 0x1,
+    VEMU_FUNCT_MULHSU       = 0x2,
+    VEMU_FUNCT_MULHU        = 0x3,
+    VEMU_FUNCT_DIV          = 0x4,
+    VEMU_FUNCT_DIVU         = 0x5,
+    VEMU_FUNCT_REM          = 0x6,
+    VEMU_FUNCT_REMU         = 0x7,
+
+    VEMU_FUNCT_SH1ADD       = 0x2,
+    VEMU_FUNCT_SH2ADD       = 0x4,
+    VEMU_FUNCT_SH3ADD       = 0x6,
+    VEMU_FUNCT_XNOR         = 0x4,
+    VEMU_FUNCT_ORN          = 0x6,
+    VEMU_FUNCT_ANDN         = 0x7,
+    VEMU_FUNCT_MIN          = 0x4,
+    VEMU_FUNCT_MINU         = 0x5,
+    VEMU_FUNCT_MAX          = 0x6,
+    VEMU_FUNCT_MAXU         = 0x7,
+    VEMU_FUNCT_ZEXT_H       = 0x4,
+    VEMU_FUNCT_ROL          = 0x1,
+    VEMU_FUNCT_ROR          = 0x5,
+    VEMU_FUNCT_BIT          = 0x1,
+    VEMU_FUNCT_BEXT         = 0x5,
+} vemu_funct_t;
+
+/* Bits 31:25 of OP and shift OP-IMM instructions. The Zb* groups also
+   tell apart the OP-IMM forms, together with bits 24:20 for clz, ctz,
+   cpop, sext.b and sext.h, and all of 31:20 for orc.b and rev8. */
+typedef enum {
+    VEMU_FUNCT7_BASE        = 0x00,
+    VEMU_FUNCT7_M           = 0x01,
+    VEMU_FUNCT7_ALT         = 0x20,
+    VEMU_FUNCT7_ZEXT        = 0x04,
+    VEMU_FUNCT7_MINMAX      = 0x05,
+    VEMU_FUNCT7_SHADD       = 0x10,
+    VEMU_FUNCT7_BSET        = 0x14,
+    VEMU_FUNCT7_BCLR        = 0x24,
+    VEMU_FUNCT7_ROTATE      = 0x30,
+    VEMU_FUNCT7_BINV        = 0x34,
+} vemu_funct7_t;
+
+#define VEMU_IMM_CLZ        0x600
+#define VEMU_IMM_CTZ        0x601
+#define VEMU_IMM_CPOP       0x602
+#define VEMU_IMM_SEXT_B     0x604
+#define VEMU_IMM_SEXT_H     0x605
+#define VEMU_IMM_ORC_B      0x287
+#define VEMU_IMM_REV8       0x698
+
+/* Bits 31:25 of sfence.vma, which shares funct3 with ecall */
+#define VEMU_FUNCT7_SFENCE_VMA  0x09
+
+/* Bits 31:27 of A extension instructions */
+typedef enum {
+    VEMU_FUNCT5_AMOADD      = 0x00,
+    VEMU_FUNCT5_AMOSWAP     = 0x01,
+    VEMU_FUNCT5_LR          = 0x02,
+    VEMU_FUNCT5_SC          = 0x03,
+    VEMU_FUNCT5_AMOXOR      = 0x04,
+    VEMU_FUNCT5_AMOOR       = 0x08,
+    VEMU_FUNCT5_AMOAND      = 0x0C,
+    VEMU_FUNCT5_AMOMIN      = 0x10,
+    VEMU_FUNCT5_AMOMAX      = 0x14,
+    VEMU_FUNCT5_AMOMINU     = 0x18,
+    VEMU_FUNCT5_AMOMAXU     = 0x1C,
+} vemu_funct5_t;
+
+#define VEMU_CSR_FFLAGS     0x001
+#define VEMU_CSR_FRM        0x002
+#define VEMU_CSR_FCSR       0x003
+#define VEMU_CSR_MHARTID    0xF14
+
+/* Compressed instructions by quadrant and funct3, see VEMU_C_OPCODE() */
+typedef enum {
+    /* Quadrant 0 */
+    VEMU_OPCODE_C_ADDI4SPN  = 0x00,
+    VEMU_OPCODE_C_FLD       = 0x01,
+    VEMU_OPCODE_C_LW        = 0x02,
+    VEMU_OPCODE_C_FLW       = 0x03,
+    VEMU_OPCODE_C_FSD       = 0x05,
+    VEMU_OPCODE_C_SW        = 0x06,
+    VEMU_OPCODE_C_FSW       = 0x07,
+
+    /* Quadrant 1 */
+    VEMU_OPCODE_C_ADDI      = 0x08,
+    VEMU_OPCODE_C_JAL       = 0x09,
+    VEMU_OPCODE_C_LI        = 0x0A,
+    VEMU_OPCODE_C_LUI       = 0x0B, /* and C.ADDI16SP */
+    VEMU_OPCODE_C_ALU       = 0x0C,
+    VEMU_OPCODE_C_J         = 0x0D,
+    VEMU_OPCODE_C_BEQZ      = 0x0E,
+    VEMU_OPCODE_C_BNEZ      = 0x0F,
+
+    /* Quadrant 2 */
+    VEMU_OPCODE_C_SLLI      = 0x10,
+    VEMU_OPCODE_C_FLDSP     = 0x11,
+    VEMU_OPCODE_C_LWSP      = 0x12,
+    VEMU_OPCODE_C_FLWSP     = 0x13,
+    VEMU_OPCODE_C_JR_MV_ADD = 0x14,
+    VEMU_OPCODE_C_FSDSP     = 0x15,
+    VEMU_OPCODE_C_SWSP      = 0x16,
+    VEMU_OPCODE_C_FSWSP     = 0x17,
+} vemu_compressed_opcode_t;
+
+typedef enum {
+    VEMU_OPCODE_R_LUI       = 0x37,
+    VEMU_OPCODE_R_AUIPC     = 0x17,
+    VEMU_OPCODE_R_JALR      = 0x67,
+    VEMU_OPCODE_R_JAL       = 0x6F,
+    VEMU_OPCODE_R_B         = 0x63,
+    VEMU_OPCODE_R_L         = 0x03,
+    VEMU_OPCODE_R_S         = 0x23,
+    VEMU_OPCODE_R_I         = 0x13,
+    VEMU_OPCODE_R_R         = 0x33,
+    VEMU_OPCODE_R_FENCE     = 0x0F,
+    VEMU_OPCODE_R_AMO       = 0x2F,
+    VEMU_OPCODE_R_LOAD_FP   = 0x07,
+    VEMU_OPCODE_R_STORE_FP  = 0x27,
+    VEMU_OPCODE_R_FMADD     = 0x43,
+    VEMU_OPCODE_R_FMSUB     = 0x47,
+    VEMU_OPCODE_R_FNMSUB    = 0x4B,
+    VEMU_OPCODE_R_FNMADD    = 0x4F,
+    VEMU_OPCODE_R_OP_FP     = 0x53,
+    VEMU_OPCODE_R_OP_V      = 0x57,
+    VEMU_OPCODE_R_ECALL     = 0x73, /* TODO: ECALL / EBREAK */
+} vemu_regular_opcode_t;
+
+typedef enum {
+    VEMU_FORMAT_R,
+    VEMU_FORMAT_I,
+    VEMU_FORMAT_S,
+    VEMU_FORMAT_B,
+    VEMU_FORMAT_U,
+    VEMU_FORMAT_J,
+} vemu_instruction_format_t;
+
+/* rd2 and imm2 describe the second half of a fused pair. n_instrs is the
+   number of guest instructions the op retires. */
+typedef struct {
+    vemu_opcode_t opcode;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t rd2;
+    uint32_t imm;
+    uint32_t imm2;
+    uint8_t n_instrs;
+    bool c;
+} vemu_decoded_t;
+
+void vemu_disassemble(vemu_decoded_t *dec, uint32_t instr, uint32_t ip);
+
+#endif
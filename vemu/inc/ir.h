@@ -0,0 +1,29 @@
+#ifndef VEMU_IR_H
+#define VEMU_IR_H
+
+#include "instr.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VEMU_IR_CONST_PROP      0x1
+#define VEMU_IR_DEAD_WRITES     0x2
+#define VEMU_IR_REDUNDANT_LOADS 0x4
+#define VEMU_IR_ALL             0x7
+
+typedef struct {
+    uint64_t ops_in;
+    uint64_t ops_out;
+
+    uint64_t folded;
+    uint64_t dead;
+    uint64_t loads;
+} vemu_ir_stats_t;
+
+void vemu_ir_stats_init(vemu_ir_stats_t *stats);
+
+bool vemu_ir_parse_passes(char const *list, uint32_t *passes);
+
+uint32_t vemu_ir_optimize(vemu_decoded_t *ops, uint32_t n_ops, bool has_term,
+                          uint32_t passes, vemu_ir_stats_t *stats);
+
+#endif
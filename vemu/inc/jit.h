@@ -0,0 +1,86 @@
+#ifndef VEMU_JIT_H
+#define VEMU_JIT_H
+
+#include "block.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VEMU_JIT_BUFFER_SIZE    (16 * 1024 * 1024)
+#define VEMU_JIT_THRESHOLD      32
+
+/* Native code returns the next guest ip. Guest ips are always even, so
+   odd values mark exits that need a C handler for the terminator; cpu->ip
+   and cpu->next_ip have been set up for it. */
+#define VEMU_JIT_EXIT_ECALL         1
+#define VEMU_JIT_EXIT_ILLEGAL       3
+#define VEMU_JIT_EXIT_FENCE_I       5
+#define VEMU_JIT_EXIT_SFENCE_VMA    7
+
+/* Host instructions beyond baseline x86-64 that generated code may use */
+#define VEMU_JIT_HOST_LZCNT     0x1
+#define VEMU_JIT_HOST_TZCNT     0x2
+#define VEMU_JIT_HOST_POPCNT    0x4
+
+typedef enum {
+    VEMU_JIT_OK,
+    VEMU_JIT_UNSUPPORTED,
+    VEMU_JIT_FULL,
+} vemu_jit_result_t;
+
+/* Returned in rax:rdx. patch is the rel32 of the jump that left native
+   code when the exit had a static successor, or NULL. */
+typedef struct {
+    uint64_t ip;
+    uint8_t *patch;
+} vemu_jit_exit_t;
+
+typedef vemu_jit_exit_t (*vemu_jit_entry_t)(void *cpu, uint8_t *ram,
+                                            uint8_t *code);
+
+typedef struct {
+    uint8_t *code;
+    size_t size;
+    size_t used;
+
+    vemu_jit_entry_t enter;
+    uint8_t *exit;
+
+    /* Follow every store with a check for overwritten code */
+    bool check_stores;
+
+    /* Look up the page of every load and store for a device behind it */
+    bool check_devices;
+
+    /* Translate loads and stores through the data TLB; follows satp when
+       a block is compiled, since a satp write drops all compiled code */
+    bool translate;
+
+    /* VEMU_JIT_HOST_* the host supports */
+    uint32_t host;
+
+    uint64_t compiled;
+    uint64_t unsupported;
+    uint64_t entries;
+    uint64_t links;
+    uint64_t resets;
+} vemu_jit_t;
+
+void vemu_jit_init(vemu_jit_t *jit);
+
+bool vemu_jit_alloc(vemu_jit_t *jit, size_t size);
+
+void vemu_jit_reset(vemu_jit_t *jit);
+
+void vemu_jit_destruct(vemu_jit_t *jit);
+
+/* The odd exit code of a terminator that runs in C, or 0 */
+uint32_t vemu_jit_exit_code(vemu_opcode_t opcode);
+
+vemu_jit_result_t vemu_jit_compile(vemu_jit_t *jit, vemu_block_t *block);
+
+void vemu_jit_link(vemu_jit_t *jit, uint8_t *patch, uint8_t *target);
+
+void vemu_jit_unlink(vemu_jit_t *jit, uint8_t *code, uint32_t ip);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef VEMU_MMU_H
+#define VEMU_MMU_H
+
+#include "bus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define VEMU_CSR_SATP           0x180
+
+/* satp has no ASID bits here, which Sv32 allows */
+#define VEMU_MMU_SATP_MODE      0x80000000
+#define VEMU_MMU_SATP_PPN       0x003FFFFF
+
+#define VEMU_MMU_PAGE_BITS      12
+#define VEMU_MMU_PAGE_MASK      (~0u << VEMU_MMU_PAGE_BITS)
+
+#define VEMU_PTE_V              0x01
+#define VEMU_PTE_R              0x02
+#define VEMU_PTE_W              0x04
+#define VEMU_PTE_X              0x08
+#define VEMU_PTE_U              0x10
+#define VEMU_PTE_G              0x20
+#define VEMU_PTE_A              0x40
+#define VEMU_PTE_D              0x80
+
+#define VEMU_MMU_TLB_BITS       8
+#define VEMU_MMU_TLB_SIZE       (1u << VEMU_MMU_TLB_BITS)
+
+/* A tag no page address matches */
+#define VEMU_MMU_INVALID        1
+
+typedef enum {
+    VEMU_MMU_LOAD,
+    VEMU_MMU_STORE,
+    VEMU_MMU_FETCH,
+} vemu_mmu_access_t;
+
+/* Maps the virtual page an address indexes by, for the accesses whose
+   tag is the page's address; the other tags are VEMU_MMU_INVALID.
+   Adding addend to a virtual address on the page gives the physical
+   one. The instruction TLB keeps fetches under the load tag. Entries are
+   16 bytes, which generated code indexes with a shift. */
+typedef struct {
+    uint32_t load;
+    uint32_t store;
+    uint32_t addend;
+    uint32_t unused;
+} vemu_tlb_entry_t;
+
+typedef struct {
+    vemu_tlb_entry_t entries[VEMU_MMU_TLB_SIZE];
+
+    uint64_t hits;
+    uint64_t misses;
+} vemu_tlb_t;
+
+/* Sv32 translation of a hart's addresses, on while satp says so. With
+   no privileged modes to tell apart, it applies to every access the
+   hart makes and ignores the U bit. Accessed and dirty bits are set in
+   the page table as pages are used. Entries are only ever filled for
+   guest memory, so device pages always take the slow path. */
+typedef struct {
+    uint32_t satp;
+
+    vemu_tlb_t itlb;
+    vemu_tlb_t dtlb;
+
+    uint64_t faults;
+    uint64_t flushes;
+} vemu_mmu_t;
+
+void vemu_mmu_init(vemu_mmu_t *mmu);
+
+void vemu_mmu_flush(vemu_mmu_t *mmu);
+
+/* Flushes the TLBs too */
+void vemu_mmu_set_satp(vemu_mmu_t *mmu, uint32_t satp);
+
+/* Walks the page table in ram for a TLB miss and fills the entry.
+   Returns false if the access may not be made. */
+bool vemu_mmu_miss(vemu_mmu_t *mmu, uint8_t *ram, vemu_bus_t *bus,
+                   uint32_t vaddr, vemu_mmu_access_t access,
+                   uint32_t *paddr);
+
+void vemu_mmu_print_stats(vemu_mmu_t *mmu, FILE *file);
+
+static inline bool vemu_mmu_on(vemu_mmu_t const *mmu) {
+    return mmu->satp & VEMU_MMU_SATP_MODE;
+}
+
+static inline vemu_tlb_entry_t *vemu_mmu_entry(vemu_tlb_t *tlb,
+                                               uint32_t vaddr) {
+    return &tlb->entries[(vaddr >> VEMU_MMU_PAGE_BITS)
+                         & (VEMU_MMU_TLB_SIZE - 1)];
+}
+
+/* The physical address of vaddr while translation is on. A hit costs a
+   compare and an add. */
+static inline bool vemu_mmu_translate(vemu_mmu_t *mmu, uint8_t *ram,
+                                      vemu_bus_t *bus, uint32_t vaddr,
+                                      vemu_mmu_access_t access,
+                                      uint32_t *paddr) {
+    vemu_tlb_t *tlb = access == VEMU_MMU_FETCH ? &mmu->itlb : &mmu->dtlb;
+    vemu_tlb_entry_t *entry = vemu_mmu_entry(tlb, vaddr);
+    uint32_t tag = access == VEMU_MMU_STORE ? entry->store : entry->load;
+
+    if (tag == (vaddr & VEMU_MMU_PAGE_MASK)) {
+        tlb->hits++;
+        *paddr = vaddr + entry->addend;
+        return true;
+    }
+
+    return vemu_mmu_miss(mmu, ram, bus, vaddr, access, paddr);
+}
+
+#endif
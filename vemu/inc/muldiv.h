@@ -0,0 +1,51 @@
+#ifndef VEMU_MULDIV_H
+#define VEMU_MULDIV_H
+
+#include <stdint.h>
+
+/* M extension arithmetic, shared by the interpreter, constant folding
+   and compiled programs so that all of them agree. Division never traps:
+   dividing by zero gives all ones and leaves the dividend as the
+   remainder, and INT32_MIN / -1 overflows to INT32_MIN with remainder 0. */
+
+static inline uint32_t vemu_mulh(uint32_t x, uint32_t y) {
+    return (uint64_t)((int64_t)(int32_t)x * (int32_t)y) >> 32;
+}
+
+static inline uint32_t vemu_mulhsu(uint32_t x, uint32_t y) {
+    return (uint64_t)((int64_t)(int32_t)x * (uint64_t)y) >> 32;
+}
+
+static inline uint32_t vemu_mulhu(uint32_t x, uint32_t y) {
+    return ((uint64_t)x * y) >> 32;
+}
+
+static inline uint32_t vemu_div(uint32_t x, uint32_t y) {
+    if (y == 0) {
+        return UINT32_MAX;
+    }
+    if (x == 0x80000000u && y == UINT32_MAX) {
+        return x;
+    }
+    return (uint32_t)((int32_t)x / (int32_t)y);
+}
+
+static inline uint32_t vemu_divu(uint32_t x, uint32_t y) {
+    return y == 0 ? UINT32_MAX : x / y;
+}
+
+static inline uint32_t vemu_rem(uint32_t x, uint32_t y) {
+    if (y == 0) {
+        return x;
+    }
+    if (x == 0x80000000u && y == UINT32_MAX) {
+        return 0;
+    }
+    return (uint32_t)((int32_t)x % (int32_t)y);
+}
+
+static inline uint32_t vemu_remu(uint32_t x, uint32_t y) {
+    return y == 0 ? x : x % y;
+}
+
+#endif
@@ -2,17 +2,81 @@
 #define VEMU_RAM_H
 
 #include <inttypes.h>
+#include <string.h>
 
-uint8_t vemu_ram_load_byte(uint8_t *ram, uint32_t addr);
+/* Guest memory sits at the start of a reservation that covers every
+   32-bit address and then some, so that any guest address plus the
+   widest access stays inside it. Only the first ram_size bytes are
+   accessible; touching the rest is a guest fault, see
+   vemu_cpu_run_guarded(). Accesses need no bounds checks. */
+#define VEMU_RAM_GUARD_SIZE     (64 * 1024)
+#define VEMU_RAM_RESERVE_SIZE   ((1ull << 32) + VEMU_RAM_GUARD_SIZE)
 
-void vemu_ram_store_byte(uint8_t *ram, uint32_t addr, uint8_t byte);
+/* On little-endian hosts halfwords and words are copied whole, so that
+   an aligned access is a single host access and harts on other threads
+   never see half of a store. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define VEMU_RAM_HOST_ORDER
+#endif
+
+static inline uint8_t vemu_ram_load_byte(uint8_t *ram, uint32_t addr) {
+    return ram[addr];
+}
+
+static inline void vemu_ram_store_byte(uint8_t *ram, uint32_t addr, 
+                                       uint8_t byte) {
+    ram[addr] = byte;
+}
+
+#ifdef VEMU_RAM_HOST_ORDER
+
+static inline uint16_t vemu_ram_load_half(uint8_t *ram, uint32_t addr) {
+    uint16_t half;
+    memcpy(&half, ram + addr, sizeof(half));
+    return half;
+}
+
+static inline void vemu_ram_store_half(uint8_t *ram, uint32_t addr, 
+                                       uint16_t half) {
+    memcpy(ram + addr, &half, sizeof(half));
+}
 
-uint16_t vemu_ram_load_half(uint8_t *ram, uint32_t addr);
+static inline uint32_t vemu_ram_load_word(uint8_t *ram, uint32_t addr) {
+    uint32_t word;
+    memcpy(&word, ram + addr, sizeof(word));
+    return word;
+}
 
-void vemu_ram_store_half(uint8_t *ram, uint32_t addr, uint16_t half);
+static inline void vemu_ram_store_word(uint8_t *ram, uint32_t addr, 
+                                       uint32_t word) {
+    memcpy(ram + addr, &word, sizeof(word));
+}
 
-uint32_t vemu_ram_load_word(uint8_t *ram, uint32_t addr);
+#else
 
-void vemu_ram_store_word(uint8_t *ram, uint32_t addr, uint32_t word);
+static inline uint16_t vemu_ram_load_half(uint8_t *ram, uint32_t addr) {
+    return (ram[addr]) | (ram[addr + 1] << 8);
+}
+
+static inline void vemu_ram_store_half(uint8_t *ram, uint32_t addr, 
+                                       uint16_t half) {
+    ram[addr] = half & 0xFF;
+    ram[addr + 1] = (half >> 8) & 0xFF;
+}
+
+static inline uint32_t vemu_ram_load_word(uint8_t *ram, uint32_t addr) {
+    return ram[addr] | (ram[addr + 1] << 8)
+        | (ram[addr + 2] << 16) | ((uint32_t)ram[addr + 3] << 24);
+}
+
+static inline void vemu_ram_store_word(uint8_t *ram, uint32_t addr, 
+                                       uint32_t word) {
+    ram[addr] = word & 0xFF;
+    ram[addr + 1] = (word >> 8) & 0xFF;
+    ram[addr + 2] = (word >> 16) & 0xFF;
+    ram[addr + 3] = (word >> 24) & 0xFF;
+}
+
+#endif
 
 #endif
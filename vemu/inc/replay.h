@@ -0,0 +1,54 @@
+#ifndef VEMU_REPLAY_H
+#define VEMU_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Bump whenever the log layout changes */
+#define VEMU_REPLAY_VERSION     1
+
+typedef enum {
+    VEMU_REPLAY_RECORD,
+    VEMU_REPLAY_REPLAY,
+} vemu_replay_mode_t;
+
+/* A log of every value that enters the guest from outside through an
+   ecall. Recording writes each one with the ecall number and the
+   instruction count it happened at; replaying hands the same values
+   back, so a run with the same program and options retires exactly the
+   same instructions. Events are LEB128-encoded with the instruction
+   count as a delta from the previous event, a handful of bytes each. */
+typedef struct {
+    vemu_replay_mode_t mode;
+    char const *path;
+    FILE *file;
+
+    uint64_t instret;
+    uint64_t events;
+
+    /* Set once replay no longer matches the log */
+    bool diverged;
+} vemu_replay_t;
+
+void vemu_replay_init(vemu_replay_t *replay);
+
+void vemu_replay_destruct(vemu_replay_t *replay);
+
+bool vemu_replay_open(vemu_replay_t *replay, char const *path,
+                      vemu_replay_mode_t mode);
+
+/* Records *value, or replaces it with the recorded one. Returns false if
+   the guest made a different ecall, or made it at a different point,
+   than the log says. */
+bool vemu_replay_event(vemu_replay_t *replay, uint64_t instret,
+                       uint32_t ecall, uint32_t *value);
+
+/* Records how the guest stopped, or checks that it stopped the same way
+   and that the whole log was used */
+bool vemu_replay_finish(vemu_replay_t *replay, uint64_t instret,
+                        uint32_t stop_ip, uint32_t exit_code);
+
+void vemu_replay_print_stats(vemu_replay_t *replay, FILE *file);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef VEMU_SMC_H
+#define VEMU_SMC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VEMU_SMC_PAGE_BITS      12
+#define VEMU_SMC_N_PAGES        (1u << (32 - VEMU_SMC_PAGE_BITS))
+
+/* One bit per halfword of a page */
+#define VEMU_SMC_BITMAP_SIZE    ((1u << VEMU_SMC_PAGE_BITS) / 16)
+
+/* Tracks which guest memory has been decoded into a cache, so stores can
+   tell when they overwrite code. Pages without code have a NULL entry,
+   which is all a data store ever looks at; pages with code point to a
+   bitmap of the halfwords that were decoded. Bits are only ever cleared
+   by a store to them, so stale bits cost a slow-path check and no more. */
+typedef struct {
+    uint8_t **pages;
+    uint32_t n_bitmaps;
+
+    uint64_t code_stores;
+    uint64_t invalidations;
+    uint64_t invalidated;
+} vemu_smc_t;
+
+void vemu_smc_init(vemu_smc_t *smc);
+
+bool vemu_smc_alloc(vemu_smc_t *smc);
+
+void vemu_smc_destruct(vemu_smc_t *smc);
+
+/* Records that [start, end) holds decoded code. Does nothing while
+   tracking is off. */
+bool vemu_smc_mark(vemu_smc_t *smc, uint32_t start, uint32_t end);
+
+/* Whether a store of len bytes at addr overwrites decoded code */
+bool vemu_smc_overlaps(vemu_smc_t *smc, uint32_t addr, uint32_t len);
+
+void vemu_smc_clear(vemu_smc_t *smc, uint32_t addr, uint32_t len);
+
+/* Fast path for every store: whether it touches a page with code */
+static inline bool vemu_smc_code_page(vemu_smc_t *smc, uint32_t addr,
+                                      uint32_t len) {
+    return smc->pages != NULL
+        && (smc->pages[addr >> VEMU_SMC_PAGE_BITS] != NULL
+            || smc->pages[(addr + len - 1) >> VEMU_SMC_PAGE_BITS] != NULL);
+}
+
+#endif
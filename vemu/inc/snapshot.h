@@ -0,0 +1,68 @@
+#ifndef VEMU_SNAPSHOT_H
+#define VEMU_SNAPSHOT_H
+
+#include "system.h"
+#include "registers.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bump whenever the file layout changes */
+#define VEMU_SNAPSHOT_VERSION   5
+
+#define VEMU_SNAPSHOT_PAGE_SIZE 4096
+
+/* A snapshot file is this header, the ascending numbers of the guest
+   pages it holds, the bus permissions of each of the first n_perms pages
+   of guest memory, a byte each, and then the pages themselves, starting
+   at the first page boundary after that so that they can be mapped
+   straight into guest memory. Pages left out are all zeros. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t n_pages;
+    uint32_t n_perms;
+    uint32_t ip;
+    uint32_t regs[VEMU_N_REGS];
+    uint32_t fcsr;
+    uint64_t fregs[VEMU_N_REGS];
+    uint32_t vl;
+    uint32_t vtype;
+    uint32_t vstart;
+    uint8_t vregs[VEMU_N_REGS][VEMU_CPU_VLENB];
+    uint32_t satp;
+    uint64_t instret;
+    uint64_t trace_start;
+} vemu_snapshot_header_t;
+
+typedef struct {
+    char const *path;
+    int fd;
+    vemu_snapshot_header_t *header;
+    size_t size;
+
+    uint32_t *pages;
+    uint8_t *perms;
+    size_t data_offset;
+} vemu_snapshot_t;
+
+void vemu_snapshot_init(vemu_snapshot_t *snap);
+
+void vemu_snapshot_destruct(vemu_snapshot_t *snap);
+
+/* Maps the file and checks its header and page list */
+bool vemu_snapshot_open(vemu_snapshot_t *snap, char const *path);
+
+/* Maps the snapshot's pages into the guest memory of a single-hart
+   system, copy-on-write, gives them back their permissions, and sets up
+   the hart to resume where the snapshot was taken */
+bool vemu_snapshot_restore(vemu_snapshot_t *snap, vemu_system_t *sys);
+
+/* Writes hart 0's state and every non-zero page of guest memory the
+   guest has touched. Pages restored from base count as touched even if
+   they were never read since. base may be NULL. */
+bool vemu_snapshot_save(char const *path, vemu_system_t *sys,
+                        vemu_snapshot_t *base);
+
+#endif
@@ -2,18 +2,66 @@
 #define VEMU_SYSTEM_H
 
 #include "cpu.h"
+#include "bus.h"
+#include "elf-file.h"
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
 
+#define VEMU_SYSTEM_RAM_SIZE    (1024 * 1024 * 1024)
+
+/* Bounds of --ram: hart 0's stack and the whole 32-bit address space */
+#define VEMU_SYSTEM_RAM_MIN     VEMU_CPU_STACK_TOP
+#define VEMU_SYSTEM_RAM_MAX     (1ull << 32)
+#define VEMU_SYSTEM_RAM_ALIGN   4096
+
+/* Harts n > 0 keep their stacks below 1 GiB of guest memory */
+#define VEMU_MAX_HARTS          64
+
+/* Harts share guest memory and nothing else: each has its own caches
+   and translations, and runs on a host thread of its own. How far a
+   guest speeds up with more harts has not been measured. */
 typedef struct {
-    vemu_cpu_t cpu;
+    vemu_cpu_t *harts;
+    uint32_t n_harts;
     uint8_t *ram;
+    size_t ram_size;
+    vemu_bus_t bus;
+
+    /* Guest memory that may be mapped from the program's file, whose
+       pages the host only backs once the guest touches them */
+    size_t image_start;
+    size_t image_end;
 } vemu_system_t;
 
 void vemu_system_init(vemu_system_t *sys);
 
+bool vemu_system_alloc(vemu_system_t *sys, uint32_t n_harts);
+
 void vemu_system_destruct(vemu_system_t *sys);
 
-void vemu_system_add_ram(vemu_system_t *sys, uint8_t *ram);
+/* Guest memory is a private anonymous mapping: pages the guest never
+   touches are never backed, and parts of it can be replaced by mappings
+   of files. The mapping reserves VEMU_RAM_RESERVE_SIZE bytes, of which
+   the first size are accessible. */
+bool vemu_system_alloc_ram(vemu_system_t *sys, size_t size);
 
-#endif
+/* Maps the program into guest memory, see vemu_elf_map(), and gives
+   each page of guest memory the permissions of the segments on it, or
+   of both segments where two share a page. Pages without a segment can
+   be read and written but not executed. */
+bool vemu_system_load_elf(vemu_system_t *sys, vemu_elf_t *elf);
+
+/* Gives n pages of guest memory from first on perms, see
+   vemu_bus_protect(), and has the host map them to match */
+bool vemu_system_protect(vemu_system_t *sys, uint32_t first, uint32_t n,
+                         uint8_t perms);
+
+/* Devices go above guest memory */
+bool vemu_system_add_device(vemu_system_t *sys, vemu_device_t const *device);
 
+/* Starts every hart at entry and returns once all of them have stopped.
+   Hart 0 runs on the calling thread. */
+bool vemu_system_run(vemu_system_t *sys, uint32_t entry);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef VEMU_TCACHE_H
+#define VEMU_TCACHE_H
+
+#include "cpu.h"
+#include "elf-file.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Bump whenever the file layout or the meaning of decoded ops changes */
+#define VEMU_TCACHE_VERSION     9
+
+typedef enum {
+    VEMU_TCACHE_MISS,
+    VEMU_TCACHE_HIT,
+    VEMU_TCACHE_STALE,
+    VEMU_TCACHE_CORRUPT,
+} vemu_tcache_result_t;
+
+/* Translated blocks of one program, kept on disk between runs. Entries
+   are keyed by a hash of the loaded segments and remember the settings
+   the blocks were translated with. */
+typedef struct {
+    char *path;
+    uint64_t key;
+    uint32_t config;
+
+    vemu_tcache_result_t result;
+    uint64_t loaded;
+    uint64_t saved;
+} vemu_tcache_t;
+
+void vemu_tcache_init(vemu_tcache_t *tcache);
+
+void vemu_tcache_destruct(vemu_tcache_t *tcache);
+
+bool vemu_tcache_open(vemu_tcache_t *tcache, char const *dir,
+                      vemu_elf_t *elf, uint8_t *ram, vemu_cpu_t *cpu);
+
+void vemu_tcache_load(vemu_tcache_t *tcache, vemu_cpu_t *cpu);
+
+bool vemu_tcache_save(vemu_tcache_t *tcache, vemu_cpu_t *cpu);
+
+void vemu_tcache_print_stats(vemu_tcache_t *tcache, vemu_cpu_t *cpu,
+                             FILE *file);
+
+#endif
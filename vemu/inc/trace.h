@@ -0,0 +1,27 @@
+#ifndef VEMU_TRACE_H
+#define VEMU_TRACE_H
+
+#include "block.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Loop heads become trace heads after this many backward jumps to them */
+#define VEMU_TRACE_THRESHOLD    16
+#define VEMU_TRACE_MAX_BLOCKS   16
+#define VEMU_TRACE_MAX_OPS      256
+
+#define VEMU_TRACE_STATS_TOP    8
+
+vemu_block_t *vemu_trace_form(vemu_block_cache_t *cache, vemu_block_t *head);
+
+uint64_t vemu_trace_side_exits(vemu_block_t *trace);
+
+uint64_t vemu_trace_retired(vemu_block_t *trace);
+
+bool vemu_trace_overlaps(vemu_block_t *trace, uint32_t start, uint32_t end);
+
+void vemu_trace_print_stats(vemu_block_cache_t *cache, FILE *file,
+                            uint64_t instret);
+
+#endif
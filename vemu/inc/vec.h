@@ -0,0 +1,160 @@
+#ifndef VEMU_VEC_H
+#define VEMU_VEC_H
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The V extension as Zve32x: integer elements of 8, 16 and 32 bits in
+   VEMU_CPU_VLENB-byte registers, grouped by LMUL from 1/4 to 8. Masked
+   off and tail elements are left undisturbed. Vector instructions all
+   decode to VEMU_OPCODE_VEC with one of these in the low byte of imm2,
+   see VEMU_VEC_OP(). */
+typedef enum {
+    VEMU_VEC_VSETVLI,
+    VEMU_VEC_VSETIVLI,
+    VEMU_VEC_VSETVL,
+
+    /* Loads and stores */
+    VEMU_VEC_VLE,
+    VEMU_VEC_VSE,
+    VEMU_VEC_VLSE,
+    VEMU_VEC_VSSE,
+    VEMU_VEC_VLXEI,
+    VEMU_VEC_VSXEI,
+    VEMU_VEC_VLM,
+    VEMU_VEC_VSM,
+    VEMU_VEC_VLR,
+    VEMU_VEC_VSR,
+
+    /* vd = vs2 op vs1, x or the immediate */
+    VEMU_VEC_VADD,
+    VEMU_VEC_VSUB,
+    VEMU_VEC_VRSUB,
+    VEMU_VEC_VAND,
+    VEMU_VEC_VOR,
+    VEMU_VEC_VXOR,
+    VEMU_VEC_VSLL,
+    VEMU_VEC_VSRL,
+    VEMU_VEC_VSRA,
+    VEMU_VEC_VMINU,
+    VEMU_VEC_VMIN,
+    VEMU_VEC_VMAXU,
+    VEMU_VEC_VMAX,
+    VEMU_VEC_VMUL,
+    VEMU_VEC_VMACC,
+    VEMU_VEC_VNMSAC,
+    VEMU_VEC_VMADD,
+    VEMU_VEC_VNMSUB,
+
+    /* Compares into a mask */
+    VEMU_VEC_VMSEQ,
+    VEMU_VEC_VMSNE,
+    VEMU_VEC_VMSLTU,
+    VEMU_VEC_VMSLT,
+    VEMU_VEC_VMSLEU,
+    VEMU_VEC_VMSLE,
+    VEMU_VEC_VMSGTU,
+    VEMU_VEC_VMSGT,
+
+    /* Reductions into element 0 of vd */
+    VEMU_VEC_VREDSUM,
+    VEMU_VEC_VREDAND,
+    VEMU_VEC_VREDOR,
+    VEMU_VEC_VREDXOR,
+    VEMU_VEC_VREDMINU,
+    VEMU_VEC_VREDMIN,
+    VEMU_VEC_VREDMAXU,
+    VEMU_VEC_VREDMAX,
+
+    /* Mask logicals, vd = vs2 op vs1 */
+    VEMU_VEC_VMANDN,
+    VEMU_VEC_VMAND,
+    VEMU_VEC_VMOR,
+    VEMU_VEC_VMXOR,
+    VEMU_VEC_VMORN,
+    VEMU_VEC_VMNAND,
+    VEMU_VEC_VMNOR,
+    VEMU_VEC_VMXNOR,
+
+    /* Moves and permutations */
+    VEMU_VEC_VMERGE,
+    VEMU_VEC_VMV_V,
+    VEMU_VEC_VMV_NR,
+    VEMU_VEC_VMV_X_S,
+    VEMU_VEC_VMV_S_X,
+    VEMU_VEC_VCPOP,
+    VEMU_VEC_VFIRST,
+    VEMU_VEC_VID,
+    VEMU_VEC_VSLIDEUP,
+    VEMU_VEC_VSLIDEDOWN,
+    VEMU_VEC_VSLIDE1UP,
+    VEMU_VEC_VSLIDE1DOWN,
+} vemu_vec_opcode_t;
+
+#define VEMU_VEC_N_OPS      (VEMU_VEC_VSLIDE1DOWN + 1)
+
+/* vtype fields */
+#define VEMU_VEC_VLMUL      0x07
+#define VEMU_VEC_VSEW_SHIFT 3
+#define VEMU_VEC_VSEW       0x38
+#define VEMU_VEC_VTA        0x40
+#define VEMU_VEC_VMA        0x80
+#define VEMU_VEC_VILL       0x80000000u
+
+#define VEMU_CSR_VSTART     0x008
+#define VEMU_CSR_VL         0xC20
+#define VEMU_CSR_VTYPE      0xC21
+#define VEMU_CSR_VLENB      0xC22
+
+/* Operand forms of arithmetic instructions */
+#define VEMU_VEC_VV         0
+#define VEMU_VEC_VX         1
+#define VEMU_VEC_VI         2
+
+/* A vector instruction packed into a word: the op, its vector registers,
+   its vm bit and a field whose meaning depends on the op. That is the
+   operand form for arithmetic, the element width (0 to 2 for 8 to 32
+   bits) and nf for loads and stores, and the register count for
+   vmv<nr>r. vsetvli and vsetivli keep their vtype immediate where the
+   vector registers would be, see VEMU_VEC_CONFIG(). The integer operands
+   are in dec->rs1 and dec->rs2 and the integer result goes to dec->rd;
+   they are x0 for instructions without one. */
+#define VEMU_VEC_OP(op, vd, vs1, vs2, vm, field)                            \
+    ((uint32_t)(op) | (uint32_t)(vd) << 8 | (uint32_t)(vs1) << 13           \
+     | (uint32_t)(vs2) << 18 | (uint32_t)(vm) << 23 | (uint32_t)(field) << 24)
+
+/* How vsetvl and vsetvli pick the application vector length when rs1 is
+   x0: VLMAX if rd is not x0, the current vl otherwise */
+#define VEMU_VEC_AVL_REG    0
+#define VEMU_VEC_AVL_MAX    1
+#define VEMU_VEC_AVL_KEEP   2
+
+#define VEMU_VEC_CONFIG(op, vtype, avl)                                     \
+    ((uint32_t)(op) | (uint32_t)(vtype) << 8 | (uint32_t)(avl) << 24)
+
+#define VEMU_VEC_OPCODE(op) ((vemu_vec_opcode_t)((op) & 0xFF))
+
+/* Decodes the OP-V major opcode and the vector loads and stores under
+   LOAD-FP and STORE-FP. Leaves dec alone for encodings that are not
+   valid instructions or that Zve32x leaves out. */
+void vemu_vec_decode(uint32_t instr, vemu_decoded_t *dec);
+
+/* Executes a packed vector instruction. x is x[rs1] plus the immediate:
+   the address of loads and stores, the scalar operand of .vx and .vi
+   forms and the AVL of vsetvli and vsetivli. y is x[rs2]: the stride of
+   strided accesses and the vtype of vsetvl. Returns what goes into x[rd],
+   or 0. Instructions that need a valid vtype are illegal while vill is
+   set, as are those whose register groups are misaligned or overlap in
+   ways the spec reserves; they stop the hart, see vemu_cpu_illegal(). */
+uint32_t vemu_vec_exec(vemu_cpu_t *cpu, uint32_t op, uint32_t x, uint32_t y);
+
+bool vemu_vec_is_csr(uint32_t csr);
+
+uint32_t vemu_vec_read_csr(vemu_cpu_t *cpu, uint32_t csr);
+
+void vemu_vec_write_csr(vemu_cpu_t *cpu, uint32_t csr, uint32_t value);
+
+void vemu_vec_disassemble(vemu_decoded_t *dec);
+
+#endif
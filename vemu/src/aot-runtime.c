@@ -0,0 +1,114 @@
+#include "aot.h"
+#include "system.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <argp.h>
+#include <string.h>
+#include <time.h>
+
+#define VEMU_AOT_RAM_SIZE   (1024 * 1024 * 1024)
+
+static struct argp_option options[] = {
+    { "stats", 's', 0, 0, "Print execution statistics on exit", 0 },
+    { 0 }
+};
+
+typedef struct {
+    int stats;
+} vemu_aot_args_t;
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    vemu_aot_args_t *args = state->input;
+    (void)arg;
+
+    switch (key) {
+        case 's':
+            args->stats = 1;
+            break;
+
+        case ARGP_KEY_ARG:
+            argp_usage(state);
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, NULL, NULL, NULL, NULL, NULL };
+
+static double vemu_aot_seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec)
+         + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+typedef struct {
+    vemu_aot_image_t const *image;
+    uint64_t fallbacks;
+} vemu_aot_guarded_t;
+
+static void vemu_aot_run_guarded(vemu_cpu_t *cpu, void *arg) {
+    vemu_aot_guarded_t *guarded = arg;
+    guarded->image->run(cpu, &guarded->fallbacks);
+}
+
+int vemu_aot_main(int argc, char **argv, vemu_aot_image_t const *image) {
+    vemu_aot_args_t args = { 0 };
+    argp_parse(&argp, argc, argv, 0, 0, &args);
+
+    vemu_system_t sys;
+    vemu_system_init(&sys);
+
+    if (!vemu_system_alloc_ram(&sys, VEMU_AOT_RAM_SIZE)) {
+        fprintf(stderr, "could not allocate guest memory\n");
+        return 1;
+    }
+
+    /* Compiled programs run a single hart */
+    if (!vemu_system_alloc(&sys, 1)) {
+        fprintf(stderr, "could not allocate harts\n");
+        vemu_system_destruct(&sys);
+        return 1;
+    }
+    vemu_cpu_t *cpu = &sys.harts[0];
+
+    for (size_t i = 0; i < image->n_segments; i++) {
+        vemu_aot_segment_t const *seg = &image->segments[i];
+        if (seg->data != NULL) {
+            memcpy(sys.ram + seg->vaddr, seg->data, seg->filesz);
+        }
+    }
+
+    vemu_cpu_reset(cpu, image->entry);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    vemu_aot_guarded_t guarded = { .image = image, .fallbacks = 0 };
+    vemu_fp_enter(cpu);
+    vemu_cpu_run_guarded(cpu, vemu_aot_run_guarded, &guarded);
+    vemu_fp_leave(cpu);
+    uint64_t fallbacks = guarded.fallbacks;
+
+    if (args.stats) {
+        double seconds = vemu_aot_seconds_since(&start);
+
+        fprintf(stderr, "instructions:  %" PRIu64 "\n", cpu->instret);
+        fprintf(stderr, "time:          %.3f s\n", seconds);
+        if (seconds > 0) {
+            fprintf(stderr, "MIPS:          %.1f\n",
+                    cpu->instret / seconds / 1e6);
+        }
+        fprintf(stderr, "aot:           %s, %" PRIu32 " blocks, %" PRIu64
+                " interpreted blocks\n", image->name, image->n_blocks,
+                fallbacks);
+    }
+
+    vemu_system_destruct(&sys);
+
+    return 0;
+}
@@ -0,0 +1,865 @@
+#include "aot.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static char const *const vemu_aot_regs[VEMU_N_REGS] = {
+    "0u",  "x1",  "x2",  "x3",  "x4",  "x5",  "x6",  "x7",
+    "x8",  "x9",  "x10", "x11", "x12", "x13", "x14", "x15",
+    "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23",
+    "x24", "x25", "x26", "x27", "x28", "x29", "x30", "x31",
+};
+
+#define R(n) vemu_aot_regs[(n)]
+
+void vemu_aot_init(vemu_aot_t *aot, vemu_cpu_t *cpu) {
+    aot->cpu = cpu;
+
+    aot->n_segments = 0;
+    for (size_t i = 0; i < VEMU_AOT_MAX_SEGMENTS; i++) {
+        aot->leaders[i] = NULL;
+    }
+
+    aot->work = NULL;
+    aot->n_work = 0;
+    aot->work_size = 0;
+
+    aot->n_blocks = 0;
+    aot->n_instrs = 0;
+    aot->n_indirect = 0;
+}
+
+void vemu_aot_destruct(vemu_aot_t *aot) {
+    for (size_t i = 0; i < aot->n_segments; i++) {
+        free(aot->leaders[i]);
+    }
+
+    free(aot->work);
+}
+
+bool vemu_aot_add_segment(vemu_aot_t *aot, uint32_t vaddr, uint32_t filesz,
+                          uint32_t memsz, bool exec) {
+    if (aot->n_segments == VEMU_AOT_MAX_SEGMENTS) {
+        fprintf(stderr, "too many segments\n");
+        return false;
+    }
+
+    size_t i = aot->n_segments;
+    if (exec) {
+        aot->leaders[i] = calloc(filesz / 16 + 1, 1);
+        if (aot->leaders[i] == NULL) {
+            return false;
+        }
+    }
+
+    aot->segments[i] = (vemu_aot_segment_t){
+        .vaddr = vaddr,
+        .filesz = filesz,
+        .memsz = memsz,
+        .exec = exec,
+        .data = *aot->cpu->ram + vaddr,
+    };
+    aot->n_segments++;
+
+    return true;
+}
+
+/* The exec segment holding code at ip, or -1 */
+static int vemu_aot_find_segment(vemu_aot_t *aot, uint32_t ip) {
+    for (size_t i = 0; i < aot->n_segments; i++) {
+        vemu_aot_segment_t *seg = &aot->segments[i];
+        if (seg->exec && ip >= seg->vaddr && ip - seg->vaddr < seg->filesz) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool vemu_aot_is_leader(vemu_aot_t *aot, uint32_t ip) {
+    int i = vemu_aot_find_segment(aot, ip);
+    if (i < 0) {
+        return false;
+    }
+
+    uint32_t bit = (ip - aot->segments[i].vaddr) >> 1;
+    return aot->leaders[i][bit / 8] & (1 << (bit % 8));
+}
+
+/* Marks ip as the start of a block and queues it for discovery. Targets
+   outside the exec segments are left to the interpreter at run time. */
+bool vemu_aot_add_root(vemu_aot_t *aot, uint32_t ip) {
+    int i = vemu_aot_find_segment(aot, ip);
+    if (i < 0 || (ip & 1) || vemu_aot_is_leader(aot, ip)) {
+        return true;
+    }
+
+    uint32_t bit = (ip - aot->segments[i].vaddr) >> 1;
+    aot->leaders[i][bit / 8] |= 1 << (bit % 8);
+
+    if (aot->n_work == aot->work_size) {
+        size_t size = aot->work_size ? 2 * aot->work_size : 256;
+        uint32_t *work = realloc(aot->work, size * sizeof(*work));
+        if (work == NULL) {
+            return false;
+        }
+        aot->work = work;
+        aot->work_size = size;
+    }
+
+    aot->work[aot->n_work++] = ip;
+    return true;
+}
+
+/* Follows every static control transfer from the roots. Return addresses
+   of calls become roots as well, since the returns that reach them are
+   indirect jumps. */
+bool vemu_aot_discover(vemu_aot_t *aot) {
+    while (aot->n_work > 0) {
+        uint32_t ip = aot->work[--aot->n_work];
+
+        while (vemu_aot_find_segment(aot, ip) >= 0) {
+            vemu_decoded_t dec;
+            uint32_t instr_ip = ip;
+            ip += vemu_cpu_decode(aot->cpu, instr_ip, &dec);
+
+            if (!vemu_cpu_is_terminator(dec.opcode)) {
+                continue;
+            }
+
+            bool ok = true;
+            switch (dec.opcode) {
+                case VEMU_OPCODE_BEQ:
+                case VEMU_OPCODE_BNE:
+                case VEMU_OPCODE_BLT:
+                case VEMU_OPCODE_BGE:
+                case VEMU_OPCODE_BLTU:
+                case VEMU_OPCODE_BGEU:
+                case VEMU_OPCODE_SLT_BNEZ:
+                case VEMU_OPCODE_SLT_BEQZ:
+                case VEMU_OPCODE_SLTU_BNEZ:
+                case VEMU_OPCODE_SLTU_BEQZ:
+                    ok = vemu_aot_add_root(aot, instr_ip + dec.imm)
+                      && vemu_aot_add_root(aot, ip);
+                    break;
+
+                case VEMU_OPCODE_JAL:
+                    ok = vemu_aot_add_root(aot, instr_ip + dec.imm)
+                      && (dec.rd == VEMU_ZERO || vemu_aot_add_root(aot, ip));
+                    break;
+
+                case VEMU_OPCODE_AUIPC_JALR:
+                    ok = vemu_aot_add_root(aot, dec.imm2)
+                      && (dec.rd2 == VEMU_ZERO
+                          || vemu_aot_add_root(aot, ip));
+                    break;
+
+                case VEMU_OPCODE_JALR:
+                    ok = dec.rd == VEMU_ZERO || vemu_aot_add_root(aot, ip);
+                    break;
+
+                case VEMU_OPCODE_ECALL:
+                case VEMU_OPCODE_FENCE_I:
+                    ok = vemu_aot_add_root(aot, ip);
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (!ok) {
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+static void vemu_aot_emit_goto(vemu_aot_t *aot, FILE *file, uint32_t ip) {
+    if (vemu_aot_is_leader(aot, ip)) {
+        fprintf(file, "    goto L_%08" PRIx32 ";\n", ip);
+    } else {
+        fprintf(file, "    ip = 0x%" PRIx32 "u;\n", ip);
+        fprintf(file, "    goto dispatch;\n");
+    }
+}
+
+static void vemu_aot_emit_load(FILE *file, vemu_decoded_t *dec,
+                               char const *load, char const *cast) {
+    if (dec->rd == VEMU_ZERO) {
+        return;
+    }
+
+    fprintf(file, "    %s = %s%s(ram, %s + 0x%" PRIx32 "u);\n", R(dec->rd),
+            cast, load, R(dec->rs1), dec->imm);
+}
+
+static void vemu_aot_emit_store(FILE *file, vemu_decoded_t *dec,
+                                char const *store) {
+    fprintf(file, "    %s(ram, %s + 0x%" PRIx32 "u, %s);\n", store,
+            R(dec->rs1), dec->imm, R(dec->rs2));
+}
+
+static void vemu_aot_emit_alu(FILE *file, vemu_decoded_t *dec,
+                              char const *fmt, char const *rhs) {
+    if (dec->rd == VEMU_ZERO) {
+        return;
+    }
+
+    fprintf(file, "    %s = ", R(dec->rd));
+    fprintf(file, fmt, R(dec->rs1), rhs);
+    fprintf(file, ";\n");
+}
+
+/* Straight-line ops. ip is the address of the op itself. */
+static void vemu_aot_emit_op(FILE *file, vemu_decoded_t *dec, uint32_t ip) {
+    char imm[16];
+    snprintf(imm, sizeof(imm), "0x%" PRIx32 "u", dec->imm);
+
+    switch (dec->opcode) {
+        case VEMU_OPCODE_LUI:
+        case VEMU_OPCODE_LUI_ADDI:
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "    %s = %s;\n", R(dec->rd), imm);
+            }
+            break;
+
+        case VEMU_OPCODE_AUIPC:
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "    %s = 0x%" PRIx32 "u;\n", R(dec->rd),
+                        ip + dec->imm);
+            }
+            break;
+
+        case VEMU_OPCODE_AUIPC_LW:
+            fprintf(file, "    %s = %s;\n", R(dec->rd), imm);
+            if (dec->rd2 != VEMU_ZERO) {
+                fprintf(file, "    %s = vemu_aot_load_word(ram, 0x%" PRIx32
+                        "u);\n", R(dec->rd2), dec->imm + dec->imm2);
+            }
+            break;
+
+        case VEMU_OPCODE_LB:
+            vemu_aot_emit_load(file, dec, "vemu_aot_load_byte",
+                               "(uint32_t)(int8_t)");
+            break;
+
+        case VEMU_OPCODE_LH:
+            vemu_aot_emit_load(file, dec, "vemu_aot_load_half",
+                               "(uint32_t)(int16_t)");
+            break;
+
+        case VEMU_OPCODE_LW:
+            vemu_aot_emit_load(file, dec, "vemu_aot_load_word", "");
+            break;
+
+        case VEMU_OPCODE_LBU:
+            vemu_aot_emit_load(file, dec, "vemu_aot_load_byte", "");
+            break;
+
+        case VEMU_OPCODE_LHU:
+            vemu_aot_emit_load(file, dec, "vemu_aot_load_half", "");
+            break;
+
+        case VEMU_OPCODE_SB:
+            vemu_aot_emit_store(file, dec, "vemu_aot_store_byte");
+            break;
+
+        case VEMU_OPCODE_SH:
+            vemu_aot_emit_store(file, dec, "vemu_aot_store_half");
+            break;
+
+        case VEMU_OPCODE_SW:
+            vemu_aot_emit_store(file, dec, "vemu_aot_store_word");
+            break;
+
+        case VEMU_OPCODE_ADDI:
+            vemu_aot_emit_alu(file, dec, "%s + %s", imm);
+            break;
+
+        case VEMU_OPCODE_SLTI:
+            vemu_aot_emit_alu(file, dec, "(int32_t)%s < (int32_t)%s", imm);
+            break;
+
+        case VEMU_OPCODE_SLTIU:
+            vemu_aot_emit_alu(file, dec, "%s < %s", imm);
+            break;
+
+        case VEMU_OPCODE_XORI:
+            vemu_aot_emit_alu(file, dec, "%s ^ %s", imm);
+            break;
+
+        case VEMU_OPCODE_ORI:
+            vemu_aot_emit_alu(file, dec, "%s | %s", imm);
+            break;
+
+        case VEMU_OPCODE_ANDI:
+            vemu_aot_emit_alu(file, dec, "%s & %s", imm);
+            break;
+
+        case VEMU_OPCODE_SLLI:
+            vemu_aot_emit_alu(file, dec, "%s << %s", imm);
+            break;
+
+        case VEMU_OPCODE_SRLI:
+            vemu_aot_emit_alu(file, dec, "%s >> %s", imm);
+            break;
+
+        case VEMU_OPCODE_SRAI:
+            vemu_aot_emit_alu(file, dec, "(uint32_t)((int32_t)%s >> %s)",
+                              imm);
+            break;
+
+        case VEMU_OPCODE_ADD:
+            vemu_aot_emit_alu(file, dec, "%s + %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SUB:
+            vemu_aot_emit_alu(file, dec, "%s - %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SLL:
+            vemu_aot_emit_alu(file, dec, "%s << (%s & 0x1F)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SLT:
+            vemu_aot_emit_alu(file, dec, "(int32_t)%s < (int32_t)%s",
+                              R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SLTU:
+            vemu_aot_emit_alu(file, dec, "%s < %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_XOR:
+            vemu_aot_emit_alu(file, dec, "%s ^ %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SRL:
+            vemu_aot_emit_alu(file, dec, "%s >> (%s & 0x1F)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SRA:
+            vemu_aot_emit_alu(file, dec,
+                              "(uint32_t)((int32_t)%s >> (%s & 0x1F))",
+                              R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_OR:
+            vemu_aot_emit_alu(file, dec, "%s | %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_AND:
+            vemu_aot_emit_alu(file, dec, "%s & %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_MUL:
+            vemu_aot_emit_alu(file, dec, "%s * %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_MULH:
+            vemu_aot_emit_alu(file, dec, "vemu_mulh(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_MULHSU:
+            vemu_aot_emit_alu(file, dec, "vemu_mulhsu(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_MULHU:
+            vemu_aot_emit_alu(file, dec, "vemu_mulhu(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_DIV:
+            vemu_aot_emit_alu(file, dec, "vemu_div(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_DIVU:
+            vemu_aot_emit_alu(file, dec, "vemu_divu(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_REM:
+            vemu_aot_emit_alu(file, dec, "vemu_rem(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_REMU:
+            vemu_aot_emit_alu(file, dec, "vemu_remu(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SH1ADD:
+            vemu_aot_emit_alu(file, dec, "(%s << 1) + %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SH2ADD:
+            vemu_aot_emit_alu(file, dec, "(%s << 2) + %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SH3ADD:
+            vemu_aot_emit_alu(file, dec, "(%s << 3) + %s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_ANDN:
+            vemu_aot_emit_alu(file, dec, "%s & ~%s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_ORN:
+            vemu_aot_emit_alu(file, dec, "%s | ~%s", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_XNOR:
+            vemu_aot_emit_alu(file, dec, "~(%s ^ %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_CLZ:
+            vemu_aot_emit_alu(file, dec, "vemu_clz(%s)%s", "");
+            break;
+
+        case VEMU_OPCODE_CTZ:
+            vemu_aot_emit_alu(file, dec, "vemu_ctz(%s)%s", "");
+            break;
+
+        case VEMU_OPCODE_CPOP:
+            vemu_aot_emit_alu(file, dec, "vemu_cpop(%s)%s", "");
+            break;
+
+        case VEMU_OPCODE_MAX:
+            vemu_aot_emit_alu(file, dec, "vemu_max(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_MAXU:
+            vemu_aot_emit_alu(file, dec, "vemu_maxu(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_MIN:
+            vemu_aot_emit_alu(file, dec, "vemu_min(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_MINU:
+            vemu_aot_emit_alu(file, dec, "vemu_minu(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_SEXT_B:
+            vemu_aot_emit_alu(file, dec, "(uint32_t)(int8_t)%s%s", "");
+            break;
+
+        case VEMU_OPCODE_SEXT_H:
+            vemu_aot_emit_alu(file, dec, "(uint32_t)(int16_t)%s%s", "");
+            break;
+
+        case VEMU_OPCODE_ZEXT_H:
+            vemu_aot_emit_alu(file, dec, "(uint16_t)%s%s", "");
+            break;
+
+        case VEMU_OPCODE_ROL:
+            vemu_aot_emit_alu(file, dec, "vemu_rol(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_ROR:
+            vemu_aot_emit_alu(file, dec, "vemu_ror(%s, %s)", R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_RORI:
+            vemu_aot_emit_alu(file, dec, "vemu_ror(%s, %s)", imm);
+            break;
+
+        case VEMU_OPCODE_ORC_B:
+            vemu_aot_emit_alu(file, dec, "vemu_orc_b(%s)%s", "");
+            break;
+
+        case VEMU_OPCODE_REV8:
+            vemu_aot_emit_alu(file, dec, "vemu_rev8(%s)%s", "");
+            break;
+
+        case VEMU_OPCODE_BCLR:
+            vemu_aot_emit_alu(file, dec, "%s & ~(1u << (%s & 0x1F))",
+                              R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_BCLRI:
+            vemu_aot_emit_alu(file, dec, "%s & ~(1u << %s)", imm);
+            break;
+
+        case VEMU_OPCODE_BEXT:
+            vemu_aot_emit_alu(file, dec, "(%s >> (%s & 0x1F)) & 1",
+                              R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_BEXTI:
+            vemu_aot_emit_alu(file, dec, "(%s >> %s) & 1", imm);
+            break;
+
+        case VEMU_OPCODE_BINV:
+            vemu_aot_emit_alu(file, dec, "%s ^ (1u << (%s & 0x1F))",
+                              R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_BINVI:
+            vemu_aot_emit_alu(file, dec, "%s ^ (1u << %s)", imm);
+            break;
+
+        case VEMU_OPCODE_BSET:
+            vemu_aot_emit_alu(file, dec, "%s | (1u << (%s & 0x1F))",
+                              R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_BSETI:
+            vemu_aot_emit_alu(file, dec, "%s | (1u << %s)", imm);
+            break;
+
+        case VEMU_OPCODE_FENCE:
+            fprintf(file, "    __atomic_thread_fence(__ATOMIC_SEQ_CST);\n");
+            break;
+
+        case VEMU_OPCODE_CSRR:
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "    %s = vemu_cpu_read_csr(cpu, %s);\n", 
+                        R(dec->rd), imm);
+            }
+            break;
+
+        case VEMU_OPCODE_LR_W:
+        case VEMU_OPCODE_SC_W:
+        case VEMU_OPCODE_AMOSWAP_W:
+        case VEMU_OPCODE_AMOADD_W:
+        case VEMU_OPCODE_AMOXOR_W:
+        case VEMU_OPCODE_AMOAND_W:
+        case VEMU_OPCODE_AMOOR_W:
+        case VEMU_OPCODE_AMOMIN_W:
+        case VEMU_OPCODE_AMOMAX_W:
+        case VEMU_OPCODE_AMOMINU_W:
+        case VEMU_OPCODE_AMOMAXU_W:
+            fprintf(file, "    ");
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "%s = ", R(dec->rd));
+            }
+            fprintf(file, "vemu_cpu_amo(cpu, %d, %s, %s);\n", dec->opcode,
+                    R(dec->rs1), R(dec->rs2));
+            break;
+
+        case VEMU_OPCODE_CSRRW:
+            fprintf(file, "    ");
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "%s = ", R(dec->rd));
+            }
+            fprintf(file, "vemu_cpu_write_csr(cpu, %s, %s | 0x%" PRIx32
+                    "u);\n", imm, R(dec->rs1), dec->imm2);
+            break;
+
+        case VEMU_OPCODE_FP:
+            fprintf(file, "    ");
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "%s = ", R(dec->rd));
+            }
+            fprintf(file, "vemu_fp_exec(cpu, 0x%" PRIx32 "u, %s + %s);\n",
+                    dec->imm2, R(dec->rs1), imm);
+            break;
+
+        case VEMU_OPCODE_VEC:
+            fprintf(file, "    ");
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "%s = ", R(dec->rd));
+            }
+            fprintf(file, "vemu_vec_exec(cpu, 0x%" PRIx32 "u, %s + %s, %s);\n",
+                    dec->imm2, R(dec->rs1), imm, R(dec->rs2));
+            break;
+
+        default:
+            break;
+    }
+}
+
+static char const *vemu_aot_condition(vemu_decoded_t *dec, char *buf,
+                                      size_t size) {
+    char const *fmt;
+    switch (dec->opcode) {
+        case VEMU_OPCODE_BEQ:  fmt = "%s == %s"; break;
+        case VEMU_OPCODE_BNE:  fmt = "%s != %s"; break;
+        case VEMU_OPCODE_BLT:  fmt = "(int32_t)%s < (int32_t)%s"; break;
+        case VEMU_OPCODE_BGE:  fmt = "(int32_t)%s >= (int32_t)%s"; break;
+        case VEMU_OPCODE_BLTU: fmt = "%s < %s"; break;
+        case VEMU_OPCODE_BGEU: fmt = "%s >= %s"; break;
+        case VEMU_OPCODE_SLT_BNEZ:
+        case VEMU_OPCODE_SLT_BEQZ:
+            fmt = "(int32_t)%s < (int32_t)%s";
+            break;
+        default:
+            fmt = "%s < %s";
+            break;
+    }
+
+    snprintf(buf, size, fmt, R(dec->rs1), R(dec->rs2));
+    return buf;
+}
+
+/* The op that ends a block. n_instrs counts the instructions retired
+   before it. */
+static void vemu_aot_emit_terminator(vemu_aot_t *aot, FILE *file,
+                                     vemu_decoded_t *dec, uint32_t ip,
+                                     uint32_t next, uint32_t n_instrs) {
+    char cond[64];
+    uint32_t total = n_instrs + dec->n_instrs;
+
+    switch (dec->opcode) {
+        case VEMU_OPCODE_JAL:
+            fprintf(file, "    instret += %" PRIu32 ";\n", total);
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "    %s = 0x%" PRIx32 "u;\n", R(dec->rd), next);
+            }
+            vemu_aot_emit_goto(aot, file, ip + dec->imm);
+            break;
+
+        case VEMU_OPCODE_JALR:
+            aot->n_indirect++;
+            fprintf(file, "    instret += %" PRIu32 ";\n", total);
+            fprintf(file, "    ip = (%s + 0x%" PRIx32 "u) & 0xFFFFFFFEu;\n",
+                    R(dec->rs1), dec->imm);
+            if (dec->rd != VEMU_ZERO) {
+                fprintf(file, "    %s = 0x%" PRIx32 "u;\n", R(dec->rd), next);
+            }
+            fprintf(file, "    goto dispatch;\n");
+            break;
+
+        case VEMU_OPCODE_AUIPC_JALR:
+            fprintf(file, "    instret += %" PRIu32 ";\n", total);
+            fprintf(file, "    %s = 0x%" PRIx32 "u;\n", R(dec->rd), dec->imm);
+            if (dec->rd2 != VEMU_ZERO) {
+                fprintf(file, "    %s = 0x%" PRIx32 "u;\n", R(dec->rd2),
+                        next);
+            }
+            vemu_aot_emit_goto(aot, file, dec->imm2);
+            break;
+
+        case VEMU_OPCODE_FENCE_I:
+            fprintf(file, "    instret += %" PRIu32 ";\n", total);
+            vemu_aot_emit_goto(aot, file, next);
+            break;
+
+        case VEMU_OPCODE_BEQ:
+        case VEMU_OPCODE_BNE:
+        case VEMU_OPCODE_BLT:
+        case VEMU_OPCODE_BGE:
+        case VEMU_OPCODE_BLTU:
+        case VEMU_OPCODE_BGEU:
+            fprintf(file, "    instret += %" PRIu32 ";\n", total);
+            fprintf(file, "    if (%s) {\n",
+                    vemu_aot_condition(dec, cond, sizeof(cond)));
+            vemu_aot_emit_goto(aot, file, ip + dec->imm);
+            fprintf(file, "    }\n");
+            vemu_aot_emit_goto(aot, file, next);
+            break;
+
+        case VEMU_OPCODE_SLT_BNEZ:
+        case VEMU_OPCODE_SLT_BEQZ:
+        case VEMU_OPCODE_SLTU_BNEZ:
+        case VEMU_OPCODE_SLTU_BEQZ: {
+            bool eqz = dec->opcode == VEMU_OPCODE_SLT_BEQZ
+                    || dec->opcode == VEMU_OPCODE_SLTU_BEQZ;
+            fprintf(file, "    instret += %" PRIu32 ";\n", total);
+            fprintf(file, "    %s = %s;\n", R(dec->rd),
+                    vemu_aot_condition(dec, cond, sizeof(cond)));
+            fprintf(file, "    if (%s%s) {\n", eqz ? "!" : "", R(dec->rd));
+            vemu_aot_emit_goto(aot, file, ip + dec->imm);
+            fprintf(file, "    }\n");
+            vemu_aot_emit_goto(aot, file, next);
+            break;
+        }
+
+        case VEMU_OPCODE_ECALL:
+            fprintf(file, "    instret += %" PRIu32 ";\n", n_instrs);
+            fprintf(file, "    VEMU_AOT_SAVE();\n");
+            fprintf(file, "    cpu->instret = instret;\n");
+            fprintf(file, "    cpu->ip = 0x%" PRIx32 "u;\n", ip);
+            fprintf(file, "    cpu->next_ip = 0x%" PRIx32 "u;\n", next);
+            fprintf(file, "    vemu_cpu_ecall(cpu);\n");
+            fprintf(file, "    instret = cpu->instret + 1;\n");
+            fprintf(file, "    if (cpu->terminated) {\n");
+            fprintf(file, "        cpu->ip = cpu->next_ip;\n");
+            fprintf(file, "        goto out;\n");
+            fprintf(file, "    }\n");
+            fprintf(file, "    VEMU_AOT_LOAD();\n");
+            vemu_aot_emit_goto(aot, file, next);
+            break;
+
+        default:
+            /* Illegal instructions terminate in the interpreter */
+            fprintf(file, "    instret += %" PRIu32 ";\n", n_instrs);
+            fprintf(file, "    ip = 0x%" PRIx32 "u;\n", ip);
+            fprintf(file, "    goto fallback;\n");
+            break;
+    }
+}
+
+/* A block runs up to its terminator or into the next block */
+static void vemu_aot_emit_block(vemu_aot_t *aot, FILE *file, uint32_t ip) {
+    uint32_t n_instrs = 0;
+
+    aot->n_blocks++;
+    fprintf(file, "L_%08" PRIx32 ":\n", ip);
+
+    for (;;) {
+        if (n_instrs > 0 && vemu_aot_is_leader(aot, ip)) {
+            fprintf(file, "    instret += %" PRIu32 ";\n", n_instrs);
+            vemu_aot_emit_goto(aot, file, ip);
+            return;
+        }
+
+        if (vemu_aot_find_segment(aot, ip) < 0) {
+            fprintf(file, "    instret += %" PRIu32 ";\n", n_instrs);
+            fprintf(file, "    ip = 0x%" PRIx32 "u;\n", ip);
+            fprintf(file, "    goto fallback;\n");
+            return;
+        }
+
+        vemu_decoded_t dec;
+        uint32_t instr_ip = ip;
+        ip += vemu_cpu_decode(aot->cpu, instr_ip, &dec);
+        aot->n_instrs += dec.n_instrs;
+
+        if (vemu_cpu_is_terminator(dec.opcode)) {
+            vemu_aot_emit_terminator(aot, file, &dec, instr_ip, ip, n_instrs);
+            return;
+        }
+
+        vemu_aot_emit_op(file, &dec, instr_ip);
+        n_instrs += dec.n_instrs;
+    }
+}
+
+/* Calls fn for every block start in address order */
+static void vemu_aot_for_each_leader(vemu_aot_t *aot, FILE *file,
+                                     void (*fn)(vemu_aot_t *, FILE *,
+                                                uint32_t)) {
+    for (size_t i = 0; i < aot->n_segments; i++) {
+        vemu_aot_segment_t *seg = &aot->segments[i];
+        if (!seg->exec) {
+            continue;
+        }
+
+        for (uint32_t off = 0; off < seg->filesz; off += 2) {
+            uint32_t bit = off >> 1;
+            if (aot->leaders[i][bit / 8] & (1 << (bit % 8))) {
+                fn(aot, file, seg->vaddr + off);
+            }
+        }
+    }
+}
+
+static void vemu_aot_emit_case(vemu_aot_t *aot, FILE *file, uint32_t ip) {
+    (void)aot;
+    fprintf(file, "    case 0x%" PRIx32 "u: goto L_%08" PRIx32 ";\n", ip, ip);
+}
+
+static void vemu_aot_emit_sync(FILE *file, char const *name, bool save) {
+    fprintf(file, "#define %s() do { \\\n", name);
+    for (size_t i = 1; i < VEMU_N_REGS; i++) {
+        if (save) {
+            fprintf(file, "    cpu->regs[%zu] = x%zu; \\\n", i, i);
+        } else {
+            fprintf(file, "    x%zu = cpu->regs[%zu]; \\\n", i, i);
+        }
+    }
+    fprintf(file, "} while (0)\n\n");
+}
+
+static void vemu_aot_emit_data(vemu_aot_t *aot, FILE *file) {
+    for (size_t i = 0; i < aot->n_segments; i++) {
+        vemu_aot_segment_t *seg = &aot->segments[i];
+        if (seg->filesz == 0) {
+            continue;
+        }
+
+        fprintf(file, "static uint8_t const segment_%zu[] = {", i);
+        for (uint32_t j = 0; j < seg->filesz; j++) {
+            fprintf(file, "%s0x%02x,", j % 16 ? " " : "\n    ",
+                    seg->data[j]);
+        }
+        fprintf(file, "\n};\n\n");
+    }
+
+    fprintf(file, "static vemu_aot_segment_t const segments[] = {\n");
+    for (size_t i = 0; i < aot->n_segments; i++) {
+        vemu_aot_segment_t *seg = &aot->segments[i];
+        char data[32] = "NULL";
+        if (seg->filesz > 0) {
+            snprintf(data, sizeof(data), "segment_%zu", i);
+        }
+
+        fprintf(file, "    { 0x%" PRIx32 "u, %" PRIu32 ", %" PRIu32
+                ", %s, %s },\n", seg->vaddr, seg->filesz, seg->memsz,
+                seg->exec ? "true" : "false", data);
+    }
+    fprintf(file, "};\n\n");
+}
+
+/* Writes the whole program as a single C function. Registers live in
+   locals so the host compiler can allocate them; they are written back
+   to the cpu around ecalls and interpreter fallbacks. Compiled code does
+   not translate addresses, so a fallback that turns translation on keeps
+   interpreting until it is off again. Jumps with a static target become
+   gotos, everything else goes through the dispatch switch over all known
+   block starts. */
+bool vemu_aot_emit(vemu_aot_t *aot, FILE *file, char const *name,
+                   uint32_t entry) {
+    fprintf(file, "/* Generated by vemu-aot from %s */\n\n", name);
+    fprintf(file, "#include \"aot.h\"\n\n");
+
+    vemu_aot_emit_sync(file, "VEMU_AOT_SAVE", true);
+    vemu_aot_emit_sync(file, "VEMU_AOT_LOAD", false);
+    vemu_aot_emit_data(aot, file);
+
+    fprintf(file, "static void run(vemu_cpu_t *cpu, uint64_t *fallbacks) "
+            "{\n");
+    fprintf(file, "    uint8_t *ram = *cpu->ram;\n");
+    fprintf(file, "    uint64_t instret = cpu->instret;\n");
+    fprintf(file, "    uint32_t ip = cpu->ip;\n");
+    for (size_t i = 1; i < VEMU_N_REGS; i++) {
+        fprintf(file, "    uint32_t x%zu;\n", i);
+    }
+    fprintf(file, "    VEMU_AOT_LOAD();\n\n");
+
+    fprintf(file, "dispatch:\n");
+    fprintf(file, "    switch (ip) {\n");
+    vemu_aot_for_each_leader(aot, file, vemu_aot_emit_case);
+    fprintf(file, "    default: goto fallback;\n");
+    fprintf(file, "    }\n\n");
+
+    fprintf(file, "fallback:\n");
+    fprintf(file, "    VEMU_AOT_SAVE();\n");
+    fprintf(file, "    cpu->instret = instret;\n");
+    fprintf(file, "    cpu->ip = ip;\n");
+    fprintf(file, "    ip = vemu_cpu_interp_block(cpu);\n");
+    fprintf(file, "    while (vemu_mmu_on(&cpu->mmu) && !cpu->terminated) {\n");
+    fprintf(file, "        cpu->ip = ip;\n");
+    fprintf(file, "        ip = vemu_cpu_interp_block(cpu);\n");
+    fprintf(file, "    }\n");
+    fprintf(file, "    instret = cpu->instret;\n");
+    fprintf(file, "    (*fallbacks)++;\n");
+    fprintf(file, "    if (cpu->terminated) {\n");
+    fprintf(file, "        return;\n");
+    fprintf(file, "    }\n");
+    fprintf(file, "    VEMU_AOT_LOAD();\n");
+    fprintf(file, "    goto dispatch;\n\n");
+
+    vemu_aot_for_each_leader(aot, file, vemu_aot_emit_block);
+
+    fprintf(file, "\nout:\n");
+    fprintf(file, "    VEMU_AOT_SAVE();\n");
+    fprintf(file, "    cpu->instret = instret;\n");
+    fprintf(file, "}\n\n");
+
+    fprintf(file, "static vemu_aot_image_t const image = {\n");
+    fprintf(file, "    \"");
+    for (char const *c = name; *c != '\0'; c++) {
+        fprintf(file, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    }
+    fprintf(file, "\", 0x%" PRIx32 "u, %" PRIu32 ",\n", entry, aot->n_blocks);
+    fprintf(file, "    %zu, segments, run\n", aot->n_segments);
+    fprintf(file, "};\n\n");
+
+    fprintf(file, "int main(int argc, char **argv) {\n");
+    fprintf(file, "    return vemu_aot_main(argc, argv, &image);\n");
+    fprintf(file, "}\n");
+
+    return !ferror(file);
+}
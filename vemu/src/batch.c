@@ -0,0 +1,377 @@
+#include "batch.h"
+#include "system.h"
+#include "elf-file.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+    vemu_batch_t *batch;
+    uint32_t id;
+    uint64_t steals;
+} vemu_batch_worker_t;
+
+void vemu_batch_init(vemu_batch_t *batch) {
+    batch->jobs = NULL;
+    batch->n_jobs = 0;
+    batch->jobs_size = 0;
+
+    batch->deques = NULL;
+    batch->n_workers = 0;
+
+    batch->setup = NULL;
+    batch->setup_arg = NULL;
+    batch->ram_size = VEMU_SYSTEM_RAM_SIZE;
+
+    batch->steals = 0;
+    batch->seconds = 0;
+}
+
+void vemu_batch_destruct(vemu_batch_t *batch) {
+    for (size_t i = 0; i < batch->n_jobs; i++) {
+        free(batch->jobs[i].elf);
+        free(batch->jobs[i].input);
+        free(batch->jobs[i].output);
+    }
+    free(batch->jobs);
+
+    if (batch->deques != NULL) {
+        free(batch->deques[0].jobs);
+        free(batch->deques);
+    }
+
+    vemu_batch_init(batch);
+}
+
+static char *vemu_batch_strdup(char const *s) {
+    char *copy = malloc(strlen(s) + 1);
+    if (copy != NULL) {
+        strcpy(copy, s);
+    }
+    return copy;
+}
+
+static bool vemu_batch_add(vemu_batch_t *batch, char const *elf,
+                           char const *input) {
+    if (batch->n_jobs == batch->jobs_size) {
+        size_t size = batch->jobs_size ? 2 * batch->jobs_size : 64;
+        vemu_batch_job_t *jobs = realloc(batch->jobs, size * sizeof(*jobs));
+        if (jobs == NULL) {
+            return false;
+        }
+        batch->jobs = jobs;
+        batch->jobs_size = size;
+    }
+
+    vemu_batch_job_t *job = &batch->jobs[batch->n_jobs];
+    *job = (vemu_batch_job_t){
+        .elf = vemu_batch_strdup(elf),
+        .input = input != NULL ? vemu_batch_strdup(input) : NULL,
+        .stop_ip = VEMU_CPU_NO_STOP,
+    };
+    batch->n_jobs++;
+
+    return job->elf != NULL && (input == NULL || job->input != NULL);
+}
+
+bool vemu_batch_load(vemu_batch_t *batch, char const *manifest) {
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not open manifest: '%s'\n", manifest);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    bool ok = true;
+
+    for (size_t n = 1; getline(&line, &line_size, file) != -1; n++) {
+        char *save;
+        char *elf = strtok_r(line, " \t\r\n", &save);
+        if (elf == NULL || elf[0] == '#') {
+            continue;
+        }
+
+        char *input = strtok_r(NULL, " \t\r\n", &save);
+        if (strtok_r(NULL, " \t\r\n", &save) != NULL) {
+            fprintf(stderr, "%s:%zu: expected ELF [INPUT]\n", manifest, n);
+            ok = false;
+            break;
+        }
+
+        if (!vemu_batch_add(batch, elf, input)) {
+            fprintf(stderr, "could not allocate job\n");
+            ok = false;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    return ok;
+}
+
+static bool vemu_batch_load_input(vemu_batch_job_t *job, vemu_system_t *sys) {
+    if (job->input == NULL) {
+        return true;
+    }
+
+    FILE *file = fopen(job->input, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "could not open input: '%s'\n", job->input);
+        return false;
+    }
+
+    bool ok = false;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+    }
+
+    if (size < 0 || size > VEMU_BATCH_INPUT_MAX
+            || VEMU_BATCH_INPUT_ADDR + (size_t)size > sys->ram_size) {
+        fprintf(stderr, "input too large: '%s'\n", job->input);
+    } else if (fseek(file, 0, SEEK_SET) == 0
+               && fread(sys->ram + VEMU_BATCH_INPUT_ADDR, 1, size, file)
+                  == (size_t)size) {
+        sys->harts[0].regs[VEMU_A2] = VEMU_BATCH_INPUT_ADDR;
+        sys->harts[0].regs[VEMU_A3] = size;
+        ok = true;
+    }
+
+    fclose(file);
+
+    return ok;
+}
+
+/* Each job gets a VM of its own that only lives while it runs. Only the
+   pages of guest memory that the guest touches cost anything. */
+static void vemu_batch_run_job(vemu_batch_t *batch, vemu_batch_job_t *job) {
+    FILE *out = open_memstream(&job->output, &job->output_size);
+    if (out == NULL) {
+        return;
+    }
+
+    vemu_system_t sys;
+    vemu_system_init(&sys);
+
+    vemu_elf_t elf;
+    vemu_elf_init(&elf);
+
+    if (!vemu_system_alloc_ram(&sys, batch->ram_size)) {
+        fprintf(out, "could not allocate guest memory\n");
+        goto end;
+    }
+
+    if (!vemu_system_alloc(&sys, 1)
+            || !batch->setup(&sys.harts[0], batch->setup_arg)) {
+        fprintf(out, "could not set up hart\n");
+        goto end;
+    }
+
+    vemu_cpu_t *cpu = &sys.harts[0];
+    if (!vemu_elf_open(&elf, job->elf)
+            || !vemu_system_load_elf(&sys, &elf)
+            || !vemu_batch_load_input(job, &sys)) {
+        fprintf(out, "could not load program\n");
+        goto end;
+    }
+
+    job->loaded = true;
+    cpu->out = out;
+    cpu->err = out;
+    vemu_cpu_run(cpu, elf.h.e_entry);
+
+    job->stop_ip = cpu->stop_ip;
+    job->exit_code = cpu->exit_code;
+    job->instret = cpu->instret;
+
+end:
+    fclose(out);
+    vemu_elf_destruct(&elf);
+    vemu_system_destruct(&sys);
+}
+
+/* Takes a job from the bottom of the deque, or from the top when
+   stealing */
+static bool vemu_batch_take(vemu_batch_deque_t *deque, bool steal,
+                            uint32_t *job) {
+    uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t top = range >> 32;
+        uint32_t bottom = (uint32_t)range;
+        if (top == bottom) {
+            return false;
+        }
+
+        uint64_t next = steal ? ((uint64_t)(top + 1) << 32) | bottom
+                              : ((uint64_t)top << 32) | (bottom - 1);
+        if (__atomic_compare_exchange_n(&deque->range, &range, next, false,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            *job = deque->jobs[steal ? top : bottom - 1];
+            return true;
+        }
+    }
+}
+
+/* No jobs are added once the workers start, so a worker that finds
+   every deque empty is done */
+static bool vemu_batch_next(vemu_batch_worker_t *worker, uint32_t *job) {
+    vemu_batch_t *batch = worker->batch;
+
+    if (vemu_batch_take(&batch->deques[worker->id], false, job)) {
+        return true;
+    }
+
+    for (uint32_t i = 1; i < batch->n_workers; i++) {
+        uint32_t victim = (worker->id + i) % batch->n_workers;
+        if (vemu_batch_take(&batch->deques[victim], true, job)) {
+            worker->steals++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void *vemu_batch_worker_main(void *arg) {
+    vemu_batch_worker_t *worker = arg;
+    uint32_t job;
+
+    while (vemu_batch_next(worker, &job)) {
+        vemu_batch_run_job(worker->batch, &worker->batch->jobs[job]);
+    }
+
+    return NULL;
+}
+
+/* Worker 0 runs on the calling thread. A worker that cannot be started
+   just leaves its share of the jobs to be stolen by the others. */
+bool vemu_batch_run(vemu_batch_t *batch, uint32_t n_workers,
+                    vemu_batch_setup_t setup, void *setup_arg) {
+    if (batch->n_jobs == 0) {
+        return true;
+    }
+    if (n_workers > batch->n_jobs) {
+        n_workers = batch->n_jobs;
+    }
+
+    uint32_t *order = malloc(batch->n_jobs * sizeof(*order));
+    batch->deques = calloc(n_workers, sizeof(*batch->deques));
+    vemu_batch_worker_t *workers = calloc(n_workers, sizeof(*workers));
+    pthread_t *threads = calloc(n_workers, sizeof(*threads));
+    bool *started = calloc(n_workers, sizeof(*started));
+
+    if (order == NULL || batch->deques == NULL || workers == NULL
+            || threads == NULL || started == NULL) {
+        fprintf(stderr, "could not allocate workers\n");
+        free(order);
+        free(batch->deques);
+        batch->deques = NULL;
+        free(workers);
+        free(threads);
+        free(started);
+        return false;
+    }
+
+    batch->n_workers = n_workers;
+    batch->setup = setup;
+    batch->setup_arg = setup_arg;
+
+    /* Each worker starts with a contiguous share of the manifest */
+    for (size_t i = 0; i < batch->n_jobs; i++) {
+        order[i] = i;
+    }
+    for (uint32_t i = 0; i < n_workers; i++) {
+        uint32_t top = batch->n_jobs * i / n_workers;
+        uint32_t bottom = batch->n_jobs * (i + 1) / n_workers;
+
+        batch->deques[i].jobs = order;
+        batch->deques[i].range = ((uint64_t)top << 32) | bottom;
+        workers[i] = (vemu_batch_worker_t){ batch, i, 0 };
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t i = 1; i < n_workers; i++) {
+        started[i] = pthread_create(&threads[i], NULL, vemu_batch_worker_main,
+                                    &workers[i]) == 0;
+    }
+
+    vemu_batch_worker_main(&workers[0]);
+
+    for (uint32_t i = 0; i < n_workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        batch->steals += workers[i].steals;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    batch->seconds = (now.tv_sec - start.tv_sec)
+                   + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+    free(workers);
+    free(threads);
+    free(started);
+
+    return true;
+}
+
+bool vemu_batch_job_ok(vemu_batch_job_t *job) {
+    return job->loaded && job->stop_ip == 0 && job->exit_code == 0;
+}
+
+void vemu_batch_print(vemu_batch_t *batch, FILE *file) {
+    for (size_t i = 0; i < batch->n_jobs; i++) {
+        vemu_batch_job_t *job = &batch->jobs[i];
+
+        fprintf(file, "== %s", job->elf);
+        if (job->input != NULL) {
+            fprintf(file, " < %s", job->input);
+        }
+
+        if (!job->loaded) {
+            fprintf(file, ": not run\n");
+        } else if (job->stop_ip == 0) {
+            fprintf(file, ": exit %" PRId32 ", %" PRIu64 " instructions\n",
+                    (int32_t)job->exit_code, job->instret);
+        } else if (job->stop_ip == VEMU_CPU_NO_STOP) {
+            fprintf(file, ": emulator error after %" PRIu64
+                    " instructions\n", job->instret);
+        } else {
+            fprintf(file, ": stopped at %" PRIx32 " after %" PRIu64
+                    " instructions\n", job->stop_ip, job->instret);
+        }
+
+        if (job->output != NULL) {
+            fwrite(job->output, 1, job->output_size, file);
+        }
+    }
+}
+
+void vemu_batch_print_stats(vemu_batch_t *batch, FILE *file) {
+    size_t failed = 0;
+    uint64_t instret = 0;
+
+    for (size_t i = 0; i < batch->n_jobs; i++) {
+        failed += !vemu_batch_job_ok(&batch->jobs[i]);
+        instret += batch->jobs[i].instret;
+    }
+
+    fprintf(file, "batch:         %zu jobs, %zu failed, %" PRIu32
+            " workers, %" PRIu64 " steals\n", batch->n_jobs, failed,
+            batch->n_workers, batch->steals);
+    fprintf(file, "time:          %.3f s\n", batch->seconds);
+    if (batch->seconds > 0) {
+        fprintf(file, "throughput:    %.1f jobs/s, %.1f MIPS\n",
+                batch->n_jobs / batch->seconds,
+                instret / batch->seconds / 1e6);
+    }
+}
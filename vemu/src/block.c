@@ -0,0 +1,225 @@
+#include "block.h"
+#include "trace.h"
+#include <stdlib.h>
+
+static inline uint32_t vemu_block_hash(vemu_block_cache_t *cache, 
+                                       uint32_t ip) {
+    return ((ip >> 1) * 0x9E3779B1) & cache->mask;
+}
+
+void vemu_block_cache_init(vemu_block_cache_t *cache) {
+    cache->slots = NULL;
+    cache->mask = 0;
+    cache->count = 0;
+
+    cache->retired = NULL;
+    cache->n_retired = 0;
+    cache->retired_size = 0;
+
+    cache->translated = 0;
+    cache->executed = 0;
+    cache->lookups = 0;
+    cache->flushes = 0;
+
+    cache->traces = 0;
+    cache->trace_entries = 0;
+    cache->trace_side_exits = 0;
+    cache->trace_instrs = 0;
+}
+
+bool vemu_block_cache_alloc(vemu_block_cache_t *cache, size_t bits) {
+    size_t n = (size_t)1 << bits;
+
+    cache->slots = calloc(n, sizeof(vemu_block_t *));
+    if (cache->slots == NULL) {
+        return false;
+    }
+    cache->mask = n - 1;
+
+    return true;
+}
+
+static void vemu_block_cache_count_trace(vemu_block_cache_t *cache,
+                                         vemu_block_t *trace) {
+    cache->trace_entries += trace->entries;
+    cache->trace_side_exits += vemu_trace_side_exits(trace);
+    cache->trace_instrs += vemu_trace_retired(trace);
+}
+
+void vemu_block_cache_flush(vemu_block_cache_t *cache) {
+    if (cache->slots == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i <= cache->mask; i++) {
+        vemu_block_t *block = cache->slots[i];
+        if (block == NULL) {
+            continue;
+        }
+
+        if (block->trace != NULL) {
+            vemu_block_cache_count_trace(cache, block->trace);
+        }
+
+        vemu_block_free(block);
+        cache->slots[i] = NULL;
+    }
+
+    for (uint32_t i = 0; i < cache->n_retired; i++) {
+        vemu_block_free(cache->retired[i]);
+    }
+
+    cache->count = 0;
+    cache->n_retired = 0;
+    cache->flushes++;
+}
+
+void vemu_block_cache_destruct(vemu_block_cache_t *cache) {
+    vemu_block_cache_flush(cache);
+
+    if (cache->slots != NULL) {
+        free(cache->slots);
+    }
+    free(cache->retired);
+    vemu_block_cache_init(cache);
+}
+
+vemu_block_t *vemu_block_cache_find(vemu_block_cache_t *cache, uint32_t ip) {
+    cache->lookups++;
+
+    for (uint32_t i = vemu_block_hash(cache, ip); ; i = (i + 1) & cache->mask) {
+        vemu_block_t *block = cache->slots[i];
+        if (block == NULL || block->ip == ip) {
+            return block;
+        }
+    }
+}
+
+void vemu_block_cache_insert(vemu_block_cache_t *cache, vemu_block_t *block) {
+    /* Keep the table at most half full so probe sequences stay short;
+       dropping everything is cheaper than tracking links for eviction.
+       Retired blocks count too, so they cannot pile up. */
+    if (cache->count + cache->n_retired >= (cache->mask + 1) / 2) {
+        vemu_block_cache_flush(cache);
+    }
+
+    uint32_t i = vemu_block_hash(cache, block->ip);
+    while (cache->slots[i] != NULL) {
+        i = (i + 1) & cache->mask;
+    }
+
+    cache->slots[i] = block;
+    cache->count++;
+}
+
+static bool vemu_block_cache_keep(vemu_block_cache_t *cache, 
+                                  vemu_block_t *block) {
+    if (cache->n_retired == cache->retired_size) {
+        uint32_t size = cache->retired_size ? 2 * cache->retired_size : 64;
+        vemu_block_t **retired = realloc(cache->retired, 
+                                         size * sizeof(*retired));
+        if (retired == NULL) {
+            return false;
+        }
+
+        cache->retired = retired;
+        cache->retired_size = size;
+    }
+
+    block->invalid = true;
+    cache->retired[cache->n_retired++] = block;
+
+    return true;
+}
+
+/* Takes block out of the table, shifting later entries of its probe 
+   sequence back so lookups never stop at the hole. */
+static void vemu_block_cache_remove(vemu_block_cache_t *cache, 
+                                    vemu_block_t *block) {
+    uint32_t hole = vemu_block_hash(cache, block->ip);
+    while (cache->slots[hole] != block) {
+        hole = (hole + 1) & cache->mask;
+    }
+
+    for (uint32_t i = (hole + 1) & cache->mask; cache->slots[i] != NULL;
+         i = (i + 1) & cache->mask) {
+        uint32_t home = vemu_block_hash(cache, cache->slots[i]->ip);
+
+        /* Entries whose home lies cyclically in (hole, i] stay put */
+        if (((i - home) & cache->mask) >= ((i - hole) & cache->mask)) {
+            cache->slots[hole] = cache->slots[i];
+            hole = i;
+        }
+    }
+
+    cache->slots[hole] = NULL;
+    cache->count--;
+}
+
+bool vemu_block_cache_retire_trace(vemu_block_cache_t *cache, 
+                                   vemu_block_t *head) {
+    vemu_block_t *trace = head->trace;
+    if (!vemu_block_cache_keep(cache, trace)) {
+        return false;
+    }
+
+    vemu_block_cache_count_trace(cache, trace);
+    head->trace = NULL;
+    head->trace_heat = 0;
+
+    return true;
+}
+
+/* Invalidates block, which must be in the table. Its trace goes with it. */
+bool vemu_block_cache_retire(vemu_block_cache_t *cache, vemu_block_t *block) {
+    if (block->trace != NULL 
+            && !vemu_block_cache_retire_trace(cache, block)) {
+        return false;
+    }
+
+    if (!vemu_block_cache_keep(cache, block)) {
+        return false;
+    }
+
+    vemu_block_cache_remove(cache, block);
+
+    return true;
+}
+
+vemu_block_t *vemu_block_alloc(uint32_t n_ops) {
+    vemu_block_t *block = malloc(sizeof(vemu_block_t) 
+                                 + n_ops * sizeof(vemu_decoded_t));
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->n_ops = n_ops;
+    block->indirect = false;
+    block->invalid = false;
+    block->heat = 0;
+    block->native = NULL;
+    for (size_t i = 0; i < 2; i++) {
+        block->succ_ip[i] = VEMU_BLOCK_NO_SUCC;
+        block->succ[i] = NULL;
+        block->succ_hits[i] = 0;
+    }
+
+    block->trace_heat = 0;
+    block->trace = NULL;
+    block->superblock = false;
+    block->n_exits = 0;
+    block->exits = NULL;
+    block->entries = 0;
+
+    return block;
+}
+
+void vemu_block_free(vemu_block_t *block) {
+    if (block->trace != NULL) {
+        vemu_block_free(block->trace);
+    }
+    if (block->exits != NULL) {
+        free(block->exits);
+    }
+    free(block);
+}
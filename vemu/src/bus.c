@@ -0,0 +1,80 @@
+#include "bus.h"
+#include <stdlib.h>
+#include <string.h>
+
+void vemu_bus_init(vemu_bus_t *bus) {
+    bus->pages = NULL;
+    bus->n_devices = 0;
+}
+
+bool vemu_bus_alloc(vemu_bus_t *bus, size_t ram_size) {
+    bus->pages = calloc(VEMU_BUS_N_PAGES, 1);
+    if (bus->pages == NULL) {
+        return false;
+    }
+
+    memset(bus->pages, VEMU_BUS_RWX, ram_size >> VEMU_BUS_PAGE_BITS);
+
+    return true;
+}
+
+void vemu_bus_destruct(vemu_bus_t *bus) {
+    free(bus->pages);
+    vemu_bus_init(bus);
+}
+
+void vemu_bus_protect(vemu_bus_t *bus, uint32_t first, uint32_t n,
+                      uint8_t perms) {
+    for (uint32_t i = first; i < first + n; i++) {
+        bus->pages[i] = (bus->pages[i] & VEMU_BUS_DEVICE_MASK) | perms;
+    }
+}
+
+bool vemu_bus_add_device(vemu_bus_t *bus, vemu_device_t const *device) {
+    uint32_t first = device->base >> VEMU_BUS_PAGE_BITS;
+    uint64_t end = (uint64_t)device->base + device->size;
+
+    if (bus->n_devices == VEMU_BUS_MAX_DEVICES || device->size == 0
+            || (device->base | device->size) & (VEMU_BUS_PAGE_SIZE - 1)
+            || end > (1ull << 32)) {
+        return false;
+    }
+
+    uint32_t n = device->size >> VEMU_BUS_PAGE_BITS;
+    for (uint32_t i = first; i < first + n; i++) {
+        if (bus->pages[i] & VEMU_BUS_DEVICE_MASK) {
+            return false;
+        }
+    }
+
+    bus->devices[bus->n_devices++] = *device;
+
+    uint8_t entry = (bus->n_devices << VEMU_BUS_DEVICE_SHIFT)
+                  | VEMU_BUS_R | VEMU_BUS_W;
+    memset(bus->pages + first, entry, n);
+
+    return true;
+}
+
+static vemu_device_t *vemu_bus_device(vemu_bus_t *bus, uint32_t addr) {
+    uint8_t entry = bus->pages[addr >> VEMU_BUS_PAGE_BITS];
+    return &bus->devices[(entry >> VEMU_BUS_DEVICE_SHIFT) - 1];
+}
+
+/* Devices without a handler read as zero and ignore writes */
+uint32_t vemu_bus_load(vemu_bus_t *bus, uint32_t addr, uint32_t len) {
+    vemu_device_t *device = vemu_bus_device(bus, addr);
+    if (device->load == NULL) {
+        return 0;
+    }
+
+    return device->load(device->arg, addr - device->base, len);
+}
+
+void vemu_bus_store(vemu_bus_t *bus, uint32_t addr, uint32_t len,
+                    uint32_t value) {
+    vemu_device_t *device = vemu_bus_device(bus, addr);
+    if (device->store != NULL) {
+        device->store(device->arg, addr - device->base, len, value);
+    }
+}
@@ -0,0 +1,273 @@
+#include "clone.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+void vemu_clone_init(vemu_clone_set_t *set) {
+    set->clones = NULL;
+    set->results = NULL;
+    set->n_clones = 0;
+    set->n_spawned = 0;
+    set->jobs = 0;
+    set->cpu = NULL;
+
+    set->index = -1;
+
+    set->warmup_instret = 0;
+    set->fork_seconds = 0;
+    set->seconds = 0;
+}
+
+void vemu_clone_destruct(vemu_clone_set_t *set) {
+    if (set->clones != NULL) {
+        for (uint32_t i = 0; i < set->n_clones; i++) {
+            if (set->clones[i].file != NULL) {
+                fclose(set->clones[i].file);
+            }
+            free(set->clones[i].output);
+        }
+        free(set->clones);
+    }
+
+    if (set->results != NULL) {
+        munmap(set->results, set->n_clones * sizeof(*set->results));
+    }
+
+    vemu_clone_init(set);
+}
+
+static double vemu_clone_seconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec)
+         + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Output goes through a temporary file, since a clone may print more
+   than a pipe holds before the parent gets around to reading it */
+static void vemu_clone_collect(vemu_clone_t *clone, int status) {
+    clone->pid = 0;
+    clone->done = true;
+    clone->status = status;
+
+    FILE *file = clone->file;
+    clone->file = NULL;
+
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+    }
+
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        clone->output = malloc(size);
+        if (clone->output != NULL) {
+            clone->output_size = fread(clone->output, 1, size, file);
+        }
+    }
+
+    fclose(file);
+}
+
+static bool vemu_clone_reap(vemu_clone_set_t *set) {
+    int status;
+    pid_t pid;
+    do {
+        pid = waitpid(-1, &status, 0);
+    } while (pid < 0 && errno == EINTR);
+
+    if (pid < 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < set->n_spawned; i++) {
+        if (set->clones[i].pid == pid) {
+            vemu_clone_collect(&set->clones[i], status);
+            break;
+        }
+    }
+
+    return true;
+}
+
+/* Returns true in a clone, with the clone's index in res, and false in
+   the parent once every clone is done */
+static bool vemu_clone_checkpoint(void *arg, uint32_t *res) {
+    vemu_clone_set_t *set = arg;
+    vemu_cpu_t *cpu = set->cpu;
+
+    /* A clone checkpointing again just carries on */
+    if (vemu_clone_is_child(set)) {
+        *res = set->index;
+        return true;
+    }
+
+    set->warmup_instret = cpu->instret;
+
+    /* Anything still buffered would be printed again by every clone */
+    fflush(NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t running = 0;
+    while (set->n_spawned < set->n_clones || running > 0) {
+        if (set->n_spawned == set->n_clones || running == set->jobs) {
+            if (!vemu_clone_reap(set)) {
+                fprintf(stderr, "could not wait for clones\n");
+                break;
+            }
+            running--;
+            continue;
+        }
+
+        uint32_t i = set->n_spawned++;
+        vemu_clone_t *clone = &set->clones[i];
+
+        clone->file = tmpfile();
+        if (clone->file == NULL) {
+            fprintf(stderr, "could not create output of clone %" PRIu32
+                    "\n", i);
+            continue;
+        }
+
+        struct timespec fork_start;
+        clock_gettime(CLOCK_MONOTONIC, &fork_start);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            set->index = i;
+            cpu->out = clone->file;
+            cpu->err = clone->file;
+            *res = i;
+            return true;
+        }
+
+        set->fork_seconds += vemu_clone_seconds(&fork_start);
+
+        if (pid < 0) {
+            fprintf(stderr, "could not fork clone %" PRIu32 "\n", i);
+            fclose(clone->file);
+            clone->file = NULL;
+            continue;
+        }
+
+        clone->pid = pid;
+        running++;
+    }
+
+    set->seconds = vemu_clone_seconds(&start);
+
+    return false;
+}
+
+bool vemu_clone_alloc(vemu_clone_set_t *set, uint32_t n_clones,
+                      uint32_t jobs, vemu_cpu_t *cpu) {
+    set->clones = calloc(n_clones, sizeof(*set->clones));
+    if (set->clones == NULL) {
+        return false;
+    }
+
+    set->results = mmap(NULL, n_clones * sizeof(*set->results),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (set->results == MAP_FAILED) {
+        set->results = NULL;
+        free(set->clones);
+        set->clones = NULL;
+        return false;
+    }
+
+    set->n_clones = n_clones;
+    set->jobs = jobs;
+    set->cpu = cpu;
+
+    cpu->checkpoint = vemu_clone_checkpoint;
+    cpu->checkpoint_arg = set;
+
+    return true;
+}
+
+bool vemu_clone_is_child(vemu_clone_set_t *set) {
+    return set->index >= 0;
+}
+
+void vemu_clone_exit(vemu_clone_set_t *set, vemu_cpu_t *cpu) {
+    set->results[set->index] = (vemu_clone_result_t){
+        .finished = true,
+        .stop_ip = cpu->stop_ip,
+        .exit_code = cpu->exit_code,
+        .instret = cpu->instret,
+    };
+
+    fflush(NULL);
+    _exit(0);
+}
+
+bool vemu_clone_ok(vemu_clone_set_t *set, uint32_t i) {
+    vemu_clone_result_t *result = &set->results[i];
+
+    return result->finished && result->stop_ip == 0
+        && result->exit_code == 0;
+}
+
+void vemu_clone_print(vemu_clone_set_t *set, FILE *file) {
+    for (uint32_t i = 0; i < set->n_clones; i++) {
+        vemu_clone_t *clone = &set->clones[i];
+        vemu_clone_result_t *result = &set->results[i];
+
+        fprintf(file, "== clone %" PRIu32, i);
+
+        if (!clone->done) {
+            fprintf(file, ": not run\n");
+        } else if (WIFSIGNALED(clone->status)) {
+            fprintf(file, ": killed by signal %d\n", WTERMSIG(clone->status));
+        } else if (!result->finished) {
+            fprintf(file, ": exited without a result\n");
+        } else if (result->stop_ip == 0) {
+            fprintf(file, ": exit %" PRId32 ", %" PRIu64 " instructions\n",
+                    (int32_t)result->exit_code, result->instret);
+        } else if (result->stop_ip == VEMU_CPU_NO_STOP) {
+            fprintf(file, ": emulator error after %" PRIu64
+                    " instructions\n", result->instret);
+        } else {
+            fprintf(file, ": stopped at %" PRIx32 " after %" PRIu64
+                    " instructions\n", result->stop_ip, result->instret);
+        }
+
+        if (clone->output != NULL) {
+            fwrite(clone->output, 1, clone->output_size, file);
+        }
+    }
+}
+
+void vemu_clone_print_stats(vemu_clone_set_t *set, FILE *file) {
+    uint32_t failed = 0;
+    uint64_t instret = 0;
+
+    for (uint32_t i = 0; i < set->n_clones; i++) {
+        failed += !vemu_clone_ok(set, i);
+        if (set->results[i].finished) {
+            instret += set->results[i].instret - set->warmup_instret;
+        }
+    }
+
+    fprintf(file, "clones:        %" PRIu32 " clones, %" PRIu32 " failed, %"
+            PRIu32 " at a time\n", set->n_clones, failed, set->jobs);
+    fprintf(file, "warmup:        %" PRIu64 " instructions\n",
+            set->warmup_instret);
+    if (set->n_spawned > 0) {
+        fprintf(file, "fork:          %.1f us per clone\n",
+                set->fork_seconds / set->n_spawned * 1e6);
+    }
+    fprintf(file, "time:          %.3f s\n", set->seconds);
+    if (set->seconds > 0) {
+        fprintf(file, "throughput:    %.1f clones/s, %.1f MIPS\n",
+                set->n_clones / set->seconds, instret / set->seconds / 1e6);
+    }
+}
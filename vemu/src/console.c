@@ -0,0 +1,41 @@
+#include "console.h"
+
+void vemu_console_init(vemu_console_t *console, FILE *out) {
+    console->out = out;
+    console->count = 0;
+}
+
+static uint32_t vemu_console_load(void *arg, uint32_t offset, uint32_t len) {
+    vemu_console_t *console = arg;
+    (void)len;
+
+    if (offset != VEMU_MMIO_CONSOLE_COUNT) {
+        return 0;
+    }
+
+    return __atomic_load_n(&console->count, __ATOMIC_RELAXED);
+}
+
+static void vemu_console_store(void *arg, uint32_t offset, uint32_t len,
+                               uint32_t value) {
+    vemu_console_t *console = arg;
+    (void)len;
+
+    if (offset == VEMU_MMIO_CONSOLE_DATA) {
+        fputc(value & 0xFF, console->out);
+        __atomic_add_fetch(&console->count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool vemu_console_add(vemu_console_t *console, vemu_system_t *sys) {
+    vemu_device_t device = {
+        .name = "console",
+        .base = VEMU_MMIO_CONSOLE_BASE,
+        .size = VEMU_MMIO_CONSOLE_SIZE,
+        .load = vemu_console_load,
+        .store = vemu_console_store,
+        .arg = console,
+    };
+
+    return vemu_system_add_device(sys, &device);
+}
@@ -1,10 +1,21 @@
 #include "cpu.h"
+#include "trace.h"
 #include "ram.h"
 #include "ecall-codes.h"
 #include "util.h"
+#include "muldiv.h"
+#include "bitmanip.h"
+#include "fp.h"
+#include "vec.h"
 #include <stdio.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 
 static vemu_opcode_t const vemu_bfunct_to_flat[VEMU_MAX_FUNCT3] = {
     [VEMU_FUNCT_BEQ]            = VEMU_OPCODE_BEQ,
@@ -51,6 +62,31 @@ static vemu_opcode_t const vemu_rfunct_to_flat[VEMU_MAX_FUNCT3] = {
     [VEMU_FUNCT_AND]            = VEMU_OPCODE_AND,
 };
 
+static vemu_opcode_t const vemu_mfunct_to_flat[VEMU_MAX_FUNCT3] = {
+    [VEMU_FUNCT_MUL]            = VEMU_OPCODE_MUL,
+    [VEMU_FUNCT_MULH]           = VEMU_OPCODE_MULH,
+    [VEMU_FUNCT_MULHSU]         = VEMU_OPCODE_MULHSU,
+    [VEMU_FUNCT_MULHU]          = VEMU_OPCODE_MULHU,
+    [VEMU_FUNCT_DIV]            = VEMU_OPCODE_DIV,
+    [VEMU_FUNCT_DIVU]           = VEMU_OPCODE_DIVU,
+    [VEMU_FUNCT_REM]            = VEMU_OPCODE_REM,
+    [VEMU_FUNCT_REMU]           = VEMU_OPCODE_REMU,
+};
+
+static vemu_opcode_t const vemu_amofunct_to_flat[32] = {
+    [VEMU_FUNCT5_AMOADD]        = VEMU_OPCODE_AMOADD_W,
+    [VEMU_FUNCT5_AMOSWAP]       = VEMU_OPCODE_AMOSWAP_W,
+    [VEMU_FUNCT5_LR]            = VEMU_OPCODE_LR_W,
+    [VEMU_FUNCT5_SC]            = VEMU_OPCODE_SC_W,
+    [VEMU_FUNCT5_AMOXOR]        = VEMU_OPCODE_AMOXOR_W,
+    [VEMU_FUNCT5_AMOOR]         = VEMU_OPCODE_AMOOR_W,
+    [VEMU_FUNCT5_AMOAND]        = VEMU_OPCODE_AMOAND_W,
+    [VEMU_FUNCT5_AMOMIN]        = VEMU_OPCODE_AMOMIN_W,
+    [VEMU_FUNCT5_AMOMAX]        = VEMU_OPCODE_AMOMAX_W,
+    [VEMU_FUNCT5_AMOMINU]       = VEMU_OPCODE_AMOMINU_W,
+    [VEMU_FUNCT5_AMOMAXU]       = VEMU_OPCODE_AMOMAXU_W,
+};
+
 static char const *vemu_opcode_names[VEMU_MAX_OPCODES] = {
     [VEMU_OPCODE_ILLEGAL]       = "illegal",
     [VEMU_OPCODE_NOP]           = "nop",
@@ -93,207 +129,403 @@ static char const *vemu_opcode_names[VEMU_MAX_OPCODES] = {
     [VEMU_OPCODE_AND]           = "and",
     [VEMU_OPCODE_FENCE]         = "fence",
     [VEMU_OPCODE_FENCE_TSO]     = "fence.tso",
+    [VEMU_OPCODE_FENCE_I]       = "fence.i",
     [VEMU_OPCODE_PAUSE]         = "pause",
     [VEMU_OPCODE_ECALL]         = "ecall",
     [VEMU_OPCODE_EBREAK]        = "ebreak",
+    [VEMU_OPCODE_SFENCE_VMA]    = "sfence.vma",
+    [VEMU_OPCODE_CSRR]          = "csrr",
+    [VEMU_OPCODE_CSRRW]         = "csrrw",
+    [VEMU_OPCODE_CSRRW_SATP]    = "csrrw",
+    [VEMU_OPCODE_LR_W]          = "lr.w",
+    [VEMU_OPCODE_SC_W]          = "sc.w",
+    [VEMU_OPCODE_AMOSWAP_W]     = "amoswap.w",
+    [VEMU_OPCODE_AMOADD_W]      = "amoadd.w",
+    [VEMU_OPCODE_AMOXOR_W]      = "amoxor.w",
+    [VEMU_OPCODE_AMOAND_W]      = "amoand.w",
+    [VEMU_OPCODE_AMOOR_W]       = "amoor.w",
+    [VEMU_OPCODE_AMOMIN_W]      = "amomin.w",
+    [VEMU_OPCODE_AMOMAX_W]      = "amomax.w",
+    [VEMU_OPCODE_AMOMINU_W]     = "amominu.w",
+    [VEMU_OPCODE_AMOMAXU_W]     = "amomaxu.w",
+    [VEMU_OPCODE_MUL]           = "mul",
+    [VEMU_OPCODE_MULH]          = "mulh",
+    [VEMU_OPCODE_MULHSU]        = "mulhsu",
+    [VEMU_OPCODE_MULHU]         = "mulhu",
+    [VEMU_OPCODE_DIV]           = "div",
+    [VEMU_OPCODE_DIVU]          = "divu",
+    [VEMU_OPCODE_REM]           = "rem",
+    [VEMU_OPCODE_REMU]          = "remu",
+    [VEMU_OPCODE_SH1ADD]        = "sh1add",
+    [VEMU_OPCODE_SH2ADD]        = "sh2add",
+    [VEMU_OPCODE_SH3ADD]        = "sh3add",
+    [VEMU_OPCODE_ANDN]          = "andn",
+    [VEMU_OPCODE_ORN]           = "orn",
+    [VEMU_OPCODE_XNOR]          = "xnor",
+    [VEMU_OPCODE_CLZ]           = "clz",
+    [VEMU_OPCODE_CTZ]           = "ctz",
+    [VEMU_OPCODE_CPOP]          = "cpop",
+    [VEMU_OPCODE_MAX]           = "max",
+    [VEMU_OPCODE_MAXU]          = "maxu",
+    [VEMU_OPCODE_MIN]           = "min",
+    [VEMU_OPCODE_MINU]          = "minu",
+    [VEMU_OPCODE_SEXT_B]        = "sext.b",
+    [VEMU_OPCODE_SEXT_H]        = "sext.h",
+    [VEMU_OPCODE_ZEXT_H]        = "zext.h",
+    [VEMU_OPCODE_ROL]           = "rol",
+    [VEMU_OPCODE_ROR]           = "ror",
+    [VEMU_OPCODE_RORI]          = "rori",
+    [VEMU_OPCODE_ORC_B]         = "orc.b",
+    [VEMU_OPCODE_REV8]          = "rev8",
+    [VEMU_OPCODE_BCLR]          = "bclr",
+    [VEMU_OPCODE_BCLRI]         = "bclri",
+    [VEMU_OPCODE_BEXT]          = "bext",
+    [VEMU_OPCODE_BEXTI]         = "bexti",
+    [VEMU_OPCODE_BINV]          = "binv",
+    [VEMU_OPCODE_BINVI]         = "binvi",
+    [VEMU_OPCODE_BSET]          = "bset",
+    [VEMU_OPCODE_BSETI]         = "bseti",
+    [VEMU_OPCODE_FP]            = "fp",
+    [VEMU_OPCODE_VEC]           = "vec",
+    [VEMU_OPCODE_LUI_ADDI]      = "lui+addi",
+    [VEMU_OPCODE_AUIPC_LW]      = "auipc+lw",
+    [VEMU_OPCODE_AUIPC_JALR]    = "auipc+jalr",
+    [VEMU_OPCODE_SLT_BNEZ]      = "slt+bnez",
+    [VEMU_OPCODE_SLT_BEQZ]      = "slt+beqz",
+    [VEMU_OPCODE_SLTU_BNEZ]     = "sltu+bnez",
+    [VEMU_OPCODE_SLTU_BEQZ]     = "sltu+beqz",
 };
 
 static inline uint32_t vemu_sext(uint32_t value, uint32_t bits) {
     return (int32_t)(value << (32 - bits)) >> (32 - bits);
 }
 
-static inline void vemu_set_illegal_if_zero(vemu_decoded_t *dec, uint32_t nz) {
-    if (nz == 0) {
-        dec->opcode = VEMU_OPCODE_ILLEGAL;
-    }
+/* Builders for the 32-bit instructions that compressed ones expand to */
+static inline uint32_t vemu_c_i(uint32_t imm, uint32_t rs1, uint32_t funct,
+                                uint32_t rd, uint32_t opcode) {
+    return (imm & 0xFFF) << 20 | rs1 << 15 | funct << 12 | rd << 7 | opcode;
 }
 
-static void vemu_decode_c_addi4spn(uint32_t instr, vemu_decoded_t *dec) {
-    dec->opcode = VEMU_OPCODE_ADDI;
-    dec->rd = 8 + ((instr >> 2) & 0x3);
-    dec->rs1 = VEMU_SP;
-    dec->imm = (((instr >> 5) & 0x1) << 3)
-             | (((instr >> 6) & 0x1) << 2)
-             | (((instr >> 7) & 0xF) << 6)
-             | (((instr >> 11) & 0x3) << 4);
+static inline uint32_t vemu_c_s(uint32_t imm, uint32_t rs2, uint32_t rs1,
+                                uint32_t funct, uint32_t opcode) {
+    return ((imm >> 5) & 0x7F) << 25 | rs2 << 20 | rs1 << 15 | funct << 12
+         | (imm & 0x1F) << 7 | opcode;
+}
 
-    vemu_set_illegal_if_zero(dec, dec->imm);
+static inline uint32_t vemu_c_r(uint32_t funct7, uint32_t rs2, uint32_t rs1,
+                                uint32_t funct, uint32_t rd) {
+    return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct << 12 | rd << 7
+         | VEMU_OPCODE_R_R;
 }
 
-static void vemu_decode_c_addi(uint32_t instr, vemu_decoded_t *dec) {
-    dec->opcode = VEMU_OPCODE_ADDI;
-    dec->rd = dec->rs1 = (instr >> 7) & 0x1F;
-    dec->imm = vemu_sext(((instr >> 2) & 0x1F) 
-                         | (((instr >> 12) & 0x1) << 5), 6);
+static inline uint32_t vemu_c_b(uint32_t imm, uint32_t rs1, uint32_t funct) {
+    return ((imm >> 12) & 0x1) << 31 | ((imm >> 5) & 0x3F) << 25
+         | rs1 << 15 | funct << 12 | ((imm >> 1) & 0xF) << 8
+         | ((imm >> 11) & 0x1) << 7 | VEMU_OPCODE_R_B;
+}
 
-    if (dec->rd == 0 && dec->imm == 0) {
-        dec->opcode = VEMU_OPCODE_NOP;
-    } else {
-        dec->opcode = VEMU_OPCODE_ADDI;
-        vemu_set_illegal_if_zero(dec, dec->imm);
-    }
+static inline uint32_t vemu_c_j(uint32_t imm, uint32_t rd) {
+    return ((imm >> 20) & 0x1) << 31 | ((imm >> 1) & 0x3FF) << 21
+         | ((imm >> 11) & 0x1) << 20 | ((imm >> 12) & 0xFF) << 12
+         | rd << 7 | VEMU_OPCODE_R_JAL;
 }
 
-static void vemu_decode_c_li(uint32_t instr, vemu_decoded_t *dec) {
-    dec->opcode = VEMU_OPCODE_ADDI;
-    dec->rd = (instr >> 7) & 0x1F;
-    dec->imm = vemu_sext(((instr >> 2) & 0x1F) 
-                         | (((instr >> 12) & 0x1) << 5), 6);
+static inline uint32_t vemu_c_bits(uint32_t instr, uint32_t lo, uint32_t n,
+                                   uint32_t at) {
+    return ((instr >> lo) & ((1u << n) - 1)) << at;
+}
 
-    vemu_set_illegal_if_zero(dec, dec->rd);
+/* The 6-bit immediate of C.ADDI, C.LI, C.ANDI and the shifts */
+static inline uint32_t vemu_c_imm6(uint32_t instr) {
+    return vemu_sext(vemu_c_bits(instr, 2, 5, 0) | vemu_c_bits(instr, 12, 1, 5),
+                     6);
 }
 
-static void vemu_decode_c_addi16sp_lui(uint32_t instr, vemu_decoded_t *dec) {
-    uint8_t r = (instr >> 7) & 0x1F;
+/* Offsets of loads and stores, scaled by the access size */
+static inline uint32_t vemu_c_mem_w(uint32_t instr) {
+    return vemu_c_bits(instr, 6, 1, 2) | vemu_c_bits(instr, 10, 3, 3)
+         | vemu_c_bits(instr, 5, 1, 6);
+}
 
-    if (r == VEMU_ZERO) {
-        dec->opcode = VEMU_OPCODE_ILLEGAL;
-    } else if (r == VEMU_SP) {
-        dec->opcode = VEMU_OPCODE_ADDI;
-        dec->rd = dec->rs1 = 2;
-        uint32_t u = (((instr >> 2) & 0x1) << 5)
-                   | (((instr >> 3) & 0x3) << 7)
-                   | (((instr >> 5) & 0x1) << 6)
-                   | (((instr >> 6) & 0x1) << 4)
-                   | (((instr >> 12) & 0x1) << 9);
-        dec->imm = vemu_sext(u, 10);
-    } else {
-        dec->imm = vemu_sext((((instr >> 2) & 0x1F) << 12)
-                             | (((instr >> 12) & 0x1) << 17), 18);
-    }
+static inline uint32_t vemu_c_mem_d(uint32_t instr) {
+    return vemu_c_bits(instr, 10, 3, 3) | vemu_c_bits(instr, 5, 2, 6);
 }
 
-static void vemu_decode_c_jr_mv(uint32_t instr, vemu_decoded_t *dec) {
-    uint8_t lo = (instr >> 2) & 0x1F;
-    uint8_t hi = (instr >> 7) & 0x1F;
+static uint32_t vemu_expand_c_q0(uint32_t instr) {
+    uint32_t rd = 8 + ((instr >> 2) & 0x7);
+    uint32_t rs1 = 8 + ((instr >> 7) & 0x7);
 
-    if (lo != VEMU_ZERO && hi != VEMU_ZERO) {
-        dec->opcode = VEMU_OPCODE_ADD;
-        dec->rs2 = lo;
-        dec->rd = hi;
-    } else if (lo == VEMU_ZERO && hi != VEMU_ZERO) {
-        dec->opcode = VEMU_OPCODE_JALR;
-        dec->rs1 = hi;
-    } else {
-        dec->opcode = VEMU_OPCODE_ILLEGAL;
+    switch ((vemu_compressed_opcode_t)VEMU_C_OPCODE(instr)) {
+        case VEMU_OPCODE_C_ADDI4SPN: {
+            uint32_t imm = vemu_c_bits(instr, 6, 1, 2)
+                         | vemu_c_bits(instr, 5, 1, 3)
+                         | vemu_c_bits(instr, 11, 2, 4)
+                         | vemu_c_bits(instr, 7, 4, 6);
+            return imm == 0 ? 0 : vemu_c_i(imm, VEMU_SP, 0x0, rd,
+                                           VEMU_OPCODE_R_I);
+        }
+
+        case VEMU_OPCODE_C_FLD:
+            return vemu_c_i(vemu_c_mem_d(instr), rs1, 0x3, rd,
+                            VEMU_OPCODE_R_LOAD_FP);
+
+        case VEMU_OPCODE_C_LW:
+            return vemu_c_i(vemu_c_mem_w(instr), rs1, 0x2, rd,
+                            VEMU_OPCODE_R_L);
+
+        case VEMU_OPCODE_C_FLW:
+            return vemu_c_i(vemu_c_mem_w(instr), rs1, 0x2, rd,
+                            VEMU_OPCODE_R_LOAD_FP);
+
+        case VEMU_OPCODE_C_FSD:
+            return vemu_c_s(vemu_c_mem_d(instr), rd, rs1, 0x3,
+                            VEMU_OPCODE_R_STORE_FP);
+
+        case VEMU_OPCODE_C_SW:
+            return vemu_c_s(vemu_c_mem_w(instr), rd, rs1, 0x2,
+                            VEMU_OPCODE_R_S);
+
+        case VEMU_OPCODE_C_FSW:
+            return vemu_c_s(vemu_c_mem_w(instr), rd, rs1, 0x2,
+                            VEMU_OPCODE_R_STORE_FP);
+
+        default:
+            return 0;
     }
 }
 
-static void vemu_decode_c_lwsp(uint32_t instr, vemu_decoded_t *dec) {
-    dec->opcode = VEMU_OPCODE_LW;
-    dec->rs1 = VEMU_SP;
-    dec->rd = (instr >> 7) & 0x1F;
-    dec->imm = (((instr >> 2) & 0x3) << 6)
-             | (((instr >> 4) & 0x7) << 2)
-             | (((instr >> 12) & 0x1) << 5);
-
-    vemu_set_illegal_if_zero(dec, dec->rd);
-}
-
-static void vemu_decode_c_ebreak_jalr_add(uint32_t instr, vemu_decoded_t *dec) {
-    uint8_t lo = (instr >> 2) & 0x1F;
-    uint8_t hi = (instr >> 7) & 0x1F;
-
-    if (lo != VEMU_ZERO && hi != VEMU_ZERO) {
-        dec->opcode = VEMU_OPCODE_ADD;
-        dec->rs2 = lo;
-        dec->rs1 = hi;
-        dec->rd = hi;
-    } else if (lo == VEMU_ZERO && hi != VEMU_ZERO) {
-        dec->opcode = VEMU_OPCODE_JALR;
-        dec->rs1 = hi;
-    } else if (lo == VEMU_ZERO && hi == VEMU_ZERO) {
-        // ebreak
-    } else {
-        dec->opcode = VEMU_OPCODE_ILLEGAL;
+/* C.SRLI, C.SRAI, C.ANDI and the register-register ALU ops on x8-x15 */
+static uint32_t vemu_expand_c_alu(uint32_t instr) {
+    static uint32_t const functs[4] = { 0x0, 0x4, 0x6, 0x7 };
+    uint32_t rd = 8 + ((instr >> 7) & 0x7);
+    uint32_t rs2 = 8 + ((instr >> 2) & 0x7);
+    uint32_t shamt = vemu_c_bits(instr, 2, 5, 0);
+    bool high = (instr >> 12) & 0x1;
+
+    switch ((instr >> 10) & 0x3) {
+        case 0x0:
+            return high ? 0 : vemu_c_i(shamt, rd, 0x5, rd, VEMU_OPCODE_R_I);
+
+        case 0x1:
+            return high ? 0 : vemu_c_i(0x400 | shamt, rd, 0x5, rd,
+                                       VEMU_OPCODE_R_I);
+
+        case 0x2:
+            return vemu_c_i(vemu_c_imm6(instr), rd, 0x7, rd, VEMU_OPCODE_R_I);
+
+        default: {
+            /* The ones with bit 12 set are RV64 only */
+            uint32_t op = (instr >> 5) & 0x3;
+            return high ? 0 : vemu_c_r(op == 0 ? 0x20 : 0x0, rs2, rd,
+                                       functs[op], rd);
+        }
     }
 }
 
-static void vemu_decode_c_swsp(uint32_t instr, vemu_decoded_t *dec) {
-    dec->opcode = VEMU_OPCODE_SW;
-    dec->rs1 = VEMU_SP;
-    dec->rs2 = (instr >> 7) & 0x1F;
-    dec->imm = (((instr >> 7) & 0x3) << 6) 
-             | (((instr >> 9) & 0xF) << 2);
+static uint32_t vemu_expand_c_q1(uint32_t instr) {
+    uint32_t rd = (instr >> 7) & 0x1F;
+    uint32_t imm = vemu_c_imm6(instr);
+
+    switch ((vemu_compressed_opcode_t)VEMU_C_OPCODE(instr)) {
+        case VEMU_OPCODE_C_ADDI:
+            return vemu_c_i(imm, rd, 0x0, rd, VEMU_OPCODE_R_I);
+
+        case VEMU_OPCODE_C_JAL:
+        case VEMU_OPCODE_C_J: {
+            uint32_t offset = vemu_c_bits(instr, 3, 3, 1)
+                            | vemu_c_bits(instr, 11, 1, 4)
+                            | vemu_c_bits(instr, 2, 1, 5)
+                            | vemu_c_bits(instr, 7, 1, 6)
+                            | vemu_c_bits(instr, 6, 1, 7)
+                            | vemu_c_bits(instr, 9, 2, 8)
+                            | vemu_c_bits(instr, 8, 1, 10)
+                            | vemu_c_bits(instr, 12, 1, 11);
+            return vemu_c_j(vemu_sext(offset, 12),
+                            VEMU_C_OPCODE(instr) == VEMU_OPCODE_C_JAL
+                            ? VEMU_RA : VEMU_ZERO);
+        }
+
+        case VEMU_OPCODE_C_LI:
+            return vemu_c_i(imm, VEMU_ZERO, 0x0, rd, VEMU_OPCODE_R_I);
+
+        case VEMU_OPCODE_C_LUI:
+            if (rd == VEMU_SP) {
+                uint32_t nzimm = vemu_c_bits(instr, 6, 1, 4)
+                               | vemu_c_bits(instr, 2, 1, 5)
+                               | vemu_c_bits(instr, 5, 1, 6)
+                               | vemu_c_bits(instr, 3, 2, 7)
+                               | vemu_c_bits(instr, 12, 1, 9);
+                return nzimm == 0 ? 0 : vemu_c_i(vemu_sext(nzimm, 10),
+                                                 VEMU_SP, 0x0, VEMU_SP,
+                                                 VEMU_OPCODE_R_I);
+            }
+            return imm == 0 ? 0 : (imm << 12) | rd << 7 | VEMU_OPCODE_R_LUI;
+
+        case VEMU_OPCODE_C_ALU:
+            return vemu_expand_c_alu(instr);
+
+        case VEMU_OPCODE_C_BEQZ:
+        case VEMU_OPCODE_C_BNEZ: {
+            uint32_t offset = vemu_c_bits(instr, 3, 2, 1)
+                            | vemu_c_bits(instr, 10, 2, 3)
+                            | vemu_c_bits(instr, 2, 1, 5)
+                            | vemu_c_bits(instr, 5, 2, 6)
+                            | vemu_c_bits(instr, 12, 1, 8);
+            return vemu_c_b(vemu_sext(offset, 9), 8 + ((instr >> 7) & 0x7),
+                            VEMU_C_OPCODE(instr) == VEMU_OPCODE_C_BNEZ);
+        }
+
+        default:
+            return 0;
+    }
 }
 
-static void vemu_decode_compressed_q0(uint32_t instr, vemu_decoded_t *dec) {
-    switch ((instr >> 13) & 0x7) {
-        case 0x0:
-            vemu_decode_c_addi4spn(instr, dec);
-            break;
+static uint32_t vemu_expand_c_q2(uint32_t instr) {
+    uint32_t rd = (instr >> 7) & 0x1F;
+    uint32_t rs2 = (instr >> 2) & 0x1F;
+    uint32_t lwsp = vemu_c_bits(instr, 4, 3, 2) | vemu_c_bits(instr, 12, 1, 5)
+                  | vemu_c_bits(instr, 2, 2, 6);
+    uint32_t ldsp = vemu_c_bits(instr, 5, 2, 3) | vemu_c_bits(instr, 12, 1, 5)
+                  | vemu_c_bits(instr, 2, 3, 6);
+    uint32_t swsp = vemu_c_bits(instr, 9, 4, 2) | vemu_c_bits(instr, 7, 2, 6);
+    uint32_t sdsp = vemu_c_bits(instr, 10, 3, 3) | vemu_c_bits(instr, 7, 3, 6);
+    bool high = (instr >> 12) & 0x1;
+
+    switch ((vemu_compressed_opcode_t)VEMU_C_OPCODE(instr)) {
+        case VEMU_OPCODE_C_SLLI:
+            return high ? 0 : vemu_c_i(rs2, rd, 0x1, rd, VEMU_OPCODE_R_I);
+
+        case VEMU_OPCODE_C_FLDSP:
+            return vemu_c_i(ldsp, VEMU_SP, 0x3, rd, VEMU_OPCODE_R_LOAD_FP);
+
+        case VEMU_OPCODE_C_LWSP:
+            return rd == VEMU_ZERO ? 0 : vemu_c_i(lwsp, VEMU_SP, 0x2, rd,
+                                                  VEMU_OPCODE_R_L);
+
+        case VEMU_OPCODE_C_FLWSP:
+            return vemu_c_i(lwsp, VEMU_SP, 0x2, rd, VEMU_OPCODE_R_LOAD_FP);
+
+        /* C.JR, C.MV, C.EBREAK, C.JALR and C.ADD */
+        case VEMU_OPCODE_C_JR_MV_ADD:
+            if (rs2 != VEMU_ZERO) {
+                return vemu_c_r(0x0, rs2, high ? rd : VEMU_ZERO, 0x0, rd);
+            } else if (rd != VEMU_ZERO) {
+                return vemu_c_i(0, rd, 0x0, high ? VEMU_RA : VEMU_ZERO,
+                                VEMU_OPCODE_R_JALR);
+            }
+            return high ? vemu_c_i(1, VEMU_ZERO, 0x0, VEMU_ZERO,
+                                   VEMU_OPCODE_R_ECALL) : 0;
+
+        case VEMU_OPCODE_C_FSDSP:
+            return vemu_c_s(sdsp, rs2, VEMU_SP, 0x3, VEMU_OPCODE_R_STORE_FP);
+
+        case VEMU_OPCODE_C_SWSP:
+            return vemu_c_s(swsp, rs2, VEMU_SP, 0x2, VEMU_OPCODE_R_S);
+
+        case VEMU_OPCODE_C_FSWSP:
+            return vemu_c_s(swsp, rs2, VEMU_SP, 0x2, VEMU_OPCODE_R_STORE_FP);
 
         default:
-            break;
+            return 0;
     }
 }
 
-static void vemu_decode_compressed_q1(uint32_t instr, vemu_decoded_t *dec) {    
-    switch ((instr >> 13) & 0x7) {
+/* The 32-bit instruction a compressed one stands for, or 0 for reserved
+   encodings. HINTs expand to instructions that write x0. */
+static uint32_t vemu_expand_compressed(uint32_t instr) {
+    switch (instr & 0x3) {
         case 0x0:
-            vemu_decode_c_addi(instr, dec);
-            break;
+            return vemu_expand_c_q0(instr);
 
-        case 0x2:
-            vemu_decode_c_li(instr, dec);
-            break;
+        case 0x1:
+            return vemu_expand_c_q1(instr);
 
-        case 0x3:
-            vemu_decode_c_addi16sp_lui(instr, dec);
-            break;
+        case 0x2:
+            return vemu_expand_c_q2(instr);
 
         default:
-            break;
+            return 0;
     }
 }
 
-static void vemu_decode_compressed_q2(uint32_t instr, vemu_decoded_t *dec) {
-    switch ((instr >> 13) & 0x7) {
-        case VEMU_OPCODE_C_LWSP:
-            vemu_decode_c_lwsp(instr, dec);
+static vemu_opcode_t vemu_decode_zb_opcode(vemu_funct_t funct, uint32_t d) {
+    switch (d) {
+        case VEMU_FUNCT7_SHADD:
+            switch (funct) {
+                case VEMU_FUNCT_SH1ADD: return VEMU_OPCODE_SH1ADD;
+                case VEMU_FUNCT_SH2ADD: return VEMU_OPCODE_SH2ADD;
+                case VEMU_FUNCT_SH3ADD: return VEMU_OPCODE_SH3ADD;
+                default:                break;
+            }
             break;
 
-        case 0x4:
-            if (((instr >> 12) & 0x1) == 0x0) {
-                vemu_decode_c_jr_mv(instr, dec);
-            } else {
-                vemu_decode_c_ebreak_jalr_add(instr, dec);
+        case VEMU_FUNCT7_ALT:
+            switch (funct) {
+                case VEMU_FUNCT_ANDN:   return VEMU_OPCODE_ANDN;
+                case VEMU_FUNCT_ORN:    return VEMU_OPCODE_ORN;
+                case VEMU_FUNCT_XNOR:   return VEMU_OPCODE_XNOR;
+                default:                break;
             }
             break;
 
-        case VEMU_OPCODE_C_SWSP:
-            vemu_decode_c_swsp(instr, dec);
+        case VEMU_FUNCT7_MINMAX:
+            switch (funct) {
+                case VEMU_FUNCT_MIN:    return VEMU_OPCODE_MIN;
+                case VEMU_FUNCT_MINU:   return VEMU_OPCODE_MINU;
+                case VEMU_FUNCT_MAX:    return VEMU_OPCODE_MAX;
+                case VEMU_FUNCT_MAXU:   return VEMU_OPCODE_MAXU;
+                default:                break;
+            }
             break;
 
-        default:
+        case VEMU_FUNCT7_ZEXT:
+            if (funct == VEMU_FUNCT_ZEXT_H) {
+                return VEMU_OPCODE_ZEXT_H;
+            }
             break;
-    }
-}
 
-static void vemu_decode_compressed(uint32_t instr, vemu_decoded_t *dec) {
-    dec->opcode = dec->rd = dec->rs1 = dec->rs2 = dec->imm = 0;
+        case VEMU_FUNCT7_ROTATE:
+            if (funct == VEMU_FUNCT_ROL) {
+                return VEMU_OPCODE_ROL;
+            } else if (funct == VEMU_FUNCT_ROR) {
+                return VEMU_OPCODE_ROR;
+            }
+            break;
 
-    switch (instr & 0x3) {
-        case 0x0:
-            vemu_decode_compressed_q0(instr, dec);
+        case VEMU_FUNCT7_BCLR:
+            if (funct == VEMU_FUNCT_BIT) {
+                return VEMU_OPCODE_BCLR;
+            } else if (funct == VEMU_FUNCT_BEXT) {
+                return VEMU_OPCODE_BEXT;
+            }
             break;
 
-        case 0x1:
-            vemu_decode_compressed_q1(instr, dec);
+        case VEMU_FUNCT7_BINV:
+            if (funct == VEMU_FUNCT_BIT) {
+                return VEMU_OPCODE_BINV;
+            }
             break;
 
-        case 0x2:
-            vemu_decode_compressed_q2(instr, dec);
+        case VEMU_FUNCT7_BSET:
+            if (funct == VEMU_FUNCT_BIT) {
+                return VEMU_OPCODE_BSET;
+            }
             break;
 
         default:
             break;
     }
+
+    return VEMU_OPCODE_ILLEGAL;
 }
 
 static vemu_opcode_t vemu_decode_r_opcode(vemu_funct_t funct, uint32_t d) {
     vemu_opcode_t opcode = vemu_rfunct_to_flat[funct];
 
+    if (d == 0x01) {
+        return vemu_mfunct_to_flat[funct];
+    }
+
     switch (funct) {
         case VEMU_FUNCT_ADD_SUB:
             if (d == 0x00) {
@@ -317,7 +549,7 @@ static vemu_opcode_t vemu_decode_r_opcode(vemu_funct_t funct, uint32_t d) {
             }
     }
 
-    return VEMU_OPCODE_ILLEGAL;
+    return vemu_decode_zb_opcode(funct, d);
 }
 
 static void vemu_decode_format_r(uint32_t instr, vemu_decoded_t *dec,
@@ -331,21 +563,47 @@ static void vemu_decode_format_r(uint32_t instr, vemu_decoded_t *dec,
     dec->rd = (instr >> 7) & 0x1F;
     dec->rs1 = (instr >> 15) & 0x1F;
     dec->rs2 = (instr >> 20) & 0x1F;                           
+
+    /* zext.h is the Zbkb pack with rs2 = x0, which is all Zbb has */
+    if (dec->opcode == VEMU_OPCODE_ZEXT_H && dec->rs2 != VEMU_ZERO) {
+        dec->opcode = VEMU_OPCODE_ILLEGAL;
+    }
 }
 
-static vemu_opcode_t vemu_decode_shift_opcode(vemu_funct_t funct, uint32_t d) {    
+/* imm is bits 31:20, of which d is the upper seven */
+static vemu_opcode_t vemu_decode_shift_opcode(vemu_funct_t funct, uint32_t d,
+                                              uint32_t imm) {
     switch (funct) {
         case VEMU_FUNCT_SLLI:
-            if (d == 0x00) {
-                return VEMU_OPCODE_SLLI;
+            switch (d) {
+                case VEMU_FUNCT7_BASE:  return VEMU_OPCODE_SLLI;
+                case VEMU_FUNCT7_BCLR:  return VEMU_OPCODE_BCLRI;
+                case VEMU_FUNCT7_BINV:  return VEMU_OPCODE_BINVI;
+                case VEMU_FUNCT7_BSET:  return VEMU_OPCODE_BSETI;
+                default:                break;
+            }
+            switch (imm) {
+                case VEMU_IMM_CLZ:      return VEMU_OPCODE_CLZ;
+                case VEMU_IMM_CTZ:      return VEMU_OPCODE_CTZ;
+                case VEMU_IMM_CPOP:     return VEMU_OPCODE_CPOP;
+                case VEMU_IMM_SEXT_B:   return VEMU_OPCODE_SEXT_B;
+                case VEMU_IMM_SEXT_H:   return VEMU_OPCODE_SEXT_H;
+                default:                break;
             }
             break;
 
         case VEMU_FUNCT_SRLI_SRAI:
-            if (d == 0x00) {
-                return VEMU_OPCODE_SRLI;
-            } else if (d == 0x20) {
-                return VEMU_OPCODE_SRAI;
+            switch (d) {
+                case VEMU_FUNCT7_BASE:  return VEMU_OPCODE_SRLI;
+                case VEMU_FUNCT7_ALT:   return VEMU_OPCODE_SRAI;
+                case VEMU_FUNCT7_ROTATE: return VEMU_OPCODE_RORI;
+                case VEMU_FUNCT7_BCLR:  return VEMU_OPCODE_BEXTI;
+                default:                break;
+            }
+            if (imm == VEMU_IMM_ORC_B) {
+                return VEMU_OPCODE_ORC_B;
+            } else if (imm == VEMU_IMM_REV8) {
+                return VEMU_OPCODE_REV8;
             }
             break;
 
@@ -372,12 +630,14 @@ static void vemu_decode_format_i(uint32_t instr, vemu_decoded_t *dec,
             dec->opcode = vemu_ifunct_to_flat[funct];
             if (dec->opcode == VEMU_OPCODE_ILLEGAL) {
                 uint32_t d = (instr >> 25) & 0x7F;
-                dec->opcode = vemu_decode_shift_opcode(funct, d);
+                dec->opcode = vemu_decode_shift_opcode(funct, d,
+                                                       (instr >> 20) & 0xFFF);
             }
             break;
 
         case VEMU_OPCODE_R_ECALL:
-            dec->opcode = VEMU_OPCODE_ECALL;
+            dec->opcode = (instr >> 20) == 0x1 ? VEMU_OPCODE_EBREAK
+                                               : VEMU_OPCODE_ECALL;
             break;
 
         default:
@@ -391,9 +651,24 @@ static void vemu_decode_format_i(uint32_t instr, vemu_decoded_t *dec,
         case VEMU_OPCODE_SLLI:
         case VEMU_OPCODE_SRLI:
         case VEMU_OPCODE_SRAI:  
+        case VEMU_OPCODE_RORI:
+        case VEMU_OPCODE_BCLRI:
+        case VEMU_OPCODE_BEXTI:
+        case VEMU_OPCODE_BINVI:
+        case VEMU_OPCODE_BSETI:
             dec->imm = (instr >> 20) & 0x1F;
             break;
 
+        case VEMU_OPCODE_CLZ:
+        case VEMU_OPCODE_CTZ:
+        case VEMU_OPCODE_CPOP:
+        case VEMU_OPCODE_SEXT_B:
+        case VEMU_OPCODE_SEXT_H:
+        case VEMU_OPCODE_ORC_B:
+        case VEMU_OPCODE_REV8:
+            dec->imm = 0;
+            break;
+
         default:    
             dec->imm = vemu_sext((instr >> 20) & 0xFFF, 12);
             break;
@@ -463,6 +738,107 @@ static void vemu_decode_format_j(uint32_t instr, vemu_decoded_t *dec,
     dec->imm = vemu_sext(u, 21);
 }
 
+static void vemu_decode_fence(uint32_t instr, vemu_decoded_t *dec) {
+    switch ((instr >> 12) & 0x7) {
+        case VEMU_FUNCT_FENCE:
+            if (instr == 0x8330000F) {
+                dec->opcode = VEMU_OPCODE_FENCE_TSO;
+            } else if (instr == 0x0100000F) {
+                dec->opcode = VEMU_OPCODE_PAUSE;
+            } else {
+                dec->opcode = VEMU_OPCODE_FENCE;
+            }
+            break;
+
+        case VEMU_FUNCT_FENCE_I:
+            dec->opcode = VEMU_OPCODE_FENCE_I;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* The aq and rl bits are ignored: every atomic is sequentially 
+   consistent on the host. */
+static void vemu_decode_amo(uint32_t instr, vemu_decoded_t *dec) {
+    if (((instr >> 12) & 0x7) != VEMU_FUNCT_AMO_W) {
+        return;
+    }
+
+    dec->opcode = vemu_amofunct_to_flat[instr >> 27];
+    dec->rd = (instr >> 7) & 0x1F;
+    dec->rs1 = (instr >> 15) & 0x1F;
+    dec->rs2 = (instr >> 20) & 0x1F;
+
+    if (dec->opcode == VEMU_OPCODE_LR_W && dec->rs2 != 0) {
+        dec->opcode = VEMU_OPCODE_ILLEGAL;
+    }
+}
+
+/* Only reads of read-only CSRs (csrr and its spellings with csrrc and
+   the immediate forms) and the floating-point, vector and translation
+   CSRs are supported, which is all there is to ask an emulator without
+   privileged modes for. 
+   Writes keep the CSR and funct3 in imm, the source register in rs1 and
+   the immediate in imm2, one of which is zero. sfence.vma flushes all
+   translations whatever its operands. */
+static void vemu_decode_system(uint32_t instr, vemu_decoded_t *dec) {
+    vemu_funct_t funct = (instr >> 12) & 0x7;
+    uint32_t csr = instr >> 20;
+    uint32_t src = (instr >> 15) & 0x1F;
+
+    if (funct != VEMU_FUNCT_PRIV && funct != 0x4
+            && (vemu_fp_is_csr(csr) || vemu_vec_is_csr(csr)
+                || csr == VEMU_CSR_SATP)) {
+        bool write = funct == VEMU_FUNCT_CSRRW || funct == VEMU_FUNCT_CSRRWI
+                  || src != 0;
+        bool uimm = funct >= VEMU_FUNCT_CSRRWI;
+
+        /* The top two bits of read-only CSR numbers are set */
+        if (write && (csr >> 10) == 0x3) {
+            return;
+        }
+
+        dec->opcode = !write ? VEMU_OPCODE_CSRR
+                    : csr == VEMU_CSR_SATP ? VEMU_OPCODE_CSRRW_SATP
+                    : VEMU_OPCODE_CSRRW;
+        dec->rd = (instr >> 7) & 0x1F;
+        dec->imm = csr;
+        if (write) {
+            dec->imm |= (funct & 0x3) << 12;
+            dec->rs1 = uimm ? 0 : src;
+            dec->imm2 = uimm ? src : 0;
+        }
+        return;
+    }
+
+    switch (funct) {
+        case VEMU_FUNCT_PRIV:
+            if ((instr >> 25) == VEMU_FUNCT7_SFENCE_VMA
+                    && ((instr >> 7) & 0x1F) == 0) {
+                dec->opcode = VEMU_OPCODE_SFENCE_VMA;
+                break;
+            }
+            vemu_decode_format_i(instr, dec, VEMU_OPCODE_R_ECALL);
+            break;
+
+        case VEMU_FUNCT_CSRRS:
+        case VEMU_FUNCT_CSRRC:
+        case VEMU_FUNCT_CSRRSI:
+        case VEMU_FUNCT_CSRRCI:
+            if (src == 0 && csr == VEMU_CSR_MHARTID) {
+                dec->opcode = VEMU_OPCODE_CSRR;
+                dec->rd = (instr >> 7) & 0x1F;
+                dec->imm = csr;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
 static void vemu_decode_regular(uint32_t instr, vemu_decoded_t *dec) {
     vemu_regular_opcode_t ropcode = instr & 0x7F;
     
@@ -501,11 +877,37 @@ static void vemu_decode_regular(uint32_t instr, vemu_decoded_t *dec) {
             break;
 
         case VEMU_OPCODE_R_FENCE:
-            // ?
+            vemu_decode_fence(instr, dec);
+            break;
+
+        case VEMU_OPCODE_R_AMO:
+            vemu_decode_amo(instr, dec);
             break;
 
         case VEMU_OPCODE_R_ECALL:
-            vemu_decode_format_i(instr, dec, ropcode);
+            vemu_decode_system(instr, dec);
+            break;
+
+        /* Widths 0 and 5 to 7 are vector loads and stores */
+        case VEMU_OPCODE_R_LOAD_FP:
+        case VEMU_OPCODE_R_STORE_FP:
+            if (((instr >> 12) & 0x7) == 0 || ((instr >> 12) & 0x7) >= 5) {
+                vemu_vec_decode(instr, dec);
+            } else {
+                vemu_fp_decode(instr, dec);
+            }
+            break;
+
+        case VEMU_OPCODE_R_FMADD:
+        case VEMU_OPCODE_R_FMSUB:
+        case VEMU_OPCODE_R_FNMSUB:
+        case VEMU_OPCODE_R_FNMADD:
+        case VEMU_OPCODE_R_OP_FP:
+            vemu_fp_decode(instr, dec);
+            break;
+
+        case VEMU_OPCODE_R_OP_V:
+            vemu_vec_decode(instr, dec);
             break;
 
         default:
@@ -513,6 +915,38 @@ static void vemu_decode_regular(uint32_t instr, vemu_decoded_t *dec) {
     }
 }
 
+#define VEMU_COMPRESSED_EMPTY   0
+#define VEMU_COMPRESSED_FILLING 1
+#define VEMU_COMPRESSED_READY   2
+
+/* Each 16-bit parcel is decoded the first time it is seen and kept, so
+   that decoding it again is one lookup. Filling all 64K entries up front
+   cost more than a short program's whole run. A hart that finds an entry
+   being filled by another decodes the parcel itself. */
+static vemu_decoded_t vemu_compressed_table[1 << 16];
+static uint8_t vemu_compressed_state[1 << 16];
+
+static void vemu_decode_compressed(uint32_t instr, vemu_decoded_t *dec) {
+    uint8_t *state = &vemu_compressed_state[instr];
+    if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == VEMU_COMPRESSED_READY) {
+        *dec = vemu_compressed_table[instr];
+        return;
+    }
+
+    *dec = (vemu_decoded_t){ 0, };
+    vemu_decode_regular(vemu_expand_compressed(instr), dec);
+    dec->n_instrs = 1;
+    dec->c = true;
+
+    uint8_t empty = VEMU_COMPRESSED_EMPTY;
+    if (__atomic_compare_exchange_n(state, &empty, VEMU_COMPRESSED_FILLING,
+                                    false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        vemu_compressed_table[instr] = *dec;
+        __atomic_store_n(state, VEMU_COMPRESSED_READY, __ATOMIC_RELEASE);
+    }
+}
+
 static vemu_instruction_format_t vemu_opcode_to_format(vemu_opcode_t opcode) {
     switch (opcode) {
         case VEMU_OPCODE_ADD:
@@ -525,6 +959,47 @@ static vemu_instruction_format_t vemu_opcode_to_format(vemu_opcode_t opcode) {
         case VEMU_OPCODE_SRA:
         case VEMU_OPCODE_OR:
         case VEMU_OPCODE_AND:
+        case VEMU_OPCODE_SLT_BNEZ:
+        case VEMU_OPCODE_SLT_BEQZ:
+        case VEMU_OPCODE_SLTU_BNEZ:
+        case VEMU_OPCODE_SLTU_BEQZ:
+        case VEMU_OPCODE_LR_W:
+        case VEMU_OPCODE_SC_W:
+        case VEMU_OPCODE_AMOSWAP_W:
+        case VEMU_OPCODE_AMOADD_W:
+        case VEMU_OPCODE_AMOXOR_W:
+        case VEMU_OPCODE_AMOAND_W:
+        case VEMU_OPCODE_AMOOR_W:
+        case VEMU_OPCODE_AMOMIN_W:
+        case VEMU_OPCODE_AMOMAX_W:
+        case VEMU_OPCODE_AMOMINU_W:
+        case VEMU_OPCODE_AMOMAXU_W:
+        case VEMU_OPCODE_MUL:
+        case VEMU_OPCODE_MULH:
+        case VEMU_OPCODE_MULHSU:
+        case VEMU_OPCODE_MULHU:
+        case VEMU_OPCODE_DIV:
+        case VEMU_OPCODE_DIVU:
+        case VEMU_OPCODE_REM:
+        case VEMU_OPCODE_REMU:
+        case VEMU_OPCODE_SH1ADD:
+        case VEMU_OPCODE_SH2ADD:
+        case VEMU_OPCODE_SH3ADD:
+        case VEMU_OPCODE_ANDN:
+        case VEMU_OPCODE_ORN:
+        case VEMU_OPCODE_XNOR:
+        case VEMU_OPCODE_MAX:
+        case VEMU_OPCODE_MAXU:
+        case VEMU_OPCODE_MIN:
+        case VEMU_OPCODE_MINU:
+        case VEMU_OPCODE_ROL:
+        case VEMU_OPCODE_ROR:
+        case VEMU_OPCODE_BCLR:
+        case VEMU_OPCODE_BEXT:
+        case VEMU_OPCODE_BINV:
+        case VEMU_OPCODE_BSET:
+        case VEMU_OPCODE_FP:
+        case VEMU_OPCODE_VEC:
             return VEMU_FORMAT_R;
             
         case VEMU_OPCODE_JALR:
@@ -542,6 +1017,19 @@ static vemu_instruction_format_t vemu_opcode_to_format(vemu_opcode_t opcode) {
         case VEMU_OPCODE_SRLI:
         case VEMU_OPCODE_SLLI:
         case VEMU_OPCODE_SRAI:
+        case VEMU_OPCODE_CLZ:
+        case VEMU_OPCODE_CTZ:
+        case VEMU_OPCODE_CPOP:
+        case VEMU_OPCODE_SEXT_B:
+        case VEMU_OPCODE_SEXT_H:
+        case VEMU_OPCODE_ZEXT_H:
+        case VEMU_OPCODE_ORC_B:
+        case VEMU_OPCODE_REV8:
+        case VEMU_OPCODE_RORI:
+        case VEMU_OPCODE_BCLRI:
+        case VEMU_OPCODE_BEXTI:
+        case VEMU_OPCODE_BINVI:
+        case VEMU_OPCODE_BSETI:
             return VEMU_FORMAT_I;
 
         case VEMU_OPCODE_SB:
@@ -559,6 +1047,9 @@ static vemu_instruction_format_t vemu_opcode_to_format(vemu_opcode_t opcode) {
 
         case VEMU_OPCODE_LUI:
         case VEMU_OPCODE_AUIPC:
+        case VEMU_OPCODE_LUI_ADDI:
+        case VEMU_OPCODE_AUIPC_LW:
+        case VEMU_OPCODE_AUIPC_JALR:
             return VEMU_FORMAT_U;
 
         case VEMU_OPCODE_JAL:
@@ -567,9 +1058,14 @@ static vemu_instruction_format_t vemu_opcode_to_format(vemu_opcode_t opcode) {
         case VEMU_OPCODE_NOP: /* TODO */
         case VEMU_OPCODE_FENCE:
         case VEMU_OPCODE_FENCE_TSO:
+        case VEMU_OPCODE_FENCE_I:
         case VEMU_OPCODE_PAUSE:
         case VEMU_OPCODE_ECALL:
         case VEMU_OPCODE_EBREAK:
+        case VEMU_OPCODE_SFENCE_VMA:
+        case VEMU_OPCODE_CSRR:
+        case VEMU_OPCODE_CSRRW:
+        case VEMU_OPCODE_CSRRW_SATP:
             return VEMU_FORMAT_I;
         
         case VEMU_OPCODE_ILLEGAL:
@@ -597,6 +1093,14 @@ void vemu_disassemble(vemu_decoded_t *dec, uint32_t instr, uint32_t ip) {
         fprintf(stderr, "illegal instruction\n");
         return;
     }
+    if (dec->opcode == VEMU_OPCODE_FP) {
+        vemu_fp_disassemble(dec);
+        return;
+    }
+    if (dec->opcode == VEMU_OPCODE_VEC) {
+        vemu_vec_disassemble(dec);
+        return;
+    }
 
     vemu_instruction_format_t format = vemu_opcode_to_format(dec->opcode);
 
@@ -632,16 +1136,128 @@ void vemu_cpu_init(vemu_cpu_t *cpu, uint8_t **ram) {
         cpu->regs[i] = 0;
     }
     cpu->ip = 0;
+    cpu->next_ip = 0;
+
+    for (size_t i = 0; i < VEMU_N_REGS; i++) {
+        cpu->fregs[i] = 0;
+    }
+    cpu->fcsr = 0;
+
+    memset(cpu->vregs, 0, sizeof(cpu->vregs));
+    cpu->vl = 0;
+    cpu->vtype = VEMU_VEC_VILL;
+    cpu->vstart = 0;
+
+    cpu->terminated = false;
+    cpu->stop_ip = VEMU_CPU_NO_STOP;
+    cpu->exit_code = 0;
+
+    cpu->out = stdout;
+    cpu->err = stderr;
+
+    cpu->checkpoint = NULL;
+    cpu->checkpoint_arg = NULL;
+    cpu->replay = NULL;
+
+    cpu->hartid = 0;
+    cpu->n_harts = 1;
+    cpu->reserved = false;
+    cpu->reservation = 0;
+    cpu->reserved_value = 0;
+
+    cpu->instret = 0;
+    cpu->trace_start = 0;
 
     cpu->ram = ram;
+    cpu->bus = NULL;
+    vemu_mmu_init(&cpu->mmu);
+
+    cpu->mode = VEMU_EXEC_INTERP;
+    cpu->fusion = true;
+    cpu->traces = true;
+    cpu->passes = VEMU_IR_ALL;
+    vemu_decode_cache_init(&cpu->dcache);
+    vemu_block_cache_init(&cpu->blocks);
+    vemu_jit_init(&cpu->jit);
+    vemu_ir_stats_init(&cpu->ir_stats);
+    vemu_smc_init(&cpu->smc);
+}
+
+void vemu_cpu_destruct(vemu_cpu_t *cpu) {
+    vemu_decode_cache_destruct(&cpu->dcache);
+    vemu_block_cache_destruct(&cpu->blocks);
+    vemu_jit_destruct(&cpu->jit);
+    vemu_smc_destruct(&cpu->smc);
 }
 
 #define EXEC_FUNC(op) \
         static inline void vemu_exec_##op(vemu_cpu_t *cpu, vemu_decoded_t *dec)
 
+/* Guest programs end by returning from _start to address 0, which is
+   where the exit code is picked up */
+static void vemu_cpu_stop(vemu_cpu_t *cpu) {
+    cpu->terminated = true;
+    cpu->stop_ip = cpu->ip;
+    cpu->exit_code = cpu->regs[VEMU_A0];
+}
+
+/* Where the instruction halfword at ip is, going through the
+   instruction TLB while addresses are translated. Code that decodes
+   without a bus, such as the ahead-of-time compiler, may fetch from
+   anywhere. Returns the fault that stops the fetch, or NULL. */
+static char const *vemu_cpu_fetch_addr(vemu_cpu_t *cpu, uint32_t ip,
+                                       uint32_t *addr) {
+    *addr = ip;
+
+    if (vemu_mmu_on(&cpu->mmu)
+            && !vemu_mmu_translate(&cpu->mmu, *cpu->ram, cpu->bus, ip,
+                                   VEMU_MMU_FETCH, addr)) {
+        return "instruction page fault";
+    }
+    if (cpu->bus != NULL && !(vemu_bus_perms(cpu->bus, *addr) & VEMU_BUS_X)) {
+        return "execute fault";
+    }
+
+    return NULL;
+}
+
+/* Both halves of an instruction have to be on executable pages; the
+   second one is only looked up again when it starts the next page */
+static char const *vemu_cpu_fetch(vemu_cpu_t *cpu, uint32_t ip,
+                                  uint32_t *instr) {
+    uint32_t addr;
+    char const *fault = vemu_cpu_fetch_addr(cpu, ip, &addr);
+    if (fault != NULL) {
+        return fault;
+    }
+
+    *instr = vemu_ram_load_half(*cpu->ram, addr);
+    if (VEMU_IS_COMPRESSED(*instr)) {
+        return NULL;
+    }
+
+    if (((ip + 2) & ~VEMU_MMU_PAGE_MASK) != 0) {
+        addr += 2;
+    } else if ((fault = vemu_cpu_fetch_addr(cpu, ip + 2, &addr)) != NULL) {
+        return fault;
+    }
+
+    *instr |= (uint32_t)vemu_ram_load_half(*cpu->ram, addr) << 16;
+    return NULL;
+}
+
+/* Fetches that fault decode as illegal. The return from _start to 0 is
+   no fault. */
 EXEC_FUNC(ILLEGAL) {
     (void)dec;
-    cpu->terminated = true;
+
+    uint32_t instr;
+    char const *fault = cpu->ip != 0 ? vemu_cpu_fetch(cpu, cpu->ip, &instr)
+                                     : NULL;
+    if (fault != NULL) {
+        fprintf(cpu->err, "guest %s at 0x%08" PRIx32 "\n", fault, cpu->ip);
+    }
+    vemu_cpu_stop(cpu);
 }
 
 EXEC_FUNC(NOP) {
@@ -662,8 +1278,9 @@ EXEC_FUNC(JAL) {
 }
 
 EXEC_FUNC(JALR) {
+    uint32_t target = (cpu->regs[dec->rs1] + dec->imm) & 0xFFFFFFFE;
     cpu->regs[dec->rd] = cpu->next_ip;
-    cpu->next_ip = (cpu->regs[dec->rs1] + dec->imm) & 0xFFFFFFFE;
+    cpu->next_ip = target;
 }
 
 EXEC_FUNC(BEQ) {
@@ -702,48 +1319,102 @@ EXEC_FUNC(BGEU) {
     }
 }
 
+/* Loads and stores leave the fast path while addresses are translated
+   and when they hit a device page */
+static inline bool vemu_cpu_slow_access(vemu_cpu_t *cpu, uint32_t addr) {
+    return vemu_mmu_on(&cpu->mmu) || vemu_bus_is_device(cpu->bus, addr);
+}
+
+/* Loads into x0 stay in blocks for their faults and device reads, whose
+   bodies do not clear x0 between ops */
+static inline void vemu_load_rd(vemu_cpu_t *cpu, uint8_t rd, uint32_t value) {
+    cpu->regs[rd] = rd != VEMU_ZERO ? value : 0;
+}
+
 EXEC_FUNC(LB) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_load_rd(cpu, dec->rd, vemu_cpu_load(cpu, addr, dec->opcode));
+        return;
+    }
     uint32_t value = vemu_ram_load_byte(*cpu->ram, addr);
-    cpu->regs[dec->rd] = vemu_sext(value, 8);
+    vemu_load_rd(cpu, dec->rd, vemu_sext(value, 8));
 }
 
 EXEC_FUNC(LH) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_load_rd(cpu, dec->rd, vemu_cpu_load(cpu, addr, dec->opcode));
+        return;
+    }
     uint32_t value = vemu_ram_load_half(*cpu->ram, addr);
-    cpu->regs[dec->rd] = vemu_sext(value, 16);
+    vemu_load_rd(cpu, dec->rd, vemu_sext(value, 16));
 }
 
 EXEC_FUNC(LW) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_load_rd(cpu, dec->rd, vemu_cpu_load(cpu, addr, dec->opcode));
+        return;
+    }
     uint32_t value = vemu_ram_load_word(*cpu->ram, addr);
-    cpu->regs[dec->rd] = value;
+    vemu_load_rd(cpu, dec->rd, value);
 }
 
 EXEC_FUNC(LBU) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_load_rd(cpu, dec->rd, vemu_cpu_load(cpu, addr, dec->opcode));
+        return;
+    }
     uint32_t value = vemu_ram_load_byte(*cpu->ram, addr);
-    cpu->regs[dec->rd] = value;
+    vemu_load_rd(cpu, dec->rd, value);
 }
 
 EXEC_FUNC(LHU) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
-    cpu->regs[dec->rd] = vemu_ram_load_half(*cpu->ram, addr);
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_load_rd(cpu, dec->rd, vemu_cpu_load(cpu, addr, dec->opcode));
+        return;
+    }
+    vemu_load_rd(cpu, dec->rd, vemu_ram_load_half(*cpu->ram, addr));
+}
+
+static inline void vemu_check_store(vemu_cpu_t *cpu, uint32_t addr,
+                                    uint32_t len) {
+    if (vemu_smc_code_page(&cpu->smc, addr, len)) {
+        vemu_cpu_code_store(cpu, addr, len);
+    }
 }
 
 EXEC_FUNC(SB) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_cpu_store(cpu, addr, 1, cpu->regs[dec->rs2]);
+        return;
+    }
     vemu_ram_store_byte(*cpu->ram, addr, cpu->regs[dec->rs2]);
+    vemu_check_store(cpu, addr, 1);
 }
 
 EXEC_FUNC(SH) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_cpu_store(cpu, addr, 2, cpu->regs[dec->rs2]);
+        return;
+    }
     vemu_ram_store_half(*cpu->ram, addr, cpu->regs[dec->rs2]);
+    vemu_check_store(cpu, addr, 2);
 }
 
 EXEC_FUNC(SW) {
     uint32_t addr = cpu->regs[dec->rs1] + dec->imm;
+    if (vemu_cpu_slow_access(cpu, addr)) {
+        vemu_cpu_store(cpu, addr, 4, cpu->regs[dec->rs2]);
+        return;
+    }
     vemu_ram_store_word(*cpu->ram, addr, cpu->regs[dec->rs2]);
+    vemu_check_store(cpu, addr, 4);
 }
 
 EXEC_FUNC(ADDI) {
@@ -791,7 +1462,8 @@ EXEC_FUNC(SUB) {
 }
 
 EXEC_FUNC(SLL) {
-    cpu->regs[dec->rd] = cpu->regs[dec->rs1] >> cpu->regs[dec->rs2];
+    uint32_t shamt = cpu->regs[dec->rs2] & 0x1F;
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] << shamt;
 }
 
 EXEC_FUNC(SLT) {
@@ -800,8 +1472,7 @@ EXEC_FUNC(SLT) {
 }
 
 EXEC_FUNC(SLTU) {
-    uint32_t shamt = cpu->regs[dec->rs2] & 0x1F;
-    cpu->regs[dec->rd] = cpu->regs[dec->rs1] < shamt;
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] < cpu->regs[dec->rs2];
 }
 
 EXEC_FUNC(XOR) {
@@ -826,142 +1497,2001 @@ EXEC_FUNC(AND) {
     cpu->regs[dec->rd] = cpu->regs[dec->rs1] & cpu->regs[dec->rs2];
 }
 
+/* Harts on other host threads see guest memory through plain host 
+   accesses, so fence orders them the way a host fence does. fence.tso 
+   asks for no more than an x86 host gives anyway. */
 EXEC_FUNC(FENCE) {
     (void)cpu, (void)dec;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
 EXEC_FUNC(FENCE_TSO) {
     (void)cpu, (void)dec;
 }
 
+/* Stores into decoded code invalidate it right away, so all fence.i has
+   to do is end the block; what follows is fetched again. Stores from 
+   other harts are not seen by this hart's caches, so with more than one
+   hart it drops everything decoded. Code is tracked by virtual address,
+   so with paging on a store through another mapping of the same page
+   goes unseen and it drops everything too. */
+EXEC_FUNC(FENCE_I) {
+    (void)dec;
+    if (cpu->n_harts > 1 || vemu_mmu_on(&cpu->mmu)) {
+        vemu_cpu_flush_code(cpu);
+    }
+}
+
 EXEC_FUNC(PAUSE) {
     (void)cpu, (void)dec;
 }
 
+/* Every value an ecall brings in from outside goes through here, so that
+   a recorded run can be replayed exactly */
+static uint32_t vemu_cpu_input(vemu_cpu_t *cpu, uint32_t ecall, 
+                               uint32_t value) {
+    if (cpu->replay != NULL 
+            && !vemu_replay_event(cpu->replay, cpu->instret, ecall, &value)) {
+        vemu_cpu_stop(cpu);
+    }
+
+    return value;
+}
+
+/* Handlers compute with floating point of their own, so they run with
+   the host's environment rather than the guest's */
 EXEC_FUNC(ECALL) {
     (void)dec;
 
     uint32_t res = 0;
 
+    vemu_fp_leave(cpu);
+
     switch (cpu->regs[VEMU_A7]) {
         case VEMU_ECALL_PRINT_INT:
-            printf(">> %d\n", cpu->regs[VEMU_A0]);
+            fprintf(cpu->out, ">> %d\n", cpu->regs[VEMU_A0]);
             break;
 
         case VEMU_ECALL_PRINT_CHAR:
-            printf("%c", cpu->regs[VEMU_A0]);
+            fprintf(cpu->out, "%c", cpu->regs[VEMU_A0]);
             break;
 
         case VEMU_ECALL_START_TRACE:
-            cpu->trace = 0;
+            cpu->trace_start = cpu->instret;
             break;
 
         case VEMU_ECALL_TRACE_RESULT:
-            res = cpu->trace;
+            res = cpu->instret - cpu->trace_start;
             break;
 
         case VEMU_ECALL_TEST_ASSERT: {
             uint32_t x = cpu->regs[VEMU_A1], y = cpu->regs[VEMU_A2];
             if (x != y) {
-                fprintf(stderr, "line %d: assertion failed: %d != %d\n", 
+                fprintf(cpu->err, "line %d: assertion failed: %d != %d\n", 
                         cpu->regs[VEMU_A0], x, y);
             }
             break;
         }
 
+        case VEMU_ECALL_CHECKPOINT:
+            if (cpu->checkpoint != NULL
+                    && !cpu->checkpoint(cpu->checkpoint_arg, &res)) {
+                vemu_cpu_stop(cpu);
+            }
+            res = vemu_cpu_input(cpu, VEMU_ECALL_CHECKPOINT, res);
+            break;
+
+        case VEMU_ECALL_TIME: {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            uint32_t us = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+            res = vemu_cpu_input(cpu, VEMU_ECALL_TIME, us);
+            break;
+        }
+
         default:
-            fprintf(stderr, "unsupported ecall: %d\n", 
+            fprintf(cpu->err, "unsupported ecall: %d\n", 
                     cpu->regs[VEMU_A7]);
-            cpu->terminated = true;
+            vemu_cpu_stop(cpu);
             break;
     }
 
     cpu->regs[VEMU_A0] = res;
+    vemu_fp_enter(cpu);
 }
 
 EXEC_FUNC(EBREAK) {
     (void)cpu, (void)dec;
 }
 
-#define DISPATCH(op) case VEMU_OPCODE_##op: vemu_exec_##op(cpu, &dec); break;
+uint32_t vemu_cpu_read_csr(vemu_cpu_t *cpu, uint32_t csr) {
+    switch (csr) {
+        case VEMU_CSR_MHARTID:
+            return cpu->hartid;
 
-static void vemu_fetch_and_decode(vemu_cpu_t *cpu, vemu_decoded_t *dec) {
-    uint32_t instr = vemu_ram_load_half(*cpu->ram, cpu->ip);
-    
-    if (VEMU_IS_COMPRESSED(instr)) {
-        vemu_decode_compressed(instr, dec);
+        case VEMU_CSR_SATP:
+            return cpu->mmu.satp;
 
-        cpu->next_ip = cpu->ip + 2;
-    } else {
-        instr = instr | (vemu_ram_load_half(*cpu->ram, cpu->ip + 2) << 16);
-        vemu_decode_regular(instr, dec);
+        case VEMU_CSR_FFLAGS:
+        case VEMU_CSR_FRM:
+        case VEMU_CSR_FCSR:
+            return vemu_fp_read_csr(cpu, csr);
 
-        cpu->next_ip = cpu->ip + 4;
-    }
+        case VEMU_CSR_VSTART:
+        case VEMU_CSR_VL:
+        case VEMU_CSR_VTYPE:
+        case VEMU_CSR_VLENB:
+            return vemu_vec_read_csr(cpu, csr);
 
-    if (0) {
-        vemu_disassemble(dec, instr, cpu->ip);
+        default:
+            return 0;
     }
 }
 
-void vemu_cpu_run(vemu_cpu_t *cpu, uint32_t entry) {
-    cpu->ip = entry;
-    cpu->regs[2] = 0x20000;
+uint32_t vemu_cpu_write_csr(vemu_cpu_t *cpu, uint32_t csr_op, uint32_t value) {
+    uint32_t csr = csr_op & 0xFFF;
+    uint32_t old = vemu_cpu_read_csr(cpu, csr);
 
-    while (!cpu->terminated) {
-        cpu->regs[VEMU_ZERO] = 0;
+    switch ((csr_op >> 12) & 0x3) {
+        case VEMU_FUNCT_CSRRS:
+            value = old | value;
+            break;
 
-        vemu_decoded_t dec = { 0, };
-        vemu_fetch_and_decode(cpu, &dec);
-
-        switch (dec.opcode) {
-            DISPATCH(ILLEGAL)
-            DISPATCH(NOP)
-            DISPATCH(LUI);
-            DISPATCH(AUIPC);
-            DISPATCH(JAL)
-            DISPATCH(JALR)
-            DISPATCH(BEQ)
-            DISPATCH(BNE)
-            DISPATCH(BLT)
-            DISPATCH(BGE)
-            DISPATCH(BLTU)
-            DISPATCH(BGEU)
-            DISPATCH(LB)
-            DISPATCH(LH)
-            DISPATCH(LW)
-            DISPATCH(LBU)
-            DISPATCH(LHU)
-            DISPATCH(SB)
-            DISPATCH(SH)
-            DISPATCH(SW)
-            DISPATCH(ADDI)
-            DISPATCH(SLTI)
-            DISPATCH(SLTIU)
-            DISPATCH(XORI)
-            DISPATCH(ORI)
-            DISPATCH(ANDI)
-            DISPATCH(SRLI)
-            DISPATCH(SLLI)
-            DISPATCH(SRAI)
-            DISPATCH(ADD)
-            DISPATCH(SUB)
-            DISPATCH(SLL)
-            DISPATCH(SLT)
-            DISPATCH(SLTU)
-            DISPATCH(XOR)
-            DISPATCH(SRL)
-            DISPATCH(SRA)
-            DISPATCH(OR)
-            DISPATCH(AND)
-            DISPATCH(FENCE)
-            DISPATCH(FENCE_TSO)
-            DISPATCH(PAUSE)
-            DISPATCH(ECALL)
-            DISPATCH(EBREAK)
-        }
+        case VEMU_FUNCT_CSRRC:
+            value = old & ~value;
+            break;
 
-        cpu->ip = cpu->next_ip;
-        cpu->trace++;
+        default:
+            break;
+    }
+
+    if (vemu_fp_is_csr(csr)) {
+        vemu_fp_write_csr(cpu, csr, value);
+    } else if (vemu_vec_is_csr(csr)) {
+        vemu_vec_write_csr(cpu, csr, value);
+    } else if (csr == VEMU_CSR_SATP) {
+        vemu_mmu_set_satp(&cpu->mmu, value);
+    }
+
+    return old;
+}
+
+static inline uint32_t vemu_amo_min(uint32_t *word, uint32_t value, 
+                                    bool is_signed, bool is_max) {
+    uint32_t old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        bool less = is_signed ? (int32_t)value < (int32_t)old 
+                              : value < old;
+        if (less == is_max) {
+            return old;
+        }
+        if (__atomic_compare_exchange_n(word, &old, value, false, 
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return old;
+        }
+    }
+}
+
+/* Translation faults stop the hart like faults on guest memory do */
+static void vemu_cpu_fault(vemu_cpu_t *cpu, char const *kind, 
+                           uint32_t addr) __attribute__((noreturn));
+
+uint32_t vemu_cpu_translate(vemu_cpu_t *cpu, uint32_t addr, uint32_t len,
+                            vemu_mmu_access_t access) {
+    char const *kind = access == VEMU_MMU_STORE ? "store page fault"
+                                                : "load page fault";
+    uint32_t paddr;
+    if (!vemu_mmu_translate(&cpu->mmu, *cpu->ram, cpu->bus, addr, access,
+                            &paddr)) {
+        vemu_cpu_fault(cpu, kind, addr);
+    }
+
+    uint32_t last = addr + len - 1, plast;
+    if ((last ^ addr) & VEMU_MMU_PAGE_MASK) {
+        if (!vemu_mmu_translate(&cpu->mmu, *cpu->ram, cpu->bus, last, access,
+                                &plast)) {
+            vemu_cpu_fault(cpu, kind, last);
+        }
+        if (plast != paddr + len - 1) {
+            vemu_cpu_fault(cpu, "misaligned access fault", addr);
+        }
+    }
+
+    return paddr;
+}
+
+/* Devices are host code of their own, which gets the host's floating
+   point environment like ecall handlers do */
+__attribute__((noinline))
+uint32_t vemu_cpu_load(vemu_cpu_t *cpu, uint32_t addr, vemu_opcode_t opcode) {
+    uint32_t len = opcode == VEMU_OPCODE_LB || opcode == VEMU_OPCODE_LBU ? 1
+                 : opcode == VEMU_OPCODE_LH || opcode == VEMU_OPCODE_LHU ? 2
+                 : 4;
+    uint32_t value;
+
+    if (vemu_mmu_on(&cpu->mmu)) {
+        addr = vemu_cpu_translate(cpu, addr, len, VEMU_MMU_LOAD);
+    }
+
+    if (vemu_bus_is_device(cpu->bus, addr)) {
+        vemu_fp_leave(cpu);
+        value = vemu_bus_load(cpu->bus, addr, len);
+        vemu_fp_enter(cpu);
+    } else {
+        value = len == 1 ? vemu_ram_load_byte(*cpu->ram, addr)
+              : len == 2 ? vemu_ram_load_half(*cpu->ram, addr)
+              : vemu_ram_load_word(*cpu->ram, addr);
+    }
+
+    switch (opcode) {
+        case VEMU_OPCODE_LB:
+            return vemu_sext(value & 0xFF, 8);
+
+        case VEMU_OPCODE_LH:
+            return vemu_sext(value & 0xFFFF, 16);
+
+        default:
+            return len == 4 ? value : value & ((1u << 8 * len) - 1);
+    }
+}
+
+/* Stores into decoded code are looked up by their virtual address, the
+   one code was fetched from */
+__attribute__((noinline))
+void vemu_cpu_store(vemu_cpu_t *cpu, uint32_t addr, uint32_t len,
+                    uint32_t value) {
+    uint32_t paddr = vemu_mmu_on(&cpu->mmu)
+                   ? vemu_cpu_translate(cpu, addr, len, VEMU_MMU_STORE)
+                   : addr;
+
+    if (vemu_bus_is_device(cpu->bus, paddr)) {
+        vemu_fp_leave(cpu);
+        vemu_bus_store(cpu->bus, paddr, len,
+                       len == 4 ? value : value & ((1u << 8 * len) - 1));
+        vemu_fp_enter(cpu);
+        return;
+    }
+
+    switch (len) {
+        case 1:
+            vemu_ram_store_byte(*cpu->ram, paddr, value);
+            break;
+
+        case 2:
+            vemu_ram_store_half(*cpu->ram, paddr, value);
+            break;
+
+        default:
+            vemu_ram_store_word(*cpu->ram, paddr, value);
+            break;
+    }
+    vemu_check_store(cpu, addr, len);
+}
+
+/* Guest atomics map onto host atomics on the word in guest memory, which
+   makes them atomic with respect to every hart whatever mode it runs in.
+   sc.w succeeds if the word still holds what lr.w read, the usual way of
+   emulating reservations on a host without them. Kept out of line: 
+   inlined into every handler it costs the interpreter loop registers. 
+   A misaligned word faults, as RISC-V has it; as a host atomic it would
+   be undefined, and a split lock on x86. */
+__attribute__((noinline))
+uint32_t vemu_cpu_amo(vemu_cpu_t *cpu, vemu_opcode_t opcode, uint32_t addr,
+                      uint32_t value) {
+    if (addr & 3) {
+        vemu_cpu_fault(cpu, "misaligned access fault", addr);
+    }
+
+    vemu_mmu_access_t access = opcode == VEMU_OPCODE_LR_W ? VEMU_MMU_LOAD
+                                                          : VEMU_MMU_STORE;
+    uint32_t *word = (uint32_t *)(*cpu->ram 
+                                  + vemu_cpu_data_addr(cpu, addr, 4, access));
+    uint32_t old;
+
+    switch (opcode) {
+        case VEMU_OPCODE_LR_W:
+            old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            cpu->reserved = true;
+            cpu->reservation = addr;
+            cpu->reserved_value = old;
+            return old;
+
+        case VEMU_OPCODE_SC_W:
+            if (!cpu->reserved || cpu->reservation != addr) {
+                cpu->reserved = false;
+                return 1;
+            }
+            cpu->reserved = false;
+            old = cpu->reserved_value;
+            if (!__atomic_compare_exchange_n(word, &old, value, false, 
+                                             __ATOMIC_SEQ_CST, 
+                                             __ATOMIC_SEQ_CST)) {
+                return 1;
+            }
+            vemu_check_store(cpu, addr, 4);
+            return 0;
+
+        case VEMU_OPCODE_AMOSWAP_W:
+            old = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+            break;
+
+        case VEMU_OPCODE_AMOADD_W:
+            old = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+            break;
+
+        case VEMU_OPCODE_AMOXOR_W:
+            old = __atomic_fetch_xor(word, value, __ATOMIC_SEQ_CST);
+            break;
+
+        case VEMU_OPCODE_AMOAND_W:
+            old = __atomic_fetch_and(word, value, __ATOMIC_SEQ_CST);
+            break;
+
+        case VEMU_OPCODE_AMOOR_W:
+            old = __atomic_fetch_or(word, value, __ATOMIC_SEQ_CST);
+            break;
+
+        case VEMU_OPCODE_AMOMIN_W:
+            old = vemu_amo_min(word, value, true, false);
+            break;
+
+        case VEMU_OPCODE_AMOMAX_W:
+            old = vemu_amo_min(word, value, true, true);
+            break;
+
+        case VEMU_OPCODE_AMOMINU_W:
+            old = vemu_amo_min(word, value, false, false);
+            break;
+
+        case VEMU_OPCODE_AMOMAXU_W:
+            old = vemu_amo_min(word, value, false, true);
+            break;
+
+        default:
+            VEMU_UNREACHED();
+    }
+
+    vemu_check_store(cpu, addr, 4);
+    return old;
+}
+
+EXEC_FUNC(CSRR) {
+    cpu->regs[dec->rd] = vemu_cpu_read_csr(cpu, dec->imm);
+}
+
+EXEC_FUNC(CSRRW) {
+    uint32_t old = vemu_cpu_write_csr(cpu, dec->imm,
+                                      cpu->regs[dec->rs1] | dec->imm2);
+    if (dec->rd != VEMU_ZERO) {
+        cpu->regs[dec->rd] = old;
+    }
+}
+
+/* Code was decoded from where its virtual addresses used to point, so
+   it goes along with the translations. Both end their block. */
+EXEC_FUNC(SFENCE_VMA) {
+    (void)dec;
+    vemu_mmu_flush(&cpu->mmu);
+    vemu_cpu_flush_code(cpu);
+}
+
+EXEC_FUNC(CSRRW_SATP) {
+    vemu_exec_CSRRW(cpu, dec);
+    vemu_cpu_flush_code(cpu);
+}
+
+/* Atomics have side effects even when their result is discarded, and
+   block bodies do not reset the zero register, so rd is only written 
+   when it is a real register. */
+#define EXEC_AMO(op)                                                        \
+    EXEC_FUNC(op) {                                                         \
+        uint32_t value = vemu_cpu_amo(cpu, VEMU_OPCODE_##op,                \
+                                      cpu->regs[dec->rs1],                  \
+                                      cpu->regs[dec->rs2]);                 \
+        if (dec->rd != VEMU_ZERO) {                                         \
+            cpu->regs[dec->rd] = value;                                     \
+        }                                                                   \
+    }
+
+EXEC_AMO(LR_W)
+EXEC_AMO(SC_W)
+EXEC_AMO(AMOSWAP_W)
+EXEC_AMO(AMOADD_W)
+EXEC_AMO(AMOXOR_W)
+EXEC_AMO(AMOAND_W)
+EXEC_AMO(AMOOR_W)
+EXEC_AMO(AMOMIN_W)
+EXEC_AMO(AMOMAX_W)
+EXEC_AMO(AMOMINU_W)
+EXEC_AMO(AMOMAXU_W)
+
+EXEC_FUNC(MUL) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] * cpu->regs[dec->rs2];
+}
+
+EXEC_FUNC(MULH) {
+    cpu->regs[dec->rd] = vemu_mulh(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(MULHSU) {
+    cpu->regs[dec->rd] = vemu_mulhsu(cpu->regs[dec->rs1],
+                                     cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(MULHU) {
+    cpu->regs[dec->rd] = vemu_mulhu(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(DIV) {
+    cpu->regs[dec->rd] = vemu_div(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(DIVU) {
+    cpu->regs[dec->rd] = vemu_divu(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(REM) {
+    cpu->regs[dec->rd] = vemu_rem(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(REMU) {
+    cpu->regs[dec->rd] = vemu_remu(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(SH1ADD) {
+    cpu->regs[dec->rd] = (cpu->regs[dec->rs1] << 1) + cpu->regs[dec->rs2];
+}
+
+EXEC_FUNC(SH2ADD) {
+    cpu->regs[dec->rd] = (cpu->regs[dec->rs1] << 2) + cpu->regs[dec->rs2];
+}
+
+EXEC_FUNC(SH3ADD) {
+    cpu->regs[dec->rd] = (cpu->regs[dec->rs1] << 3) + cpu->regs[dec->rs2];
+}
+
+EXEC_FUNC(ANDN) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] & ~cpu->regs[dec->rs2];
+}
+
+EXEC_FUNC(ORN) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] | ~cpu->regs[dec->rs2];
+}
+
+EXEC_FUNC(XNOR) {
+    cpu->regs[dec->rd] = ~(cpu->regs[dec->rs1] ^ cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(CLZ) {
+    cpu->regs[dec->rd] = vemu_clz(cpu->regs[dec->rs1]);
+}
+
+EXEC_FUNC(CTZ) {
+    cpu->regs[dec->rd] = vemu_ctz(cpu->regs[dec->rs1]);
+}
+
+EXEC_FUNC(CPOP) {
+    cpu->regs[dec->rd] = vemu_cpop(cpu->regs[dec->rs1]);
+}
+
+EXEC_FUNC(MAX) {
+    cpu->regs[dec->rd] = vemu_max(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(MAXU) {
+    cpu->regs[dec->rd] = vemu_maxu(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(MIN) {
+    cpu->regs[dec->rd] = vemu_min(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(MINU) {
+    cpu->regs[dec->rd] = vemu_minu(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(SEXT_B) {
+    cpu->regs[dec->rd] = (int8_t)cpu->regs[dec->rs1];
+}
+
+EXEC_FUNC(SEXT_H) {
+    cpu->regs[dec->rd] = (int16_t)cpu->regs[dec->rs1];
+}
+
+EXEC_FUNC(ZEXT_H) {
+    cpu->regs[dec->rd] = (uint16_t)cpu->regs[dec->rs1];
+}
+
+EXEC_FUNC(ROL) {
+    cpu->regs[dec->rd] = vemu_rol(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(ROR) {
+    cpu->regs[dec->rd] = vemu_ror(cpu->regs[dec->rs1], cpu->regs[dec->rs2]);
+}
+
+EXEC_FUNC(RORI) {
+    cpu->regs[dec->rd] = vemu_ror(cpu->regs[dec->rs1], dec->imm);
+}
+
+EXEC_FUNC(ORC_B) {
+    cpu->regs[dec->rd] = vemu_orc_b(cpu->regs[dec->rs1]);
+}
+
+EXEC_FUNC(REV8) {
+    cpu->regs[dec->rd] = vemu_rev8(cpu->regs[dec->rs1]);
+}
+
+EXEC_FUNC(BCLR) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1]
+                       & ~(1u << (cpu->regs[dec->rs2] & 0x1F));
+}
+
+EXEC_FUNC(BCLRI) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] & ~(1u << dec->imm);
+}
+
+EXEC_FUNC(BEXT) {
+    cpu->regs[dec->rd] = (cpu->regs[dec->rs1]
+                          >> (cpu->regs[dec->rs2] & 0x1F)) & 1;
+}
+
+EXEC_FUNC(BEXTI) {
+    cpu->regs[dec->rd] = (cpu->regs[dec->rs1] >> dec->imm) & 1;
+}
+
+EXEC_FUNC(BINV) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1]
+                       ^ (1u << (cpu->regs[dec->rs2] & 0x1F));
+}
+
+EXEC_FUNC(BINVI) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] ^ (1u << dec->imm);
+}
+
+EXEC_FUNC(BSET) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1]
+                       | (1u << (cpu->regs[dec->rs2] & 0x1F));
+}
+
+EXEC_FUNC(BSETI) {
+    cpu->regs[dec->rd] = cpu->regs[dec->rs1] | (1u << dec->imm);
+}
+
+/* Like atomics, FP ops matter for what they do to the FP registers and
+   flags, so rd is only written when it is a real register */
+EXEC_FUNC(FP) {
+    uint32_t value = vemu_fp_exec(cpu, dec->imm2,
+                                  cpu->regs[dec->rs1] + dec->imm);
+    if (dec->rd != VEMU_ZERO) {
+        cpu->regs[dec->rd] = value;
+    }
+}
+
+EXEC_FUNC(VEC) {
+    uint32_t value = vemu_vec_exec(cpu, dec->imm2,
+                                   cpu->regs[dec->rs1] + dec->imm,
+                                   cpu->regs[dec->rs2]);
+    if (dec->rd != VEMU_ZERO) {
+        cpu->regs[dec->rd] = value;
+    }
+}
+
+/* The fused handlers see ip-relative values already resolved by 
+   vemu_fuse(), and write the first half's rd before the second half's 
+   so that rd == rd2 ends up with the second result. */
+
+EXEC_FUNC(LUI_ADDI) {
+    cpu->regs[dec->rd] = dec->imm;
+}
+
+EXEC_FUNC(AUIPC_LW) {
+    uint32_t addr = dec->imm + dec->imm2;
+    cpu->regs[dec->rd] = dec->imm;
+    cpu->regs[dec->rd2] = vemu_cpu_slow_access(cpu, addr)
+                        ? vemu_cpu_load(cpu, addr, VEMU_OPCODE_LW)
+                        : vemu_ram_load_word(*cpu->ram, addr);
+}
+
+EXEC_FUNC(AUIPC_JALR) {
+    cpu->regs[dec->rd] = dec->imm;
+    cpu->regs[dec->rd2] = cpu->next_ip;
+    cpu->next_ip = dec->imm2;
+}
+
+EXEC_FUNC(SLT_BNEZ) {
+    int32_t x = cpu->regs[dec->rs1], y = cpu->regs[dec->rs2];
+    cpu->regs[dec->rd] = x < y;
+    if (x < y) {
+        cpu->next_ip = cpu->ip + dec->imm;
+    }
+}
+
+EXEC_FUNC(SLT_BEQZ) {
+    int32_t x = cpu->regs[dec->rs1], y = cpu->regs[dec->rs2];
+    cpu->regs[dec->rd] = x < y;
+    if (!(x < y)) {
+        cpu->next_ip = cpu->ip + dec->imm;
+    }
+}
+
+EXEC_FUNC(SLTU_BNEZ) {
+    uint32_t x = cpu->regs[dec->rs1], y = cpu->regs[dec->rs2];
+    cpu->regs[dec->rd] = x < y;
+    if (x < y) {
+        cpu->next_ip = cpu->ip + dec->imm;
+    }
+}
+
+EXEC_FUNC(SLTU_BEQZ) {
+    uint32_t x = cpu->regs[dec->rs1], y = cpu->regs[dec->rs2];
+    cpu->regs[dec->rd] = x < y;
+    if (!(x < y)) {
+        cpu->next_ip = cpu->ip + dec->imm;
+    }
+}
+
+#define DISPATCH(op) case VEMU_OPCODE_##op: vemu_exec_##op(cpu, dec); break;
+
+static inline void vemu_execute(vemu_cpu_t *cpu, vemu_decoded_t *dec) {
+    switch (dec->opcode) {
+        DISPATCH(ILLEGAL)
+        DISPATCH(NOP)
+        DISPATCH(LUI);
+        DISPATCH(AUIPC);
+        DISPATCH(JAL)
+        DISPATCH(JALR)
+        DISPATCH(BEQ)
+        DISPATCH(BNE)
+        DISPATCH(BLT)
+        DISPATCH(BGE)
+        DISPATCH(BLTU)
+        DISPATCH(BGEU)
+        DISPATCH(LB)
+        DISPATCH(LH)
+        DISPATCH(LW)
+        DISPATCH(LBU)
+        DISPATCH(LHU)
+        DISPATCH(SB)
+        DISPATCH(SH)
+        DISPATCH(SW)
+        DISPATCH(ADDI)
+        DISPATCH(SLTI)
+        DISPATCH(SLTIU)
+        DISPATCH(XORI)
+        DISPATCH(ORI)
+        DISPATCH(ANDI)
+        DISPATCH(SRLI)
+        DISPATCH(SLLI)
+        DISPATCH(SRAI)
+        DISPATCH(ADD)
+        DISPATCH(SUB)
+        DISPATCH(SLL)
+        DISPATCH(SLT)
+        DISPATCH(SLTU)
+        DISPATCH(XOR)
+        DISPATCH(SRL)
+        DISPATCH(SRA)
+        DISPATCH(OR)
+        DISPATCH(AND)
+        DISPATCH(FENCE)
+        DISPATCH(FENCE_TSO)
+        DISPATCH(FENCE_I)
+        DISPATCH(PAUSE)
+        DISPATCH(ECALL)
+        DISPATCH(EBREAK)
+        DISPATCH(SFENCE_VMA)
+        DISPATCH(CSRR)
+        DISPATCH(CSRRW)
+        DISPATCH(CSRRW_SATP)
+        DISPATCH(LR_W)
+        DISPATCH(SC_W)
+        DISPATCH(AMOSWAP_W)
+        DISPATCH(AMOADD_W)
+        DISPATCH(AMOXOR_W)
+        DISPATCH(AMOAND_W)
+        DISPATCH(AMOOR_W)
+        DISPATCH(AMOMIN_W)
+        DISPATCH(AMOMAX_W)
+        DISPATCH(AMOMINU_W)
+        DISPATCH(AMOMAXU_W)
+        DISPATCH(MUL)
+        DISPATCH(MULH)
+        DISPATCH(MULHSU)
+        DISPATCH(MULHU)
+        DISPATCH(DIV)
+        DISPATCH(DIVU)
+        DISPATCH(REM)
+        DISPATCH(REMU)
+        DISPATCH(SH1ADD)
+        DISPATCH(SH2ADD)
+        DISPATCH(SH3ADD)
+        DISPATCH(ANDN)
+        DISPATCH(ORN)
+        DISPATCH(XNOR)
+        DISPATCH(CLZ)
+        DISPATCH(CTZ)
+        DISPATCH(CPOP)
+        DISPATCH(MAX)
+        DISPATCH(MAXU)
+        DISPATCH(MIN)
+        DISPATCH(MINU)
+        DISPATCH(SEXT_B)
+        DISPATCH(SEXT_H)
+        DISPATCH(ZEXT_H)
+        DISPATCH(ROL)
+        DISPATCH(ROR)
+        DISPATCH(RORI)
+        DISPATCH(ORC_B)
+        DISPATCH(REV8)
+        DISPATCH(BCLR)
+        DISPATCH(BCLRI)
+        DISPATCH(BEXT)
+        DISPATCH(BEXTI)
+        DISPATCH(BINV)
+        DISPATCH(BINVI)
+        DISPATCH(BSET)
+        DISPATCH(BSETI)
+        DISPATCH(FP)
+        DISPATCH(VEC)
+        DISPATCH(LUI_ADDI)
+        DISPATCH(AUIPC_LW)
+        DISPATCH(AUIPC_JALR)
+        DISPATCH(SLT_BNEZ)
+        DISPATCH(SLT_BEQZ)
+        DISPATCH(SLTU_BNEZ)
+        DISPATCH(SLTU_BEQZ)
+    }
+}
+
+static inline uint8_t vemu_fetch_and_decode_one(vemu_cpu_t *cpu, uint32_t ip, 
+                                                vemu_decoded_t *dec) {
+    dec->n_instrs = 1;
+
+    uint32_t instr;
+    if (vemu_cpu_fetch(cpu, ip, &instr) != NULL) {
+        dec->opcode = VEMU_OPCODE_ILLEGAL;
+        return 2;
+    }
+
+    uint8_t len;
+    if (VEMU_IS_COMPRESSED(instr)) {
+        vemu_decode_compressed(instr, dec);
+        len = 2;
+    } else {
+        vemu_decode_regular(instr, dec);
+        len = 4;
+    }
+
+    if (0) {
+        vemu_disassemble(dec, instr, ip);
+    }
+
+    return len;
+}
+
+/* slt/sltu rd followed by beqz/bnez rd, written either way around. The 
+   branch offset is rebased onto the ip of the pair. */
+static bool vemu_fuse_set_branch(vemu_decoded_t *dec, vemu_decoded_t *next,
+                                 uint8_t len) {
+    bool tests_rd = (next->rs1 == dec->rd && next->rs2 == VEMU_ZERO)
+                 || (next->rs1 == VEMU_ZERO && next->rs2 == dec->rd);
+    if (!tests_rd) {
+        return false;
+    }
+
+    bool u = dec->opcode == VEMU_OPCODE_SLTU;
+    switch (next->opcode) {
+        case VEMU_OPCODE_BNE:
+            dec->opcode = u ? VEMU_OPCODE_SLTU_BNEZ : VEMU_OPCODE_SLT_BNEZ;
+            break;
+
+        case VEMU_OPCODE_BEQ:
+            dec->opcode = u ? VEMU_OPCODE_SLTU_BEQZ : VEMU_OPCODE_SLT_BEQZ;
+            break;
+
+        default:
+            return false;
+    }
+
+    dec->imm = next->imm + len;
+    return true;
+}
+
+/* Merges dec (decoded at ip, len bytes long) with the instruction after 
+   it when the two form one of the idioms below. Only pairs whose second
+   half consumes the first half's rd are fused. Values that depend on ip 
+   are resolved here, which is safe because an op is only ever executed 
+   at the address it was decoded at. */
+static bool vemu_fuse(vemu_decoded_t *dec, vemu_decoded_t *next, uint32_t ip,
+                      uint8_t len) {
+    switch (dec->opcode) {
+        case VEMU_OPCODE_LUI:
+            /* li / la with a non-zero low part */
+            if (next->opcode == VEMU_OPCODE_ADDI && next->rd == dec->rd 
+                    && next->rs1 == dec->rd) {
+                dec->opcode = VEMU_OPCODE_LUI_ADDI;
+                dec->imm += next->imm;
+                return true;
+            }
+            return false;
+
+        case VEMU_OPCODE_AUIPC:
+            if (next->rs1 != dec->rd) {
+                return false;
+            }
+
+            /* Pc-relative load of a global */
+            if (next->opcode == VEMU_OPCODE_LW && next->rd != VEMU_ZERO
+                    && dec->rd != VEMU_ZERO) {
+                dec->opcode = VEMU_OPCODE_AUIPC_LW;
+                dec->imm += ip;
+                dec->rd2 = next->rd;
+                dec->imm2 = next->imm;
+                return true;
+            }
+
+            /* call / tail, which now have a static target */
+            if (next->opcode == VEMU_OPCODE_JALR) {
+                dec->opcode = VEMU_OPCODE_AUIPC_JALR;
+                dec->imm += ip;
+                dec->rd2 = next->rd;
+                dec->imm2 = (dec->imm + next->imm) & 0xFFFFFFFE;
+                return true;
+            }
+            return false;
+
+        case VEMU_OPCODE_SLT:
+        case VEMU_OPCODE_SLTU:
+            return vemu_fuse_set_branch(dec, next, len);
+
+        default:
+            return false;
+    }
+}
+
+static inline uint8_t vemu_fetch_and_decode(vemu_cpu_t *cpu, uint32_t ip, 
+                                            vemu_decoded_t *dec) {
+    uint8_t len = vemu_fetch_and_decode_one(cpu, ip, dec);
+
+    if (!cpu->fusion || dec->rd == VEMU_ZERO) {
+        return len;
+    }
+
+    switch (dec->opcode) {
+        case VEMU_OPCODE_LUI:
+        case VEMU_OPCODE_AUIPC:
+        case VEMU_OPCODE_SLT:
+        case VEMU_OPCODE_SLTU: {
+            vemu_decoded_t next = { 0, };
+            uint8_t next_len = vemu_fetch_and_decode_one(cpu, ip + len, &next);
+
+            if (vemu_fuse(dec, &next, ip, len)) {
+                dec->n_instrs = 2;
+                return len + next_len;
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return len;
+}
+
+static inline vemu_decoded_t *vemu_fetch_cached(vemu_cpu_t *cpu) {
+    vemu_decode_cache_entry_t *entry = vemu_decode_cache_slot(&cpu->dcache, 
+                                                              cpu->ip);
+
+    if (entry->ip != cpu->ip) {
+        entry->dec = (vemu_decoded_t){ 0, };
+        entry->len = vemu_fetch_and_decode(cpu, cpu->ip, &entry->dec);
+        entry->ip = vemu_smc_mark(&cpu->smc, cpu->ip, cpu->ip + entry->len)
+                  ? cpu->ip
+                  : VEMU_DECODE_CACHE_EMPTY;
+        cpu->dcache.misses++;
+    }
+
+    cpu->next_ip = cpu->ip + entry->len;
+    return &entry->dec;
+}
+
+#ifdef VEMU_THREADED_DISPATCH
+
+/* Labels-as-values are a GNU extension, hence the pragma. Every handler
+   ends in its own copy of the fetch and indirect jump, so the host 
+   predictor sees one jump site per opcode instead of one shared switch. 
+   Only ILLEGAL and ECALL can terminate the cpu, so the other handlers 
+   skip that check entirely. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+#define THREADED_LABEL(op) [VEMU_OPCODE_##op] = &&exec_##op
+
+#define THREADED_NEXT()                                                     \
+    do {                                                                    \
+        cpu->ip = cpu->next_ip;                                             \
+        cpu->instret += dec->n_instrs;                                      \
+        cpu->regs[VEMU_ZERO] = 0;                                           \
+        dec = vemu_fetch_cached(cpu);                                       \
+        goto *handlers[dec->opcode];                                        \
+    } while (0)
+
+#define THREADED_OP(op)                                                     \
+    exec_##op:                                                              \
+        vemu_exec_##op(cpu, dec);                                           \
+        THREADED_NEXT();
+
+#define THREADED_OP_CHECKED(op)                                             \
+    exec_##op:                                                              \
+        vemu_exec_##op(cpu, dec);                                           \
+        if (cpu->terminated) {                                              \
+            goto terminated;                                                \
+        }                                                                   \
+        THREADED_NEXT();
+
+static void vemu_cpu_run_cached(vemu_cpu_t *cpu) {
+    static void *const handlers[VEMU_MAX_OPCODES] = {
+        THREADED_LABEL(ILLEGAL),
+        THREADED_LABEL(NOP),
+        THREADED_LABEL(LUI),
+        THREADED_LABEL(AUIPC),
+        THREADED_LABEL(JAL),
+        THREADED_LABEL(JALR),
+        THREADED_LABEL(BEQ),
+        THREADED_LABEL(BNE),
+        THREADED_LABEL(BLT),
+        THREADED_LABEL(BGE),
+        THREADED_LABEL(BLTU),
+        THREADED_LABEL(BGEU),
+        THREADED_LABEL(LB),
+        THREADED_LABEL(LH),
+        THREADED_LABEL(LW),
+        THREADED_LABEL(LBU),
+        THREADED_LABEL(LHU),
+        THREADED_LABEL(SB),
+        THREADED_LABEL(SH),
+        THREADED_LABEL(SW),
+        THREADED_LABEL(ADDI),
+        THREADED_LABEL(SLTI),
+        THREADED_LABEL(SLTIU),
+        THREADED_LABEL(XORI),
+        THREADED_LABEL(ORI),
+        THREADED_LABEL(ANDI),
+        THREADED_LABEL(SRLI),
+        THREADED_LABEL(SLLI),
+        THREADED_LABEL(SRAI),
+        THREADED_LABEL(ADD),
+        THREADED_LABEL(SUB),
+        THREADED_LABEL(SLL),
+        THREADED_LABEL(SLT),
+        THREADED_LABEL(SLTU),
+        THREADED_LABEL(XOR),
+        THREADED_LABEL(SRL),
+        THREADED_LABEL(SRA),
+        THREADED_LABEL(OR),
+        THREADED_LABEL(AND),
+        THREADED_LABEL(FENCE),
+        THREADED_LABEL(FENCE_TSO),
+        THREADED_LABEL(FENCE_I),
+        THREADED_LABEL(PAUSE),
+        THREADED_LABEL(ECALL),
+        THREADED_LABEL(EBREAK),
+        THREADED_LABEL(SFENCE_VMA),
+        THREADED_LABEL(CSRR),
+        THREADED_LABEL(CSRRW),
+        THREADED_LABEL(CSRRW_SATP),
+        THREADED_LABEL(LR_W),
+        THREADED_LABEL(SC_W),
+        THREADED_LABEL(AMOSWAP_W),
+        THREADED_LABEL(AMOADD_W),
+        THREADED_LABEL(AMOXOR_W),
+        THREADED_LABEL(AMOAND_W),
+        THREADED_LABEL(AMOOR_W),
+        THREADED_LABEL(AMOMIN_W),
+        THREADED_LABEL(AMOMAX_W),
+        THREADED_LABEL(AMOMINU_W),
+        THREADED_LABEL(AMOMAXU_W),
+        THREADED_LABEL(MUL),
+        THREADED_LABEL(MULH),
+        THREADED_LABEL(MULHSU),
+        THREADED_LABEL(MULHU),
+        THREADED_LABEL(DIV),
+        THREADED_LABEL(DIVU),
+        THREADED_LABEL(REM),
+        THREADED_LABEL(REMU),
+        THREADED_LABEL(SH1ADD),
+        THREADED_LABEL(SH2ADD),
+        THREADED_LABEL(SH3ADD),
+        THREADED_LABEL(ANDN),
+        THREADED_LABEL(ORN),
+        THREADED_LABEL(XNOR),
+        THREADED_LABEL(CLZ),
+        THREADED_LABEL(CTZ),
+        THREADED_LABEL(CPOP),
+        THREADED_LABEL(MAX),
+        THREADED_LABEL(MAXU),
+        THREADED_LABEL(MIN),
+        THREADED_LABEL(MINU),
+        THREADED_LABEL(SEXT_B),
+        THREADED_LABEL(SEXT_H),
+        THREADED_LABEL(ZEXT_H),
+        THREADED_LABEL(ROL),
+        THREADED_LABEL(ROR),
+        THREADED_LABEL(RORI),
+        THREADED_LABEL(ORC_B),
+        THREADED_LABEL(REV8),
+        THREADED_LABEL(BCLR),
+        THREADED_LABEL(BCLRI),
+        THREADED_LABEL(BEXT),
+        THREADED_LABEL(BEXTI),
+        THREADED_LABEL(BINV),
+        THREADED_LABEL(BINVI),
+        THREADED_LABEL(BSET),
+        THREADED_LABEL(BSETI),
+        THREADED_LABEL(FP),
+        THREADED_LABEL(VEC),
+        THREADED_LABEL(LUI_ADDI),
+        THREADED_LABEL(AUIPC_LW),
+        THREADED_LABEL(AUIPC_JALR),
+        THREADED_LABEL(SLT_BNEZ),
+        THREADED_LABEL(SLT_BEQZ),
+        THREADED_LABEL(SLTU_BNEZ),
+        THREADED_LABEL(SLTU_BEQZ),
+    };
+
+    vemu_decoded_t *dec;
+
+    cpu->regs[VEMU_ZERO] = 0;
+    dec = vemu_fetch_cached(cpu);
+    goto *handlers[dec->opcode];
+
+    THREADED_OP_CHECKED(ILLEGAL)
+    THREADED_OP(NOP)
+    THREADED_OP(LUI)
+    THREADED_OP(AUIPC)
+    THREADED_OP(JAL)
+    THREADED_OP(JALR)
+    THREADED_OP(BEQ)
+    THREADED_OP(BNE)
+    THREADED_OP(BLT)
+    THREADED_OP(BGE)
+    THREADED_OP(BLTU)
+    THREADED_OP(BGEU)
+    THREADED_OP(LB)
+    THREADED_OP(LH)
+    THREADED_OP(LW)
+    THREADED_OP(LBU)
+    THREADED_OP(LHU)
+    THREADED_OP(SB)
+    THREADED_OP(SH)
+    THREADED_OP(SW)
+    THREADED_OP(ADDI)
+    THREADED_OP(SLTI)
+    THREADED_OP(SLTIU)
+    THREADED_OP(XORI)
+    THREADED_OP(ORI)
+    THREADED_OP(ANDI)
+    THREADED_OP(SRLI)
+    THREADED_OP(SLLI)
+    THREADED_OP(SRAI)
+    THREADED_OP(ADD)
+    THREADED_OP(SUB)
+    THREADED_OP(SLL)
+    THREADED_OP(SLT)
+    THREADED_OP(SLTU)
+    THREADED_OP(XOR)
+    THREADED_OP(SRL)
+    THREADED_OP(SRA)
+    THREADED_OP(OR)
+    THREADED_OP(AND)
+    THREADED_OP(FENCE)
+    THREADED_OP(FENCE_TSO)
+    THREADED_OP(FENCE_I)
+    THREADED_OP(PAUSE)
+    THREADED_OP_CHECKED(ECALL)
+    THREADED_OP(EBREAK)
+    THREADED_OP(SFENCE_VMA)
+    THREADED_OP(CSRR)
+    THREADED_OP(CSRRW)
+    THREADED_OP(CSRRW_SATP)
+    THREADED_OP(LR_W)
+    THREADED_OP(SC_W)
+    THREADED_OP(AMOSWAP_W)
+    THREADED_OP(AMOADD_W)
+    THREADED_OP(AMOXOR_W)
+    THREADED_OP(AMOAND_W)
+    THREADED_OP(AMOOR_W)
+    THREADED_OP(AMOMIN_W)
+    THREADED_OP(AMOMAX_W)
+    THREADED_OP(AMOMINU_W)
+    THREADED_OP(AMOMAXU_W)
+    THREADED_OP(MUL)
+    THREADED_OP(MULH)
+    THREADED_OP(MULHSU)
+    THREADED_OP(MULHU)
+    THREADED_OP(DIV)
+    THREADED_OP(DIVU)
+    THREADED_OP(REM)
+    THREADED_OP(REMU)
+    THREADED_OP(SH1ADD)
+    THREADED_OP(SH2ADD)
+    THREADED_OP(SH3ADD)
+    THREADED_OP(ANDN)
+    THREADED_OP(ORN)
+    THREADED_OP(XNOR)
+    THREADED_OP(CLZ)
+    THREADED_OP(CTZ)
+    THREADED_OP(CPOP)
+    THREADED_OP(MAX)
+    THREADED_OP(MAXU)
+    THREADED_OP(MIN)
+    THREADED_OP(MINU)
+    THREADED_OP(SEXT_B)
+    THREADED_OP(SEXT_H)
+    THREADED_OP(ZEXT_H)
+    THREADED_OP(ROL)
+    THREADED_OP(ROR)
+    THREADED_OP(RORI)
+    THREADED_OP(ORC_B)
+    THREADED_OP(REV8)
+    THREADED_OP(BCLR)
+    THREADED_OP(BCLRI)
+    THREADED_OP(BEXT)
+    THREADED_OP(BEXTI)
+    THREADED_OP(BINV)
+    THREADED_OP(BINVI)
+    THREADED_OP(BSET)
+    THREADED_OP(BSETI)
+    THREADED_OP(FP)
+    THREADED_OP(VEC)
+    THREADED_OP(LUI_ADDI)
+    THREADED_OP(AUIPC_LW)
+    THREADED_OP(AUIPC_JALR)
+    THREADED_OP(SLT_BNEZ)
+    THREADED_OP(SLT_BEQZ)
+    THREADED_OP(SLTU_BNEZ)
+    THREADED_OP(SLTU_BEQZ)
+
+terminated:
+    cpu->ip = cpu->next_ip;
+    cpu->instret += dec->n_instrs;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+static void vemu_cpu_run_cached(vemu_cpu_t *cpu) {
+    while (!cpu->terminated) {
+        cpu->regs[VEMU_ZERO] = 0;
+
+        vemu_decoded_t *dec = vemu_fetch_cached(cpu);
+        vemu_execute(cpu, dec);
+
+        cpu->ip = cpu->next_ip;
+        cpu->instret += dec->n_instrs;
+    }
+}
+
+#endif
+
+uint8_t vemu_cpu_decode(vemu_cpu_t *cpu, uint32_t ip, vemu_decoded_t *dec) {
+    *dec = (vemu_decoded_t){ 0, };
+    return vemu_fetch_and_decode(cpu, ip, dec);
+}
+
+void vemu_cpu_ecall(vemu_cpu_t *cpu) {
+    vemu_decoded_t dec = { .opcode = VEMU_OPCODE_ECALL };
+    vemu_exec_ECALL(cpu, &dec);
+}
+
+uint32_t vemu_cpu_interp_block(vemu_cpu_t *cpu) {
+    while (!cpu->terminated) {
+        vemu_decoded_t dec;
+        cpu->next_ip = cpu->ip + vemu_cpu_decode(cpu, cpu->ip, &dec);
+
+        vemu_execute(cpu, &dec);
+
+        cpu->regs[VEMU_ZERO] = 0;
+        cpu->ip = cpu->next_ip;
+        cpu->instret += dec.n_instrs;
+
+        if (vemu_cpu_is_terminator(dec.opcode)) {
+            break;
+        }
+    }
+
+    return cpu->ip;
+}
+
+static void vemu_cpu_run_uncached(vemu_cpu_t *cpu) {
+    while (!cpu->terminated) {
+        cpu->regs[VEMU_ZERO] = 0;
+
+        vemu_decoded_t dec = { 0, };
+        cpu->next_ip = cpu->ip + vemu_fetch_and_decode(cpu, cpu->ip, &dec);
+
+        vemu_execute(cpu, &dec);
+
+        cpu->ip = cpu->next_ip;
+        cpu->instret += dec.n_instrs;
+    }
+}
+
+bool vemu_cpu_is_terminator(vemu_opcode_t opcode) {
+    switch (opcode) {
+        case VEMU_OPCODE_ILLEGAL:
+        case VEMU_OPCODE_JAL:
+        case VEMU_OPCODE_JALR:
+        case VEMU_OPCODE_BEQ:
+        case VEMU_OPCODE_BNE:
+        case VEMU_OPCODE_BLT:
+        case VEMU_OPCODE_BGE:
+        case VEMU_OPCODE_BLTU:
+        case VEMU_OPCODE_BGEU:
+        case VEMU_OPCODE_ECALL:
+        case VEMU_OPCODE_FENCE_I:
+        case VEMU_OPCODE_SFENCE_VMA:
+        case VEMU_OPCODE_CSRRW_SATP:
+        case VEMU_OPCODE_AUIPC_JALR:
+        case VEMU_OPCODE_SLT_BNEZ:
+        case VEMU_OPCODE_SLT_BEQZ:
+        case VEMU_OPCODE_SLTU_BNEZ:
+        case VEMU_OPCODE_SLTU_BEQZ:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* Ops that only write rd (or nothing at all) can be left out of a block
+   when their result is discarded. Loads cannot: they may fault or read a
+   device. */
+static bool vemu_is_discardable(vemu_decoded_t *dec) {
+    switch (dec->opcode) {
+        case VEMU_OPCODE_NOP:
+        case VEMU_OPCODE_FENCE_TSO:
+        case VEMU_OPCODE_PAUSE:
+        case VEMU_OPCODE_EBREAK:
+            return true;
+
+        case VEMU_OPCODE_FENCE:
+        case VEMU_OPCODE_LB:
+        case VEMU_OPCODE_LH:
+        case VEMU_OPCODE_LW:
+        case VEMU_OPCODE_LBU:
+        case VEMU_OPCODE_LHU:
+        case VEMU_OPCODE_AUIPC_LW:
+        case VEMU_OPCODE_SB:
+        case VEMU_OPCODE_SH:
+        case VEMU_OPCODE_SW:
+        case VEMU_OPCODE_LR_W:
+        case VEMU_OPCODE_SC_W:
+        case VEMU_OPCODE_AMOSWAP_W:
+        case VEMU_OPCODE_AMOADD_W:
+        case VEMU_OPCODE_AMOXOR_W:
+        case VEMU_OPCODE_AMOAND_W:
+        case VEMU_OPCODE_AMOOR_W:
+        case VEMU_OPCODE_AMOMIN_W:
+        case VEMU_OPCODE_AMOMAX_W:
+        case VEMU_OPCODE_AMOMINU_W:
+        case VEMU_OPCODE_AMOMAXU_W:
+        case VEMU_OPCODE_CSRRW:
+        case VEMU_OPCODE_FP:
+        case VEMU_OPCODE_VEC:
+            return false;
+
+        default:
+            return dec->rd == VEMU_ZERO;
+    }
+}
+
+static vemu_block_t *vemu_translate_block(vemu_cpu_t *cpu, uint32_t ip) {
+    vemu_decoded_t ops[VEMU_BLOCK_MAX_INSTRS];
+    uint32_t n_ops = 0, n_instrs = 0;
+    uint32_t start = ip;
+    bool has_term = false;
+    uint32_t term_ip = 0;
+
+    while (n_instrs < VEMU_BLOCK_MAX_INSTRS) {
+        vemu_decoded_t dec = { 0, };
+        uint32_t instr_ip = ip;
+        ip += vemu_fetch_and_decode(cpu, instr_ip, &dec);
+        n_instrs += dec.n_instrs;
+
+        if (vemu_cpu_is_terminator(dec.opcode)) {
+            ops[n_ops++] = dec;
+            has_term = true;
+            term_ip = instr_ip;
+            break;
+        }
+
+        if (vemu_is_discardable(&dec)) {
+            continue;
+        }
+
+        /* The body runs without ip, so resolve pc-relative values now. */
+        if (dec.opcode == VEMU_OPCODE_AUIPC) {
+            dec.opcode = VEMU_OPCODE_LUI;
+            dec.imm += instr_ip;
+        }
+
+        ops[n_ops++] = dec;
+    }
+
+    n_ops = vemu_ir_optimize(ops, n_ops, has_term, cpu->passes, 
+                             &cpu->ir_stats);
+
+    if (!vemu_smc_mark(&cpu->smc, start, ip)) {
+        return NULL;
+    }
+
+    vemu_block_t *block = vemu_block_alloc(n_ops);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->ip = start;
+    block->end = ip;
+    block->term_ip = term_ip;
+    block->has_term = has_term;
+    block->n_instrs = n_instrs;
+    for (size_t i = 0; i < n_ops; i++) {
+        block->ops[i] = ops[i];
+    }
+
+    if (!has_term) {
+        block->succ_ip[VEMU_BLOCK_SUCC_NEXT] = ip;
+    } else {
+        vemu_decoded_t *term = &block->ops[n_ops - 1];
+        switch (term->opcode) {
+            case VEMU_OPCODE_BEQ:
+            case VEMU_OPCODE_BNE:
+            case VEMU_OPCODE_BLT:
+            case VEMU_OPCODE_BGE:
+            case VEMU_OPCODE_BLTU:
+            case VEMU_OPCODE_BGEU:
+            case VEMU_OPCODE_SLT_BNEZ:
+            case VEMU_OPCODE_SLT_BEQZ:
+            case VEMU_OPCODE_SLTU_BNEZ:
+            case VEMU_OPCODE_SLTU_BEQZ:
+                block->succ_ip[VEMU_BLOCK_SUCC_TAKEN] = term_ip + term->imm;
+                block->succ_ip[VEMU_BLOCK_SUCC_NEXT] = ip;
+                break;
+
+            case VEMU_OPCODE_JAL:
+                block->succ_ip[VEMU_BLOCK_SUCC_TAKEN] = term_ip + term->imm;
+                break;
+
+            case VEMU_OPCODE_AUIPC_JALR:
+                block->succ_ip[VEMU_BLOCK_SUCC_TAKEN] = term->imm2;
+                break;
+
+            case VEMU_OPCODE_JALR:
+                block->indirect = true;
+                break;
+
+            case VEMU_OPCODE_ECALL:
+            case VEMU_OPCODE_FENCE_I:
+            case VEMU_OPCODE_SFENCE_VMA:
+            case VEMU_OPCODE_CSRRW_SATP:
+                block->succ_ip[VEMU_BLOCK_SUCC_NEXT] = ip;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    vemu_block_cache_insert(&cpu->blocks, block);
+    cpu->blocks.translated++;
+
+    return block;
+}
+
+static vemu_block_t *vemu_get_block(vemu_cpu_t *cpu, uint32_t ip) {
+    vemu_block_t *block = vemu_block_cache_find(&cpu->blocks, ip);
+    if (block == NULL) {
+        uint64_t flushes = cpu->blocks.flushes;
+        block = vemu_translate_block(cpu, ip);
+
+        /* Native code belongs to the blocks that were just dropped */
+        if (flushes != cpu->blocks.flushes) {
+            vemu_jit_reset(&cpu->jit);
+        }
+    }
+
+    return block;
+}
+
+static vemu_block_t *vemu_link_block(vemu_cpu_t *cpu, vemu_block_t *block,
+                                     size_t i, uint32_t ip) {
+    /* Translating the successor may flush the cache, which frees the 
+       block we would be linking from. */
+    uint64_t flushes = cpu->blocks.flushes;
+    vemu_block_t *succ = vemu_get_block(cpu, ip);
+
+    if (flushes == cpu->blocks.flushes) {
+        block->succ_ip[i] = ip;
+        block->succ[i] = succ;
+    }
+
+    return succ;
+}
+
+static inline vemu_block_t *vemu_next_block(vemu_cpu_t *cpu, 
+                                            vemu_block_t *block, 
+                                            uint32_t ip) {
+    for (size_t i = 0; i < 2; i++) {
+        if (block->succ_ip[i] == ip) {
+            block->succ_hits[i]++;
+            if (block->succ[i] == NULL || block->succ[i]->invalid) {
+                return vemu_link_block(cpu, block, i, ip);
+            }
+            return block->succ[i];
+        }
+    }
+
+    if (block->indirect) {
+        return vemu_link_block(cpu, block, VEMU_BLOCK_SUCC_TAKEN, ip);
+    }
+
+    return vemu_get_block(cpu, ip);
+}
+
+/* Runs block from op to the end, including its terminator */
+static inline uint32_t vemu_exec_ops(vemu_cpu_t *cpu, vemu_block_t *block,
+                                     vemu_decoded_t *op) {
+    vemu_decoded_t *body_end = block->ops + block->n_ops 
+                             - (block->has_term ? 1 : 0);
+    for (; op < body_end; op++) {
+        vemu_execute(cpu, op);
+    }
+
+    if (!block->has_term) {
+        cpu->instret += block->n_instrs;
+        return block->end;
+    }
+
+    cpu->ip = block->term_ip;
+    cpu->next_ip = block->end;
+    cpu->instret += block->n_instrs - op->n_instrs;
+
+    vemu_execute(cpu, op);
+
+    cpu->regs[VEMU_ZERO] = 0;
+    cpu->instret += op->n_instrs;
+    return cpu->next_ip;
+}
+
+static inline uint32_t vemu_exec_block(vemu_cpu_t *cpu, vemu_block_t *block) {
+    cpu->blocks.executed++;
+
+    return vemu_exec_ops(cpu, block, block->ops);
+}
+
+/* Each branch inside a superblock runs at its own ip, like a block 
+   terminator. If it does not continue along the trace, the superblock is
+   left through that side exit with only the instructions before it 
+   retired, and *taken is set to the exit. */
+static inline uint32_t vemu_exec_trace(vemu_cpu_t *cpu, vemu_block_t *trace,
+                                       vemu_trace_exit_t **taken) {
+    cpu->blocks.executed++;
+    trace->entries++;
+
+    vemu_decoded_t *op = trace->ops;
+    for (uint32_t i = 0; i < trace->n_exits; i++) {
+        vemu_trace_exit_t *exit = &trace->exits[i];
+        vemu_decoded_t *branch = trace->ops + exit->end - 1;
+
+        for (; op < branch; op++) {
+            vemu_execute(cpu, op);
+        }
+
+        cpu->ip = exit->term_ip;
+        cpu->next_ip = exit->next_ip;
+        vemu_execute(cpu, op++);
+        cpu->regs[VEMU_ZERO] = 0;
+
+        if (cpu->next_ip != exit->expect) {
+            *taken = exit;
+            exit->taken++;
+            cpu->instret += exit->n_instrs;
+            return cpu->next_ip;
+        }
+    }
+
+    /* Stayed on the trace, so all of it retires */
+    return vemu_exec_ops(cpu, trace, op);
+}
+
+/* Loop heads are found by counting direct backward jumps into them. By 
+   the time one gets hot, the blocks of the loop have branch counts that
+   show which way the trace should go. */
+static inline void vemu_profile_loop(vemu_cpu_t *cpu, vemu_block_t *head) {
+    if (cpu->traces && head->trace == NULL 
+            && ++head->trace_heat == VEMU_TRACE_THRESHOLD) {
+        head->trace = vemu_trace_form(&cpu->blocks, head);
+    }
+}
+
+/* Runs a superblock without native code. Returns the block to run next,
+   or NULL once the cpu has terminated. */
+static vemu_block_t *vemu_step_trace(vemu_cpu_t *cpu, vemu_block_t *trace) {
+    vemu_trace_exit_t *exit = NULL;
+    uint32_t next = vemu_exec_trace(cpu, trace, &exit);
+
+    if (cpu->terminated) {
+        cpu->ip = next;
+        return NULL;
+    }
+
+    if (exit == NULL) {
+        return vemu_next_block(cpu, trace, next);
+    }
+
+    /* A side exit only ever leaves for one place */
+    if (exit->link == NULL || exit->link->invalid) {
+        uint64_t flushes = cpu->blocks.flushes;
+        vemu_block_t *succ = vemu_get_block(cpu, next);
+
+        if (flushes != cpu->blocks.flushes) {
+            return succ;
+        }
+        exit->link = succ;
+    }
+
+    return exit->link;
+}
+
+/* Same for a plain block, which also looks out for loop heads */
+static inline vemu_block_t *vemu_step_block(vemu_cpu_t *cpu, 
+                                            vemu_block_t *block) {
+    uint32_t next = vemu_exec_block(cpu, block);
+
+    if (cpu->terminated) {
+        cpu->ip = next;
+        return NULL;
+    }
+
+    /* block may be freed by the lookup below */
+    bool backward = next <= block->ip && !block->indirect;
+
+    vemu_block_t *succ = vemu_next_block(cpu, block, next);
+    if (succ != NULL && backward) {
+        vemu_profile_loop(cpu, succ);
+    }
+
+    return succ;
+}
+
+static void vemu_cpu_run_blocks(vemu_cpu_t *cpu) {
+    vemu_block_t *block = vemu_get_block(cpu, cpu->ip);
+
+    while (block != NULL) {
+        if (block->trace != NULL) {
+            block = vemu_step_trace(cpu, block->trace);
+        } else {
+            block = vemu_step_block(cpu, block);
+        }
+    }
+
+    if (cpu->terminated) {
+        return;
+    }
+
+    fprintf(stderr, "could not allocate block\n");
+    cpu->terminated = true;
+}
+
+static void vemu_jit_compile_block(vemu_cpu_t *cpu, vemu_block_t *block) {
+    cpu->jit.translate = vemu_mmu_on(&cpu->mmu);
+    if (vemu_jit_compile(&cpu->jit, block) == VEMU_JIT_FULL) {
+        /* Start over with an empty buffer; block links into the old 
+           code go away with it. */
+        for (size_t i = 0; i <= cpu->blocks.mask; i++) {
+            vemu_block_t *slot = cpu->blocks.slots[i];
+            if (slot != NULL) {
+                slot->native = NULL;
+                if (slot->trace != NULL) {
+                    slot->trace->native = NULL;
+                }
+            }
+        }
+        vemu_jit_reset(&cpu->jit);
+        vemu_jit_compile(&cpu->jit, block);
+    }
+}
+
+/* A decoded entry covers up to a fused pair of 4-byte instructions, so
+   entries from 6 bytes below addr on can include it. */
+static void vemu_invalidate_decoded(vemu_cpu_t *cpu, uint32_t addr, 
+                                    uint32_t len) {
+    if (cpu->dcache.entries == NULL) {
+        return;
+    }
+
+    uint32_t first = (addr - 6) & ~1u;
+    uint32_t n = (addr + len - first + 1) / 2;
+
+    for (uint32_t i = 0, ip = first; i < n; i++, ip += 2) {
+        vemu_decode_cache_entry_t *entry = vemu_decode_cache_slot(&cpu->dcache,
+                                                                  ip);
+        if (entry->ip == ip) {
+            entry->ip = VEMU_DECODE_CACHE_EMPTY;
+            cpu->smc.invalidated++;
+        }
+    }
+}
+
+/* Retires the blocks and traces built from [start, end). Retiring moves
+   entries of the table around, so the overlapping blocks are marked in
+   one pass and taken out in a second one that rechecks each slot it
+   refills. */
+static bool vemu_invalidate_blocks(vemu_cpu_t *cpu, uint32_t start, 
+                                   uint32_t end) {
+    vemu_block_cache_t *blocks = &cpu->blocks;
+    if (blocks->slots == NULL) {
+        return true;
+    }
+
+    uint32_t first_retired = blocks->n_retired;
+
+    for (size_t i = 0; i <= blocks->mask; i++) {
+        vemu_block_t *block = blocks->slots[i];
+        if (block == NULL) {
+            continue;
+        }
+
+        if (block->ip < end && block->end > start) {
+            block->invalid = true;
+        } else if (block->trace != NULL 
+                   && vemu_trace_overlaps(block->trace, start, end)
+                   && !vemu_block_cache_retire_trace(blocks, block)) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i <= blocks->mask; ) {
+        vemu_block_t *block = blocks->slots[i];
+        if (block == NULL || !block->invalid) {
+            i++;
+            continue;
+        }
+
+        if (!vemu_block_cache_retire(blocks, block)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = first_retired; i < blocks->n_retired; i++) {
+        vemu_block_t *block = blocks->retired[i];
+        if (block->native != NULL) {
+            vemu_jit_unlink(&cpu->jit, block->native, block->ip);
+        }
+    }
+    cpu->smc.invalidated += blocks->n_retired - first_retired;
+
+    return true;
+}
+
+/* The block doing the store still runs to its end on the old code, which
+   is fine: the guest has to execute fence.i before relying on the new 
+   one. */
+void vemu_cpu_code_store(vemu_cpu_t *cpu, uint32_t addr, uint32_t len) {
+    vemu_smc_t *smc = &cpu->smc;
+    if (!vemu_smc_code_page(smc, addr, len)) {
+        return;
+    }
+    smc->code_stores++;
+
+    if (!vemu_smc_overlaps(smc, addr, len)) {
+        return;
+    }
+    smc->invalidations++;
+
+    vemu_invalidate_decoded(cpu, addr, len);
+    if (!vemu_invalidate_blocks(cpu, addr, addr + len)) {
+        fprintf(stderr, "could not invalidate blocks\n");
+        cpu->terminated = true;
+    }
+
+    vemu_smc_clear(smc, addr, len);
+}
+
+void vemu_cpu_flush_code(vemu_cpu_t *cpu) {
+    vemu_decode_cache_flush(&cpu->dcache);
+    if (!vemu_invalidate_blocks(cpu, 0, UINT32_MAX)) {
+        fprintf(stderr, "could not invalidate blocks\n");
+        cpu->terminated = true;
+    }
+}
+
+/* Hot blocks run as native code and chain into each other through 
+   patched jumps; everything else runs as in block mode. */
+static void vemu_cpu_run_jit(vemu_cpu_t *cpu) {
+    static vemu_opcode_t const exit_opcodes[] = {
+        [VEMU_JIT_EXIT_ECALL]       = VEMU_OPCODE_ECALL,
+        [VEMU_JIT_EXIT_ILLEGAL]     = VEMU_OPCODE_ILLEGAL,
+        [VEMU_JIT_EXIT_FENCE_I]     = VEMU_OPCODE_FENCE_I,
+        [VEMU_JIT_EXIT_SFENCE_VMA]  = VEMU_OPCODE_SFENCE_VMA,
+    };
+
+    vemu_block_t *block = vemu_get_block(cpu, cpu->ip);
+
+    while (block != NULL) {
+        if (block->trace != NULL) {
+            block = block->trace;
+        }
+
+        if (block->native == NULL && block->heat++ == VEMU_JIT_THRESHOLD) {
+            vemu_jit_compile_block(cpu, block);
+        }
+
+        if (block->native == NULL) {
+            block = block->superblock ? vemu_step_trace(cpu, block)
+                                      : vemu_step_block(cpu, block);
+            continue;
+        }
+
+        cpu->jit.entries++;
+        vemu_jit_exit_t exit = cpu->jit.enter(cpu, *cpu->ram, block->native);
+
+        if (exit.ip & 1) {
+            vemu_decoded_t dec = { .opcode = exit_opcodes[exit.ip] };
+            vemu_execute(cpu, &dec);
+
+            cpu->regs[VEMU_ZERO] = 0;
+            cpu->instret++;
+
+            if (cpu->terminated) {
+                cpu->ip = cpu->next_ip;
+                return;
+            }
+
+            block = vemu_get_block(cpu, cpu->next_ip);
+            continue;
+        }
+
+        if (cpu->terminated) {
+            return;
+        }
+
+        uint64_t flushes = cpu->blocks.flushes;
+        block = vemu_get_block(cpu, exit.ip);
+        if (block != NULL && block->trace != NULL) {
+            block = block->trace;
+        }
+
+        if (block != NULL && block->native != NULL && exit.patch != NULL
+                && flushes == cpu->blocks.flushes) {
+            vemu_jit_link(&cpu->jit, exit.patch, block->native);
+        }
+    }
+
+    if (cpu->terminated) {
+        return;
+    }
+
+    fprintf(stderr, "could not allocate block\n");
+    cpu->terminated = true;
+}
+
+void vemu_cpu_reset(vemu_cpu_t *cpu, uint32_t entry) {
+    cpu->ip = entry;
+    cpu->regs[VEMU_SP] = cpu->hartid == 0 
+                       ? VEMU_CPU_STACK_TOP 
+                       : VEMU_CPU_HART_STACKS 
+                         + cpu->hartid * VEMU_CPU_HART_STACK_SIZE;
+    cpu->regs[VEMU_A0] = cpu->hartid;
+    cpu->regs[VEMU_A1] = cpu->n_harts;
+    cpu->reserved = false;
+}
+
+void vemu_cpu_run(vemu_cpu_t *cpu, uint32_t entry) {
+    vemu_cpu_reset(cpu, entry);
+    vemu_cpu_resume(cpu);
+}
+
+/* The hart running on this thread and where its fault handler goes */
+static __thread vemu_cpu_t *vemu_guarded_cpu;
+static __thread sigjmp_buf *vemu_guarded_jmp;
+static __thread uintptr_t vemu_guarded_addr;
+static __thread char const *vemu_guarded_kind;
+static __thread bool vemu_guarded_illegal;
+static pthread_once_t vemu_fault_once = PTHREAD_ONCE_INIT;
+
+/* Faults inside the guest memory reservation of the hart running on this
+   thread go back to vemu_cpu_run_guarded(); any other fault restores the
+   default action, which takes effect when the access is retried */
+static void vemu_cpu_fault_handler(int sig, siginfo_t *info, void *context) {
+    (void)context;
+
+    vemu_cpu_t *cpu = vemu_guarded_cpu;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+
+    if (cpu != NULL && addr - (uintptr_t)*cpu->ram < VEMU_RAM_RESERVE_SIZE) {
+        vemu_guarded_addr = addr - (uintptr_t)*cpu->ram;
+        vemu_guarded_kind = NULL;
+        siglongjmp(*vemu_guarded_jmp, 1);
+    }
+
+    signal(sig, SIG_DFL);
+}
+
+static void vemu_cpu_install_fault_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = vemu_cpu_fault_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    /* SIGBUS covers snapshot pages mapped past the end of their file */
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+/* Guest memory stays readable to the host, so a fault on it was a store
+   the guest may not make. Devices only take the loads and stores of the
+   base ISA. */
+static char const *vemu_cpu_fault_kind(vemu_cpu_t *cpu, uintptr_t addr) {
+    if (cpu->bus == NULL || addr >> VEMU_BUS_PAGE_BITS >= VEMU_BUS_N_PAGES) {
+        return "memory fault";
+    }
+
+    uint8_t entry = cpu->bus->pages[addr >> VEMU_BUS_PAGE_BITS];
+    if (entry & VEMU_BUS_DEVICE_MASK) {
+        return "device access fault";
+    }
+
+    return entry & VEMU_BUS_R ? "write fault" : "memory fault";
+}
+
+/* Only harts that run guarded make accesses that can fault */
+static void vemu_cpu_fault(vemu_cpu_t *cpu, char const *kind, 
+                           uint32_t addr) {
+    if (cpu != vemu_guarded_cpu) {
+        fprintf(cpu->err, "guest %s at 0x%08" PRIx32 "\n", kind, addr);
+        abort();
+    }
+
+    vemu_guarded_addr = addr;
+    vemu_guarded_kind = kind;
+    siglongjmp(*vemu_guarded_jmp, 1);
+}
+
+void vemu_cpu_illegal(vemu_cpu_t *cpu) {
+    if (cpu != vemu_guarded_cpu) {
+        fprintf(cpu->err, "guest illegal instruction near ip 0x%08" PRIx32
+                "\n", cpu->ip);
+        abort();
+    }
+
+    vemu_guarded_illegal = true;
+    siglongjmp(*vemu_guarded_jmp, 1);
+}
+
+void vemu_cpu_run_guarded(vemu_cpu_t *cpu, 
+                          void (*run)(vemu_cpu_t *cpu, void *arg), void *arg) {
+    pthread_once(&vemu_fault_once, vemu_cpu_install_fault_handler);
+
+    sigjmp_buf jmp;
+    vemu_guarded_jmp = &jmp;
+    vemu_guarded_cpu = cpu;
+
+    if (sigsetjmp(jmp, 1) == 0) {
+        run(cpu, arg);
+    } else if (vemu_guarded_illegal) {
+        vemu_guarded_illegal = false;
+        vemu_cpu_stop(cpu);
+    } else {
+        char const *kind = vemu_guarded_kind != NULL 
+                         ? vemu_guarded_kind
+                         : vemu_cpu_fault_kind(cpu, vemu_guarded_addr);
+        fprintf(cpu->err, "guest %s at 0x%08" PRIx64 " near ip 0x%08" 
+                PRIx32 "\n", kind, (uint64_t)vemu_guarded_addr, cpu->ip);
+        cpu->terminated = true;
+        cpu->stop_ip = cpu->ip;
+        cpu->exit_code = cpu->regs[VEMU_A0];
+    }
+
+    vemu_guarded_cpu = NULL;
+}
+
+static void vemu_cpu_run_mode(vemu_cpu_t *cpu, void *arg) {
+    (void)arg;
+
+    switch (cpu->mode) {
+        case VEMU_EXEC_INTERP:
+            if (cpu->dcache.entries != NULL) {
+                vemu_cpu_run_cached(cpu);
+            } else {
+                vemu_cpu_run_uncached(cpu);
+            }
+            break;
+
+        case VEMU_EXEC_BLOCK:
+            vemu_cpu_run_blocks(cpu);
+            break;
+
+        case VEMU_EXEC_JIT:
+            vemu_cpu_run_jit(cpu);
+            break;
+    }
+}
+
+void vemu_cpu_resume(vemu_cpu_t *cpu) {
+    vemu_fp_enter(cpu);
+    vemu_cpu_run_guarded(cpu, vemu_cpu_run_mode, NULL);
+    vemu_fp_leave(cpu);
+}
+
+void vemu_cpu_print_stats(vemu_cpu_t *cpu, FILE *file, double seconds) {
+    fprintf(file, "instructions:  %" PRIu64 "\n", cpu->instret);
+    fprintf(file, "time:          %.3f s\n", seconds);
+    if (seconds > 0) {
+        fprintf(file, "MIPS:          %.1f\n", cpu->instret / seconds / 1e6);
+    }
+
+    if (cpu->dcache.entries != NULL) {
+        uint64_t misses = cpu->dcache.misses;
+        uint64_t hits = cpu->instret > misses ? cpu->instret - misses : 0;
+        double rate = cpu->instret ? 100.0 * hits / cpu->instret : 0;
+
+        fprintf(file, "decode cache:  %" PRIu64 " hits, %" PRIu64 " misses "
+                "(%.2f%% hit rate)\n", hits, misses, rate);
+    } else if (cpu->mode == VEMU_EXEC_INTERP) {
+        fprintf(file, "decode cache:  disabled\n");
+    }
+
+    if (cpu->mode == VEMU_EXEC_BLOCK || cpu->mode == VEMU_EXEC_JIT) {
+        vemu_block_cache_t *blocks = &cpu->blocks;
+        double chained = blocks->executed > blocks->lookups
+                       ? 100.0 * (blocks->executed - blocks->lookups) 
+                               / blocks->executed 
+                       : 0;
+
+        fprintf(file, "blocks:        %" PRIu64 " translated, %" PRIu64 
+                " flushes\n", blocks->translated, blocks->flushes);
+        fprintf(file, "block exits:   %" PRIu64 " executed, %" PRIu64 
+                " lookups (%.2f%% chained)\n", 
+                blocks->executed, blocks->lookups, chained);
+
+        vemu_ir_stats_t *ir = &cpu->ir_stats;
+        fprintf(file, "ir passes:     %" PRIu64 " -> %" PRIu64 " ops, %" 
+                PRIu64 " folded, %" PRIu64 " dead writes, %" PRIu64 
+                " loads reused\n", ir->ops_in, ir->ops_out, ir->folded, 
+                ir->dead, ir->loads);
+
+        if (cpu->traces) {
+            vemu_trace_print_stats(blocks, file, cpu->instret);
+        }
+    }
+
+    if (cpu->smc.pages != NULL) {
+        vemu_smc_t *smc = &cpu->smc;
+
+        fprintf(file, "code stores:   %" PRIu64 " to code pages, %" PRIu64 
+                " overwrote code, %" PRIu64 " entries invalidated\n", 
+                smc->code_stores, smc->invalidations, smc->invalidated);
+    }
+
+    if (cpu->mmu.itlb.misses + cpu->mmu.dtlb.misses != 0) {
+        vemu_mmu_print_stats(&cpu->mmu, file);
+    }
+
+    if (cpu->mode == VEMU_EXEC_JIT) {
+        vemu_jit_t *jit = &cpu->jit;
+
+        fprintf(file, "jit:           %" PRIu64 " blocks compiled, %" PRIu64 
+                " unsupported, %zu KiB code, %" PRIu64 " resets\n", 
+                jit->compiled, jit->unsupported, jit->used / 1024, 
+                jit->resets);
+        fprintf(file, "jit entries:   %" PRIu64 " from C, %" PRIu64 
+                " exits linked\n", jit->entries, jit->links);
     }
 }
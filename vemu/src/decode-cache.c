@@ -0,0 +1,39 @@
+#include "decode-cache.h"
+#include <stdlib.h>
+
+void vemu_decode_cache_init(vemu_decode_cache_t *cache) {
+    cache->entries = NULL;
+    cache->mask = 0;
+    cache->misses = 0;
+}
+
+bool vemu_decode_cache_alloc(vemu_decode_cache_t *cache, size_t bits) {
+    size_t n = (size_t)1 << bits;
+
+    cache->entries = malloc(n * sizeof(vemu_decode_cache_entry_t));
+    if (cache->entries == NULL) {
+        return false;
+    }
+    cache->mask = n - 1;
+
+    vemu_decode_cache_flush(cache);
+
+    return true;
+}
+
+void vemu_decode_cache_flush(vemu_decode_cache_t *cache) {
+    if (cache->entries == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i <= cache->mask; i++) {
+        cache->entries[i].ip = VEMU_DECODE_CACHE_EMPTY;
+    }
+}
+
+void vemu_decode_cache_destruct(vemu_decode_cache_t *cache) {
+    if (cache->entries != NULL) {
+        free(cache->entries);
+    }
+    vemu_decode_cache_init(cache);
+}
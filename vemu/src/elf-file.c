@@ -2,10 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 void vemu_elf_init(vemu_elf_t *elf) {
     elf->file = NULL;
     elf->strtab = NULL;
+    elf->phdrs = NULL;
 }
 
 bool vemu_elf_open(vemu_elf_t *elf, char const *filename) {
@@ -34,21 +37,30 @@ bool vemu_elf_open(vemu_elf_t *elf, char const *filename) {
         return false;
     }
 
+    elf->phdrs = vemu_read_program_headers(elf->file, &elf->h);
+    if (elf->phdrs == NULL && elf->h.e_phnum > 0) {
+        return false;
+    }
+
     return true;
 }
 
-bool vemu_elf_load(vemu_elf_t *elf, uint8_t *ram) {
+static bool vemu_elf_place(vemu_elf_t *elf, uint8_t *ram, size_t ram_size,
+                           bool map) {
     for (size_t i = 0; i < elf->h.e_phnum; i++) {
-        vemu_elf_program_header_t ph;
-        if (!vemu_read_program_header(elf->file, &elf->h, &ph, i)) {
-            return false;
+        vemu_elf_program_header_t *ph = &elf->phdrs[i];
+        if (ph->p_type != ELF_PT_LOAD) {
+            continue;
         }
 
-        if (ph.p_type != ELF_PT_LOAD) {
-            continue;
+        if ((uint64_t)ph->p_vaddr + ph->p_memsz > ram_size) {
+            fprintf(stderr, "segment at 0x%" PRIx32 " does not fit in "
+                    "guest memory\n", ph->p_vaddr);
+            return false;
         }
 
-        if (!vemu_load_program(elf->file, &ph, ram)) {
+        if (!(map ? vemu_map_program(elf->file, ph, ram)
+                  : vemu_load_program(elf->file, ph, ram))) {
             fprintf(stderr, "failed to load program\n");
             return false;
         }
@@ -57,6 +69,14 @@ bool vemu_elf_load(vemu_elf_t *elf, uint8_t *ram) {
     return true;
 }
 
+bool vemu_elf_load(vemu_elf_t *elf, uint8_t *ram, size_t ram_size) {
+    return vemu_elf_place(elf, ram, ram_size, false);
+}
+
+bool vemu_elf_map(vemu_elf_t *elf, uint8_t *ram, size_t ram_size) {
+    return vemu_elf_place(elf, ram, ram_size, true);
+}
+
 void vemu_elf_destruct(vemu_elf_t *elf) {
     if (elf->file != NULL) {
         fclose(elf->file);
@@ -65,6 +85,8 @@ void vemu_elf_destruct(vemu_elf_t *elf) {
     if (elf->strtab != NULL) {
         free(elf->strtab);
     }
+
+    free(elf->phdrs);
 }
 
 bool vemu_read_elf_header(FILE *file, vemu_elf_header_t *elf) {
@@ -108,40 +130,76 @@ bool vemu_validate_elf_header(vemu_elf_header_t *elf) {
     return true;
 }
 
-bool vemu_read_program_header(FILE *file, vemu_elf_header_t *elf, 
-                              vemu_elf_program_header_t *ph,
-                              size_t i) {
+vemu_elf_program_header_t *vemu_read_program_headers(FILE *file, 
+                                                     vemu_elf_header_t *elf) {
+    if (elf->e_phnum == 0) {
+        return NULL;
+    }
+
     assert(elf->e_phentsize == sizeof(vemu_elf_program_header_t));
-    
-    fseek(file, elf->e_phoff + i * elf->e_phentsize, SEEK_SET);
 
-    size_t size = fread(ph, 1, sizeof(vemu_elf_program_header_t), file);
-    if (size < sizeof(vemu_elf_program_header_t)) {
-        return false;
+    vemu_elf_program_header_t *phdrs = malloc(elf->e_phnum * sizeof(*phdrs));
+    if (phdrs == NULL) {
+        return NULL;
     }
-    
-    return true;                        
+
+    fseek(file, elf->e_phoff, SEEK_SET);
+
+    size_t n = fread(phdrs, sizeof(*phdrs), elf->e_phnum, file);
+    if (n < elf->e_phnum) {
+        free(phdrs);
+        return NULL;
+    }
+
+    return phdrs;
+}
+
+/* Reads len bytes at offset in the file to dst */
+static bool vemu_elf_read(FILE *file, uint32_t offset, uint8_t *dst,
+                          size_t len) {
+    fseek(file, offset, SEEK_SET);
+
+    return fread(dst, 1, len, file) == len;
 }
 
+/* Guest memory starts out zero, so the part of a segment past its file
+   contents is left alone rather than cleared page by page */
 bool vemu_load_program(FILE *file, vemu_elf_program_header_t *ph,
                        uint8_t *ram) {
     assert(ph->p_type == ELF_PT_LOAD);
     assert(ph->p_filesz <= ph->p_memsz);
 
-    if (ph->p_filesz > 0) {
-        fseek(file, ph->p_offset, SEEK_SET);
+    return vemu_elf_read(file, ph->p_offset, ram + ph->p_vaddr, 
+                         ph->p_filesz);
+}
 
-        size_t size = fread(ram + ph->p_vaddr, 1, ph->p_filesz, file);
-        if (size < ph->p_filesz) {
-            return false;
-        }
+/* Only pages the segment fills are mapped, as a page it shares with the
+   start or end of another segment, or with its own zero-filled part,
+   must not see whatever else the file holds there */
+bool vemu_map_program(FILE *file, vemu_elf_program_header_t *ph,
+                      uint8_t *ram) {
+    assert(ph->p_type == ELF_PT_LOAD);
+    assert(ph->p_filesz <= ph->p_memsz);
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = ph->p_vaddr;
+    uint64_t end = start + ph->p_filesz;
+    uint64_t first = (start + page - 1) & ~(page - 1);
+    uint64_t last = end & ~(page - 1);
+
+    if ((ph->p_offset - ph->p_vaddr) % page != 0 || first >= last) {
+        return vemu_load_program(file, ph, ram);
     }
 
-    if (ph->p_memsz > ph->p_filesz) {
-        memset(ram + ph->p_vaddr + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+    uint32_t offset = ph->p_offset + (first - start);
+    if (mmap(ram + first, last - first, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fileno(file), offset) == MAP_FAILED) {
+        return false;
     }
 
-    return true;
+    return vemu_elf_read(file, ph->p_offset, ram + start, first - start)
+        && vemu_elf_read(file, offset + (last - first), ram + last, 
+                         end - last);
 }
 
 bool vemu_read_section_header(FILE *file, vemu_elf_header_t *elf, 
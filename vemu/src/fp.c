@@ -0,0 +1,1038 @@
+#include "fp.h"
+#include "ram.h"
+#include "util.h"
+#include <fenv.h>
+#include <math.h>
+#include <string.h>
+
+#define VEMU_FP_NAN_S       0x7FC00000u
+#define VEMU_FP_NAN_D       0x7FF8000000000000ull
+#define VEMU_FP_BOX         0xFFFFFFFF00000000ull
+
+#define VEMU_FP_SIGN_S      0x80000000u
+#define VEMU_FP_SIGN_D      0x8000000000000000ull
+
+/* Host rounding modes for RNE, RTZ, RDN, RUP and RMM. RMM rounds to
+   nearest and fixes up ties, see vemu_fp_ties_away(). */
+static int const vemu_fp_host_rm[VEMU_FP_RMM + 1] = {
+    FE_TONEAREST,
+    FE_TOWARDZERO,
+    FE_DOWNWARD,
+    FE_UPWARD,
+    FE_TONEAREST,
+};
+
+static char const *vemu_fp_names[] = {
+    [VEMU_FP_FLW]           = "flw",
+    [VEMU_FP_FSW]           = "fsw",
+    [VEMU_FP_FMADD_S]       = "fmadd.s",
+    [VEMU_FP_FMSUB_S]       = "fmsub.s",
+    [VEMU_FP_FNMSUB_S]      = "fnmsub.s",
+    [VEMU_FP_FNMADD_S]      = "fnmadd.s",
+    [VEMU_FP_FADD_S]        = "fadd.s",
+    [VEMU_FP_FSUB_S]        = "fsub.s",
+    [VEMU_FP_FMUL_S]        = "fmul.s",
+    [VEMU_FP_FDIV_S]        = "fdiv.s",
+    [VEMU_FP_FSQRT_S]       = "fsqrt.s",
+    [VEMU_FP_FSGNJ_S]       = "fsgnj.s",
+    [VEMU_FP_FSGNJN_S]      = "fsgnjn.s",
+    [VEMU_FP_FSGNJX_S]      = "fsgnjx.s",
+    [VEMU_FP_FMIN_S]        = "fmin.s",
+    [VEMU_FP_FMAX_S]        = "fmax.s",
+    [VEMU_FP_FCVT_W_S]      = "fcvt.w.s",
+    [VEMU_FP_FCVT_WU_S]     = "fcvt.wu.s",
+    [VEMU_FP_FMV_X_W]       = "fmv.x.w",
+    [VEMU_FP_FEQ_S]         = "feq.s",
+    [VEMU_FP_FLT_S]         = "flt.s",
+    [VEMU_FP_FLE_S]         = "fle.s",
+    [VEMU_FP_FCLASS_S]      = "fclass.s",
+    [VEMU_FP_FCVT_S_W]      = "fcvt.s.w",
+    [VEMU_FP_FCVT_S_WU]     = "fcvt.s.wu",
+    [VEMU_FP_FMV_W_X]       = "fmv.w.x",
+    [VEMU_FP_FLD]           = "fld",
+    [VEMU_FP_FSD]           = "fsd",
+    [VEMU_FP_FMADD_D]       = "fmadd.d",
+    [VEMU_FP_FMSUB_D]       = "fmsub.d",
+    [VEMU_FP_FNMSUB_D]      = "fnmsub.d",
+    [VEMU_FP_FNMADD_D]      = "fnmadd.d",
+    [VEMU_FP_FADD_D]        = "fadd.d",
+    [VEMU_FP_FSUB_D]        = "fsub.d",
+    [VEMU_FP_FMUL_D]        = "fmul.d",
+    [VEMU_FP_FDIV_D]        = "fdiv.d",
+    [VEMU_FP_FSQRT_D]       = "fsqrt.d",
+    [VEMU_FP_FSGNJ_D]       = "fsgnj.d",
+    [VEMU_FP_FSGNJN_D]      = "fsgnjn.d",
+    [VEMU_FP_FSGNJX_D]      = "fsgnjx.d",
+    [VEMU_FP_FMIN_D]        = "fmin.d",
+    [VEMU_FP_FMAX_D]        = "fmax.d",
+    [VEMU_FP_FCVT_S_D]      = "fcvt.s.d",
+    [VEMU_FP_FCVT_D_S]      = "fcvt.d.s",
+    [VEMU_FP_FEQ_D]         = "feq.d",
+    [VEMU_FP_FLT_D]         = "flt.d",
+    [VEMU_FP_FLE_D]         = "fle.d",
+    [VEMU_FP_FCLASS_D]      = "fclass.d",
+    [VEMU_FP_FCVT_W_D]      = "fcvt.w.d",
+    [VEMU_FP_FCVT_WU_D]     = "fcvt.wu.d",
+    [VEMU_FP_FCVT_D_W]      = "fcvt.d.w",
+    [VEMU_FP_FCVT_D_WU]     = "fcvt.d.wu",
+};
+
+static char const * const vemu_fp_register_names[32] = {
+    "ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "ft6", "ft7",
+    "fs0", "fs1", "fa0", "fa1", "fa2", "fa3", "fa4", "fa5",
+    "fa6", "fa7", "fs2", "fs3", "fs4", "fs5", "fs6", "fs7",
+    "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11",
+};
+
+/* Operands of an instruction as the disassembler shows them: f for a
+   floating-point register, x for an integer one */
+typedef enum {
+    VEMU_FP_ARGS_LOAD,
+    VEMU_FP_ARGS_STORE,
+    VEMU_FP_ARGS_FFFF,
+    VEMU_FP_ARGS_FFF,
+    VEMU_FP_ARGS_FF,
+    VEMU_FP_ARGS_XFF,
+    VEMU_FP_ARGS_XF,
+    VEMU_FP_ARGS_FX,
+} vemu_fp_args_t;
+
+static vemu_fp_args_t vemu_fp_args(vemu_fp_opcode_t op) {
+    switch (op) {
+        case VEMU_FP_FLW:
+        case VEMU_FP_FLD:
+            return VEMU_FP_ARGS_LOAD;
+
+        case VEMU_FP_FSW:
+        case VEMU_FP_FSD:
+            return VEMU_FP_ARGS_STORE;
+
+        case VEMU_FP_FMADD_S:
+        case VEMU_FP_FMSUB_S:
+        case VEMU_FP_FNMSUB_S:
+        case VEMU_FP_FNMADD_S:
+        case VEMU_FP_FMADD_D:
+        case VEMU_FP_FMSUB_D:
+        case VEMU_FP_FNMSUB_D:
+        case VEMU_FP_FNMADD_D:
+            return VEMU_FP_ARGS_FFFF;
+
+        case VEMU_FP_FSQRT_S:
+        case VEMU_FP_FSQRT_D:
+        case VEMU_FP_FCVT_S_D:
+        case VEMU_FP_FCVT_D_S:
+            return VEMU_FP_ARGS_FF;
+
+        case VEMU_FP_FEQ_S:
+        case VEMU_FP_FLT_S:
+        case VEMU_FP_FLE_S:
+        case VEMU_FP_FEQ_D:
+        case VEMU_FP_FLT_D:
+        case VEMU_FP_FLE_D:
+            return VEMU_FP_ARGS_XFF;
+
+        case VEMU_FP_FCVT_W_S:
+        case VEMU_FP_FCVT_WU_S:
+        case VEMU_FP_FMV_X_W:
+        case VEMU_FP_FCLASS_S:
+        case VEMU_FP_FCLASS_D:
+        case VEMU_FP_FCVT_W_D:
+        case VEMU_FP_FCVT_WU_D:
+            return VEMU_FP_ARGS_XF;
+
+        case VEMU_FP_FCVT_S_W:
+        case VEMU_FP_FCVT_S_WU:
+        case VEMU_FP_FMV_W_X:
+        case VEMU_FP_FCVT_D_W:
+        case VEMU_FP_FCVT_D_WU:
+            return VEMU_FP_ARGS_FX;
+
+        default:
+            return VEMU_FP_ARGS_FFF;
+    }
+}
+
+static inline uint32_t vemu_fp_sext(uint32_t value, uint32_t bits) {
+    return (int32_t)(value << (32 - bits)) >> (32 - bits);
+}
+
+/* OP-FP, by bits 31:27 and the format in bits 26:25. has_rm is set for
+   instructions whose rm field is a rounding mode. Returns -1 for
+   encodings that are not valid. */
+static int vemu_fp_decode_op(uint32_t instr, bool *has_rm) {
+    uint32_t funct5 = instr >> 27;
+    bool d = ((instr >> 25) & 0x3) == 1;
+    uint32_t funct3 = (instr >> 12) & 0x7;
+    uint32_t rs2 = (instr >> 20) & 0x1F;
+
+    if (((instr >> 25) & 0x3) > 1) {
+        return -1;
+    }
+
+    *has_rm = false;
+    switch (funct5) {
+        case 0x00:
+            *has_rm = true;
+            return d ? VEMU_FP_FADD_D : VEMU_FP_FADD_S;
+
+        case 0x01:
+            *has_rm = true;
+            return d ? VEMU_FP_FSUB_D : VEMU_FP_FSUB_S;
+
+        case 0x02:
+            *has_rm = true;
+            return d ? VEMU_FP_FMUL_D : VEMU_FP_FMUL_S;
+
+        case 0x03:
+            *has_rm = true;
+            return d ? VEMU_FP_FDIV_D : VEMU_FP_FDIV_S;
+
+        case 0x0B:
+            *has_rm = true;
+            if (rs2 == 0) {
+                return d ? VEMU_FP_FSQRT_D : VEMU_FP_FSQRT_S;
+            }
+            break;
+
+        case 0x04:
+            if (funct3 <= 2) {
+                return (d ? VEMU_FP_FSGNJ_D : VEMU_FP_FSGNJ_S) + funct3;
+            }
+            break;
+
+        case 0x05:
+            if (funct3 <= 1) {
+                return (d ? VEMU_FP_FMIN_D : VEMU_FP_FMIN_S) + funct3;
+            }
+            break;
+
+        case 0x08:
+            *has_rm = true;
+            if (d && rs2 == 0) {
+                return VEMU_FP_FCVT_D_S;
+            } else if (!d && rs2 == 1) {
+                return VEMU_FP_FCVT_S_D;
+            }
+            break;
+
+        case 0x14:
+            /* fle, flt, feq */
+            if (funct3 <= 2) {
+                return (d ? VEMU_FP_FEQ_D : VEMU_FP_FEQ_S) + 2 - funct3;
+            }
+            break;
+
+        case 0x18:
+            *has_rm = true;
+            if (rs2 <= 1) {
+                return (d ? VEMU_FP_FCVT_W_D : VEMU_FP_FCVT_W_S) + rs2;
+            }
+            break;
+
+        case 0x1A:
+            *has_rm = true;
+            if (rs2 <= 1) {
+                return (d ? VEMU_FP_FCVT_D_W : VEMU_FP_FCVT_S_W) + rs2;
+            }
+            break;
+
+        case 0x1C:
+            if (rs2 == 0 && funct3 == 0 && !d) {
+                return VEMU_FP_FMV_X_W;
+            } else if (rs2 == 0 && funct3 == 1) {
+                return d ? VEMU_FP_FCLASS_D : VEMU_FP_FCLASS_S;
+            }
+            break;
+
+        case 0x1E:
+            if (rs2 == 0 && funct3 == 0 && !d) {
+                return VEMU_FP_FMV_W_X;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return -1;
+}
+
+void vemu_fp_decode(uint32_t instr, vemu_decoded_t *dec) {
+    uint32_t rd = (instr >> 7) & 0x1F;
+    uint32_t rm = (instr >> 12) & 0x7;
+    uint32_t rs1 = (instr >> 15) & 0x1F;
+    uint32_t rs2 = (instr >> 20) & 0x1F;
+    uint32_t rs3 = instr >> 27;
+    uint32_t imm = 0;
+    bool has_rm = false;
+    int op = -1;
+
+    switch (instr & 0x7F) {
+        case VEMU_OPCODE_R_LOAD_FP:
+            op = rm == 2 ? VEMU_FP_FLW : rm == 3 ? VEMU_FP_FLD : -1;
+            imm = vemu_fp_sext(instr >> 20, 12);
+            break;
+
+        case VEMU_OPCODE_R_STORE_FP:
+            op = rm == 2 ? VEMU_FP_FSW : rm == 3 ? VEMU_FP_FSD : -1;
+            imm = vemu_fp_sext(((instr >> 7) & 0x1F) | ((instr >> 25) << 5),
+                               12);
+            break;
+
+        case VEMU_OPCODE_R_FMADD:
+        case VEMU_OPCODE_R_FMSUB:
+        case VEMU_OPCODE_R_FNMSUB:
+        case VEMU_OPCODE_R_FNMADD: {
+            uint32_t fmt = (instr >> 25) & 0x3;
+            if (fmt <= 1) {
+                op = (fmt == 1 ? VEMU_FP_FMADD_D : VEMU_FP_FMADD_S)
+                   + ((instr >> 2) & 0x3);
+                has_rm = true;
+            }
+            break;
+        }
+
+        case VEMU_OPCODE_R_OP_FP:
+            op = vemu_fp_decode_op(instr, &has_rm);
+            break;
+
+        default:
+            break;
+    }
+
+    /* rm 5 and 6 are reserved */
+    if (op < 0 || (has_rm && rm > VEMU_FP_RMM && rm != VEMU_FP_DYN)) {
+        return;
+    }
+    if (!has_rm) {
+        rm = 0;
+    }
+
+    dec->opcode = VEMU_OPCODE_FP;
+    dec->rd = 0;
+    dec->rs1 = 0;
+    dec->imm = imm;
+    dec->imm2 = VEMU_FP_OP(op, rd, rs1, rs2, rs3, rm);
+
+    switch (vemu_fp_args(op)) {
+        case VEMU_FP_ARGS_LOAD:
+        case VEMU_FP_ARGS_STORE:
+        case VEMU_FP_ARGS_FX:
+            dec->rs1 = rs1;
+            break;
+
+        case VEMU_FP_ARGS_XFF:
+        case VEMU_FP_ARGS_XF:
+            dec->rd = rd;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static inline float vemu_fp_float(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline double vemu_fp_double(uint64_t bits) {
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static inline uint32_t vemu_fp_bits_s(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static inline uint64_t vemu_fp_bits_d(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+/* Singles sit in the low half of a register with the upper half all
+   ones; anything else reads as the canonical NaN */
+static inline uint32_t vemu_fp_get_s(vemu_cpu_t *cpu, uint32_t r) {
+    uint64_t v = cpu->fregs[r];
+    return (v & VEMU_FP_BOX) == VEMU_FP_BOX ? (uint32_t)v : VEMU_FP_NAN_S;
+}
+
+static inline void vemu_fp_set_s(vemu_cpu_t *cpu, uint32_t r, float f) {
+    uint32_t bits = isnan(f) ? VEMU_FP_NAN_S : vemu_fp_bits_s(f);
+    cpu->fregs[r] = VEMU_FP_BOX | bits;
+}
+
+static inline void vemu_fp_set_d(vemu_cpu_t *cpu, uint32_t r, double d) {
+    cpu->fregs[r] = isnan(d) ? VEMU_FP_NAN_D : vemu_fp_bits_d(d);
+}
+
+static inline bool vemu_fp_snan_s(uint32_t bits) {
+    return (bits & 0x7FC00000u) == 0x7F800000u && (bits & 0x003FFFFFu) != 0;
+}
+
+static inline bool vemu_fp_snan_d(uint64_t bits) {
+    return (bits & 0x7FF8000000000000ull) == 0x7FF0000000000000ull
+        && (bits & 0x0007FFFFFFFFFFFFull) != 0;
+}
+
+static inline uint32_t vemu_fp_frm(vemu_cpu_t *cpu) {
+    return (cpu->fcsr >> VEMU_FP_FRM_SHIFT) & 0x7;
+}
+
+/* Reserved values in frm round to nearest, even rather than trap */
+static inline uint32_t vemu_fp_rm(vemu_cpu_t *cpu, uint32_t rm) {
+    if (rm == VEMU_FP_DYN) {
+        rm = vemu_fp_frm(cpu);
+    }
+    return rm <= VEMU_FP_RMM ? rm : VEMU_FP_RNE;
+}
+
+/* The mode the host rounds in while the guest runs */
+static inline int vemu_fp_host_mode(vemu_cpu_t *cpu) {
+    return vemu_fp_host_rm[vemu_fp_rm(cpu, VEMU_FP_DYN)];
+}
+
+static void vemu_fp_collect(vemu_cpu_t *cpu) {
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    if (raised == 0) {
+        return;
+    }
+
+    cpu->fcsr |= ((raised & FE_INVALID) ? VEMU_FP_NV : 0)
+               | ((raised & FE_DIVBYZERO) ? VEMU_FP_DZ : 0)
+               | ((raised & FE_OVERFLOW) ? VEMU_FP_OF : 0)
+               | ((raised & FE_UNDERFLOW) ? VEMU_FP_UF : 0)
+               | ((raised & FE_INEXACT) ? VEMU_FP_NX : 0);
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+void vemu_fp_enter(vemu_cpu_t *cpu) {
+    feclearexcept(FE_ALL_EXCEPT);
+    fesetround(vemu_fp_host_mode(cpu));
+}
+
+void vemu_fp_leave(vemu_cpu_t *cpu) {
+    vemu_fp_collect(cpu);
+    fesetround(FE_TONEAREST);
+}
+
+bool vemu_fp_is_csr(uint32_t csr) {
+    return csr == VEMU_CSR_FFLAGS || csr == VEMU_CSR_FRM
+        || csr == VEMU_CSR_FCSR;
+}
+
+uint32_t vemu_fp_read_csr(vemu_cpu_t *cpu, uint32_t csr) {
+    vemu_fp_collect(cpu);
+
+    switch (csr) {
+        case VEMU_CSR_FFLAGS:
+            return cpu->fcsr & VEMU_FP_FLAGS;
+
+        case VEMU_CSR_FRM:
+            return vemu_fp_frm(cpu);
+
+        default:
+            return cpu->fcsr & VEMU_FP_FCSR_MASK;
+    }
+}
+
+void vemu_fp_write_csr(vemu_cpu_t *cpu, uint32_t csr, uint32_t value) {
+    switch (csr) {
+        case VEMU_CSR_FFLAGS:
+            cpu->fcsr = (cpu->fcsr & ~VEMU_FP_FLAGS) | (value & VEMU_FP_FLAGS);
+            break;
+
+        case VEMU_CSR_FRM:
+            cpu->fcsr = (cpu->fcsr & VEMU_FP_FLAGS)
+                      | (value & 0x7) << VEMU_FP_FRM_SHIFT;
+            break;
+
+        default:
+            cpu->fcsr = value & VEMU_FP_FCSR_MASK;
+            break;
+    }
+
+    vemu_fp_enter(cpu);
+}
+
+/* Sign of the exact sum of n doubles. They are summed into an expansion
+   of nonoverlapping components with error-free additions, so the sign is
+   that of the largest component. Needs round to nearest. */
+static int vemu_fp_sum_sign(double const *terms, int n) {
+    double e[8];
+    int m = 0;
+
+    for (int i = 0; i < n; i++) {
+        double q = terms[i];
+        int k = 0;
+
+        for (int j = 0; j < m; j++) {
+            double s = q + e[j];
+            double b = s - q;
+            double err = (q - (s - b)) + (e[j] - b);
+            q = s;
+            if (err != 0) {
+                e[k++] = err;
+            }
+        }
+        e[k++] = q;
+        m = k;
+    }
+
+    for (int j = m - 1; j >= 0; j--) {
+        if (e[j] != 0) {
+            return e[j] > 0 ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+typedef enum {
+    VEMU_FP_KIND_ADD,
+    VEMU_FP_KIND_MUL,
+    VEMU_FP_KIND_DIV,
+    VEMU_FP_KIND_FMA,
+    VEMU_FP_KIND_SQRT,
+} vemu_fp_kind_t;
+
+/* Turns r, the result of an op rounded to nearest, even, into the result
+   rounded to nearest, ties away from zero, which the host has no mode
+   for. The two differ only when the exact result lies halfway between r
+   and its neighbour away from zero; the exact result is written as a
+   sum of doubles to tell. Operands and results of singles are exact in
+   doubles, so the same test serves both. Square roots never tie, and
+   neither do results too close to zero for the halfway point to be a
+   double, which are let through. */
+static double vemu_fp_ties_away(vemu_fp_kind_t kind, double a, double b,
+                                double c, double r, bool single) {
+    double terms[6];
+    double scale = 1;
+    int n = 0;
+
+    if (kind == VEMU_FP_KIND_SQRT || !isfinite(r) || !isfinite(a)
+            || !isfinite(b) || !isfinite(c)) {
+        return r;
+    }
+
+    fexcept_t flags;
+    fegetexceptflag(&flags, FE_ALL_EXCEPT);
+
+    /* terms sum to (exact - r) * scale */
+    switch (kind) {
+        case VEMU_FP_KIND_ADD:
+            terms[n++] = a;
+            terms[n++] = b;
+            terms[n++] = -r;
+            break;
+
+        case VEMU_FP_KIND_DIV:
+            terms[n++] = fma(-r, b, a);
+            scale = b;
+            break;
+
+        default: {
+            double p = a * b;
+            terms[n++] = p;
+            terms[n++] = fma(a, b, -p);
+            if (kind == VEMU_FP_KIND_FMA) {
+                terms[n++] = c;
+            }
+            terms[n++] = -r;
+            break;
+        }
+    }
+
+    int sign = vemu_fp_sum_sign(terms, n) * (scale < 0 ? -1 : 1);
+    double result = r;
+
+    if (sign != 0 && (sign > 0) == (r >= 0)) {
+        double away = single ? nextafterf(r, sign * INFINITY)
+                             : nextafter(r, sign * INFINITY);
+        terms[n++] = -(away - r) / 2 * scale;
+        if (isfinite(away) && vemu_fp_sum_sign(terms, n) == 0) {
+            result = away;
+        }
+    }
+
+    fesetexceptflag(&flags, FE_ALL_EXCEPT);
+    return result;
+}
+
+/* Ops whose result the host rounds. Runs with the host rounding as rm
+   asks, loads operands after switching and stores the result before
+   switching back, so that the compiler cannot move the arithmetic out
+   from under the mode it needs. */
+static void vemu_fp_arith(vemu_cpu_t *cpu, vemu_fp_opcode_t opcode,
+                          uint32_t op, uint32_t x, bool rmm) {
+    uint32_t rd = (op >> 8) & 0x1F;
+    uint32_t rs1 = (op >> 13) & 0x1F;
+    uint32_t rs2 = (op >> 18) & 0x1F;
+    uint32_t rs3 = (op >> 23) & 0x1F;
+    vemu_fp_kind_t kind = VEMU_FP_KIND_ADD;
+    bool single = true;
+    double a = 0, b = 0, c = 0, r;
+
+    switch (opcode) {
+        case VEMU_FP_FADD_S:
+        case VEMU_FP_FSUB_S:
+        case VEMU_FP_FMUL_S:
+        case VEMU_FP_FDIV_S:
+        case VEMU_FP_FSQRT_S:
+        case VEMU_FP_FMADD_S:
+        case VEMU_FP_FMSUB_S:
+        case VEMU_FP_FNMSUB_S:
+        case VEMU_FP_FNMADD_S: {
+            float fa = vemu_fp_float(vemu_fp_get_s(cpu, rs1));
+            float fb = vemu_fp_float(vemu_fp_get_s(cpu, rs2));
+            float fc = vemu_fp_float(vemu_fp_get_s(cpu, rs3));
+            float fr;
+
+            switch (opcode) {
+                case VEMU_FP_FSUB_S:
+                    fb = -fb;
+                    /* fall through */
+                case VEMU_FP_FADD_S:
+                    fr = fa + fb;
+                    break;
+
+                case VEMU_FP_FMUL_S:
+                    kind = VEMU_FP_KIND_MUL;
+                    fr = fa * fb;
+                    break;
+
+                case VEMU_FP_FDIV_S:
+                    kind = VEMU_FP_KIND_DIV;
+                    fr = fa / fb;
+                    break;
+
+                case VEMU_FP_FSQRT_S:
+                    kind = VEMU_FP_KIND_SQRT;
+                    fr = sqrtf(fa);
+                    break;
+
+                default:
+                    kind = VEMU_FP_KIND_FMA;
+                    if (opcode == VEMU_FP_FNMSUB_S
+                            || opcode == VEMU_FP_FNMADD_S) {
+                        fa = -fa;
+                    }
+                    if (opcode == VEMU_FP_FMSUB_S
+                            || opcode == VEMU_FP_FNMADD_S) {
+                        fc = -fc;
+                    }
+                    if ((isinf(fa) && fb == 0) || (fa == 0 && isinf(fb))) {
+                        cpu->fcsr |= VEMU_FP_NV;
+                    }
+                    fr = fmaf(fa, fb, fc);
+                    break;
+            }
+
+            a = fa, b = fb, c = fc, r = fr;
+            break;
+        }
+
+        /* x is read through a volatile so that the conversion cannot be
+           hoisted above the switch of rounding mode */
+        case VEMU_FP_FCVT_S_W: {
+            volatile int32_t v = x;
+            a = v;
+            r = (float)v;
+            break;
+        }
+
+        case VEMU_FP_FCVT_S_WU: {
+            volatile uint32_t v = x;
+            a = v;
+            r = (float)v;
+            break;
+        }
+
+        case VEMU_FP_FCVT_S_D:
+            a = vemu_fp_double(cpu->fregs[rs1]);
+            r = (float)a;
+            break;
+
+        default: {
+            a = vemu_fp_double(cpu->fregs[rs1]);
+            b = vemu_fp_double(cpu->fregs[rs2]);
+            c = vemu_fp_double(cpu->fregs[rs3]);
+            single = false;
+
+            switch (opcode) {
+                case VEMU_FP_FSUB_D:
+                    b = -b;
+                    /* fall through */
+                case VEMU_FP_FADD_D:
+                    r = a + b;
+                    break;
+
+                case VEMU_FP_FMUL_D:
+                    kind = VEMU_FP_KIND_MUL;
+                    r = a * b;
+                    break;
+
+                case VEMU_FP_FDIV_D:
+                    kind = VEMU_FP_KIND_DIV;
+                    r = a / b;
+                    break;
+
+                case VEMU_FP_FSQRT_D:
+                    kind = VEMU_FP_KIND_SQRT;
+                    r = sqrt(a);
+                    break;
+
+                default:
+                    kind = VEMU_FP_KIND_FMA;
+                    if (opcode == VEMU_FP_FNMSUB_D
+                            || opcode == VEMU_FP_FNMADD_D) {
+                        a = -a;
+                    }
+                    if (opcode == VEMU_FP_FMSUB_D
+                            || opcode == VEMU_FP_FNMADD_D) {
+                        c = -c;
+                    }
+                    if ((isinf(a) && b == 0) || (a == 0 && isinf(b))) {
+                        cpu->fcsr |= VEMU_FP_NV;
+                    }
+                    r = fma(a, b, c);
+                    break;
+            }
+            break;
+        }
+    }
+
+    if (rmm) {
+        r = vemu_fp_ties_away(kind, a, b, c, r, single);
+    }
+
+    if (single) {
+        vemu_fp_set_s(cpu, rd, r);
+    } else {
+        vemu_fp_set_d(cpu, rd, r);
+    }
+}
+
+/* Round to nearest, even without depending on the host's mode */
+static double vemu_fp_round_even(double v) {
+    double t = round(v);
+    if (fabs(t - v) == 0.5) {
+        t = 2 * round(v / 2);
+    }
+    return t;
+}
+
+/* Conversions to integers round as rm says and saturate, raising invalid
+   for NaNs and values out of range and inexact for anything else that
+   had to be rounded */
+static uint32_t vemu_fp_to_int(vemu_cpu_t *cpu, double v, uint32_t rm,
+                               bool is_signed) {
+    double lo = is_signed ? -2147483648.0 : 0.0;
+    double hi = is_signed ? 2147483647.0 : 4294967295.0;
+    fexcept_t flags;
+    double t;
+
+    if (isnan(v)) {
+        cpu->fcsr |= VEMU_FP_NV;
+        return is_signed ? INT32_MAX : UINT32_MAX;
+    }
+
+    /* The guest's flags are in the host environment, and libm is free to
+       raise inexact or underflow along the way */
+    fegetexceptflag(&flags, FE_ALL_EXCEPT);
+    switch (rm) {
+        case VEMU_FP_RTZ:   t = trunc(v);               break;
+        case VEMU_FP_RDN:   t = floor(v);               break;
+        case VEMU_FP_RUP:   t = ceil(v);                break;
+        case VEMU_FP_RMM:   t = round(v);               break;
+        default:            t = vemu_fp_round_even(v);  break;
+    }
+    fesetexceptflag(&flags, FE_ALL_EXCEPT);
+
+    if (t < lo) {
+        cpu->fcsr |= VEMU_FP_NV;
+        return is_signed ? (uint32_t)INT32_MIN : 0;
+    }
+    if (t > hi) {
+        cpu->fcsr |= VEMU_FP_NV;
+        return is_signed ? INT32_MAX : UINT32_MAX;
+    }
+    if (t != v) {
+        cpu->fcsr |= VEMU_FP_NX;
+    }
+
+    return is_signed ? (uint32_t)(int32_t)t : (uint32_t)t;
+}
+
+/* fmin and fmax return the other operand for a single NaN, the canonical
+   NaN for two, and order -0 below +0. Only signaling NaNs raise
+   invalid. */
+static uint64_t vemu_fp_min_max(vemu_cpu_t *cpu, uint64_t a, uint64_t b,
+                                bool single, bool is_max) {
+    double x = single ? vemu_fp_float(a) : vemu_fp_double(a);
+    double y = single ? vemu_fp_float(b) : vemu_fp_double(b);
+    uint64_t sign = single ? VEMU_FP_SIGN_S : VEMU_FP_SIGN_D;
+
+    if (single ? vemu_fp_snan_s(a) || vemu_fp_snan_s(b)
+               : vemu_fp_snan_d(a) || vemu_fp_snan_d(b)) {
+        cpu->fcsr |= VEMU_FP_NV;
+    }
+
+    if (isnan(x) && isnan(y)) {
+        return single ? VEMU_FP_NAN_S : VEMU_FP_NAN_D;
+    } else if (isnan(x)) {
+        return b;
+    } else if (isnan(y)) {
+        return a;
+    } else if (x == y) {
+        /* Only differs for zeros of opposite signs */
+        return is_max ? (a & b & sign) | (a & ~sign) : (a | b) & (a | sign);
+    }
+
+    return (x < y) != is_max ? a : b;
+}
+
+/* feq only raises invalid for signaling NaNs, flt and fle for any NaN */
+static uint32_t vemu_fp_compare(vemu_cpu_t *cpu, uint64_t a, uint64_t b,
+                                bool single, int how) {
+    double x = single ? vemu_fp_float(a) : vemu_fp_double(a);
+    double y = single ? vemu_fp_float(b) : vemu_fp_double(b);
+
+    if (isnan(x) || isnan(y)) {
+        if (how != 0 || (single ? vemu_fp_snan_s(a) || vemu_fp_snan_s(b)
+                                : vemu_fp_snan_d(a) || vemu_fp_snan_d(b))) {
+            cpu->fcsr |= VEMU_FP_NV;
+        }
+        return 0;
+    }
+
+    switch (how) {
+        case 0:     return x == y;
+        case 1:     return x < y;
+        default:    return x <= y;
+    }
+}
+
+/* Worked out on the bits, since the host raises invalid for merely
+   looking at a signaling NaN */
+static uint32_t vemu_fp_class(uint64_t bits, bool single) {
+    uint32_t exp_bits = single ? 8 : 11;
+    uint32_t man_bits = single ? 23 : 52;
+    bool neg = (bits >> (exp_bits + man_bits)) & 1;
+    uint64_t exp = (bits >> man_bits) & ((1u << exp_bits) - 1);
+    uint64_t man = bits & ((1ull << man_bits) - 1);
+
+    if (exp == (1u << exp_bits) - 1) {
+        if (man == 0) {
+            return neg ? 1 << 0 : 1 << 7;
+        }
+        return (man >> (man_bits - 1)) != 0 ? 1 << 9 : 1 << 8;
+    }
+    if (exp == 0) {
+        if (man == 0) {
+            return neg ? 1 << 3 : 1 << 4;
+        }
+        return neg ? 1 << 2 : 1 << 5;
+    }
+    return neg ? 1 << 1 : 1 << 6;
+}
+
+static inline void vemu_fp_check_store(vemu_cpu_t *cpu, uint32_t addr,
+                                       uint32_t len) {
+    if (vemu_smc_code_page(&cpu->smc, addr, len)) {
+        vemu_cpu_code_store(cpu, addr, len);
+    }
+}
+
+uint32_t vemu_fp_exec(vemu_cpu_t *cpu, uint32_t op, uint32_t x) {
+    vemu_fp_opcode_t opcode = VEMU_FP_OPCODE(op);
+    uint32_t rd = (op >> 8) & 0x1F;
+    uint32_t rs1 = (op >> 13) & 0x1F;
+    uint32_t rs2 = (op >> 18) & 0x1F;
+    uint32_t rm = op >> 28;
+    uint64_t *f = cpu->fregs;
+    uint8_t *ram = *cpu->ram;
+
+    switch (opcode) {
+        case VEMU_FP_FLW: {
+            uint32_t addr = vemu_cpu_data_addr(cpu, x, 4, VEMU_MMU_LOAD);
+            f[rd] = VEMU_FP_BOX | vemu_ram_load_word(ram, addr);
+            return 0;
+        }
+
+        case VEMU_FP_FLD: {
+            uint32_t addr = vemu_cpu_data_addr(cpu, x, 8, VEMU_MMU_LOAD);
+            f[rd] = vemu_ram_load_word(ram, addr)
+                  | (uint64_t)vemu_ram_load_word(ram, addr + 4) << 32;
+            return 0;
+        }
+
+        case VEMU_FP_FSW: {
+            uint32_t addr = vemu_cpu_data_addr(cpu, x, 4, VEMU_MMU_STORE);
+            vemu_ram_store_word(ram, addr, f[rs2]);
+            vemu_fp_check_store(cpu, x, 4);
+            return 0;
+        }
+
+        case VEMU_FP_FSD: {
+            uint32_t addr = vemu_cpu_data_addr(cpu, x, 8, VEMU_MMU_STORE);
+            vemu_ram_store_word(ram, addr, f[rs2]);
+            vemu_ram_store_word(ram, addr + 4, f[rs2] >> 32);
+            vemu_fp_check_store(cpu, x, 8);
+            return 0;
+        }
+
+        case VEMU_FP_FSGNJ_S:
+        case VEMU_FP_FSGNJN_S:
+        case VEMU_FP_FSGNJX_S: {
+            uint32_t a = vemu_fp_get_s(cpu, rs1);
+            uint32_t b = vemu_fp_get_s(cpu, rs2);
+            uint32_t sign = opcode == VEMU_FP_FSGNJ_S ? b
+                          : opcode == VEMU_FP_FSGNJN_S ? ~b : a ^ b;
+            f[rd] = VEMU_FP_BOX | (a & ~VEMU_FP_SIGN_S)
+                  | (sign & VEMU_FP_SIGN_S);
+            return 0;
+        }
+
+        case VEMU_FP_FSGNJ_D:
+        case VEMU_FP_FSGNJN_D:
+        case VEMU_FP_FSGNJX_D: {
+            uint64_t a = f[rs1], b = f[rs2];
+            uint64_t sign = opcode == VEMU_FP_FSGNJ_D ? b
+                          : opcode == VEMU_FP_FSGNJN_D ? ~b : a ^ b;
+            f[rd] = (a & ~VEMU_FP_SIGN_D) | (sign & VEMU_FP_SIGN_D);
+            return 0;
+        }
+
+        case VEMU_FP_FMIN_S:
+        case VEMU_FP_FMAX_S:
+            f[rd] = VEMU_FP_BOX
+                  | vemu_fp_min_max(cpu, vemu_fp_get_s(cpu, rs1),
+                                    vemu_fp_get_s(cpu, rs2), true,
+                                    opcode == VEMU_FP_FMAX_S);
+            return 0;
+
+        case VEMU_FP_FMIN_D:
+        case VEMU_FP_FMAX_D:
+            f[rd] = vemu_fp_min_max(cpu, f[rs1], f[rs2], false,
+                                    opcode == VEMU_FP_FMAX_D);
+            return 0;
+
+        case VEMU_FP_FCVT_W_S:
+        case VEMU_FP_FCVT_WU_S:
+            return vemu_fp_to_int(cpu, vemu_fp_float(vemu_fp_get_s(cpu, rs1)),
+                                  vemu_fp_rm(cpu, rm),
+                                  opcode == VEMU_FP_FCVT_W_S);
+
+        case VEMU_FP_FCVT_W_D:
+        case VEMU_FP_FCVT_WU_D:
+            return vemu_fp_to_int(cpu, vemu_fp_double(f[rs1]),
+                                  vemu_fp_rm(cpu, rm),
+                                  opcode == VEMU_FP_FCVT_W_D);
+
+        case VEMU_FP_FMV_X_W:
+            return f[rs1];
+
+        case VEMU_FP_FMV_W_X:
+            f[rd] = VEMU_FP_BOX | x;
+            return 0;
+
+        case VEMU_FP_FEQ_S:
+        case VEMU_FP_FLT_S:
+        case VEMU_FP_FLE_S:
+            return vemu_fp_compare(cpu, vemu_fp_get_s(cpu, rs1),
+                                   vemu_fp_get_s(cpu, rs2), true,
+                                   opcode - VEMU_FP_FEQ_S);
+
+        case VEMU_FP_FEQ_D:
+        case VEMU_FP_FLT_D:
+        case VEMU_FP_FLE_D:
+            return vemu_fp_compare(cpu, f[rs1], f[rs2], false,
+                                   opcode - VEMU_FP_FEQ_D);
+
+        case VEMU_FP_FCLASS_S:
+            return vemu_fp_class(vemu_fp_get_s(cpu, rs1), true);
+
+        case VEMU_FP_FCLASS_D:
+            return vemu_fp_class(f[rs1], false);
+
+        case VEMU_FP_FCVT_D_S:
+            vemu_fp_set_d(cpu, rd, vemu_fp_float(vemu_fp_get_s(cpu, rs1)));
+            return 0;
+
+        case VEMU_FP_FCVT_D_W:
+            vemu_fp_set_d(cpu, rd, (int32_t)x);
+            return 0;
+
+        case VEMU_FP_FCVT_D_WU:
+            vemu_fp_set_d(cpu, rd, x);
+            return 0;
+
+        default:
+            break;
+    }
+
+    rm = vemu_fp_rm(cpu, rm);
+    int mode = vemu_fp_host_rm[rm];
+    int host = vemu_fp_host_mode(cpu);
+
+    if (mode != host) {
+        fesetround(mode);
+    }
+    vemu_fp_arith(cpu, opcode, op, x, rm == VEMU_FP_RMM);
+    if (mode != host) {
+        fesetround(host);
+    }
+
+    return 0;
+}
+
+void vemu_fp_disassemble(vemu_decoded_t *dec) {
+    uint32_t op = dec->imm2;
+    vemu_fp_opcode_t opcode = VEMU_FP_OPCODE(op);
+    char const *name = vemu_fp_names[opcode];
+    char const *rd = vemu_fp_register_names[(op >> 8) & 0x1F];
+    char const *rs1 = vemu_fp_register_names[(op >> 13) & 0x1F];
+    char const *rs2 = vemu_fp_register_names[(op >> 18) & 0x1F];
+    char const *rs3 = vemu_fp_register_names[(op >> 23) & 0x1F];
+    char const *xd = vemu_register_name(dec->rd);
+    char const *xs = vemu_register_name(dec->rs1);
+
+    switch (vemu_fp_args(opcode)) {
+        case VEMU_FP_ARGS_LOAD:
+            fprintf(stderr, "%s %s,%d(%s)\n", name, rd, dec->imm, xs);
+            break;
+
+        case VEMU_FP_ARGS_STORE:
+            fprintf(stderr, "%s %s,%d(%s)\n", name, rs2, dec->imm, xs);
+            break;
+
+        case VEMU_FP_ARGS_FFFF:
+            fprintf(stderr, "%s %s,%s,%s,%s\n", name, rd, rs1, rs2, rs3);
+            break;
+
+        case VEMU_FP_ARGS_FFF:
+            fprintf(stderr, "%s %s,%s,%s\n", name, rd, rs1, rs2);
+            break;
+
+        case VEMU_FP_ARGS_FF:
+            fprintf(stderr, "%s %s,%s\n", name, rd, rs1);
+            break;
+
+        case VEMU_FP_ARGS_XFF:
+            fprintf(stderr, "%s %s,%s,%s\n", name, xd, rs1, rs2);
+            break;
+
+        case VEMU_FP_ARGS_XF:
+            fprintf(stderr, "%s %s,%s\n", name, xd, rs1);
+            break;
+
+        case VEMU_FP_ARGS_FX:
+            fprintf(stderr, "%s %s,%s\n", name, rd, xs);
+            break;
+    }
+}
@@ -0,0 +1,748 @@
+#include "ir.h"
+#include "block.h"
+#include "registers.h"
+#include "muldiv.h"
+#include "bitmanip.h"
+#include "fp.h"
+#include "vec.h"
+#include <string.h>
+
+/* Every definition in a block gets its own value number, so the IR is in
+   SSA form without renaming the ops themselves: each op records the
+   values it reads and the value it defines, and register contents are
+   tracked as value numbers while walking the block. Values that are
+   computed the same way from the same operands share a number. */
+
+#define VEMU_IR_MAX_VALUES  (1 + VEMU_N_REGS + 2 * VEMU_BLOCK_MAX_INSTRS)
+#define VEMU_IR_NONE        0xFFFFFFFF
+
+#define VEMU_IR_REG(r)      (((uint32_t)1 << (r)) & ~(uint32_t)1)
+#define VEMU_IR_ALL_REGS    0xFFFFFFFE
+
+typedef enum {
+    VEMU_IR_CLASS_IMM,      /* rd = imm */
+    VEMU_IR_CLASS_I,        /* rd = f(rs1, imm) */
+    VEMU_IR_CLASS_R,        /* rd = f(rs1, rs2) */
+    VEMU_IR_CLASS_LOAD,
+    VEMU_IR_CLASS_STORE,
+    VEMU_IR_CLASS_OTHER,
+} vemu_ir_class_t;
+
+typedef enum {
+    VEMU_IR_VALUE_ENTRY,    /* register contents on entry to the block */
+    VEMU_IR_VALUE_CONST,
+    VEMU_IR_VALUE_EXPR,
+    VEMU_IR_VALUE_UNKNOWN,
+} vemu_ir_value_kind_t;
+
+typedef struct {
+    vemu_ir_value_kind_t kind;
+    uint32_t c;
+
+    vemu_opcode_t opcode;
+    uint32_t args[2];
+    uint32_t imm;
+} vemu_ir_value_t;
+
+typedef struct {
+    vemu_decoded_t dec;
+    uint32_t src[2];
+    uint32_t dst;
+    bool dead;
+} vemu_ir_op_t;
+
+/* A load whose result is known, keyed by its normalised address */
+typedef struct {
+    vemu_opcode_t opcode;
+    uint32_t base;
+    uint32_t imm;
+    uint32_t value;
+} vemu_ir_mem_t;
+
+typedef struct {
+    vemu_ir_op_t ops[VEMU_BLOCK_MAX_INSTRS];
+    uint32_t n_ops;
+    bool has_term;
+
+    vemu_ir_value_t values[VEMU_IR_MAX_VALUES];
+    uint32_t n_values;
+    uint32_t zero;
+
+    uint32_t regs[VEMU_N_REGS];
+
+    vemu_ir_mem_t mem[VEMU_BLOCK_MAX_INSTRS];
+    uint32_t n_mem;
+} vemu_ir_t;
+
+void vemu_ir_stats_init(vemu_ir_stats_t *stats) {
+    stats->ops_in = 0;
+    stats->ops_out = 0;
+    stats->folded = 0;
+    stats->dead = 0;
+    stats->loads = 0;
+}
+
+bool vemu_ir_parse_passes(char const *list, uint32_t *passes) {
+    static struct {
+        char const *name;
+        uint32_t passes;
+    } const names[] = {
+        { "none", 0 },
+        { "all", VEMU_IR_ALL },
+        { "const", VEMU_IR_CONST_PROP },
+        { "dead", VEMU_IR_DEAD_WRITES },
+        { "load", VEMU_IR_REDUNDANT_LOADS },
+    };
+
+    *passes = 0;
+
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        bool found = false;
+
+        for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+            if (strlen(names[i].name) == len
+                    && strncmp(names[i].name, list, len) == 0) {
+                *passes |= names[i].passes;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            return false;
+        }
+
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+
+    return true;
+}
+
+static vemu_ir_class_t vemu_ir_class(vemu_opcode_t opcode) {
+    switch (opcode) {
+        case VEMU_OPCODE_LUI:
+        case VEMU_OPCODE_LUI_ADDI:
+            return VEMU_IR_CLASS_IMM;
+
+        case VEMU_OPCODE_ADDI:
+        case VEMU_OPCODE_SLTI:
+        case VEMU_OPCODE_SLTIU:
+        case VEMU_OPCODE_XORI:
+        case VEMU_OPCODE_ORI:
+        case VEMU_OPCODE_ANDI:
+        case VEMU_OPCODE_SLLI:
+        case VEMU_OPCODE_SRLI:
+        case VEMU_OPCODE_SRAI:
+        case VEMU_OPCODE_CLZ:
+        case VEMU_OPCODE_CTZ:
+        case VEMU_OPCODE_CPOP:
+        case VEMU_OPCODE_SEXT_B:
+        case VEMU_OPCODE_SEXT_H:
+        case VEMU_OPCODE_ZEXT_H:
+        case VEMU_OPCODE_RORI:
+        case VEMU_OPCODE_ORC_B:
+        case VEMU_OPCODE_REV8:
+        case VEMU_OPCODE_BCLRI:
+        case VEMU_OPCODE_BEXTI:
+        case VEMU_OPCODE_BINVI:
+        case VEMU_OPCODE_BSETI:
+            return VEMU_IR_CLASS_I;
+
+        case VEMU_OPCODE_ADD:
+        case VEMU_OPCODE_SUB:
+        case VEMU_OPCODE_SLL:
+        case VEMU_OPCODE_SLT:
+        case VEMU_OPCODE_SLTU:
+        case VEMU_OPCODE_XOR:
+        case VEMU_OPCODE_SRL:
+        case VEMU_OPCODE_SRA:
+        case VEMU_OPCODE_OR:
+        case VEMU_OPCODE_AND:
+        case VEMU_OPCODE_MUL:
+        case VEMU_OPCODE_MULH:
+        case VEMU_OPCODE_MULHSU:
+        case VEMU_OPCODE_MULHU:
+        case VEMU_OPCODE_DIV:
+        case VEMU_OPCODE_DIVU:
+        case VEMU_OPCODE_REM:
+        case VEMU_OPCODE_REMU:
+        case VEMU_OPCODE_SH1ADD:
+        case VEMU_OPCODE_SH2ADD:
+        case VEMU_OPCODE_SH3ADD:
+        case VEMU_OPCODE_ANDN:
+        case VEMU_OPCODE_ORN:
+        case VEMU_OPCODE_XNOR:
+        case VEMU_OPCODE_MAX:
+        case VEMU_OPCODE_MAXU:
+        case VEMU_OPCODE_MIN:
+        case VEMU_OPCODE_MINU:
+        case VEMU_OPCODE_ROL:
+        case VEMU_OPCODE_ROR:
+        case VEMU_OPCODE_BCLR:
+        case VEMU_OPCODE_BEXT:
+        case VEMU_OPCODE_BINV:
+        case VEMU_OPCODE_BSET:
+            return VEMU_IR_CLASS_R;
+
+        case VEMU_OPCODE_LB:
+        case VEMU_OPCODE_LH:
+        case VEMU_OPCODE_LW:
+        case VEMU_OPCODE_LBU:
+        case VEMU_OPCODE_LHU:
+            return VEMU_IR_CLASS_LOAD;
+
+        case VEMU_OPCODE_SB:
+        case VEMU_OPCODE_SH:
+        case VEMU_OPCODE_SW:
+            return VEMU_IR_CLASS_STORE;
+
+        default:
+            return VEMU_IR_CLASS_OTHER;
+    }
+}
+
+static uint32_t vemu_ir_reads(vemu_decoded_t *dec) {
+    switch (vemu_ir_class(dec->opcode)) {
+        case VEMU_IR_CLASS_IMM:
+            return 0;
+
+        case VEMU_IR_CLASS_I:
+        case VEMU_IR_CLASS_LOAD:
+            return VEMU_IR_REG(dec->rs1);
+
+        case VEMU_IR_CLASS_R:
+        case VEMU_IR_CLASS_STORE:
+            return VEMU_IR_REG(dec->rs1) | VEMU_IR_REG(dec->rs2);
+
+        case VEMU_IR_CLASS_OTHER:
+            break;
+    }
+
+    switch (dec->opcode) {
+        case VEMU_OPCODE_JALR:
+            return VEMU_IR_REG(dec->rs1);
+
+        case VEMU_OPCODE_BEQ:
+        case VEMU_OPCODE_BNE:
+        case VEMU_OPCODE_BLT:
+        case VEMU_OPCODE_BGE:
+        case VEMU_OPCODE_BLTU:
+        case VEMU_OPCODE_BGEU:
+        case VEMU_OPCODE_SLT_BNEZ:
+        case VEMU_OPCODE_SLT_BEQZ:
+        case VEMU_OPCODE_SLTU_BNEZ:
+        case VEMU_OPCODE_SLTU_BEQZ:
+        case VEMU_OPCODE_LR_W:
+        case VEMU_OPCODE_SC_W:
+        case VEMU_OPCODE_AMOSWAP_W:
+        case VEMU_OPCODE_AMOADD_W:
+        case VEMU_OPCODE_AMOXOR_W:
+        case VEMU_OPCODE_AMOAND_W:
+        case VEMU_OPCODE_AMOOR_W:
+        case VEMU_OPCODE_AMOMIN_W:
+        case VEMU_OPCODE_AMOMAX_W:
+        case VEMU_OPCODE_AMOMINU_W:
+        case VEMU_OPCODE_AMOMAXU_W:
+            return VEMU_IR_REG(dec->rs1) | VEMU_IR_REG(dec->rs2);
+
+        case VEMU_OPCODE_CSRRW:
+        case VEMU_OPCODE_CSRRW_SATP:
+        case VEMU_OPCODE_FP:
+            return VEMU_IR_REG(dec->rs1);
+
+        case VEMU_OPCODE_VEC:
+            return VEMU_IR_REG(dec->rs1) | VEMU_IR_REG(dec->rs2);
+
+        case VEMU_OPCODE_ECALL:
+        case VEMU_OPCODE_ILLEGAL:
+            return VEMU_IR_ALL_REGS;
+
+        default:
+            return 0;
+    }
+}
+
+static uint32_t vemu_ir_writes(vemu_decoded_t *dec) {
+    if (vemu_ir_class(dec->opcode) != VEMU_IR_CLASS_OTHER) {
+        return vemu_ir_class(dec->opcode) == VEMU_IR_CLASS_STORE
+               ? 0
+               : VEMU_IR_REG(dec->rd);
+    }
+
+    switch (dec->opcode) {
+        case VEMU_OPCODE_AUIPC_LW:
+        case VEMU_OPCODE_AUIPC_JALR:
+            return VEMU_IR_REG(dec->rd) | VEMU_IR_REG(dec->rd2);
+
+        case VEMU_OPCODE_AUIPC:
+        case VEMU_OPCODE_JAL:
+        case VEMU_OPCODE_JALR:
+        case VEMU_OPCODE_SLT_BNEZ:
+        case VEMU_OPCODE_SLT_BEQZ:
+        case VEMU_OPCODE_SLTU_BNEZ:
+        case VEMU_OPCODE_SLTU_BEQZ:
+        case VEMU_OPCODE_CSRR:
+        case VEMU_OPCODE_CSRRW:
+        case VEMU_OPCODE_CSRRW_SATP:
+        case VEMU_OPCODE_FP:
+        case VEMU_OPCODE_VEC:
+        case VEMU_OPCODE_LR_W:
+        case VEMU_OPCODE_SC_W:
+        case VEMU_OPCODE_AMOSWAP_W:
+        case VEMU_OPCODE_AMOADD_W:
+        case VEMU_OPCODE_AMOXOR_W:
+        case VEMU_OPCODE_AMOAND_W:
+        case VEMU_OPCODE_AMOOR_W:
+        case VEMU_OPCODE_AMOMIN_W:
+        case VEMU_OPCODE_AMOMAX_W:
+        case VEMU_OPCODE_AMOMINU_W:
+        case VEMU_OPCODE_AMOMAXU_W:
+            return VEMU_IR_REG(dec->rd);
+
+        case VEMU_OPCODE_ECALL:
+            return VEMU_IR_REG(VEMU_A0);
+
+        default:
+            return 0;
+    }
+}
+
+/* Ops that may write memory or order accesses to it, past which no
+   earlier load can be reused */
+static bool vemu_ir_is_barrier(vemu_decoded_t *dec) {
+    switch (dec->opcode) {
+        case VEMU_OPCODE_FENCE:
+        case VEMU_OPCODE_ECALL:
+        case VEMU_OPCODE_LR_W:
+        case VEMU_OPCODE_SC_W:
+        case VEMU_OPCODE_AMOSWAP_W:
+        case VEMU_OPCODE_AMOADD_W:
+        case VEMU_OPCODE_AMOXOR_W:
+        case VEMU_OPCODE_AMOAND_W:
+        case VEMU_OPCODE_AMOOR_W:
+        case VEMU_OPCODE_AMOMIN_W:
+        case VEMU_OPCODE_AMOMAX_W:
+        case VEMU_OPCODE_AMOMINU_W:
+        case VEMU_OPCODE_AMOMAXU_W:
+            return true;
+
+        case VEMU_OPCODE_FP:
+            return VEMU_FP_OPCODE(dec->imm2) == VEMU_FP_FSW
+                || VEMU_FP_OPCODE(dec->imm2) == VEMU_FP_FSD;
+
+        case VEMU_OPCODE_VEC:
+            switch (VEMU_VEC_OPCODE(dec->imm2)) {
+                case VEMU_VEC_VSE:
+                case VEMU_VEC_VSSE:
+                case VEMU_VEC_VSXEI:
+                case VEMU_VEC_VSM:
+                case VEMU_VEC_VSR:
+                    return true;
+
+                default:
+                    return false;
+            }
+
+        default:
+            return false;
+    }
+}
+
+/* Ops whose only effect is the registers they write. Loads are not: they
+   may fault or read a device, so only the redundant loads pass, which
+   knows the earlier load already did, gets to drop them. */
+static bool vemu_ir_is_pure(vemu_decoded_t *dec) {
+    switch (vemu_ir_class(dec->opcode)) {
+        case VEMU_IR_CLASS_IMM:
+        case VEMU_IR_CLASS_I:
+        case VEMU_IR_CLASS_R:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* Must agree with the EXEC_FUNC handlers */
+static uint32_t vemu_ir_fold(vemu_opcode_t opcode, uint32_t x, uint32_t y,
+                             uint32_t imm) {
+    switch (opcode) {
+        case VEMU_OPCODE_ADDI:  return x + imm;
+        case VEMU_OPCODE_SLTI:  return (int32_t)x < (int32_t)imm;
+        case VEMU_OPCODE_SLTIU: return x < imm;
+        case VEMU_OPCODE_XORI:  return x ^ imm;
+        case VEMU_OPCODE_ORI:   return x | imm;
+        case VEMU_OPCODE_ANDI:  return x & imm;
+        case VEMU_OPCODE_SLLI:  return x << imm;
+        case VEMU_OPCODE_SRLI:  return x >> imm;
+        case VEMU_OPCODE_SRAI:  return (int32_t)x >> imm;
+        case VEMU_OPCODE_ADD:   return x + y;
+        case VEMU_OPCODE_SUB:   return x - y;
+        case VEMU_OPCODE_SLL:   return x << (y & 0x1F);
+        case VEMU_OPCODE_SLT:   return (int32_t)x < (int32_t)y;
+        case VEMU_OPCODE_SLTU:  return x < y;
+        case VEMU_OPCODE_XOR:   return x ^ y;
+        case VEMU_OPCODE_SRL:   return x >> (y & 0x1F);
+        case VEMU_OPCODE_SRA:   return (int32_t)x >> (y & 0x1F);
+        case VEMU_OPCODE_OR:    return x | y;
+        case VEMU_OPCODE_AND:   return x & y;
+        case VEMU_OPCODE_MUL:   return x * y;
+        case VEMU_OPCODE_MULH:  return vemu_mulh(x, y);
+        case VEMU_OPCODE_MULHSU: return vemu_mulhsu(x, y);
+        case VEMU_OPCODE_MULHU: return vemu_mulhu(x, y);
+        case VEMU_OPCODE_DIV:   return vemu_div(x, y);
+        case VEMU_OPCODE_DIVU:  return vemu_divu(x, y);
+        case VEMU_OPCODE_REM:   return vemu_rem(x, y);
+        case VEMU_OPCODE_REMU:  return vemu_remu(x, y);
+        case VEMU_OPCODE_SH1ADD: return (x << 1) + y;
+        case VEMU_OPCODE_SH2ADD: return (x << 2) + y;
+        case VEMU_OPCODE_SH3ADD: return (x << 3) + y;
+        case VEMU_OPCODE_ANDN:  return x & ~y;
+        case VEMU_OPCODE_ORN:   return x | ~y;
+        case VEMU_OPCODE_XNOR:  return ~(x ^ y);
+        case VEMU_OPCODE_CLZ:   return vemu_clz(x);
+        case VEMU_OPCODE_CTZ:   return vemu_ctz(x);
+        case VEMU_OPCODE_CPOP:  return vemu_cpop(x);
+        case VEMU_OPCODE_MAX:   return vemu_max(x, y);
+        case VEMU_OPCODE_MAXU:  return vemu_maxu(x, y);
+        case VEMU_OPCODE_MIN:   return vemu_min(x, y);
+        case VEMU_OPCODE_MINU:  return vemu_minu(x, y);
+        case VEMU_OPCODE_SEXT_B: return (int8_t)x;
+        case VEMU_OPCODE_SEXT_H: return (int16_t)x;
+        case VEMU_OPCODE_ZEXT_H: return (uint16_t)x;
+        case VEMU_OPCODE_ROL:   return vemu_rol(x, y);
+        case VEMU_OPCODE_ROR:   return vemu_ror(x, y);
+        case VEMU_OPCODE_RORI:  return vemu_ror(x, imm);
+        case VEMU_OPCODE_ORC_B: return vemu_orc_b(x);
+        case VEMU_OPCODE_REV8:  return vemu_rev8(x);
+        case VEMU_OPCODE_BCLR:  return x & ~(1u << (y & 0x1F));
+        case VEMU_OPCODE_BCLRI: return x & ~(1u << imm);
+        case VEMU_OPCODE_BEXT:  return (x >> (y & 0x1F)) & 1;
+        case VEMU_OPCODE_BEXTI: return (x >> imm) & 1;
+        case VEMU_OPCODE_BINV:  return x ^ (1u << (y & 0x1F));
+        case VEMU_OPCODE_BINVI: return x ^ (1u << imm);
+        case VEMU_OPCODE_BSET:  return x | (1u << (y & 0x1F));
+        case VEMU_OPCODE_BSETI: return x | (1u << imm);
+        default:                return imm;
+    }
+}
+
+static uint32_t vemu_ir_add_value(vemu_ir_t *ir, vemu_ir_value_t value) {
+    ir->values[ir->n_values] = value;
+    return ir->n_values++;
+}
+
+static uint32_t vemu_ir_const(vemu_ir_t *ir, uint32_t c) {
+    for (uint32_t i = 0; i < ir->n_values; i++) {
+        vemu_ir_value_t *value = &ir->values[i];
+        if (value->kind == VEMU_IR_VALUE_CONST && value->c == c) {
+            return i;
+        }
+    }
+
+    return vemu_ir_add_value(ir, (vemu_ir_value_t){
+        .kind = VEMU_IR_VALUE_CONST, .c = c
+    });
+}
+
+static uint32_t vemu_ir_expr(vemu_ir_t *ir, vemu_opcode_t opcode, uint32_t x,
+                             uint32_t y, uint32_t imm) {
+    for (uint32_t i = 0; i < ir->n_values; i++) {
+        vemu_ir_value_t *value = &ir->values[i];
+        if (value->kind == VEMU_IR_VALUE_EXPR && value->opcode == opcode
+                && value->args[0] == x && value->args[1] == y
+                && value->imm == imm) {
+            return i;
+        }
+    }
+
+    return vemu_ir_add_value(ir, (vemu_ir_value_t){
+        .kind = VEMU_IR_VALUE_EXPR, .opcode = opcode,
+        .args = { x, y }, .imm = imm
+    });
+}
+
+static uint32_t vemu_ir_unknown(vemu_ir_t *ir) {
+    return vemu_ir_add_value(ir, (vemu_ir_value_t){
+        .kind = VEMU_IR_VALUE_UNKNOWN
+    });
+}
+
+static bool vemu_ir_is_const(vemu_ir_t *ir, uint32_t value) {
+    return ir->values[value].kind == VEMU_IR_VALUE_CONST;
+}
+
+static void vemu_ir_set_reg(vemu_ir_t *ir, uint8_t r, uint32_t value) {
+    if (r != VEMU_ZERO) {
+        ir->regs[r] = value;
+    }
+}
+
+static void vemu_ir_build(vemu_ir_t *ir, vemu_decoded_t *ops, uint32_t n_ops,
+                          bool has_term) {
+    ir->n_ops = n_ops;
+    ir->has_term = has_term;
+    for (uint32_t i = 0; i < n_ops; i++) {
+        ir->ops[i] = (vemu_ir_op_t){
+            .dec = ops[i],
+            .src = { VEMU_IR_NONE, VEMU_IR_NONE },
+            .dst = VEMU_IR_NONE,
+            .dead = false,
+        };
+    }
+
+    ir->n_values = 0;
+    for (uint32_t r = 0; r < VEMU_N_REGS; r++) {
+        ir->regs[r] = vemu_ir_add_value(ir, (vemu_ir_value_t){
+            .kind = VEMU_IR_VALUE_ENTRY
+        });
+    }
+    ir->zero = vemu_ir_const(ir, 0);
+    ir->regs[VEMU_ZERO] = ir->zero;
+
+    ir->n_mem = 0;
+}
+
+/* Loads and stores through a constant base become absolute, which also
+   makes their address comparable to other absolute accesses. */
+static void vemu_ir_address(vemu_ir_t *ir, vemu_ir_op_t *op, uint32_t passes,
+                            vemu_ir_stats_t *stats, uint32_t *base,
+                            uint32_t *imm) {
+    vemu_decoded_t *dec = &op->dec;
+    uint32_t value = op->src[0];
+
+    *base = value;
+    *imm = dec->imm;
+
+    if (!vemu_ir_is_const(ir, value)) {
+        return;
+    }
+
+    *base = ir->zero;
+    *imm = ir->values[value].c + dec->imm;
+
+    if ((passes & VEMU_IR_CONST_PROP) && dec->rs1 != VEMU_ZERO) {
+        dec->rs1 = VEMU_ZERO;
+        dec->imm = *imm;
+        op->src[0] = ir->zero;
+        stats->folded++;
+    }
+}
+
+static vemu_ir_mem_t *vemu_ir_find_load(vemu_ir_t *ir, vemu_opcode_t opcode,
+                                        uint32_t base, uint32_t imm) {
+    for (uint32_t i = 0; i < ir->n_mem; i++) {
+        vemu_ir_mem_t *mem = &ir->mem[i];
+        if (mem->opcode == opcode && mem->base == base && mem->imm == imm) {
+            return mem;
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t vemu_ir_load(vemu_ir_t *ir, vemu_opcode_t opcode,
+                             uint32_t base, uint32_t imm) {
+    vemu_ir_mem_t *mem = vemu_ir_find_load(ir, opcode, base, imm);
+    if (mem != NULL) {
+        return mem->value;
+    }
+
+    uint32_t value = vemu_ir_unknown(ir);
+    ir->mem[ir->n_mem++] = (vemu_ir_mem_t){
+        .opcode = opcode, .base = base, .imm = imm, .value = value
+    };
+
+    return value;
+}
+
+static int vemu_ir_holder(vemu_ir_t *ir, uint32_t value) {
+    for (int r = 1; r < VEMU_N_REGS; r++) {
+        if (ir->regs[r] == value) {
+            return r;
+        }
+    }
+
+    return -1;
+}
+
+static void vemu_ir_reuse_load(vemu_ir_t *ir, vemu_ir_op_t *op,
+                               uint32_t value, vemu_ir_stats_t *stats) {
+    int r = vemu_ir_holder(ir, value);
+    if (r < 0) {
+        return;
+    }
+
+    /* The load the value came from has already faulted if it was going
+       to, so a load into x0 goes away too */
+    if (r == op->dec.rd || op->dec.rd == VEMU_ZERO) {
+        op->dead = true;
+    } else {
+        uint8_t n_instrs = op->dec.n_instrs;
+        op->dec = (vemu_decoded_t){
+            .opcode = VEMU_OPCODE_ADDI, .rd = op->dec.rd, .rs1 = r,
+            .n_instrs = n_instrs,
+        };
+        op->src[0] = value;
+    }
+    stats->loads++;
+}
+
+/* Numbers every value in the block, folding constants and reusing loaded
+   values on the way. */
+static void vemu_ir_forward(vemu_ir_t *ir, uint32_t passes,
+                            vemu_ir_stats_t *stats) {
+    for (uint32_t i = 0; i < ir->n_ops; i++) {
+        vemu_ir_op_t *op = &ir->ops[i];
+        vemu_decoded_t *dec = &op->dec;
+        vemu_ir_class_t class = vemu_ir_class(dec->opcode);
+        uint32_t x = ir->regs[dec->rs1], y = ir->regs[dec->rs2];
+        uint32_t value, base, imm;
+
+        op->src[0] = x;
+        op->src[1] = y;
+
+        switch (class) {
+            case VEMU_IR_CLASS_IMM:
+                value = vemu_ir_const(ir, dec->imm);
+                break;
+
+            case VEMU_IR_CLASS_I:
+            case VEMU_IR_CLASS_R:
+                if (vemu_ir_is_const(ir, x) && (class == VEMU_IR_CLASS_I
+                                                || vemu_ir_is_const(ir, y))) {
+                    uint32_t c = vemu_ir_fold(dec->opcode, ir->values[x].c,
+                                              ir->values[y].c, dec->imm);
+                    value = vemu_ir_const(ir, c);
+
+                    if (passes & VEMU_IR_CONST_PROP) {
+                        dec->opcode = VEMU_OPCODE_LUI;
+                        dec->rs1 = dec->rs2 = VEMU_ZERO;
+                        dec->imm = c;
+                        stats->folded++;
+                    }
+                } else if (dec->opcode == VEMU_OPCODE_ADDI && dec->imm == 0) {
+                    value = x;
+                } else if (class == VEMU_IR_CLASS_I) {
+                    value = vemu_ir_expr(ir, dec->opcode, x, VEMU_IR_NONE,
+                                         dec->imm);
+                } else {
+                    value = vemu_ir_expr(ir, dec->opcode, x, y, 0);
+                }
+                break;
+
+            case VEMU_IR_CLASS_LOAD: {
+                vemu_ir_address(ir, op, passes, stats, &base, &imm);
+
+                vemu_ir_mem_t *mem = vemu_ir_find_load(ir, dec->opcode,
+                                                       base, imm);
+                if (mem != NULL && (passes & VEMU_IR_REDUNDANT_LOADS)) {
+                    vemu_ir_reuse_load(ir, op, mem->value, stats);
+                }
+                value = vemu_ir_load(ir, dec->opcode, base, imm);
+                break;
+            }
+
+            case VEMU_IR_CLASS_STORE:
+                vemu_ir_address(ir, op, passes, stats, &base, &imm);
+
+                /* Addresses are not disambiguated, so any store may
+                   clobber any earlier load. A word store does tell us
+                   what a word load from the same place will see. */
+                ir->n_mem = 0;
+                if (dec->opcode == VEMU_OPCODE_SW) {
+                    ir->mem[ir->n_mem++] = (vemu_ir_mem_t){
+                        .opcode = VEMU_OPCODE_LW, .base = base, .imm = imm,
+                        .value = y
+                    };
+                }
+                continue;
+
+            case VEMU_IR_CLASS_OTHER:
+            default:
+                if (dec->opcode == VEMU_OPCODE_AUIPC_LW) {
+                    vemu_ir_set_reg(ir, dec->rd, vemu_ir_const(ir, dec->imm));
+                    value = vemu_ir_load(ir, VEMU_OPCODE_LW, ir->zero,
+                                         dec->imm + dec->imm2);
+                    vemu_ir_set_reg(ir, dec->rd2, value);
+                    op->dst = value;
+                    continue;
+                }
+
+                if (vemu_ir_is_barrier(dec)) {
+                    ir->n_mem = 0;
+                }
+
+                for (uint8_t r = 1; r < VEMU_N_REGS; r++) {
+                    if (vemu_ir_writes(dec) & VEMU_IR_REG(r)) {
+                        vemu_ir_set_reg(ir, r, vemu_ir_unknown(ir));
+                    }
+                }
+                continue;
+        }
+
+        op->dst = value;
+        vemu_ir_set_reg(ir, dec->rd, value);
+    }
+}
+
+/* Everything is live when the block is left, so a write is dead only if
+   a later op in the block overwrites the register before reading it. */
+static void vemu_ir_dead_writes(vemu_ir_t *ir, vemu_ir_stats_t *stats) {
+    uint32_t live = VEMU_IR_ALL_REGS;
+
+    for (uint32_t i = ir->n_ops; i-- > 0; ) {
+        vemu_ir_op_t *op = &ir->ops[i];
+        if (op->dead) {
+            continue;
+        }
+
+        uint32_t writes = vemu_ir_writes(&op->dec);
+        bool is_term = ir->has_term && i == ir->n_ops - 1;
+
+        if (!is_term && vemu_ir_is_pure(&op->dec) && (writes & live) == 0) {
+            op->dead = true;
+            stats->dead++;
+            continue;
+        }
+
+        live = (live & ~writes) | vemu_ir_reads(&op->dec);
+    }
+}
+
+static uint32_t vemu_ir_lower(vemu_ir_t *ir, vemu_decoded_t *ops) {
+    uint32_t n_ops = 0;
+
+    for (uint32_t i = 0; i < ir->n_ops; i++) {
+        if (!ir->ops[i].dead) {
+            ops[n_ops++] = ir->ops[i].dec;
+        }
+    }
+
+    return n_ops;
+}
+
+/* Rewrites the ops of a block in place and returns how many are left.
+   The terminator, if any, stays last. */
+uint32_t vemu_ir_optimize(vemu_decoded_t *ops, uint32_t n_ops, bool has_term,
+                          uint32_t passes, vemu_ir_stats_t *stats) {
+    vemu_ir_t ir;
+
+    stats->ops_in += n_ops;
+
+    if (passes != 0) {
+        vemu_ir_build(&ir, ops, n_ops, has_term);
+        vemu_ir_forward(&ir, passes, stats);
+        if (passes & VEMU_IR_DEAD_WRITES) {
+            vemu_ir_dead_writes(&ir, stats);
+        }
+        n_ops = vemu_ir_lower(&ir, ops);
+    }
+
+    stats->ops_out += n_ops;
+
+    return n_ops;
+}
@@ -0,0 +1,1580 @@
+#include "jit.h"
+#include "cpu.h"
+#include "fp.h"
+#include "vec.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Register use in generated code:
+     rbx   vemu_cpu_t *, guest registers live in cpu->regs
+     r12   guest RAM base
+     rax, rcx, rdx   scratch
+   Blocks carry no prologue of their own, so a chained exit is a plain
+   jmp into the next block. */
+
+#define X86_RAX     0
+#define X86_RCX     1
+#define X86_RDX     2
+#define X86_RBX     3
+#define X86_RSI     6
+
+#define X86_CC_B    0x2
+#define X86_CC_AE   0x3
+#define X86_CC_E    0x4
+#define X86_CC_NE   0x5
+#define X86_CC_A    0x7
+#define X86_CC_L    0xC
+#define X86_CC_GE   0xD
+#define X86_CC_G    0xF
+
+#define X86_ALU_ADD 0
+#define X86_ALU_OR  1
+#define X86_ALU_AND 4
+#define X86_ALU_SUB 5
+#define X86_ALU_XOR 6
+#define X86_ALU_CMP 7
+
+#define X86_SHIFT_ROL   0
+#define X86_SHIFT_ROR   1
+#define X86_SHIFT_SHL   4
+#define X86_SHIFT_SHR   5
+#define X86_SHIFT_SAR   7
+
+#define VEMU_JIT_REG(r) (offsetof(vemu_cpu_t, regs) + 4 * (r))
+
+typedef struct {
+    uint8_t *p;
+    uint8_t *end;
+    bool overflow;
+    bool check_stores;
+    bool check_devices;
+    bool translate;
+    uint32_t host;
+} vemu_jit_emitter_t;
+
+static void emit8(vemu_jit_emitter_t *e, uint8_t byte) {
+    if (e->p < e->end) {
+        *e->p++ = byte;
+    } else {
+        e->overflow = true;
+    }
+}
+
+static void emit32(vemu_jit_emitter_t *e, uint32_t word) {
+    for (size_t i = 0; i < 4; i++) {
+        emit8(e, (word >> (8 * i)) & 0xFF);
+    }
+}
+
+static void emit_bytes(vemu_jit_emitter_t *e, uint8_t const *bytes,
+                       size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        emit8(e, bytes[i]);
+    }
+}
+
+/* ModRM (+ displacement) for [rbx + disp] */
+static void emit_rbx_operand(vemu_jit_emitter_t *e, uint8_t reg,
+                             uint32_t disp) {
+    if (disp < 0x80) {
+        emit8(e, 0x40 | (reg << 3) | X86_RBX);
+        emit8(e, disp);
+    } else {
+        emit8(e, 0x80 | (reg << 3) | X86_RBX);
+        emit32(e, disp);
+    }
+}
+
+/* mov r32, [rbx + disp] */
+static void emit_load_cpu(vemu_jit_emitter_t *e, uint8_t reg, uint32_t disp) {
+    emit8(e, 0x8B);
+    emit_rbx_operand(e, reg, disp);
+}
+
+/* mov [rbx + disp], r32 */
+static void emit_store_cpu(vemu_jit_emitter_t *e, uint8_t reg,
+                           uint32_t disp) {
+    emit8(e, 0x89);
+    emit_rbx_operand(e, reg, disp);
+}
+
+/* mov dword [rbx + disp], imm32 */
+static void emit_store_cpu_imm(vemu_jit_emitter_t *e, uint32_t disp,
+                               uint32_t imm) {
+    emit8(e, 0xC7);
+    emit_rbx_operand(e, 0, disp);
+    emit32(e, imm);
+}
+
+/* <alu> r32, [rbx + disp] */
+static void emit_alu_cpu(vemu_jit_emitter_t *e, uint8_t alu, uint8_t reg,
+                         uint32_t disp) {
+    emit8(e, (alu << 3) | 0x03);
+    emit_rbx_operand(e, reg, disp);
+}
+
+/* <alu> r32, imm32 */
+static void emit_alu_imm(vemu_jit_emitter_t *e, uint8_t alu, uint8_t reg,
+                         uint32_t imm) {
+    emit8(e, 0x81);
+    emit8(e, 0xC0 | (alu << 3) | reg);
+    emit32(e, imm);
+}
+
+/* <shift> r32, imm8 */
+static void emit_shift_imm(vemu_jit_emitter_t *e, uint8_t shift,
+                           uint8_t reg, uint8_t imm) {
+    emit8(e, 0xC1);
+    emit8(e, 0xC0 | (shift << 3) | reg);
+    emit8(e, imm);
+}
+
+/* <shift> r32, cl */
+static void emit_shift_cl(vemu_jit_emitter_t *e, uint8_t shift,
+                          uint8_t reg) {
+    emit8(e, 0xD3);
+    emit8(e, 0xC0 | (shift << 3) | reg);
+}
+
+/* mov r32, imm32 */
+static void emit_mov_imm(vemu_jit_emitter_t *e, uint8_t reg, uint32_t imm) {
+    emit8(e, 0xB8 + reg);
+    emit32(e, imm);
+}
+
+/* xor r32, r32 */
+static void emit_zero(vemu_jit_emitter_t *e, uint8_t reg) {
+    emit8(e, 0x31);
+    emit8(e, 0xC0 | (reg << 3) | reg);
+}
+
+/* set<cc> r8 */
+static void emit_setcc(vemu_jit_emitter_t *e, uint8_t cc, uint8_t reg) {
+    emit8(e, 0x0F);
+    emit8(e, 0x90 | cc);
+    emit8(e, 0xC0 | reg);
+}
+
+/* <alu> qword [rbx + disp], imm */
+static void emit_alu_cpu64(vemu_jit_emitter_t *e, uint8_t alu, uint32_t disp,
+                           uint32_t imm) {
+    emit8(e, 0x48);
+    if (imm < 0x80) {
+        emit8(e, 0x83);
+        emit_rbx_operand(e, alu, disp);
+        emit8(e, imm);
+    } else {
+        emit8(e, 0x81);
+        emit_rbx_operand(e, alu, disp);
+        emit32(e, imm);
+    }
+}
+
+/* Increments a 64-bit counter outside the cpu, clobbering rax */
+static void emit_count(vemu_jit_emitter_t *e, uint64_t *counter) {
+    /* add qword [rax], 1 */
+    static uint8_t const add_one[] = { 0x48, 0x83, 0x00, 0x01 };
+    uint64_t addr = (uint64_t)(uintptr_t)counter;
+
+    emit8(e, 0x48);
+    emit8(e, 0xB8 + X86_RAX);
+    emit32(e, addr & 0xFFFFFFFF);
+    emit32(e, addr >> 32);
+    emit_bytes(e, add_one, sizeof(add_one));
+}
+
+/* Calls fn with rdi = cpu and the other arguments already in place. The
+   call may clobber any caller-saved register. */
+static void emit_call(vemu_jit_emitter_t *e, uintptr_t fn) {
+    /* mov rdi, rbx */
+    static uint8_t const mov_rdi_rbx[] = { 0x48, 0x89, 0xDF };
+    static uint8_t const call_rax[] = { 0xFF, 0xD0 };
+    uint64_t addr = fn;
+
+    emit_bytes(e, mov_rdi_rbx, sizeof(mov_rdi_rbx));
+    emit8(e, 0x48);
+    emit8(e, 0xB8 + X86_RAX);
+    emit32(e, addr & 0xFFFFFFFF);
+    emit32(e, addr >> 32);
+    emit_bytes(e, call_rax, sizeof(call_rax));
+}
+
+static uint8_t *emit_rel32(vemu_jit_emitter_t *e, uint8_t *target) {
+    uint8_t *site = e->p;
+    emit32(e, (uint32_t)(target - (site + 4)));
+    return site;
+}
+
+/* Leaves native code with eax = ip. Exits with a static successor also
+   pass the address of their jump's rel32 in rdx so the dispatcher can
+   later point it straight at the successor's code. */
+static void emit_exit(vemu_jit_emitter_t *e, vemu_jit_t *jit, uint32_t ip,
+                      bool linkable) {
+    static uint8_t const lea_rdx_next_rel32[] = {
+        0x48, 0x8D, 0x15, 0x01, 0x00, 0x00, 0x00
+    };
+
+    emit_mov_imm(e, X86_RAX, ip);
+    if (linkable) {
+        emit_bytes(e, lea_rdx_next_rel32, sizeof(lea_rdx_next_rel32));
+    } else {
+        emit_zero(e, X86_RDX);
+    }
+    emit8(e, 0xE9);
+    emit_rel32(e, jit->exit);
+}
+
+/* eax = rs1 + imm, which also clears the upper half of rax */
+static void emit_address(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    if (dec->imm != 0) {
+        emit_alu_imm(e, X86_ALU_ADD, X86_RAX, dec->imm);
+    }
+}
+
+/* Branches if the guest address in eax is on a device page, and returns
+   the rel8 of the branch. Clobbers rdx and rsi. */
+static uint8_t *emit_device_check(vemu_jit_emitter_t *e) {
+    /* mov edx, eax */
+    static uint8_t const mov_edx_eax[] = { 0x89, 0xC2 };
+    /* test byte [rsi + rdx], device mask */
+    static uint8_t const test_page[] = { 0xF6, 0x04, 0x16 };
+
+    /* mov rsi, [rbx + bus]; mov rsi, [rsi + pages] */
+    emit8(e, 0x48);
+    emit8(e, 0x8B);
+    emit_rbx_operand(e, X86_RSI, offsetof(vemu_cpu_t, bus));
+    emit8(e, 0x48);
+    emit8(e, 0x8B);
+    emit8(e, 0x76);
+    emit8(e, offsetof(vemu_bus_t, pages));
+
+    emit_bytes(e, mov_edx_eax, sizeof(mov_edx_eax));
+    emit_shift_imm(e, X86_SHIFT_SHR, X86_RDX, VEMU_BUS_PAGE_BITS);
+    emit_bytes(e, test_page, sizeof(test_page));
+    emit8(e, VEMU_BUS_DEVICE_MASK);
+
+    /* jne slow */
+    emit8(e, 0x75);
+    uint8_t *to_slow = e->p;
+    emit8(e, 0);
+
+    return to_slow;
+}
+
+/* Points a rel8 emitted at site at the current position */
+static void emit_patch_rel8(vemu_jit_emitter_t *e, uint8_t *site) {
+    if (!e->overflow) {
+        *site = (uint8_t)(e->p - (site + 1));
+    }
+}
+
+/* jmp rel8, returning the rel8 */
+static uint8_t *emit_jmp_rel8(vemu_jit_emitter_t *e) {
+    emit8(e, 0xEB);
+    uint8_t *site = e->p;
+    emit8(e, 0);
+    return site;
+}
+
+/* op reg, [rbx + rdx + disp32] on field of the data TLB entry rdx is
+   the offset of */
+static void emit_tlb_operand(vemu_jit_emitter_t *e, uint8_t op, uint8_t reg,
+                             size_t field) {
+    emit8(e, op);
+    emit8(e, 0x84 | (reg << 3));
+    emit8(e, 0x13);
+    emit32(e, offsetof(vemu_cpu_t, mmu.dtlb.entries) + field);
+}
+
+/* Looks the access of len bytes at the guest address in eax up in the
+   data TLB, and returns the rel8 of the jump taken on a miss, which an
+   access running on into the next page also takes. Falls through on a
+   hit with rdx = the offset of the entry, for emit_tlb_operand(). 
+   Clobbers rsi. */
+static uint8_t *emit_tlb_lookup(vemu_jit_emitter_t *e, uint8_t len,
+                                bool store) {
+    /* mov edx, eax */
+    static uint8_t const mov_edx_eax[] = { 0x89, 0xC2 };
+    /* mov esi, eax */
+    static uint8_t const mov_esi_eax[] = { 0x89, 0xC6 };
+
+    /* Entries are 16 bytes, so the index shifted left by 4 is the page
+       number shifted right by 8, masked */
+    emit_bytes(e, mov_edx_eax, sizeof(mov_edx_eax));
+    emit_shift_imm(e, X86_SHIFT_SHR, X86_RDX, VEMU_MMU_PAGE_BITS - 4);
+    emit_alu_imm(e, X86_ALU_AND, X86_RDX, (VEMU_MMU_TLB_SIZE - 1) << 4);
+
+    /* esi = page of the last byte */
+    if (len > 1) {
+        /* lea esi, [rax + len - 1] */
+        emit8(e, 0x8D);
+        emit8(e, 0x70);
+        emit8(e, len - 1);
+    } else {
+        emit_bytes(e, mov_esi_eax, sizeof(mov_esi_eax));
+    }
+    emit_alu_imm(e, X86_ALU_AND, X86_RSI, VEMU_MMU_PAGE_MASK);
+
+    /* cmp esi, tag; jne slow */
+    emit_tlb_operand(e, 0x3B, X86_RSI,
+                     store ? offsetof(vemu_tlb_entry_t, store)
+                           : offsetof(vemu_tlb_entry_t, load));
+    emit8(e, 0x75);
+    uint8_t *to_slow = e->p;
+    emit8(e, 0);
+
+    emit_alu_cpu64(e, X86_ALU_ADD, offsetof(vemu_cpu_t, mmu.dtlb.hits), 1);
+
+    return to_slow;
+}
+
+static uint8_t vemu_jit_load_len(vemu_opcode_t opcode) {
+    switch (opcode) {
+        case VEMU_OPCODE_LB:
+        case VEMU_OPCODE_LBU:
+            return 1;
+
+        case VEMU_OPCODE_LH:
+        case VEMU_OPCODE_LHU:
+            return 2;
+
+        default:
+            return 4;
+    }
+}
+
+/* Loads from the guest address in eax into rd. While addresses are
+   translated, a TLB miss goes to vemu_cpu_load() instead, and so does an
+   address on a device page with devices on the bus. */
+static void emit_load_rax(vemu_jit_emitter_t *e, vemu_opcode_t opcode,
+                          uint8_t rd, uint8_t const *op, size_t n) {
+    /* <op> ecx, [r12 + rax] */
+    static uint8_t const operand[] = { 0x0C, 0x04 };
+    /* mov esi, eax */
+    static uint8_t const mov_esi_eax[] = { 0x89, 0xC6 };
+    /* mov ecx, eax */
+    static uint8_t const mov_ecx_eax[] = { 0x89, 0xC1 };
+
+    uint8_t *to_slow = NULL;
+    if (e->translate) {
+        /* add eax, addend */
+        to_slow = emit_tlb_lookup(e, vemu_jit_load_len(opcode), false);
+        emit_tlb_operand(e, 0x03, X86_RAX, 
+                         offsetof(vemu_tlb_entry_t, addend));
+    } else if (e->check_devices) {
+        to_slow = emit_device_check(e);
+    }
+
+    emit8(e, 0x41);
+    emit_bytes(e, op, n);
+    emit_bytes(e, operand, sizeof(operand));
+
+    if (to_slow != NULL) {
+        uint8_t *to_done = emit_jmp_rel8(e);
+
+        emit_patch_rel8(e, to_slow);
+        emit_bytes(e, mov_esi_eax, sizeof(mov_esi_eax));
+        emit_mov_imm(e, X86_RDX, opcode);
+        emit_call(e, (uintptr_t)vemu_cpu_load);
+        emit_bytes(e, mov_ecx_eax, sizeof(mov_ecx_eax));
+
+        emit_patch_rel8(e, to_done);
+    }
+
+    if (rd != VEMU_ZERO) {
+        emit_store_cpu(e, X86_RCX, VEMU_JIT_REG(rd));
+    }
+}
+
+static void emit_load(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                      uint8_t const *op, size_t n) {
+    emit_address(e, dec);
+    emit_load_rax(e, dec->opcode, dec->rd, op, n);
+}
+
+/* Calls vemu_cpu_code_store() if the store of len bytes at eax hit a 
+   page with decoded code. Only the first page is looked up inline; the
+   rare store that crosses into the next one always takes the call, which
+   checks again. Clobbers rax, rcx and rdx; the call may clobber any 
+   caller-saved register. */
+static void emit_store_check(vemu_jit_emitter_t *e, uint8_t len) {
+    /* cmp qword [rdx + rcx * 8], 0 */
+    static uint8_t const cmp_page[] = { 0x48, 0x83, 0x3C, 0xCA, 0x00 };
+    /* mov esi, eax */
+    static uint8_t const mov_esi_eax[] = { 0x89, 0xC6 };
+
+    /* mov rdx, [rbx + smc.pages] */
+    emit8(e, 0x48);
+    emit8(e, 0x8B);
+    emit_rbx_operand(e, X86_RDX, offsetof(vemu_cpu_t, smc.pages));
+
+    /* mov ecx, eax; shr ecx, page bits */
+    emit8(e, 0x89);
+    emit8(e, 0xC1);
+    emit_shift_imm(e, X86_SHIFT_SHR, X86_RCX, VEMU_SMC_PAGE_BITS);
+    emit_bytes(e, cmp_page, sizeof(cmp_page));
+
+    uint8_t *to_slow = NULL;
+    if (len > 1) {
+        /* jne slow; lea ecx, [rax + len - 1]; xor ecx, eax; 
+           test ecx, ~page offset mask */
+        emit8(e, 0x75);
+        to_slow = e->p;
+        emit8(e, 0);
+        emit8(e, 0x8D);
+        emit8(e, 0x48);
+        emit8(e, len - 1);
+        emit8(e, 0x31);
+        emit8(e, 0xC1);
+        emit8(e, 0xF7);
+        emit8(e, 0xC1);
+        emit32(e, ~0u << VEMU_SMC_PAGE_BITS);
+    }
+
+    /* je done */
+    emit8(e, 0x74);
+    uint8_t *to_done = e->p;
+    emit8(e, 0);
+
+    uint8_t *slow_start = e->p;
+    emit_bytes(e, mov_esi_eax, sizeof(mov_esi_eax));
+    emit_mov_imm(e, X86_RDX, len);
+    emit_call(e, (uintptr_t)vemu_cpu_code_store);
+
+    if (!e->overflow) {
+        *to_done = (uint8_t)(e->p - (to_done + 1));
+        if (to_slow != NULL) {
+            *to_slow = (uint8_t)(slow_start - (to_slow + 1));
+        }
+    }
+}
+
+/* Stores that miss the TLB or hit a device page go to vemu_cpu_store()
+   with the value still in ecx. A translated store goes through esi, so
+   that eax keeps the virtual address the store check looks up. */
+static void emit_store(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                       uint8_t len) {
+    /* mov [r12 + rax], cl/cx/ecx */
+    static uint8_t const operand[] = { 0x0C, 0x04 };
+    /* mov [r12 + rsi], cl/cx/ecx */
+    static uint8_t const translated[] = { 0x0C, 0x34 };
+    /* mov esi, eax */
+    static uint8_t const mov_esi_eax[] = { 0x89, 0xC6 };
+    /* add esi, eax */
+    static uint8_t const add_esi_eax[] = { 0x01, 0xC6 };
+
+    emit_address(e, dec);
+    emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+
+    uint8_t *to_slow = NULL;
+    if (e->translate) {
+        /* mov esi, addend; add esi, eax */
+        to_slow = emit_tlb_lookup(e, len, true);
+        emit_tlb_operand(e, 0x8B, X86_RSI, 
+                         offsetof(vemu_tlb_entry_t, addend));
+        emit_bytes(e, add_esi_eax, sizeof(add_esi_eax));
+    } else if (e->check_devices) {
+        to_slow = emit_device_check(e);
+    }
+
+    if (len == 2) {
+        emit8(e, 0x66);
+    }
+    emit8(e, 0x41);
+    emit8(e, len == 1 ? 0x88 : 0x89);
+    if (e->translate) {
+        emit_bytes(e, translated, sizeof(translated));
+    } else {
+        emit_bytes(e, operand, sizeof(operand));
+    }
+
+    if (e->check_stores) {
+        emit_store_check(e, len);
+    }
+
+    if (to_slow != NULL) {
+        uint8_t *to_done = emit_jmp_rel8(e);
+
+        emit_patch_rel8(e, to_slow);
+        emit_bytes(e, mov_esi_eax, sizeof(mov_esi_eax));
+        emit_mov_imm(e, X86_RDX, len);
+        emit_call(e, (uintptr_t)vemu_cpu_store);
+
+        emit_patch_rel8(e, to_done);
+    }
+}
+
+static void emit_alu_rr(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                        uint8_t alu) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_alu_cpu(e, alu, X86_RAX, VEMU_JIT_REG(dec->rs2));
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_alu_ri(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                        uint8_t alu) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_alu_imm(e, alu, X86_RAX, dec->imm);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_shift_rr(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                          uint8_t shift) {
+    /* x86 masks 32-bit shift counts to 5 bits, as RV32I requires */
+    emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_shift_cl(e, shift, X86_RAX);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_shift_ri(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                          uint8_t shift) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_shift_imm(e, shift, X86_RAX, dec->imm & 0x1F);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_set_rr(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                        uint8_t cc) {
+    emit_zero(e, X86_RCX);
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_alu_cpu(e, X86_ALU_CMP, X86_RAX, VEMU_JIT_REG(dec->rs2));
+    emit_setcc(e, cc, X86_RCX);
+    emit_store_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_set_ri(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                        uint8_t cc) {
+    emit_zero(e, X86_RCX);
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_alu_imm(e, X86_ALU_CMP, X86_RAX, dec->imm);
+    emit_setcc(e, cc, X86_RCX);
+    emit_store_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rd));
+}
+
+/* imul eax, [rs2] for mul; the one-operand imul and mul leave the upper
+   half of the product in edx */
+static void emit_mul(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+
+    switch (dec->opcode) {
+        case VEMU_OPCODE_MUL:
+            emit8(e, 0x0F);
+            emit8(e, 0xAF);
+            emit_rbx_operand(e, X86_RAX, VEMU_JIT_REG(dec->rs2));
+            emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+            break;
+
+        case VEMU_OPCODE_MULH:
+        case VEMU_OPCODE_MULHU:
+            /* imul/mul dword [rbx + disp] */
+            emit8(e, 0xF7);
+            emit_rbx_operand(e, dec->opcode == VEMU_OPCODE_MULH ? 5 : 4,
+                             VEMU_JIT_REG(dec->rs2));
+            emit_store_cpu(e, X86_RDX, VEMU_JIT_REG(dec->rd));
+            break;
+
+        default: {
+            /* mulhsu: movsxd rax, eax; imul rax, rcx; shr rax, 32 */
+            static uint8_t const movsxd_rax_eax[] = { 0x48, 0x63, 0xC0 };
+            static uint8_t const imul_rax_rcx[] = { 0x48, 0x0F, 0xAF, 0xC1 };
+            static uint8_t const shr_rax_32[] = { 0x48, 0xC1, 0xE8, 0x20 };
+
+            emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+            emit_bytes(e, movsxd_rax_eax, sizeof(movsxd_rax_eax));
+            emit_bytes(e, imul_rax_rcx, sizeof(imul_rax_rcx));
+            emit_bytes(e, shr_rax_32, sizeof(shr_rax_32));
+            emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+            break;
+        }
+    }
+}
+
+/* x86 division traps where RISC-V gives a result, so a zero divisor and,
+   for signed division, a divisor of -1 are handled before idiv. Every
+   path leaves the result in eax:
+
+       mov eax, [rs1]; mov ecx, [rs2]
+       test ecx, ecx; jz zero
+       cmp ecx, -1; jne divide          (signed only)
+       neg eax / xor eax, eax; jmp done (signed only)
+   divide:
+       cdq; idiv ecx / xor edx, edx; div ecx
+       mov eax, edx                     (remainder only)
+       jmp done
+   zero:
+       or eax, -1                       (quotient only)
+   done:
+       mov [rd], eax */
+static void emit_divide(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    static uint8_t const test_ecx_ecx[] = { 0x85, 0xC9 };
+    static uint8_t const cmp_ecx_m1[] = { 0x83, 0xF9, 0xFF };
+    static uint8_t const neg_eax[] = { 0xF7, 0xD8 };
+    static uint8_t const cdq_idiv_ecx[] = { 0x99, 0xF7, 0xF9 };
+    static uint8_t const div_ecx[] = { 0xF7, 0xF1 };
+    static uint8_t const mov_eax_edx[] = { 0x89, 0xD0 };
+    static uint8_t const or_eax_m1[] = { 0x83, 0xC8, 0xFF };
+
+    bool sign = dec->opcode == VEMU_OPCODE_DIV
+             || dec->opcode == VEMU_OPCODE_REM;
+    bool rem = dec->opcode == VEMU_OPCODE_REM
+            || dec->opcode == VEMU_OPCODE_REMU;
+
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+    emit_bytes(e, test_ecx_ecx, sizeof(test_ecx_ecx));
+    emit8(e, 0x74);
+    uint8_t *to_zero = e->p;
+    emit8(e, 0);
+
+    uint8_t *to_divide = NULL, *minus_one_done = NULL;
+    if (sign) {
+        /* INT32_MIN / -1 overflows to INT32_MIN, which is what neg does */
+        emit_bytes(e, cmp_ecx_m1, sizeof(cmp_ecx_m1));
+        emit8(e, 0x75);
+        to_divide = e->p;
+        emit8(e, 0);
+        if (rem) {
+            emit_zero(e, X86_RAX);
+        } else {
+            emit_bytes(e, neg_eax, sizeof(neg_eax));
+        }
+        emit8(e, 0xEB);
+        minus_one_done = e->p;
+        emit8(e, 0);
+    }
+
+    uint8_t *divide = e->p;
+    if (sign) {
+        emit_bytes(e, cdq_idiv_ecx, sizeof(cdq_idiv_ecx));
+    } else {
+        emit_zero(e, X86_RDX);
+        emit_bytes(e, div_ecx, sizeof(div_ecx));
+    }
+    if (rem) {
+        emit_bytes(e, mov_eax_edx, sizeof(mov_eax_edx));
+    }
+    emit8(e, 0xEB);
+    uint8_t *divide_done = e->p;
+    emit8(e, 0);
+
+    /* Dividing by zero gives all ones and leaves rs1 as the remainder */
+    uint8_t *zero = e->p;
+    if (!rem) {
+        emit_bytes(e, or_eax_m1, sizeof(or_eax_m1));
+    }
+
+    uint8_t *done = e->p;
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+
+    if (!e->overflow) {
+        *to_zero = (uint8_t)(zero - (to_zero + 1));
+        *divide_done = (uint8_t)(done - (divide_done + 1));
+        if (sign) {
+            *to_divide = (uint8_t)(divide - (to_divide + 1));
+            *minus_one_done = (uint8_t)(done - (minus_one_done + 1));
+        }
+    }
+}
+
+/* sh1add, sh2add and sh3add: lea eax, [rcx + rax * (1 << shift)] */
+static void emit_shadd(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                       uint8_t shift) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+    emit8(e, 0x8D);
+    emit8(e, 0x04);
+    emit8(e, (shift << 6) | (X86_RAX << 3) | X86_RCX);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+/* andn and orn invert rs2 before the operation, xnor the result after */
+static void emit_alu_not(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                         uint8_t alu) {
+    static uint8_t const not_eax[] = { 0xF7, 0xD0 };
+
+    if (alu == X86_ALU_XOR) {
+        emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+        emit_alu_cpu(e, alu, X86_RAX, VEMU_JIT_REG(dec->rs2));
+        emit_bytes(e, not_eax, sizeof(not_eax));
+    } else {
+        emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs2));
+        emit_bytes(e, not_eax, sizeof(not_eax));
+        emit_alu_cpu(e, alu, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    }
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+/* cmp eax, ecx; cmov<cc> eax, ecx, with cc saying when rs2 wins */
+static void emit_min_max(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                         uint8_t cc) {
+    static uint8_t const cmp_eax_ecx[] = { 0x39, 0xC8 };
+
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+    emit_bytes(e, cmp_eax_ecx, sizeof(cmp_eax_ecx));
+    emit8(e, 0x0F);
+    emit8(e, 0x40 | cc);
+    emit8(e, 0xC1);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+/* lzcnt, tzcnt and popcnt eax, [rs1] where the host has them. Without
+   lzcnt and tzcnt, bsr and bsf leave eax alone and set ZF for zero, so
+   a cmovz puts in the 32 that clz and ctz give for it. Without popcnt,
+   cpop is left to the interpreter. */
+static bool emit_count_bits(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    static uint8_t const cmovz_eax_ecx[] = { 0x0F, 0x44, 0xC1 };
+    static uint8_t const xor_eax_31[] = { 0x83, 0xF0, 0x1F };
+
+    uint32_t needs = dec->opcode == VEMU_OPCODE_CLZ ? VEMU_JIT_HOST_LZCNT
+                   : dec->opcode == VEMU_OPCODE_CTZ ? VEMU_JIT_HOST_TZCNT
+                   : VEMU_JIT_HOST_POPCNT;
+    uint8_t op = dec->opcode == VEMU_OPCODE_CLZ ? 0xBD
+               : dec->opcode == VEMU_OPCODE_CTZ ? 0xBC
+               : 0xB8;
+
+    if (e->host & needs) {
+        emit8(e, 0xF3);
+        emit8(e, 0x0F);
+        emit8(e, op);
+        emit_rbx_operand(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+        emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+        return true;
+    }
+    if (dec->opcode == VEMU_OPCODE_CPOP) {
+        return false;
+    }
+
+    /* clz is 31 - bsr, which is bsr ^ 31, and 63 ^ 31 is 32 */
+    bool clz = dec->opcode == VEMU_OPCODE_CLZ;
+    emit_mov_imm(e, X86_RCX, clz ? 63 : 32);
+    emit8(e, 0x0F);
+    emit8(e, op);
+    emit_rbx_operand(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_bytes(e, cmovz_eax_ecx, sizeof(cmovz_eax_ecx));
+    if (clz) {
+        emit_bytes(e, xor_eax_31, sizeof(xor_eax_31));
+    }
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+    return true;
+}
+
+/* movsx/movzx eax, byte/word [rs1] */
+static void emit_extend(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                        uint8_t op) {
+    emit8(e, 0x0F);
+    emit8(e, op);
+    emit_rbx_operand(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+/* orc.b has no x86 counterpart; pcmpeqb against zero finds the zero
+   bytes, which are the ones that stay zero:
+
+       movd xmm0, [rs1]; pxor xmm1, xmm1; pcmpeqb xmm0, xmm1
+       movd eax, xmm0; not eax */
+static void emit_orc_b(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    static uint8_t const movd_xmm0[] = { 0x66, 0x0F, 0x6E };
+    static uint8_t const zero_bytes[] = {
+        0x66, 0x0F, 0xEF, 0xC9,
+        0x66, 0x0F, 0x74, 0xC1,
+        0x66, 0x0F, 0x7E, 0xC0,
+        0xF7, 0xD0,
+    };
+
+    emit_bytes(e, movd_xmm0, sizeof(movd_xmm0));
+    emit_rbx_operand(e, 0, VEMU_JIT_REG(dec->rs1));
+    emit_bytes(e, zero_bytes, sizeof(zero_bytes));
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_rev8(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    static uint8_t const bswap_eax[] = { 0x0F, 0xC8 };
+
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_bytes(e, bswap_eax, sizeof(bswap_eax));
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+/* bts, btr or btc eax, ecx, which take the bit number modulo 32 */
+static void emit_bit_rr(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                        uint8_t op) {
+    emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit8(e, 0x0F);
+    emit8(e, op);
+    emit8(e, 0xC0 | (X86_RCX << 3) | X86_RAX);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_bit_ri(vemu_jit_emitter_t *e, vemu_decoded_t *dec,
+                        uint8_t alu, uint32_t mask) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    emit_alu_imm(e, alu, X86_RAX, mask);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+/* (rs1 >> n) & 1, with n in cl or an immediate */
+static void emit_bext(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rs1));
+    if (dec->opcode == VEMU_OPCODE_BEXT) {
+        emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+        emit_shift_cl(e, X86_SHIFT_SHR, X86_RAX);
+    } else {
+        emit_shift_imm(e, X86_SHIFT_SHR, X86_RAX, dec->imm & 0x1F);
+    }
+    emit_alu_imm(e, X86_ALU_AND, X86_RAX, 1);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+/* Atomics run in C on the word in guest memory */
+static void emit_amo(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_mov_imm(e, X86_RSI, dec->opcode);
+    emit_load_cpu(e, X86_RDX, VEMU_JIT_REG(dec->rs1));
+    emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+    emit_call(e, (uintptr_t)vemu_cpu_amo);
+    if (dec->rd != VEMU_ZERO) {
+        emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+    }
+}
+
+static void emit_csrr(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_mov_imm(e, X86_RSI, dec->imm);
+    emit_call(e, (uintptr_t)vemu_cpu_read_csr);
+    emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+}
+
+static void emit_csrrw(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_mov_imm(e, X86_RSI, dec->imm);
+    if (dec->rs1 != VEMU_ZERO) {
+        emit_load_cpu(e, X86_RDX, VEMU_JIT_REG(dec->rs1));
+    } else {
+        emit_mov_imm(e, X86_RDX, dec->imm2);
+    }
+    emit_call(e, (uintptr_t)vemu_cpu_write_csr);
+    if (dec->rd != VEMU_ZERO) {
+        emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+    }
+}
+
+/* FP ops run in C, which rounds and raises flags in the host's MXCSR as
+   the guest has set it up */
+static void emit_fp(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_mov_imm(e, X86_RSI, dec->imm2);
+    if (dec->rs1 != VEMU_ZERO) {
+        emit_load_cpu(e, X86_RDX, VEMU_JIT_REG(dec->rs1));
+        if (dec->imm != 0) {
+            emit_alu_imm(e, X86_ALU_ADD, X86_RDX, dec->imm);
+        }
+    } else {
+        emit_mov_imm(e, X86_RDX, dec->imm);
+    }
+    emit_call(e, (uintptr_t)vemu_fp_exec);
+    if (dec->rd != VEMU_ZERO) {
+        emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+    }
+}
+
+/* Vector ops run in C too, each a loop over its elements */
+static void emit_vec(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    emit_mov_imm(e, X86_RSI, dec->imm2);
+    if (dec->rs1 != VEMU_ZERO) {
+        emit_load_cpu(e, X86_RDX, VEMU_JIT_REG(dec->rs1));
+        if (dec->imm != 0) {
+            emit_alu_imm(e, X86_ALU_ADD, X86_RDX, dec->imm);
+        }
+    } else {
+        emit_mov_imm(e, X86_RDX, dec->imm);
+    }
+    if (dec->rs2 != VEMU_ZERO) {
+        emit_load_cpu(e, X86_RCX, VEMU_JIT_REG(dec->rs2));
+    } else {
+        emit_mov_imm(e, X86_RCX, 0);
+    }
+    emit_call(e, (uintptr_t)vemu_vec_exec);
+    if (dec->rd != VEMU_ZERO) {
+        emit_store_cpu(e, X86_RAX, VEMU_JIT_REG(dec->rd));
+    }
+}
+
+static bool vemu_jit_emit_op(vemu_jit_emitter_t *e, vemu_decoded_t *dec) {
+    static uint8_t const movsx_byte[] = { 0x0F, 0xBE };
+    static uint8_t const movzx_byte[] = { 0x0F, 0xB6 };
+    static uint8_t const movsx_half[] = { 0x0F, 0xBF };
+    static uint8_t const movzx_half[] = { 0x0F, 0xB7 };
+    static uint8_t const mov_word[] = { 0x8B };
+    static uint8_t const mfence[] = { 0x0F, 0xAE, 0xF0 };
+
+    switch (dec->opcode) {
+        case VEMU_OPCODE_FENCE:
+            emit_bytes(e, mfence, sizeof(mfence));
+            break;
+
+        case VEMU_OPCODE_NOP:
+        case VEMU_OPCODE_FENCE_TSO:
+        case VEMU_OPCODE_FENCE_I:
+        case VEMU_OPCODE_PAUSE:
+        case VEMU_OPCODE_EBREAK:
+            break;
+
+        case VEMU_OPCODE_LUI:
+        case VEMU_OPCODE_LUI_ADDI:
+            emit_store_cpu_imm(e, VEMU_JIT_REG(dec->rd), dec->imm);
+            break;
+
+        case VEMU_OPCODE_AUIPC_LW:
+            emit_store_cpu_imm(e, VEMU_JIT_REG(dec->rd), dec->imm);
+            emit_mov_imm(e, X86_RAX, dec->imm + dec->imm2);
+            emit_load_rax(e, VEMU_OPCODE_LW, dec->rd2, mov_word, 
+                          sizeof(mov_word));
+            break;
+
+        case VEMU_OPCODE_LB:
+            emit_load(e, dec, movsx_byte, sizeof(movsx_byte));
+            break;
+
+        case VEMU_OPCODE_LH:
+            emit_load(e, dec, movsx_half, sizeof(movsx_half));
+            break;
+
+        case VEMU_OPCODE_LW:
+            emit_load(e, dec, mov_word, sizeof(mov_word));
+            break;
+
+        case VEMU_OPCODE_LBU:
+            emit_load(e, dec, movzx_byte, sizeof(movzx_byte));
+            break;
+
+        case VEMU_OPCODE_LHU:
+            emit_load(e, dec, movzx_half, sizeof(movzx_half));
+            break;
+
+        case VEMU_OPCODE_SB:
+            emit_store(e, dec, 1);
+            break;
+
+        case VEMU_OPCODE_SH:
+            emit_store(e, dec, 2);
+            break;
+
+        case VEMU_OPCODE_SW:
+            emit_store(e, dec, 4);
+            break;
+
+        case VEMU_OPCODE_ADDI:
+            emit_alu_ri(e, dec, X86_ALU_ADD);
+            break;
+
+        case VEMU_OPCODE_SLTI:
+            emit_set_ri(e, dec, X86_CC_L);
+            break;
+
+        case VEMU_OPCODE_SLTIU:
+            emit_set_ri(e, dec, X86_CC_B);
+            break;
+
+        case VEMU_OPCODE_XORI:
+            emit_alu_ri(e, dec, X86_ALU_XOR);
+            break;
+
+        case VEMU_OPCODE_ORI:
+            emit_alu_ri(e, dec, X86_ALU_OR);
+            break;
+
+        case VEMU_OPCODE_ANDI:
+            emit_alu_ri(e, dec, X86_ALU_AND);
+            break;
+
+        case VEMU_OPCODE_SLLI:
+            emit_shift_ri(e, dec, X86_SHIFT_SHL);
+            break;
+
+        case VEMU_OPCODE_SRLI:
+            emit_shift_ri(e, dec, X86_SHIFT_SHR);
+            break;
+
+        case VEMU_OPCODE_SRAI:
+            emit_shift_ri(e, dec, X86_SHIFT_SAR);
+            break;
+
+        case VEMU_OPCODE_ADD:
+            emit_alu_rr(e, dec, X86_ALU_ADD);
+            break;
+
+        case VEMU_OPCODE_SUB:
+            emit_alu_rr(e, dec, X86_ALU_SUB);
+            break;
+
+        case VEMU_OPCODE_SLL:
+            emit_shift_rr(e, dec, X86_SHIFT_SHL);
+            break;
+
+        case VEMU_OPCODE_SLT:
+            emit_set_rr(e, dec, X86_CC_L);
+            break;
+
+        case VEMU_OPCODE_SLTU:
+            emit_set_rr(e, dec, X86_CC_B);
+            break;
+
+        case VEMU_OPCODE_XOR:
+            emit_alu_rr(e, dec, X86_ALU_XOR);
+            break;
+
+        case VEMU_OPCODE_SRL:
+            emit_shift_rr(e, dec, X86_SHIFT_SHR);
+            break;
+
+        case VEMU_OPCODE_SRA:
+            emit_shift_rr(e, dec, X86_SHIFT_SAR);
+            break;
+
+        case VEMU_OPCODE_OR:
+            emit_alu_rr(e, dec, X86_ALU_OR);
+            break;
+
+        case VEMU_OPCODE_AND:
+            emit_alu_rr(e, dec, X86_ALU_AND);
+            break;
+
+        case VEMU_OPCODE_MUL:
+        case VEMU_OPCODE_MULH:
+        case VEMU_OPCODE_MULHSU:
+        case VEMU_OPCODE_MULHU:
+            emit_mul(e, dec);
+            break;
+
+        case VEMU_OPCODE_DIV:
+        case VEMU_OPCODE_DIVU:
+        case VEMU_OPCODE_REM:
+        case VEMU_OPCODE_REMU:
+            emit_divide(e, dec);
+            break;
+
+        case VEMU_OPCODE_SH1ADD:
+            emit_shadd(e, dec, 1);
+            break;
+
+        case VEMU_OPCODE_SH2ADD:
+            emit_shadd(e, dec, 2);
+            break;
+
+        case VEMU_OPCODE_SH3ADD:
+            emit_shadd(e, dec, 3);
+            break;
+
+        case VEMU_OPCODE_ANDN:
+            emit_alu_not(e, dec, X86_ALU_AND);
+            break;
+
+        case VEMU_OPCODE_ORN:
+            emit_alu_not(e, dec, X86_ALU_OR);
+            break;
+
+        case VEMU_OPCODE_XNOR:
+            emit_alu_not(e, dec, X86_ALU_XOR);
+            break;
+
+        case VEMU_OPCODE_CLZ:
+        case VEMU_OPCODE_CTZ:
+        case VEMU_OPCODE_CPOP:
+            return emit_count_bits(e, dec);
+
+        case VEMU_OPCODE_MAX:
+            emit_min_max(e, dec, X86_CC_L);
+            break;
+
+        case VEMU_OPCODE_MAXU:
+            emit_min_max(e, dec, X86_CC_B);
+            break;
+
+        case VEMU_OPCODE_MIN:
+            emit_min_max(e, dec, X86_CC_G);
+            break;
+
+        case VEMU_OPCODE_MINU:
+            emit_min_max(e, dec, X86_CC_A);
+            break;
+
+        case VEMU_OPCODE_SEXT_B:
+            emit_extend(e, dec, movsx_byte[1]);
+            break;
+
+        case VEMU_OPCODE_SEXT_H:
+            emit_extend(e, dec, movsx_half[1]);
+            break;
+
+        case VEMU_OPCODE_ZEXT_H:
+            emit_extend(e, dec, movzx_half[1]);
+            break;
+
+        case VEMU_OPCODE_ROL:
+            emit_shift_rr(e, dec, X86_SHIFT_ROL);
+            break;
+
+        case VEMU_OPCODE_ROR:
+            emit_shift_rr(e, dec, X86_SHIFT_ROR);
+            break;
+
+        case VEMU_OPCODE_RORI:
+            emit_shift_ri(e, dec, X86_SHIFT_ROR);
+            break;
+
+        case VEMU_OPCODE_ORC_B:
+            emit_orc_b(e, dec);
+            break;
+
+        case VEMU_OPCODE_REV8:
+            emit_rev8(e, dec);
+            break;
+
+        case VEMU_OPCODE_BCLR:
+            emit_bit_rr(e, dec, 0xB3);
+            break;
+
+        case VEMU_OPCODE_BINV:
+            emit_bit_rr(e, dec, 0xBB);
+            break;
+
+        case VEMU_OPCODE_BSET:
+            emit_bit_rr(e, dec, 0xAB);
+            break;
+
+        case VEMU_OPCODE_BCLRI:
+            emit_bit_ri(e, dec, X86_ALU_AND, ~(1u << dec->imm));
+            break;
+
+        case VEMU_OPCODE_BINVI:
+            emit_bit_ri(e, dec, X86_ALU_XOR, 1u << dec->imm);
+            break;
+
+        case VEMU_OPCODE_BSETI:
+            emit_bit_ri(e, dec, X86_ALU_OR, 1u << dec->imm);
+            break;
+
+        case VEMU_OPCODE_BEXT:
+        case VEMU_OPCODE_BEXTI:
+            emit_bext(e, dec);
+            break;
+
+        case VEMU_OPCODE_CSRR:
+            emit_csrr(e, dec);
+            break;
+
+        case VEMU_OPCODE_CSRRW:
+            emit_csrrw(e, dec);
+            break;
+
+        case VEMU_OPCODE_FP:
+            emit_fp(e, dec);
+            break;
+
+        case VEMU_OPCODE_VEC:
+            emit_vec(e, dec);
+            break;
+
+        case VEMU_OPCODE_LR_W:
+        case VEMU_OPCODE_SC_W:
+        case VEMU_OPCODE_AMOSWAP_W:
+        case VEMU_OPCODE_AMOADD_W:
+        case VEMU_OPCODE_AMOXOR_W:
+        case VEMU_OPCODE_AMOAND_W:
+        case VEMU_OPCODE_AMOOR_W:
+        case VEMU_OPCODE_AMOMIN_W:
+        case VEMU_OPCODE_AMOMAX_W:
+        case VEMU_OPCODE_AMOMINU_W:
+        case VEMU_OPCODE_AMOMAXU_W:
+            emit_amo(e, dec);
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+static uint8_t vemu_jit_branch_cc(vemu_opcode_t opcode) {
+    switch (opcode) {
+        case VEMU_OPCODE_BEQ:   return X86_CC_E;
+        case VEMU_OPCODE_BNE:   return X86_CC_NE;
+        case VEMU_OPCODE_BLT:   return X86_CC_L;
+        case VEMU_OPCODE_BGE:   return X86_CC_GE;
+        case VEMU_OPCODE_BLTU:  return X86_CC_B;
+        case VEMU_OPCODE_BGEU:  return X86_CC_AE;
+        default:                return 0xFF;
+    }
+}
+
+/* Condition under which a fused set-and-branch is taken, tested on the
+   value of rd */
+static uint8_t vemu_jit_fused_branch_cc(vemu_opcode_t opcode) {
+    switch (opcode) {
+        case VEMU_OPCODE_SLT_BNEZ:
+        case VEMU_OPCODE_SLTU_BNEZ:
+            return X86_CC_NE;
+
+        case VEMU_OPCODE_SLT_BEQZ:
+        case VEMU_OPCODE_SLTU_BEQZ:
+            return X86_CC_E;
+
+        default:
+            return 0xFF;
+    }
+}
+
+/* j<cc> to an exit for target, falling through to an exit for the end
+   of the block. Flags must already be set. */
+static void emit_branch(vemu_jit_emitter_t *e, vemu_jit_t *jit,
+                        vemu_block_t *block, uint8_t cc, uint32_t target) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    uint8_t *taken = emit_rel32(e, e->p);
+
+    emit_exit(e, jit, block->end, true);
+
+    if (!e->overflow) {
+        uint32_t rel = (uint32_t)(e->p - (taken + 4));
+        memcpy(taken, &rel, sizeof(rel));
+    }
+    emit_exit(e, jit, target, true);
+}
+
+/* Sets flags for a (fused) conditional branch and returns the condition
+   under which it is taken, or 0xFF if op is not one. */
+static uint8_t emit_condition(vemu_jit_emitter_t *e, vemu_decoded_t *op) {
+    /* test ecx, ecx */
+    static uint8_t const test_ecx[] = { 0x85, 0xC9 };
+
+    uint8_t cc = vemu_jit_branch_cc(op->opcode);
+    if (cc != 0xFF) {
+        emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(op->rs1));
+        emit_alu_cpu(e, X86_ALU_CMP, X86_RAX, VEMU_JIT_REG(op->rs2));
+        return cc;
+    }
+
+    cc = vemu_jit_fused_branch_cc(op->opcode);
+    if (cc != 0xFF) {
+        bool u = op->opcode == VEMU_OPCODE_SLTU_BNEZ
+              || op->opcode == VEMU_OPCODE_SLTU_BEQZ;
+        emit_set_rr(e, op, u ? X86_CC_B : X86_CC_L);
+        emit_bytes(e, test_ecx, sizeof(test_ecx));
+    }
+
+    return cc;
+}
+
+/* A branch inside a superblock. The path the trace continues on falls
+   through; the other one leaves, handing back the instructions the entry
+   counted for the rest of the trace. */
+static bool vemu_jit_emit_side_exit(vemu_jit_emitter_t *e, vemu_jit_t *jit,
+                                    vemu_trace_exit_t *exit, 
+                                    vemu_decoded_t *op, uint32_t uncounted) {
+    switch (op->opcode) {
+        case VEMU_OPCODE_JAL:
+            if (op->rd != VEMU_ZERO) {
+                emit_store_cpu_imm(e, VEMU_JIT_REG(op->rd), exit->next_ip);
+            }
+            return true;
+
+        case VEMU_OPCODE_AUIPC_JALR:
+            emit_store_cpu_imm(e, VEMU_JIT_REG(op->rd), op->imm);
+            if (op->rd2 != VEMU_ZERO) {
+                emit_store_cpu_imm(e, VEMU_JIT_REG(op->rd2), exit->next_ip);
+            }
+            return true;
+
+        default:
+            break;
+    }
+
+    uint8_t cc = emit_condition(e, op);
+    if (cc == 0xFF) {
+        return false;
+    }
+
+    uint32_t target = exit->term_ip + op->imm;
+    uint32_t leave_ip = target;
+    if (exit->expect == target) {
+        leave_ip = exit->next_ip;
+        cc ^= 1;
+    }
+
+    /* j<!cc> stay */
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | (cc ^ 1));
+    uint8_t *stay = emit_rel32(e, e->p);
+
+    emit_count(e, &exit->taken);
+    if (uncounted > 0) {
+        emit_alu_cpu64(e, X86_ALU_SUB, offsetof(vemu_cpu_t, instret), 
+                       uncounted);
+    }
+    emit_exit(e, jit, leave_ip, true);
+
+    if (!e->overflow) {
+        uint32_t rel = (uint32_t)(e->p - (stay + 4));
+        memcpy(stay, &rel, sizeof(rel));
+    }
+
+    return true;
+}
+
+uint32_t vemu_jit_exit_code(vemu_opcode_t opcode) {
+    switch (opcode) {
+        case VEMU_OPCODE_ECALL:     return VEMU_JIT_EXIT_ECALL;
+        case VEMU_OPCODE_ILLEGAL:   return VEMU_JIT_EXIT_ILLEGAL;
+        case VEMU_OPCODE_FENCE_I:   return VEMU_JIT_EXIT_FENCE_I;
+        case VEMU_OPCODE_SFENCE_VMA:
+        case VEMU_OPCODE_CSRRW_SATP:
+            return VEMU_JIT_EXIT_SFENCE_VMA;
+        default:                    return 0;
+    }
+}
+
+static bool vemu_jit_emit_term(vemu_jit_emitter_t *e, vemu_jit_t *jit,
+                               vemu_block_t *block, vemu_decoded_t *term) {
+    uint32_t target = block->term_ip + term->imm;
+
+    uint8_t cc = emit_condition(e, term);
+    if (cc != 0xFF) {
+        emit_branch(e, jit, block, cc, target);
+        return true;
+    }
+
+    switch (term->opcode) {
+        case VEMU_OPCODE_JAL:
+            if (term->rd != VEMU_ZERO) {
+                emit_store_cpu_imm(e, VEMU_JIT_REG(term->rd), block->end);
+            }
+            emit_exit(e, jit, target, true);
+            return true;
+
+        case VEMU_OPCODE_JALR:
+            /* The target is read before the link register is written,
+               so rd == rs1 behaves. */
+            emit_load_cpu(e, X86_RAX, VEMU_JIT_REG(term->rs1));
+            emit_alu_imm(e, X86_ALU_ADD, X86_RAX, term->imm);
+            emit_alu_imm(e, X86_ALU_AND, X86_RAX, 0xFFFFFFFE);
+            if (term->rd != VEMU_ZERO) {
+                emit_store_cpu_imm(e, VEMU_JIT_REG(term->rd), block->end);
+            }
+            emit_zero(e, X86_RDX);
+            emit8(e, 0xE9);
+            emit_rel32(e, jit->exit);
+            return true;
+
+        case VEMU_OPCODE_AUIPC_JALR:
+            emit_store_cpu_imm(e, VEMU_JIT_REG(term->rd), term->imm);
+            if (term->rd2 != VEMU_ZERO) {
+                emit_store_cpu_imm(e, VEMU_JIT_REG(term->rd2), block->end);
+            }
+            emit_exit(e, jit, term->imm2, true);
+            return true;
+
+        case VEMU_OPCODE_ECALL:
+        case VEMU_OPCODE_ILLEGAL:
+        case VEMU_OPCODE_CSRRW_SATP:
+            /* The C handler of sfence.vma drops the code translated
+               under the old satp */
+            emit_csrrw(e, term);
+            /* fall through */
+
+        case VEMU_OPCODE_FENCE_I:
+        case VEMU_OPCODE_SFENCE_VMA:
+            emit_store_cpu_imm(e, offsetof(vemu_cpu_t, ip), block->term_ip);
+            emit_store_cpu_imm(e, offsetof(vemu_cpu_t, next_ip), block->end);
+            emit_exit(e, jit, vemu_jit_exit_code(term->opcode), false);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* Entry trampoline: vemu_jit_exit_t enter(cpu, ram, code). Saves the
+   callee-saved registers used by blocks and jumps into the block; the
+   exit stub that follows undoes that and returns rax:rdx. */
+static void vemu_jit_emit_stubs(vemu_jit_t *jit) {
+    static uint8_t const enter[] = {
+        0x53,                   /* push rbx */
+        0x41, 0x54,             /* push r12 */
+        0x50,                   /* push rax (alignment) */
+        0x48, 0x89, 0xFB,       /* mov rbx, rdi */
+        0x49, 0x89, 0xF4,       /* mov r12, rsi */
+        0xFF, 0xE2,             /* jmp rdx */
+    };
+    static uint8_t const exit[] = {
+        0x59,                   /* pop rcx */
+        0x41, 0x5C,             /* pop r12 */
+        0x5B,                   /* pop rbx */
+        0xC3,                   /* ret */
+    };
+
+    memcpy(jit->code, enter, sizeof(enter));
+    memcpy(&jit->enter, &(void *){ jit->code }, sizeof(jit->enter));
+
+    jit->exit = jit->code + sizeof(enter);
+    memcpy(jit->exit, exit, sizeof(exit));
+
+    jit->used = sizeof(enter) + sizeof(exit);
+}
+
+static uint32_t vemu_jit_host(void) {
+    uint32_t host = 0;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("lzcnt")) {
+        host |= VEMU_JIT_HOST_LZCNT;
+    }
+    if (__builtin_cpu_supports("bmi")) {
+        host |= VEMU_JIT_HOST_TZCNT;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        host |= VEMU_JIT_HOST_POPCNT;
+    }
+
+    return host;
+}
+
+void vemu_jit_init(vemu_jit_t *jit) {
+    jit->code = NULL;
+    jit->size = 0;
+    jit->used = 0;
+
+    jit->enter = NULL;
+    jit->exit = NULL;
+    jit->check_stores = false;
+    jit->check_devices = false;
+    jit->translate = false;
+    jit->host = vemu_jit_host();
+
+    jit->compiled = 0;
+    jit->unsupported = 0;
+    jit->entries = 0;
+    jit->links = 0;
+    jit->resets = 0;
+}
+
+bool vemu_jit_alloc(vemu_jit_t *jit, size_t size) {
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return false;
+    }
+
+    jit->code = code;
+    jit->size = size;
+    vemu_jit_emit_stubs(jit);
+
+    return true;
+}
+
+void vemu_jit_reset(vemu_jit_t *jit) {
+    if (jit->code == NULL) {
+        return;
+    }
+
+    vemu_jit_emit_stubs(jit);
+    jit->resets++;
+}
+
+void vemu_jit_destruct(vemu_jit_t *jit) {
+    if (jit->code != NULL) {
+        munmap(jit->code, jit->size);
+    }
+    vemu_jit_init(jit);
+}
+
+vemu_jit_result_t vemu_jit_compile(vemu_jit_t *jit, vemu_block_t *block) {
+    vemu_jit_emitter_t e = {
+        .p = jit->code + jit->used,
+        .end = jit->code + jit->size,
+        .overflow = false,
+        .check_stores = jit->check_stores,
+        .check_devices = jit->check_devices,
+        .translate = jit->translate,
+        .host = jit->host,
+    };
+    uint8_t *start = e.p;
+
+    uint32_t n_body = block->n_ops - (block->has_term ? 1 : 0);
+    bool native_term = !block->has_term
+                    || vemu_jit_exit_code(block->ops[n_body].opcode) == 0;
+
+    /* Terminators with a C exit retire there, after the dispatcher runs
+       them */
+    uint32_t instrs = block->n_instrs - (native_term ? 0 : 1);
+    if (instrs > 0) {
+        emit_alu_cpu64(&e, X86_ALU_ADD, offsetof(vemu_cpu_t, instret), 
+                       instrs);
+    }
+
+    if (block->superblock) {
+        emit_count(&e, &block->entries);
+    }
+
+    uint32_t n_exits = 0;
+    for (uint32_t i = 0; i < n_body; i++) {
+        vemu_trace_exit_t *exit = n_exits < block->n_exits 
+                                ? &block->exits[n_exits] 
+                                : NULL;
+        bool ok;
+
+        if (exit != NULL && exit->end == i + 1) {
+            ok = vemu_jit_emit_side_exit(&e, jit, exit, &block->ops[i],
+                                         instrs - exit->n_instrs);
+            n_exits++;
+        } else {
+            ok = vemu_jit_emit_op(&e, &block->ops[i]);
+        }
+
+        if (!ok) {
+            jit->unsupported++;
+            return VEMU_JIT_UNSUPPORTED;
+        }
+    }
+
+    if (block->has_term) {
+        if (!vemu_jit_emit_term(&e, jit, block, &block->ops[n_body])) {
+            jit->unsupported++;
+            return VEMU_JIT_UNSUPPORTED;
+        }
+    } else {
+        emit_exit(&e, jit, block->end, true);
+    }
+
+    if (e.overflow) {
+        return VEMU_JIT_FULL;
+    }
+
+    block->native = start;
+    jit->used = e.p - jit->code;
+    jit->compiled++;
+
+    return VEMU_JIT_OK;
+}
+
+void vemu_jit_link(vemu_jit_t *jit, uint8_t *patch, uint8_t *target) {
+    uint32_t rel = (uint32_t)(target - (patch + 4));
+    memcpy(patch, &rel, sizeof(rel));
+    jit->links++;
+}
+
+/* Turns the entry of native code into an unlinked exit to ip, so jumps
+   chained into it go back to the dispatcher. Every block is longer than
+   that exit. */
+void vemu_jit_unlink(vemu_jit_t *jit, uint8_t *code, uint32_t ip) {
+    vemu_jit_emitter_t e = {
+        .p = code,
+        .end = jit->code + jit->size,
+        .overflow = false,
+        .check_stores = false,
+        .host = 0,
+    };
+
+    emit_exit(&e, jit, ip, false);
+}
@@ -1,20 +1,151 @@
 #include "elf-file.h"
 #include "system.h"
+#include "tcache.h"
+#include "batch.h"
+#include "clone.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "console.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <argp.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VEMU_OPT_NO_DECODE_CACHE    256
+#define VEMU_OPT_NO_FUSION          257
+#define VEMU_OPT_NO_TRACES          258
+#define VEMU_OPT_CACHE_DIR          259
+#define VEMU_OPT_BATCH              260
+#define VEMU_OPT_CLONES             261
+#define VEMU_OPT_SAVE_SNAPSHOT      262
+#define VEMU_OPT_RESTORE_SNAPSHOT   263
+#define VEMU_OPT_RECORD             264
+#define VEMU_OPT_REPLAY             265
+#define VEMU_OPT_RAM                266
+#define VEMU_OPT_CONSOLE            267
+
+static struct {
+    char const *name;
+    vemu_exec_mode_t mode;
+} const vemu_modes[] = {
+    { "interp", VEMU_EXEC_INTERP },
+    { "block", VEMU_EXEC_BLOCK },
+    { "jit", VEMU_EXEC_JIT },
+};
 
 static struct argp_option options[] = {
     { "verbose", 'v', 0, 0, "Enable verbose output", 0 },
+    { "stats", 's', 0, 0, "Print execution statistics on exit", 0 },
+    { "mode", 'm', "MODE", 0, 
+      "Execution mode: interp, block or jit (default: block)", 0 },
+    { "no-decode-cache", VEMU_OPT_NO_DECODE_CACHE, 0, 0, 
+      "Decode every instruction on each execution", 0 },
+    { "no-fusion", VEMU_OPT_NO_FUSION, 0, 0, 
+      "Execute common instruction pairs separately", 0 },
+    { "no-traces", VEMU_OPT_NO_TRACES, 0, 0, 
+      "Do not form superblocks from hot loops (block and jit modes)", 0 },
+    { "optimize", 'O', "PASSES", 0, 
+      "Block optimization passes, a comma-separated list of const, dead "
+      "and load, or all or none (default: all)", 0 },
+    { "cache-dir", VEMU_OPT_CACHE_DIR, "DIR", 0, 
+      "Keep translated blocks in DIR between runs (block and jit modes, "
+      "not for batches, default: $VEMU_CACHE_DIR)", 0 },
+    { "harts", 'H', "N", 0, 
+      "Run N harts, each on its own host thread; they start at the entry "
+      "point with a0 = hart id and a1 = N (default: 1)", 0 },
+    { "batch", VEMU_OPT_BATCH, "MANIFEST", 0, 
+      "Run every program listed in MANIFEST, one \"ELF [INPUT]\" per line, "
+      "as a VM of its own; INPUT is loaded at 0x20000000 with its address "
+      "in a2 and size in a3", 0 },
+    { "clones", VEMU_OPT_CLONES, "N", 0, 
+      "Fork N copies of the VM at the program's checkpoint ecall; each "
+      "continues from there with its index as the ecall's result", 0 },
+    { "save-snapshot", VEMU_OPT_SAVE_SNAPSHOT, "FILE", 0, 
+      "Stop at the program's checkpoint ecall and save the machine to "
+      "FILE", 0 },
+    { "restore-snapshot", VEMU_OPT_RESTORE_SNAPSHOT, "FILE", 0, 
+      "Resume a machine saved with --save-snapshot instead of loading a "
+      "program; the checkpoint ecall returns 0", 0 },
+    { "record", VEMU_OPT_RECORD, "LOG", 0, 
+      "Log every value the program gets from outside through an ecall", 0 },
+    { "replay", VEMU_OPT_REPLAY, "LOG", 0, 
+      "Feed the values of a recorded log back to rerun it exactly", 0 },
+    { "jobs", 'j', "N", 0, 
+      "Batch jobs or clones run at a time (default: one per CPU)", 0 },
+    { "ram", VEMU_OPT_RAM, "SIZE", 0, 
+      "Guest memory in bytes, or with a K, M or G suffix; pages are only "
+      "backed once the guest touches them (default: 1G)", 0 },
+    { "console", VEMU_OPT_CONSOLE, 0, 0, 
+      "Map a console device above guest memory at 0xF0000000 that prints "
+      "each byte stored to it (not for batches)", 0 },
     { 0 }
 };
 
 typedef struct {
     char *filename;
     int verbose;
+    int stats;
+    int no_decode_cache;
+    int no_fusion;
+    int no_traces;
+    uint32_t passes;
+    char const *cache_dir;
+    uint32_t harts;
+    char const *batch;
+    uint32_t clones;
+    char const *save_snapshot;
+    char const *restore_snapshot;
+    char const *record;
+    char const *replay;
+    uint32_t jobs;
+    size_t ram_size;
+    int console;
+    vemu_exec_mode_t mode;
 } vemu_args_t;
 
+static bool vemu_parse_mode(char const *name, vemu_exec_mode_t *mode) {
+    for (size_t i = 0; i < sizeof(vemu_modes) / sizeof(*vemu_modes); i++) {
+        if (strcmp(vemu_modes[i].name, name) == 0) {
+            *mode = vemu_modes[i].mode;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* A whole number of pages between VEMU_SYSTEM_RAM_MIN and
+   VEMU_SYSTEM_RAM_MAX */
+static bool vemu_parse_ram_size(char const *arg, size_t *size) {
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (*arg < '0' || *arg > '9' || end == arg) {
+        return false;
+    }
+
+    static char const units[] = "KMG";
+    char const *unit = *end != '\0' ? strchr(units, *end) : NULL;
+    unsigned shift = 0;
+    if (unit != NULL) {
+        shift = 10 * (unit - units + 1);
+        end++;
+    }
+
+    if (*end != '\0' || n > (VEMU_SYSTEM_RAM_MAX >> shift)) {
+        return false;
+    }
+    n <<= shift;
+
+    if (n < VEMU_SYSTEM_RAM_MIN || n % VEMU_SYSTEM_RAM_ALIGN != 0) {
+        return false;
+    }
+    *size = n;
+
+    return true;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     vemu_args_t *args = state->input;
 
@@ -23,8 +154,102 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             args->verbose = 1;
             break;
 
+        case 's':
+            args->stats = 1;
+            break;
+
+        case VEMU_OPT_NO_DECODE_CACHE:
+            args->no_decode_cache = 1;
+            break;
+
+        case VEMU_OPT_NO_FUSION:
+            args->no_fusion = 1;
+            break;
+
+        case VEMU_OPT_NO_TRACES:
+            args->no_traces = 1;
+            break;
+
+        case VEMU_OPT_CACHE_DIR:
+            args->cache_dir = arg;
+            break;
+
+        case 'H': {
+            char *end;
+            unsigned long n = strtoul(arg, &end, 10);
+            if (*arg == '\0' || *end != '\0' || n < 1 || n > VEMU_MAX_HARTS) {
+                argp_error(state, "number of harts must be 1 to %d: '%s'", 
+                           VEMU_MAX_HARTS, arg);
+            }
+            args->harts = n;
+            break;
+        }
+
+        case VEMU_OPT_BATCH:
+            args->batch = arg;
+            break;
+
+        case VEMU_OPT_CLONES: {
+            char *end;
+            unsigned long n = strtoul(arg, &end, 10);
+            if (*arg == '\0' || *end != '\0' || n < 1 || n > UINT32_MAX) {
+                argp_error(state, "invalid number of clones: '%s'", arg);
+            }
+            args->clones = n;
+            break;
+        }
+
+        case VEMU_OPT_SAVE_SNAPSHOT:
+            args->save_snapshot = arg;
+            break;
+
+        case VEMU_OPT_RESTORE_SNAPSHOT:
+            args->restore_snapshot = arg;
+            break;
+
+        case VEMU_OPT_RECORD:
+            args->record = arg;
+            break;
+
+        case VEMU_OPT_REPLAY:
+            args->replay = arg;
+            break;
+
+        case 'j': {
+            char *end;
+            unsigned long n = strtoul(arg, &end, 10);
+            if (*arg == '\0' || *end != '\0' || n < 1 || n > UINT32_MAX) {
+                argp_error(state, "invalid number of jobs: '%s'", arg);
+            }
+            args->jobs = n;
+            break;
+        }
+
+        case VEMU_OPT_RAM:
+            if (!vemu_parse_ram_size(arg, &args->ram_size)) {
+                argp_error(state, "guest memory must be a multiple of 4K "
+                           "from 128K to 4G: '%s'", arg);
+            }
+            break;
+
+        case VEMU_OPT_CONSOLE:
+            args->console = 1;
+            break;
+
+        case 'O':
+            if (!vemu_ir_parse_passes(arg, &args->passes)) {
+                argp_error(state, "unknown optimization pass in '%s'", arg);
+            }
+            break;
+
+        case 'm':
+            if (!vemu_parse_mode(arg, &args->mode)) {
+                argp_error(state, "unknown execution mode: '%s'", arg);
+            }
+            break;
+
         case ARGP_KEY_ARG:
-            if (state->arg_num == 0) {
+            if (state->arg_num == 0 && args->batch == NULL) {
                 args->filename = arg;
             } else {
                 argp_usage(state);
@@ -32,7 +257,42 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             break;
 
         case ARGP_KEY_END:
-            if (state->arg_num < 1) {
+            if (args->batch != NULL && args->harts > 1) {
+                argp_error(state, "batch jobs run a single hart");
+            }
+            if (args->clones > 0 && (args->batch != NULL || args->harts > 1)) {
+                argp_error(state, "only a single-hart VM can be cloned");
+            }
+            if ((args->save_snapshot != NULL 
+                 || args->restore_snapshot != NULL)
+                    && (args->batch != NULL || args->harts > 1)) {
+                argp_error(state, "snapshots hold a single-hart VM");
+            }
+            if (args->save_snapshot != NULL && args->clones > 0) {
+                argp_error(state, "a checkpoint either saves a snapshot "
+                           "or spawns clones");
+            }
+            if (args->restore_snapshot != NULL && args->filename != NULL) {
+                argp_error(state, "a restored snapshot replaces the program");
+            }
+            if ((args->record != NULL || args->replay != NULL)
+                    && (args->batch != NULL || args->harts > 1 
+                        || args->clones > 0)) {
+                argp_error(state, "only a single-hart VM can be recorded");
+            }
+            if (args->record != NULL && args->replay != NULL) {
+                argp_error(state, "a run is either recorded or replayed");
+            }
+            if (args->harts > 1 && args->ram_size < VEMU_CPU_HART_STACKS 
+                    + (size_t)args->harts * VEMU_CPU_HART_STACK_SIZE) {
+                argp_error(state, "%" PRIu32 " harts need their stacks "
+                           "below %zuM of guest memory", args->harts,
+                           (VEMU_CPU_HART_STACKS + (size_t)args->harts 
+                            * VEMU_CPU_HART_STACK_SIZE) >> 20);
+            }
+            bool no_program = args->batch != NULL 
+                           || args->restore_snapshot != NULL;
+            if (state->arg_num < (no_program ? 0 : 1)) {
                 argp_usage(state);
             }
             break;
@@ -45,41 +305,298 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = { options, parse_opt, NULL, NULL, NULL, NULL, NULL };
 
+static double vemu_seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) 
+         + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Each hart gets caches of its own */
+static bool vemu_setup_hart(vemu_cpu_t *cpu, void *arg) {
+    vemu_args_t *args = arg;
+
+    cpu->mode = args->mode;
+    cpu->fusion = !args->no_fusion;
+    cpu->traces = !args->no_traces;
+    cpu->passes = args->passes;
+
+    if (args->mode == VEMU_EXEC_INTERP && !args->no_decode_cache 
+            && !vemu_decode_cache_alloc(&cpu->dcache, 
+                                        VEMU_DECODE_CACHE_BITS)) {
+        fprintf(stderr, "could not allocate decode cache\n");
+        return false;
+    }
+
+    if ((args->mode == VEMU_EXEC_BLOCK || args->mode == VEMU_EXEC_JIT)
+            && !vemu_block_cache_alloc(&cpu->blocks, VEMU_BLOCK_CACHE_BITS)) {
+        fprintf(stderr, "could not allocate block cache\n");
+        return false;
+    }
+
+    if (args->mode == VEMU_EXEC_JIT 
+            && !vemu_jit_alloc(&cpu->jit, VEMU_JIT_BUFFER_SIZE)) {
+        fprintf(stderr, "could not allocate jit code buffer\n");
+        return false;
+    }
+
+    /* Only cached code can go stale when the guest writes to it */
+    bool cached_code = args->mode != VEMU_EXEC_INTERP 
+                    || !args->no_decode_cache;
+    if (cached_code && !vemu_smc_alloc(&cpu->smc)) {
+        fprintf(stderr, "could not allocate code page table\n");
+        return false;
+    }
+    cpu->jit.check_stores = cached_code;
+
+    /* Device loads and stores have effects of their own, so none of them
+       may be dropped or merged with another */
+    if (cpu->bus->n_devices != 0) {
+        cpu->passes &= ~(VEMU_IR_DEAD_WRITES | VEMU_IR_REDUNDANT_LOADS);
+        cpu->jit.check_devices = true;
+    }
+
+    return true;
+}
+
+static uint32_t vemu_jobs(vemu_args_t *args) {
+    if (args->jobs != 0) {
+        return args->jobs;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+/* With --save-snapshot the guest stops at its checkpoint ecall. Once
+   restored it carries on as if the ecall had returned 0. */
+static bool vemu_pause(void *arg, uint32_t *res) {
+    *(bool *)arg = true;
+    *res = 0;
+    return false;
+}
+
+/* Job results go to stdout in manifest order once all of them are done */
+static int vemu_run_batch(vemu_args_t *args) {
+    vemu_batch_t batch;
+    vemu_batch_init(&batch);
+
+    uint32_t jobs = vemu_jobs(args);
+    batch.ram_size = args->ram_size;
+
+    int res = 0;
+    if (!vemu_batch_load(&batch, args->batch)
+            || !vemu_batch_run(&batch, jobs, vemu_setup_hart, args)) {
+        res = 1;
+    } else {
+        vemu_batch_print(&batch, stdout);
+        vemu_batch_print_stats(&batch, stderr);
+
+        for (size_t i = 0; i < batch.n_jobs; i++) {
+            if (!vemu_batch_job_ok(&batch.jobs[i])) {
+                res = 1;
+            }
+        }
+    }
+
+    vemu_batch_destruct(&batch);
+
+    return res;
+}
+
 int main(int argc, char **argv) {
     vemu_args_t args = { 0 };
+    args.mode = VEMU_EXEC_BLOCK;
+    args.passes = VEMU_IR_ALL;
+    args.cache_dir = getenv("VEMU_CACHE_DIR");
+    args.harts = 1;
+    args.ram_size = VEMU_SYSTEM_RAM_SIZE;
     argp_parse(&argp, argc, argv, 0, 0, &args);
 
+    if (args.batch != NULL) {
+        return vemu_run_batch(&args);
+    }
+
     int res = 0;
 
     vemu_system_t sys;
     vemu_system_init(&sys);
 
-    size_t ram_size = 1024 * 1024 * 1024;
+    if (!vemu_system_alloc_ram(&sys, args.ram_size)) {
+        fprintf(stderr, "could not allocate guest memory\n");
+        return 1;
+    }
 
-    uint8_t *ram = malloc(ram_size);
-    if (ram == NULL) {
+    vemu_console_t console;
+    vemu_console_init(&console, stdout);
+    if (args.console && !vemu_console_add(&console, &sys)) {
+        vemu_system_destruct(&sys);
         return 1;
     }
-    memset(ram, 0, ram_size);
 
-    vemu_system_add_ram(&sys, ram);
+    if (!vemu_system_alloc(&sys, args.harts)) {
+        fprintf(stderr, "could not allocate harts\n");
+        vemu_system_destruct(&sys);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < sys.n_harts; i++) {
+        if (!vemu_setup_hart(&sys.harts[i], &args)) {
+            vemu_system_destruct(&sys);
+            return 1;
+        }
+    }
 
     vemu_elf_t elf;
     vemu_elf_init(&elf);
 
-    if (!vemu_elf_open(&elf, args.filename)) {
+    vemu_tcache_t tcache;
+    vemu_tcache_init(&tcache);
+
+    vemu_clone_set_t clones;
+    vemu_clone_init(&clones);
+
+    vemu_snapshot_t snap;
+    vemu_snapshot_init(&snap);
+
+    vemu_replay_t replay;
+    vemu_replay_init(&replay);
+
+    if (args.clones > 0 && !vemu_clone_alloc(&clones, args.clones, 
+                                             vemu_jobs(&args), 
+                                             &sys.harts[0])) {
+        fprintf(stderr, "could not allocate clones\n");
+        res = 1;
+        goto end;
+    }
+
+    bool paused = false;
+    if (args.save_snapshot != NULL) {
+        sys.harts[0].checkpoint = vemu_pause;
+        sys.harts[0].checkpoint_arg = &paused;
+    }
+
+    char const *log = args.record != NULL ? args.record : args.replay;
+    if (log != NULL) {
+        vemu_replay_mode_t mode = args.record != NULL ? VEMU_REPLAY_RECORD
+                                                      : VEMU_REPLAY_REPLAY;
+        if (!vemu_replay_open(&replay, log, mode)) {
+            res = 1;
+            goto end;
+        }
+        sys.harts[0].replay = &replay;
+    }
+
+    bool restored = args.restore_snapshot != NULL;
+    if (restored) {
+        if (!vemu_snapshot_open(&snap, args.restore_snapshot)
+                || !vemu_snapshot_restore(&snap, &sys)) {
+            res = 1;
+            goto end;
+        }
+    } else if (!vemu_elf_open(&elf, args.filename)
+               || !vemu_system_load_elf(&sys, &elf)) {
         res = 1;
         goto end;
     }
 
-    if (!vemu_elf_load(&elf, sys.ram)) {
+    /* Without a usable cache directory the program just runs uncached.
+       Every hart starts from the cached blocks; hart 0's are saved. 
+       Cache entries are keyed by the ELF, which a snapshot does not 
+       have. */
+    bool cached = !restored
+               && args.cache_dir != NULL && args.cache_dir[0] != '\0'
+               && (args.mode == VEMU_EXEC_BLOCK || args.mode == VEMU_EXEC_JIT)
+               && vemu_tcache_open(&tcache, args.cache_dir, &elf, sys.ram, 
+                                   &sys.harts[0]);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (cached) {
+        for (uint32_t i = 0; i < sys.n_harts; i++) {
+            vemu_tcache_load(&tcache, &sys.harts[i]);
+        }
+    }
+
+    if (restored) {
+        vemu_cpu_resume(&sys.harts[0]);
+    } else if (!vemu_system_run(&sys, elf.h.e_entry)) {
         res = 1;
         goto end;
     }
 
-    vemu_cpu_run(&sys.cpu, elf.h.e_entry);
+    /* Clones leave the parent to report on them and save the cache */
+    if (vemu_clone_is_child(&clones)) {
+        vemu_clone_exit(&clones, &sys.harts[0]);
+    }
+
+    if (log != NULL) {
+        vemu_cpu_t *cpu = &sys.harts[0];
+        if (!vemu_replay_finish(&replay, cpu->instret, cpu->stop_ip, 
+                                cpu->exit_code)) {
+            res = 1;
+        }
+    }
+
+    if (args.stats) {
+        double seconds = vemu_seconds_since(&start);
+
+        for (uint32_t i = 0; i < sys.n_harts; i++) {
+            if (sys.n_harts > 1) {
+                fprintf(stderr, "hart %" PRIu32 ":\n", i);
+            }
+            vemu_cpu_print_stats(&sys.harts[i], stderr, seconds);
+        }
+    }
+
+    if (log != NULL && args.stats) {
+        vemu_replay_print_stats(&replay, stderr);
+    }
+
+    /* Code translated under a guest's page tables is keyed by addresses
+       the next run does not start out with */
+    if (cached && !vemu_mmu_on(&sys.harts[0].mmu)) {
+        vemu_tcache_save(&tcache, &sys.harts[0]);
+        if (args.stats) {
+            vemu_tcache_print_stats(&tcache, &sys.harts[0], stderr);
+        }
+    }
+
+    if (args.save_snapshot != NULL) {
+        if (!paused) {
+            fprintf(stderr, "program finished without a checkpoint\n");
+            res = 1;
+        } else if (!vemu_snapshot_save(args.save_snapshot, &sys, 
+                                       restored ? &snap : NULL)) {
+            res = 1;
+        }
+    }
+
+    if (args.clones > 0) {
+        if (clones.n_spawned == 0) {
+            fprintf(stderr, "program finished without a checkpoint\n");
+            res = 1;
+        } else {
+            vemu_clone_print(&clones, stdout);
+            if (args.stats) {
+                vemu_clone_print_stats(&clones, stderr);
+            }
+        }
+
+        for (uint32_t i = 0; i < clones.n_spawned; i++) {
+            if (!vemu_clone_ok(&clones, i)) {
+                res = 1;
+            }
+        }
+    }
 
 end:
+    vemu_replay_destruct(&replay);
+    vemu_snapshot_destruct(&snap);
+    vemu_clone_destruct(&clones);
+    vemu_tcache_destruct(&tcache);
     vemu_elf_destruct(&elf);
     vemu_system_destruct(&sys);
 
@@ -0,0 +1,160 @@
+#include "mmu.h"
+#include <inttypes.h>
+
+#define VEMU_MMU_LEVELS         2
+#define VEMU_MMU_VPN_BITS       10
+#define VEMU_MMU_PTE_SIZE       4
+
+void vemu_mmu_init(vemu_mmu_t *mmu) {
+    mmu->satp = 0;
+    vemu_mmu_flush(mmu);
+
+    mmu->itlb.hits = 0;
+    mmu->itlb.misses = 0;
+    mmu->dtlb.hits = 0;
+    mmu->dtlb.misses = 0;
+    mmu->faults = 0;
+    mmu->flushes = 0;
+}
+
+void vemu_mmu_flush(vemu_mmu_t *mmu) {
+    vemu_tlb_entry_t invalid = {
+        .load = VEMU_MMU_INVALID,
+        .store = VEMU_MMU_INVALID,
+        .addend = 0,
+        .unused = 0,
+    };
+
+    for (uint32_t i = 0; i < VEMU_MMU_TLB_SIZE; i++) {
+        mmu->itlb.entries[i] = invalid;
+        mmu->dtlb.entries[i] = invalid;
+    }
+    mmu->flushes++;
+}
+
+void vemu_mmu_set_satp(vemu_mmu_t *mmu, uint32_t satp) {
+    mmu->satp = satp & (VEMU_MMU_SATP_MODE | VEMU_MMU_SATP_PPN);
+    vemu_mmu_flush(mmu);
+}
+
+static bool vemu_mmu_allows(uint32_t pte, vemu_mmu_access_t access) {
+    switch (access) {
+        case VEMU_MMU_LOAD:
+            return pte & VEMU_PTE_R;
+
+        case VEMU_MMU_STORE:
+            return pte & VEMU_PTE_W;
+
+        default:
+            return pte & VEMU_PTE_X;
+    }
+}
+
+/* Finds the leaf for vaddr, going down from the root table at satp's
+   PPN, and returns the physical address of its page. A leaf on the first
+   level maps a 4 MiB megapage, of which vaddr picks the 4 KiB page.
+   Page tables outside of guest memory fault like any other access to
+   it. */
+static bool vemu_mmu_walk(vemu_mmu_t *mmu, uint8_t *ram, uint32_t vaddr,
+                          vemu_mmu_access_t access, uint32_t *pte_out,
+                          uint32_t *page) {
+    uint64_t table = (uint64_t)(mmu->satp & VEMU_MMU_SATP_PPN)
+                     << VEMU_MMU_PAGE_BITS;
+
+    for (int level = VEMU_MMU_LEVELS - 1; level >= 0; level--) {
+        uint32_t shift = VEMU_MMU_PAGE_BITS + level * VEMU_MMU_VPN_BITS;
+        uint32_t vpn = (vaddr >> shift) & ((1u << VEMU_MMU_VPN_BITS) - 1);
+        uint64_t addr = table + vpn * VEMU_MMU_PTE_SIZE;
+        if (addr >> 32) {
+            return false;
+        }
+
+        uint32_t *entry = (uint32_t *)(ram + addr);
+        uint32_t pte = __atomic_load_n(entry, __ATOMIC_RELAXED);
+        if (!(pte & VEMU_PTE_V)
+                || (!(pte & VEMU_PTE_R) && (pte & VEMU_PTE_W))) {
+            return false;
+        }
+
+        uint64_t ppn = pte >> 10;
+        if (!(pte & (VEMU_PTE_R | VEMU_PTE_X))) {
+            table = ppn << VEMU_MMU_PAGE_BITS;
+            continue;
+        }
+
+        uint64_t low = (1u << (shift - VEMU_MMU_PAGE_BITS)) - 1;
+        if ((ppn & low) || !vemu_mmu_allows(pte, access)) {
+            return false;
+        }
+
+        uint64_t phys = ((ppn & ~low) | ((vaddr >> VEMU_MMU_PAGE_BITS) & low))
+                        << VEMU_MMU_PAGE_BITS;
+        if (phys >> 32) {
+            return false;
+        }
+
+        uint32_t used = VEMU_PTE_A
+                      | (access == VEMU_MMU_STORE ? VEMU_PTE_D : 0);
+        if ((pte & used) != used) {
+            pte = __atomic_or_fetch(entry, used, __ATOMIC_RELAXED);
+        }
+
+        *pte_out = pte;
+        *page = phys;
+        return true;
+    }
+
+    return false;
+}
+
+/* A load fills the store tag too once the page is dirty; until then the
+   first store walks again to set the dirty bit */
+bool vemu_mmu_miss(vemu_mmu_t *mmu, uint8_t *ram, vemu_bus_t *bus,
+                   uint32_t vaddr, vemu_mmu_access_t access,
+                   uint32_t *paddr) {
+    bool fetch = access == VEMU_MMU_FETCH;
+    vemu_tlb_t *tlb = fetch ? &mmu->itlb : &mmu->dtlb;
+    tlb->misses++;
+
+    uint32_t pte, page;
+    if (!vemu_mmu_walk(mmu, ram, vaddr, access, &pte, &page)) {
+        mmu->faults++;
+        return false;
+    }
+
+    uint32_t vpage = vaddr & VEMU_MMU_PAGE_MASK;
+    *paddr = page | (vaddr & ~VEMU_MMU_PAGE_MASK);
+
+    if (!fetch && bus != NULL && vemu_bus_is_device(bus, page)) {
+        return true;
+    }
+
+    vemu_tlb_entry_t *entry = vemu_mmu_entry(tlb, vaddr);
+    entry->addend = page - vpage;
+    if (fetch) {
+        entry->load = vpage;
+        entry->store = VEMU_MMU_INVALID;
+    } else {
+        entry->load = pte & VEMU_PTE_R ? vpage : VEMU_MMU_INVALID;
+        entry->store = (pte & VEMU_PTE_W) && (pte & VEMU_PTE_D)
+                     ? vpage : VEMU_MMU_INVALID;
+    }
+
+    return true;
+}
+
+static void vemu_mmu_print_tlb(vemu_tlb_t *tlb, char const *name,
+                               FILE *file) {
+    uint64_t lookups = tlb->hits + tlb->misses;
+    double rate = lookups ? 100.0 * tlb->hits / lookups : 0;
+
+    fprintf(file, "%s:          %" PRIu64 " hits, %" PRIu64 " misses "
+            "(%.2f%% hit rate)\n", name, tlb->hits, tlb->misses, rate);
+}
+
+void vemu_mmu_print_stats(vemu_mmu_t *mmu, FILE *file) {
+    vemu_mmu_print_tlb(&mmu->itlb, "itlb", file);
+    vemu_mmu_print_tlb(&mmu->dtlb, "dtlb", file);
+    fprintf(file, "page faults:   %" PRIu64 ", %" PRIu64 " tlb flushes\n",
+            mmu->faults, mmu->flushes);
+}
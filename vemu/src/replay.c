@@ -0,0 +1,205 @@
+#include "replay.h"
+#include <string.h>
+#include <inttypes.h>
+
+#define VEMU_REPLAY_MAGIC       "VEMULOG"
+
+/* Takes the place of the ecall number in the last event of a log */
+#define VEMU_REPLAY_END         UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+} vemu_replay_header_t;
+
+void vemu_replay_init(vemu_replay_t *replay) {
+    replay->mode = VEMU_REPLAY_RECORD;
+    replay->path = NULL;
+    replay->file = NULL;
+
+    replay->instret = 0;
+    replay->events = 0;
+
+    replay->diverged = false;
+}
+
+void vemu_replay_destruct(vemu_replay_t *replay) {
+    if (replay->file != NULL) {
+        fclose(replay->file);
+    }
+
+    vemu_replay_init(replay);
+}
+
+bool vemu_replay_open(vemu_replay_t *replay, char const *path,
+                      vemu_replay_mode_t mode) {
+    bool record = mode == VEMU_REPLAY_RECORD;
+
+    replay->mode = mode;
+    replay->path = path;
+    replay->file = fopen(path, record ? "wb" : "rb");
+    if (replay->file == NULL) {
+        fprintf(stderr, "could not open file: '%s'\n", path);
+        return false;
+    }
+
+    vemu_replay_header_t h = { .version = VEMU_REPLAY_VERSION };
+    memcpy(h.magic, VEMU_REPLAY_MAGIC, sizeof(h.magic));
+
+    if (record) {
+        if (fwrite(&h, sizeof(h), 1, replay->file) != 1) {
+            fprintf(stderr, "could not write log: '%s'\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    vemu_replay_header_t file_h;
+    if (fread(&file_h, sizeof(file_h), 1, replay->file) != 1
+            || memcmp(&file_h, &h, sizeof(h)) != 0) {
+        fprintf(stderr, "not a valid log: '%s'\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static void vemu_replay_put(FILE *file, uint64_t value) {
+    while (value >= 0x80) {
+        putc((value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    putc(value, file);
+}
+
+static bool vemu_replay_get(FILE *file, uint64_t *value) {
+    *value = 0;
+
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+        int c = getc(file);
+        if (c == EOF) {
+            return false;
+        }
+
+        *value |= (uint64_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void vemu_replay_write(vemu_replay_t *replay, uint64_t instret,
+                              uint32_t ecall, uint32_t a, uint32_t b) {
+    FILE *file = replay->file;
+
+    vemu_replay_put(file, instret - replay->instret);
+    vemu_replay_put(file, ecall);
+    vemu_replay_put(file, a);
+    if (ecall == VEMU_REPLAY_END) {
+        vemu_replay_put(file, b);
+    }
+
+    replay->instret = instret;
+}
+
+static bool vemu_replay_read(vemu_replay_t *replay, uint64_t *instret,
+                             uint32_t *ecall, uint32_t *a, uint32_t *b) {
+    FILE *file = replay->file;
+    uint64_t delta, e, x, y = 0;
+
+    if (!vemu_replay_get(file, &delta) || !vemu_replay_get(file, &e)
+            || !vemu_replay_get(file, &x)
+            || (e == VEMU_REPLAY_END && !vemu_replay_get(file, &y))) {
+        return false;
+    }
+
+    *instret = replay->instret += delta;
+    *ecall = e;
+    *a = x;
+    *b = y;
+
+    return true;
+}
+
+/* Reports the first point where the run leaves the log */
+static bool vemu_replay_diverge(vemu_replay_t *replay, uint64_t instret,
+                                char const *what) {
+    if (!replay->diverged) {
+        fprintf(stderr, "replay diverged after %" PRIu64 " instructions, "
+                "event %" PRIu64 ": %s\n", instret, replay->events, what);
+        replay->diverged = true;
+    }
+
+    return false;
+}
+
+bool vemu_replay_event(vemu_replay_t *replay, uint64_t instret,
+                       uint32_t ecall, uint32_t *value) {
+    if (replay->mode == VEMU_REPLAY_RECORD) {
+        vemu_replay_write(replay, instret, ecall, *value, 0);
+        replay->events++;
+        return true;
+    }
+
+    uint64_t logged_instret;
+    uint32_t logged_ecall, a, b;
+
+    if (replay->diverged) {
+        return false;
+    }
+    if (!vemu_replay_read(replay, &logged_instret, &logged_ecall, &a, &b)) {
+        return vemu_replay_diverge(replay, instret, "log ended");
+    }
+    if (logged_instret != instret || logged_ecall != ecall) {
+        return vemu_replay_diverge(replay, instret, "unexpected ecall");
+    }
+
+    *value = a;
+    replay->events++;
+    return true;
+}
+
+bool vemu_replay_finish(vemu_replay_t *replay, uint64_t instret,
+                        uint32_t stop_ip, uint32_t exit_code) {
+    if (replay->mode == VEMU_REPLAY_RECORD) {
+        vemu_replay_write(replay, instret, VEMU_REPLAY_END, stop_ip,
+                          exit_code);
+        if (fflush(replay->file) != 0 || ferror(replay->file)) {
+            fprintf(stderr, "could not write log: '%s'\n", replay->path);
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t logged_instret;
+    uint32_t ecall, logged_stop_ip, logged_exit_code;
+
+    if (replay->diverged) {
+        return false;
+    }
+    if (!vemu_replay_read(replay, &logged_instret, &ecall, &logged_stop_ip,
+                          &logged_exit_code)) {
+        return vemu_replay_diverge(replay, instret, "log ended");
+    }
+    if (ecall != VEMU_REPLAY_END) {
+        return vemu_replay_diverge(replay, instret, "guest stopped early");
+    }
+    if (logged_instret != instret || logged_stop_ip != stop_ip
+            || logged_exit_code != exit_code) {
+        return vemu_replay_diverge(replay, instret, "guest stopped "
+                                   "differently");
+    }
+
+    return true;
+}
+
+void vemu_replay_print_stats(vemu_replay_t *replay, FILE *file) {
+    long size = ftell(replay->file);
+
+    fprintf(file, "%s:        %" PRIu64 " events, %ld bytes%s\n",
+            replay->mode == VEMU_REPLAY_RECORD ? "record" : "replay",
+            replay->events, size,
+            replay->diverged ? ", diverged" : "");
+}
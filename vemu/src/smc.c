@@ -0,0 +1,110 @@
+#include "smc.h"
+#include <stdlib.h>
+
+#define VEMU_SMC_OFFSET_MASK    ((1u << VEMU_SMC_PAGE_BITS) - 1)
+
+/* Halfwords touched by [addr, addr + len), counted so ranges at the top
+   of the address space wrap like the guest's own addresses */
+static inline uint32_t vemu_smc_halfwords(uint32_t addr, uint32_t len) {
+    return ((addr & 1) + len + 1) >> 1;
+}
+
+void vemu_smc_init(vemu_smc_t *smc) {
+    smc->pages = NULL;
+    smc->n_bitmaps = 0;
+
+    smc->code_stores = 0;
+    smc->invalidations = 0;
+    smc->invalidated = 0;
+}
+
+bool vemu_smc_alloc(vemu_smc_t *smc) {
+    smc->pages = calloc(VEMU_SMC_N_PAGES, sizeof(uint8_t *));
+
+    return smc->pages != NULL;
+}
+
+/* Code tends to sit low in memory, so counting the bitmaps saves
+   touching most of the table on the way out */
+void vemu_smc_destruct(vemu_smc_t *smc) {
+    if (smc->pages != NULL) {
+        for (size_t i = 0; smc->n_bitmaps > 0 && i < VEMU_SMC_N_PAGES; i++) {
+            if (smc->pages[i] != NULL) {
+                free(smc->pages[i]);
+                smc->n_bitmaps--;
+            }
+        }
+        free(smc->pages);
+    }
+    vemu_smc_init(smc);
+}
+
+bool vemu_smc_mark(vemu_smc_t *smc, uint32_t start, uint32_t end) {
+    if (smc->pages == NULL) {
+        return true;
+    }
+
+    uint32_t n = vemu_smc_halfwords(start, end - start);
+
+    for (uint32_t i = 0, ip = start & ~1u; i < n; i++, ip += 2) {
+        uint8_t **page = &smc->pages[ip >> VEMU_SMC_PAGE_BITS];
+        if (*page == NULL) {
+            *page = calloc(VEMU_SMC_BITMAP_SIZE, 1);
+            if (*page == NULL) {
+                return false;
+            }
+            smc->n_bitmaps++;
+        }
+
+        uint32_t bit = (ip & VEMU_SMC_OFFSET_MASK) >> 1;
+        (*page)[bit >> 3] |= 1 << (bit & 7);
+    }
+
+    return true;
+}
+
+bool vemu_smc_overlaps(vemu_smc_t *smc, uint32_t addr, uint32_t len) {
+    uint32_t n = vemu_smc_halfwords(addr, len);
+
+    for (uint32_t i = 0, ip = addr & ~1u; i < n; i++, ip += 2) {
+        uint8_t *page = smc->pages[ip >> VEMU_SMC_PAGE_BITS];
+        uint32_t bit = (ip & VEMU_SMC_OFFSET_MASK) >> 1;
+
+        if (page != NULL && (page[bit >> 3] & (1 << (bit & 7)))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool vemu_smc_empty(uint8_t const *bitmap) {
+    for (size_t i = 0; i < VEMU_SMC_BITMAP_SIZE; i++) {
+        if (bitmap[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Pages whose last code bit goes away drop back to the fast path */
+void vemu_smc_clear(vemu_smc_t *smc, uint32_t addr, uint32_t len) {
+    uint32_t n = vemu_smc_halfwords(addr, len);
+
+    for (uint32_t i = 0, ip = addr & ~1u; i < n; i++, ip += 2) {
+        uint8_t **page = &smc->pages[ip >> VEMU_SMC_PAGE_BITS];
+        if (*page == NULL) {
+            continue;
+        }
+
+        uint32_t bit = (ip & VEMU_SMC_OFFSET_MASK) >> 1;
+        (*page)[bit >> 3] &= ~(1 << (bit & 7));
+
+        if (vemu_smc_empty(*page)) {
+            free(*page);
+            *page = NULL;
+            smc->n_bitmaps--;
+        }
+    }
+}
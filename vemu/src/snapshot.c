@@ -0,0 +1,369 @@
+#include "snapshot.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VEMU_SNAPSHOT_MAGIC     "VEMUSNAP"
+
+/* Entries of /proc/self/pagemap read at a time */
+#define VEMU_SNAPSHOT_PAGEMAP_CHUNK 4096
+
+#define VEMU_PAGEMAP_PRESENT    (1ull << 63)
+#define VEMU_PAGEMAP_SWAPPED    (1ull << 62)
+
+void vemu_snapshot_init(vemu_snapshot_t *snap) {
+    snap->path = NULL;
+    snap->fd = -1;
+    snap->header = NULL;
+    snap->size = 0;
+
+    snap->pages = NULL;
+    snap->perms = NULL;
+    snap->data_offset = 0;
+}
+
+void vemu_snapshot_destruct(vemu_snapshot_t *snap) {
+    if (snap->header != NULL) {
+        munmap(snap->header, snap->size);
+    }
+    if (snap->fd >= 0) {
+        close(snap->fd);
+    }
+
+    vemu_snapshot_init(snap);
+}
+
+static size_t vemu_snapshot_data_offset(uint32_t n_pages, uint32_t n_perms) {
+    size_t end = sizeof(vemu_snapshot_header_t)
+               + (size_t)n_pages * sizeof(uint32_t) + n_perms;
+    return (end + VEMU_SNAPSHOT_PAGE_SIZE - 1)
+         & ~(size_t)(VEMU_SNAPSHOT_PAGE_SIZE - 1);
+}
+
+static bool vemu_snapshot_check(vemu_snapshot_t *snap) {
+    vemu_snapshot_header_t *h = snap->header;
+
+    if (snap->size < sizeof(*h)
+            || memcmp(h->magic, VEMU_SNAPSHOT_MAGIC, sizeof(h->magic)) != 0
+            || h->version != VEMU_SNAPSHOT_VERSION
+            || h->page_size != VEMU_SNAPSHOT_PAGE_SIZE) {
+        return false;
+    }
+
+    snap->pages = (uint32_t *)(h + 1);
+    snap->perms = (uint8_t *)(snap->pages + h->n_pages);
+    snap->data_offset = vemu_snapshot_data_offset(h->n_pages, h->n_perms);
+    if (snap->data_offset + (size_t)h->n_pages * h->page_size > snap->size) {
+        return false;
+    }
+
+    for (uint32_t i = 1; i < h->n_pages; i++) {
+        if (snap->pages[i] <= snap->pages[i - 1]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool vemu_snapshot_open(vemu_snapshot_t *snap, char const *path) {
+    snap->path = path;
+
+    snap->fd = open(path, O_RDONLY);
+    if (snap->fd < 0) {
+        fprintf(stderr, "could not open snapshot: '%s'\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(snap->fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "could not read snapshot: '%s'\n", path);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, snap->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "could not map snapshot: '%s'\n", path);
+        return false;
+    }
+    snap->header = map;
+    snap->size = st.st_size;
+
+    if (!vemu_snapshot_check(snap)) {
+        fprintf(stderr, "not a valid snapshot: '%s'\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+/* Consecutive pages go into guest memory as one mapping of the file.
+   On hosts with other page sizes they are copied out of it instead. */
+bool vemu_snapshot_restore(vemu_snapshot_t *snap, vemu_system_t *sys) {
+    vemu_snapshot_header_t *h = snap->header;
+    uint32_t page_size = h->page_size;
+
+    if (sys->n_harts != 1) {
+        fprintf(stderr, "snapshots hold a single hart\n");
+        return false;
+    }
+    if ((h->n_pages > 0
+         && snap->pages[h->n_pages - 1] >= sys->ram_size / page_size)
+            || h->n_perms > sys->ram_size / page_size) {
+        fprintf(stderr, "snapshot does not fit in guest memory: '%s'\n",
+                snap->path);
+        return false;
+    }
+
+    bool map = sysconf(_SC_PAGESIZE) == page_size;
+
+    for (uint32_t i = 0; i < h->n_pages; ) {
+        uint32_t n = 1;
+        while (i + n < h->n_pages && snap->pages[i + n] == snap->pages[i] + n) {
+            n++;
+        }
+
+        uint8_t *dst = sys->ram + (size_t)snap->pages[i] * page_size;
+        size_t offset = snap->data_offset + (size_t)i * page_size;
+        size_t len = (size_t)n * page_size;
+
+        if (!map) {
+            memcpy(dst, (uint8_t *)h + offset, len);
+        } else if (mmap(dst, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, snap->fd, offset)
+                   == MAP_FAILED) {
+            fprintf(stderr, "could not map snapshot: '%s'\n", snap->path);
+            return false;
+        }
+
+        i += n;
+    }
+
+    /* Guest memory starts out RWX and mapped pages writable, so only
+       runs of pages with less have to be protected */
+    for (uint32_t i = 0; i < h->n_perms; ) {
+        uint32_t n = 1;
+        while (i + n < h->n_perms && snap->perms[i + n] == snap->perms[i]) {
+            n++;
+        }
+
+        if (snap->perms[i] != VEMU_BUS_RWX
+                && !vemu_system_protect(sys, i, n, snap->perms[i])) {
+            fprintf(stderr, "could not protect guest memory\n");
+            return false;
+        }
+
+        i += n;
+    }
+
+    vemu_cpu_t *cpu = &sys->harts[0];
+    memcpy(cpu->regs, h->regs, sizeof(cpu->regs));
+    memcpy(cpu->fregs, h->fregs, sizeof(cpu->fregs));
+    cpu->fcsr = h->fcsr;
+    memcpy(cpu->vregs, h->vregs, sizeof(cpu->vregs));
+    cpu->vl = h->vl;
+    cpu->vtype = h->vtype;
+    cpu->vstart = h->vstart;
+    cpu->ip = h->ip;
+    vemu_mmu_set_satp(&cpu->mmu, h->satp);
+    cpu->instret = h->instret;
+    cpu->trace_start = h->trace_start;
+
+    return true;
+}
+
+static bool vemu_snapshot_zero(uint8_t const *page) {
+    uint64_t const *words = (uint64_t const *)page;
+    uint64_t any = 0;
+
+    for (size_t i = 0; i < VEMU_SNAPSHOT_PAGE_SIZE / sizeof(*words); i++) {
+        any |= words[i];
+    }
+
+    return any == 0;
+}
+
+static bool vemu_snapshot_in_image(vemu_system_t *sys, uint32_t page) {
+    size_t addr = (size_t)page * VEMU_SNAPSHOT_PAGE_SIZE;
+
+    return addr + VEMU_SNAPSHOT_PAGE_SIZE > sys->image_start
+        && addr < sys->image_end;
+}
+
+/* Collects the numbers of the non-zero pages among those the guest may
+   have touched. The kernel's page map tells which pages of guest memory
+   ever got backed; without it every page is looked at. The program's
+   pages always are, as those mapped from its file only get backed once
+   the guest gets to them. */
+static uint32_t *vemu_snapshot_pages(vemu_system_t *sys,
+                                     vemu_snapshot_t *base,
+                                     uint32_t *n_pages) {
+    uint32_t total = sys->ram_size / VEMU_SNAPSHOT_PAGE_SIZE;
+    uint32_t *pages = malloc(VEMU_SNAPSHOT_PAGEMAP_CHUNK * sizeof(*pages));
+    uint32_t size = VEMU_SNAPSHOT_PAGEMAP_CHUNK;
+    uint32_t n = 0;
+
+    uint64_t *entries = malloc(VEMU_SNAPSHOT_PAGEMAP_CHUNK
+                               * sizeof(*entries));
+    int pagemap = -1;
+    if (sysconf(_SC_PAGESIZE) == VEMU_SNAPSHOT_PAGE_SIZE) {
+        pagemap = open("/proc/self/pagemap", O_RDONLY);
+    }
+
+    uint32_t base_i = 0;
+    uint32_t base_n = base != NULL ? base->header->n_pages : 0;
+
+    for (uint32_t first = 0; pages != NULL && first < total;
+            first += VEMU_SNAPSHOT_PAGEMAP_CHUNK) {
+        uint32_t count = total - first;
+        if (count > VEMU_SNAPSHOT_PAGEMAP_CHUNK) {
+            count = VEMU_SNAPSHOT_PAGEMAP_CHUNK;
+        }
+
+        size_t len = count * sizeof(*entries);
+        off_t offset = ((uintptr_t)sys->ram / VEMU_SNAPSHOT_PAGE_SIZE + first)
+                     * sizeof(*entries);
+        bool mapped = pagemap >= 0 && entries != NULL
+                   && pread(pagemap, entries, len, offset) == (ssize_t)len;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t page = first + i;
+
+            bool touched = !mapped
+                        || (entries[i] & (VEMU_PAGEMAP_PRESENT
+                                          | VEMU_PAGEMAP_SWAPPED)) != 0;
+            while (base_i < base_n && base->pages[base_i] < page) {
+                base_i++;
+            }
+            touched = touched
+                   || (base_i < base_n && base->pages[base_i] == page)
+                   || vemu_snapshot_in_image(sys, page);
+
+            uint8_t *data = sys->ram + (size_t)page * VEMU_SNAPSHOT_PAGE_SIZE;
+            if (!touched || vemu_snapshot_zero(data)) {
+                continue;
+            }
+
+            if (n == size) {
+                size *= 2;
+                uint32_t *grown = realloc(pages, size * sizeof(*pages));
+                if (grown == NULL) {
+                    free(pages);
+                    pages = NULL;
+                    break;
+                }
+                pages = grown;
+            }
+            pages[n++] = page;
+        }
+    }
+
+    if (pagemap >= 0) {
+        close(pagemap);
+    }
+    free(entries);
+
+    *n_pages = n;
+    return pages;
+}
+
+static bool vemu_snapshot_write(FILE *file, vemu_system_t *sys,
+                                uint32_t *pages, uint32_t n_pages) {
+    vemu_cpu_t *cpu = &sys->harts[0];
+    uint32_t n_perms = sys->ram_size / VEMU_SNAPSHOT_PAGE_SIZE;
+
+    vemu_snapshot_header_t h = {
+        .version = VEMU_SNAPSHOT_VERSION,
+        .page_size = VEMU_SNAPSHOT_PAGE_SIZE,
+        .n_pages = n_pages,
+        .n_perms = n_perms,
+        .ip = cpu->ip,
+        .fcsr = cpu->fcsr,
+        .vl = cpu->vl,
+        .vtype = cpu->vtype,
+        .vstart = cpu->vstart,
+        .satp = cpu->mmu.satp,
+        .instret = cpu->instret,
+        .trace_start = cpu->trace_start,
+    };
+    memcpy(h.magic, VEMU_SNAPSHOT_MAGIC, sizeof(h.magic));
+    memcpy(h.regs, cpu->regs, sizeof(h.regs));
+    memcpy(h.fregs, cpu->fregs, sizeof(h.fregs));
+    memcpy(h.vregs, cpu->vregs, sizeof(h.vregs));
+
+    if (fwrite(&h, sizeof(h), 1, file) != 1
+            || fwrite(pages, sizeof(*pages), n_pages, file) != n_pages) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_perms; i++) {
+        uint8_t perms = vemu_bus_perms(&sys->bus,
+                                       i * VEMU_SNAPSHOT_PAGE_SIZE);
+        if (fputc(perms, file) == EOF) {
+            return false;
+        }
+    }
+
+    if (fseek(file, vemu_snapshot_data_offset(n_pages, n_perms), SEEK_SET)
+            != 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_pages; i++) {
+        uint8_t *data = sys->ram + (size_t)pages[i] * VEMU_SNAPSHOT_PAGE_SIZE;
+        if (fwrite(data, VEMU_SNAPSHOT_PAGE_SIZE, 1, file) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* The file is replaced atomically, so a snapshot being restored from
+   elsewhere is never seen half-written */
+bool vemu_snapshot_save(char const *path, vemu_system_t *sys,
+                        vemu_snapshot_t *base) {
+    if (sys->n_harts != 1) {
+        fprintf(stderr, "snapshots hold a single hart\n");
+        return false;
+    }
+
+    uint32_t n_pages;
+    uint32_t *pages = vemu_snapshot_pages(sys, base, &n_pages);
+    if (pages == NULL) {
+        fprintf(stderr, "could not allocate snapshot page list\n");
+        return false;
+    }
+
+    char *tmp;
+    if (asprintf(&tmp, "%s.%ld.tmp", path, (long)getpid()) < 0) {
+        free(pages);
+        return false;
+    }
+
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "could not open file: '%s'\n", tmp);
+        free(tmp);
+        free(pages);
+        return false;
+    }
+
+    bool ok = vemu_snapshot_write(file, sys, pages, n_pages);
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok) {
+        fprintf(stderr, "could not write snapshot: '%s'\n", path);
+        remove(tmp);
+    }
+
+    free(tmp);
+    free(pages);
+    return ok;
+}
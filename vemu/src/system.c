@@ -1,18 +1,234 @@
+
 #include "system.h"
+#include "ram.h"
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 void vemu_system_init(vemu_system_t *sys) {
-    vemu_cpu_init(&sys->cpu, &sys->ram);
+    sys->harts = NULL;
+    sys->n_harts = 0;
     sys->ram = NULL;
+    sys->ram_size = 0;
+    sys->image_start = 0;
+    sys->image_end = 0;
+    vemu_bus_init(&sys->bus);
+}
+
+bool vemu_system_alloc(vemu_system_t *sys, uint32_t n_harts) {
+    sys->harts = calloc(n_harts, sizeof(vemu_cpu_t));
+    if (sys->harts == NULL) {
+        return false;
+    }
+    sys->n_harts = n_harts;
+
+    for (uint32_t i = 0; i < n_harts; i++) {
+        vemu_cpu_init(&sys->harts[i], &sys->ram);
+        sys->harts[i].bus = &sys->bus;
+        sys->harts[i].hartid = i;
+        sys->harts[i].n_harts = n_harts;
+    }
+
+    return true;
 }
 
 void vemu_system_destruct(vemu_system_t *sys) {
+    for (uint32_t i = 0; i < sys->n_harts; i++) {
+        vemu_cpu_destruct(&sys->harts[i]);
+    }
+    free(sys->harts);
+
     if (sys->ram != NULL) {
-        free(sys->ram);
+        munmap(sys->ram, VEMU_RAM_RESERVE_SIZE);
     }
+    vemu_bus_destruct(&sys->bus);
+
+    vemu_system_init(sys);
 }
 
-void vemu_system_add_ram(vemu_system_t *sys, uint8_t *ram) {
+bool vemu_system_alloc_ram(vemu_system_t *sys, size_t size) {
+    void *ram = mmap(NULL, VEMU_RAM_RESERVE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ram == MAP_FAILED) {
+        return false;
+    }
+
+    if (mprotect(ram, size, PROT_READ | PROT_WRITE) != 0
+            || !vemu_bus_alloc(&sys->bus, size)) {
+        munmap(ram, VEMU_RAM_RESERVE_SIZE);
+        return false;
+    }
+
     sys->ram = ram;
+    sys->ram_size = size;
+
+    return true;
+}
+
+/* Guest memory always stays readable */
+bool vemu_system_protect(vemu_system_t *sys, uint32_t first, uint32_t n,
+                         uint8_t perms) {
+    vemu_bus_protect(&sys->bus, first, n, perms);
+
+    int prot = PROT_READ | (perms & VEMU_BUS_W ? PROT_WRITE : 0);
+    return mprotect(sys->ram + ((size_t)first << VEMU_BUS_PAGE_BITS),
+                    (size_t)n << VEMU_BUS_PAGE_BITS, prot) == 0;
+}
+
+static uint8_t vemu_system_segment_perms(vemu_elf_program_header_t *ph) {
+    return (ph->p_flags & ELF_PF_R ? VEMU_BUS_R : 0)
+         | (ph->p_flags & ELF_PF_W ? VEMU_BUS_W : 0)
+         | (ph->p_flags & ELF_PF_X ? VEMU_BUS_X : 0);
+}
+
+static void vemu_system_add_image(vemu_system_t *sys,
+                                  vemu_elf_program_header_t *ph) {
+    size_t start = ph->p_vaddr;
+    size_t end = start + ph->p_filesz;
+
+    if (start == end) {
+        return;
+    }
+    if (sys->image_start == sys->image_end || start < sys->image_start) {
+        sys->image_start = start;
+    }
+    if (end > sys->image_end) {
+        sys->image_end = end;
+    }
+}
+
+/* Every segment's pages are cleared first, so that each page ends up
+   with the union of the permissions of the segments on it */
+bool vemu_system_load_elf(vemu_system_t *sys, vemu_elf_t *elf) {
+    if (!vemu_elf_map(elf, sys->ram, sys->ram_size)) {
+        return false;
+    }
+
+    vemu_bus_protect(&sys->bus, 0, sys->ram_size >> VEMU_BUS_PAGE_BITS,
+                     VEMU_BUS_R | VEMU_BUS_W);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < elf->h.e_phnum; i++) {
+            vemu_elf_program_header_t *ph = &elf->phdrs[i];
+            if (ph->p_type != ELF_PT_LOAD || ph->p_memsz == 0) {
+                continue;
+            }
+
+            if (pass == 0) {
+                vemu_system_add_image(sys, ph);
+            }
+
+            uint32_t first = ph->p_vaddr >> VEMU_BUS_PAGE_BITS;
+            uint32_t last = (ph->p_vaddr + ph->p_memsz - 1) 
+                          >> VEMU_BUS_PAGE_BITS;
+            for (uint32_t page = first; page <= last; page++) {
+                uint8_t perms = pass == 0 ? 0
+                              : vemu_bus_perms(&sys->bus, 
+                                               page << VEMU_BUS_PAGE_BITS)
+                                | vemu_system_segment_perms(ph);
+                if (!vemu_system_protect(sys, page, 1, perms)) {
+                    fprintf(stderr, "could not protect guest memory\n");
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool vemu_system_add_device(vemu_system_t *sys, vemu_device_t const *device) {
+    if (device->base < sys->ram_size
+            || !vemu_bus_add_device(&sys->bus, device)) {
+        fprintf(stderr, "could not map device %s at 0x%08" PRIx32 "\n",
+                device->name, device->base);
+        return false;
+    }
+
+    return true;
+}
+
+/* Harts wait for all of them to be created before running, so a hart
+   that fails to start does not leave the others spinning on it */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool released;
+    bool go;
+    uint32_t entry;
+} vemu_system_start_t;
+
+typedef struct {
+    vemu_cpu_t *cpu;
+    vemu_system_start_t *start;
+} vemu_hart_thread_t;
+
+static bool vemu_system_wait(vemu_system_start_t *start) {
+    pthread_mutex_lock(&start->lock);
+    while (!start->released) {
+        pthread_cond_wait(&start->cond, &start->lock);
+    }
+    pthread_mutex_unlock(&start->lock);
+
+    return start->go;
+}
+
+static void vemu_system_release(vemu_system_start_t *start, bool go) {
+    pthread_mutex_lock(&start->lock);
+    start->released = true;
+    start->go = go;
+    pthread_cond_broadcast(&start->cond);
+    pthread_mutex_unlock(&start->lock);
+}
+
+static void *vemu_system_hart_main(void *arg) {
+    vemu_hart_thread_t *thread = arg;
+
+    if (vemu_system_wait(thread->start)) {
+        vemu_cpu_run(thread->cpu, thread->start->entry);
+    }
+
+    return NULL;
+}
+
+bool vemu_system_run(vemu_system_t *sys, uint32_t entry) {
+    if (sys->n_harts == 1) {
+        vemu_cpu_run(&sys->harts[0], entry);
+        return true;
+    }
+
+    vemu_system_start_t start = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .released = false,
+        .go = false,
+        .entry = entry,
+    };
+    pthread_t ids[VEMU_MAX_HARTS];
+    vemu_hart_thread_t threads[VEMU_MAX_HARTS];
+    uint32_t n = 1;
+
+    for (; n < sys->n_harts; n++) {
+        threads[n] = (vemu_hart_thread_t){ &sys->harts[n], &start };
+        if (pthread_create(&ids[n], NULL, vemu_system_hart_main, 
+                           &threads[n]) != 0) {
+            fprintf(stderr, "could not start hart %" PRIu32 "\n", n);
+            break;
+        }
+    }
+
+    bool go = n == sys->n_harts;
+    vemu_system_release(&start, go);
+
+    if (go) {
+        vemu_cpu_run(&sys->harts[0], entry);
+    }
+
+    for (uint32_t i = 1; i < n; i++) {
+        pthread_join(ids[i], NULL);
+    }
+
+    return go;
 }
@@ -0,0 +1,442 @@
+#include "tcache.h"
+#include "trace.h"
+#include "fp.h"
+#include "vec.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VEMU_TCACHE_MAGIC       "VEMUTC\r\n"
+
+#define VEMU_TCACHE_HAS_TERM    0x01
+#define VEMU_TCACHE_INDIRECT    0x02
+#define VEMU_TCACHE_HOT         0x04
+#define VEMU_TCACHE_TRACE       0x08
+#define VEMU_TCACHE_TRACE_HOT   0x10
+
+/* The file is a header followed by each block and its ops. All fields
+   have fixed sizes so the layout does not depend on struct padding. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t config;
+    uint64_t key;
+    uint64_t checksum;
+    uint32_t n_blocks;
+    uint32_t size;
+} vemu_tcache_header_t;
+
+typedef struct {
+    uint32_t ip;
+    uint32_t end;
+    uint32_t term_ip;
+    uint32_t n_instrs;
+    uint32_t succ_ip[2];
+    uint32_t succ_hits[2];
+    uint32_t flags;
+    uint32_t n_ops;
+} vemu_tcache_block_t;
+
+typedef struct {
+    uint32_t imm;
+    uint32_t imm2;
+    uint8_t opcode;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t rd2;
+    uint8_t n_instrs;
+    uint8_t c;
+    uint8_t pad;
+} vemu_tcache_op_t;
+
+static uint64_t vemu_tcache_hash(uint64_t hash, void const *data,
+                                 size_t size) {
+    uint8_t const *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3;
+    }
+
+    return hash;
+}
+
+#define VEMU_TCACHE_HASH_INIT   0xCBF29CE484222325
+
+/* Everything that changes how blocks are translated */
+static uint32_t vemu_tcache_config(vemu_cpu_t *cpu) {
+    return (cpu->fusion ? 0x1 : 0) | (cpu->traces ? 0x2 : 0)
+         | (cpu->passes << 8);
+}
+
+void vemu_tcache_init(vemu_tcache_t *tcache) {
+    tcache->path = NULL;
+    tcache->key = 0;
+    tcache->config = 0;
+
+    tcache->result = VEMU_TCACHE_MISS;
+    tcache->loaded = 0;
+    tcache->saved = 0;
+}
+
+void vemu_tcache_destruct(vemu_tcache_t *tcache) {
+    free(tcache->path);
+    vemu_tcache_init(tcache);
+}
+
+/* Derives the cache entry for the program in ram from its entry point
+   and the placement and contents of every PT_LOAD segment. Only the
+   bytes a segment has in the file are hashed: the rest is bss, zero
+   whatever the program, and reading it would back pages of guest memory
+   the guest may never touch. */
+bool vemu_tcache_open(vemu_tcache_t *tcache, char const *dir,
+                      vemu_elf_t *elf, uint8_t *ram, vemu_cpu_t *cpu) {
+    uint64_t key = VEMU_TCACHE_HASH_INIT;
+    key = vemu_tcache_hash(key, &elf->h.e_entry, sizeof(elf->h.e_entry));
+
+    for (size_t i = 0; i < elf->h.e_phnum; i++) {
+        vemu_elf_program_header_t *ph = &elf->phdrs[i];
+        if (ph->p_type != ELF_PT_LOAD) {
+            continue;
+        }
+
+        key = vemu_tcache_hash(key, &ph->p_vaddr, sizeof(ph->p_vaddr));
+        key = vemu_tcache_hash(key, &ph->p_filesz, sizeof(ph->p_filesz));
+        key = vemu_tcache_hash(key, &ph->p_memsz, sizeof(ph->p_memsz));
+        key = vemu_tcache_hash(key, &ph->p_flags, sizeof(ph->p_flags));
+        key = vemu_tcache_hash(key, ram + ph->p_vaddr, ph->p_filesz);
+    }
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "could not create cache directory: '%s'\n", dir);
+        return false;
+    }
+
+    if (asprintf(&tcache->path, "%s/%016" PRIx64 ".vtc", dir, key) < 0) {
+        tcache->path = NULL;
+        return false;
+    }
+
+    tcache->key = key;
+    tcache->config = vemu_tcache_config(cpu);
+
+    return true;
+}
+
+static bool vemu_tcache_valid_op(vemu_tcache_op_t const *op) {
+    return op->opcode < VEMU_N_OPCODES && op->rd < VEMU_N_REGS
+        && op->rs1 < VEMU_N_REGS && op->rs2 < VEMU_N_REGS
+        && op->rd2 < VEMU_N_REGS && op->n_instrs >= 1 && op->n_instrs <= 2
+        && (op->opcode != VEMU_OPCODE_FP
+            || VEMU_FP_OPCODE(op->imm2) < VEMU_FP_N_OPS)
+        && (op->opcode != VEMU_OPCODE_VEC
+            || VEMU_VEC_OPCODE(op->imm2) < VEMU_VEC_N_OPS);
+}
+
+static vemu_block_t *vemu_tcache_read_block(uint8_t const **data,
+                                            uint8_t const *end,
+                                            uint32_t *flags) {
+    vemu_tcache_block_t b;
+    if ((size_t)(end - *data) < sizeof(b)) {
+        return NULL;
+    }
+    memcpy(&b, *data, sizeof(b));
+    *data += sizeof(b);
+
+    if (b.n_ops > VEMU_BLOCK_MAX_INSTRS
+            || ((b.flags & VEMU_TCACHE_HAS_TERM) && b.n_ops == 0)
+            || (size_t)(end - *data) < b.n_ops * sizeof(vemu_tcache_op_t)) {
+        return NULL;
+    }
+
+    vemu_block_t *block = vemu_block_alloc(b.n_ops);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->ip = b.ip;
+    block->end = b.end;
+    block->term_ip = b.term_ip;
+    block->has_term = b.flags & VEMU_TCACHE_HAS_TERM;
+    block->indirect = b.flags & VEMU_TCACHE_INDIRECT;
+    block->n_instrs = b.n_instrs;
+    for (size_t i = 0; i < 2; i++) {
+        block->succ_ip[i] = b.succ_ip[i];
+        block->succ_hits[i] = b.succ_hits[i];
+    }
+
+    *flags = b.flags;
+
+    for (uint32_t i = 0; i < b.n_ops; i++) {
+        vemu_tcache_op_t op;
+        memcpy(&op, *data, sizeof(op));
+        *data += sizeof(op);
+
+        if (!vemu_tcache_valid_op(&op)) {
+            vemu_block_free(block);
+            return NULL;
+        }
+
+        block->ops[i] = (vemu_decoded_t){
+            .opcode = op.opcode,
+            .rd = op.rd,
+            .rs1 = op.rs1,
+            .rs2 = op.rs2,
+            .rd2 = op.rd2,
+            .imm = op.imm,
+            .imm2 = op.imm2,
+            .n_instrs = op.n_instrs,
+            .c = op.c,
+        };
+    }
+
+    return block;
+}
+
+/* Blocks that were hot last time skip the warmup: they get their
+   superblocks back right away and are compiled on first use. Superblocks
+   are formed once every block is in, since they take ops from the blocks
+   along the path. */
+static void vemu_tcache_warm(vemu_cpu_t *cpu, vemu_block_t *block,
+                             uint32_t flags) {
+    if (flags & VEMU_TCACHE_HOT) {
+        block->heat = VEMU_JIT_THRESHOLD;
+    }
+
+    if (cpu->traces && (flags & VEMU_TCACHE_TRACE)) {
+        block->trace_heat = VEMU_TRACE_THRESHOLD;
+        block->trace = vemu_trace_form(&cpu->blocks, block);
+        if (block->trace != NULL && (flags & VEMU_TCACHE_TRACE_HOT)) {
+            block->trace->heat = VEMU_JIT_THRESHOLD;
+        }
+    }
+}
+
+static vemu_tcache_result_t vemu_tcache_read(vemu_tcache_t *tcache,
+                                             vemu_cpu_t *cpu,
+                                             uint8_t const *data,
+                                             size_t size) {
+    vemu_tcache_header_t h;
+    if (size < sizeof(h)) {
+        return VEMU_TCACHE_CORRUPT;
+    }
+    memcpy(&h, data, sizeof(h));
+
+    if (memcmp(h.magic, VEMU_TCACHE_MAGIC, sizeof(h.magic)) != 0
+            || h.size != size - sizeof(h) || h.key != tcache->key) {
+        return VEMU_TCACHE_CORRUPT;
+    }
+
+    if (h.version != VEMU_TCACHE_VERSION || h.config != tcache->config) {
+        return VEMU_TCACHE_STALE;
+    }
+
+    uint8_t const *payload = data + sizeof(h), *end = data + size;
+    if (vemu_tcache_hash(VEMU_TCACHE_HASH_INIT, payload, h.size)
+            != h.checksum || h.n_blocks > (cpu->blocks.mask + 1) / 2) {
+        return VEMU_TCACHE_CORRUPT;
+    }
+
+    vemu_block_t **loaded = malloc(h.n_blocks * sizeof(*loaded));
+    uint32_t *flags = malloc(h.n_blocks * sizeof(*flags));
+    if ((loaded == NULL || flags == NULL) && h.n_blocks > 0) {
+        free(loaded);
+        free(flags);
+        return VEMU_TCACHE_MISS;
+    }
+
+    vemu_tcache_result_t result = VEMU_TCACHE_HIT;
+    for (uint32_t i = 0; i < h.n_blocks; i++) {
+        loaded[i] = vemu_tcache_read_block(&payload, end, &flags[i]);
+        if (loaded[i] == NULL) {
+            vemu_block_cache_flush(&cpu->blocks);
+            tcache->loaded = 0;
+            result = VEMU_TCACHE_CORRUPT;
+            break;
+        }
+
+        vemu_block_cache_insert(&cpu->blocks, loaded[i]);
+        tcache->loaded++;
+
+        if (!vemu_smc_mark(&cpu->smc, loaded[i]->ip, loaded[i]->end)) {
+            vemu_block_cache_flush(&cpu->blocks);
+            tcache->loaded = 0;
+            result = VEMU_TCACHE_MISS;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < tcache->loaded; i++) {
+        vemu_tcache_warm(cpu, loaded[i], flags[i]);
+    }
+
+    free(loaded);
+    free(flags);
+    return result;
+}
+
+/* Fills the block cache from disk. Missing, stale and corrupt entries
+   leave it empty, so the program is simply translated as usual. */
+void vemu_tcache_load(vemu_tcache_t *tcache, vemu_cpu_t *cpu) {
+    tcache->result = VEMU_TCACHE_MISS;
+
+    int fd = open(tcache->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        tcache->result = VEMU_TCACHE_CORRUPT;
+        close(fd);
+        return;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        tcache->result = VEMU_TCACHE_CORRUPT;
+        return;
+    }
+
+    tcache->result = vemu_tcache_read(tcache, cpu, data, st.st_size);
+    munmap(data, st.st_size);
+}
+
+static uint32_t vemu_tcache_flags(vemu_block_t *block) {
+    uint32_t flags = 0;
+
+    if (block->has_term) {
+        flags |= VEMU_TCACHE_HAS_TERM;
+    }
+    if (block->indirect) {
+        flags |= VEMU_TCACHE_INDIRECT;
+    }
+    if (block->native != NULL || block->heat >= VEMU_JIT_THRESHOLD) {
+        flags |= VEMU_TCACHE_HOT;
+    }
+    if (block->trace != NULL) {
+        flags |= VEMU_TCACHE_TRACE;
+        if (block->trace->native != NULL
+                || block->trace->heat >= VEMU_JIT_THRESHOLD) {
+            flags |= VEMU_TCACHE_TRACE_HOT;
+        }
+    }
+
+    return flags;
+}
+
+static bool vemu_tcache_write(FILE *file, vemu_cpu_t *cpu,
+                              vemu_tcache_header_t *h) {
+    vemu_block_cache_t *blocks = &cpu->blocks;
+
+    for (size_t i = 0; i <= blocks->mask; i++) {
+        vemu_block_t *block = blocks->slots[i];
+        if (block == NULL) {
+            continue;
+        }
+
+        vemu_tcache_block_t b = {
+            .ip = block->ip,
+            .end = block->end,
+            .term_ip = block->term_ip,
+            .n_instrs = block->n_instrs,
+            .succ_ip = { block->succ_ip[0], block->succ_ip[1] },
+            .succ_hits = { block->succ_hits[0], block->succ_hits[1] },
+            .flags = vemu_tcache_flags(block),
+            .n_ops = block->n_ops,
+        };
+        if (fwrite(&b, sizeof(b), 1, file) != 1) {
+            return false;
+        }
+        h->checksum = vemu_tcache_hash(h->checksum, &b, sizeof(b));
+
+        for (uint32_t j = 0; j < block->n_ops; j++) {
+            vemu_decoded_t *dec = &block->ops[j];
+            vemu_tcache_op_t op = {
+                .imm = dec->imm,
+                .imm2 = dec->imm2,
+                .opcode = dec->opcode,
+                .rd = dec->rd,
+                .rs1 = dec->rs1,
+                .rs2 = dec->rs2,
+                .rd2 = dec->rd2,
+                .n_instrs = dec->n_instrs,
+                .c = dec->c,
+                .pad = 0,
+            };
+            if (fwrite(&op, sizeof(op), 1, file) != 1) {
+                return false;
+            }
+            h->checksum = vemu_tcache_hash(h->checksum, &op, sizeof(op));
+        }
+
+        h->n_blocks++;
+        h->size += sizeof(b) + block->n_ops * sizeof(vemu_tcache_op_t);
+    }
+
+    /* Only a complete file gets a valid header */
+    return fseek(file, 0, SEEK_SET) == 0
+        && fwrite(h, sizeof(*h), 1, file) == 1;
+}
+
+/* Writes the current contents of the block cache. The entry is replaced
+   atomically, so concurrent runs of the same program only ever see a
+   whole file. */
+bool vemu_tcache_save(vemu_tcache_t *tcache, vemu_cpu_t *cpu) {
+    char *tmp;
+    if (asprintf(&tmp, "%s.%ld.tmp", tcache->path, (long)getpid()) < 0) {
+        return false;
+    }
+
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "could not open file: '%s'\n", tmp);
+        free(tmp);
+        return false;
+    }
+
+    vemu_tcache_header_t h = {
+        .version = VEMU_TCACHE_VERSION,
+        .config = tcache->config,
+        .key = tcache->key,
+        .checksum = VEMU_TCACHE_HASH_INIT,
+        .n_blocks = 0,
+        .size = 0,
+    };
+    memcpy(h.magic, VEMU_TCACHE_MAGIC, sizeof(h.magic));
+
+    bool ok = fwrite(&h, sizeof(h), 1, file) == 1
+           && vemu_tcache_write(file, cpu, &h);
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tmp, tcache->path) == 0;
+
+    if (!ok) {
+        fprintf(stderr, "could not write translation cache: '%s'\n",
+                tcache->path);
+        remove(tmp);
+    } else {
+        tcache->saved = h.n_blocks;
+    }
+
+    free(tmp);
+    return ok;
+}
+
+void vemu_tcache_print_stats(vemu_tcache_t *tcache, vemu_cpu_t *cpu,
+                             FILE *file) {
+    static char const *const results[] = {
+        [VEMU_TCACHE_MISS] = "miss",
+        [VEMU_TCACHE_HIT] = "hit",
+        [VEMU_TCACHE_STALE] = "miss (stale)",
+        [VEMU_TCACHE_CORRUPT] = "miss (corrupt)",
+    };
+
+    fprintf(file, "disk cache:    %s, %" PRIu64 " blocks loaded, %" PRIu64
+            " translated, %" PRIu64 " saved\n", results[tcache->result],
+            tcache->loaded, cpu->blocks.translated, tcache->saved);
+}
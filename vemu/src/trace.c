@@ -0,0 +1,230 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <inttypes.h>
+
+/* The successor a trace through block should continue with, or 
+   VEMU_BLOCK_NO_SUCC if the trace has to end at block. Conditional 
+   branches follow whichever side has been taken most often so far. */
+static uint32_t vemu_trace_successor(vemu_block_t *block) {
+    if (!block->has_term) {
+        return block->end;
+    }
+
+    if (block->indirect) {
+        return VEMU_BLOCK_NO_SUCC;
+    }
+
+    uint32_t taken = block->succ_ip[VEMU_BLOCK_SUCC_TAKEN];
+    uint32_t next = block->succ_ip[VEMU_BLOCK_SUCC_NEXT];
+    uint32_t taken_hits = block->succ_hits[VEMU_BLOCK_SUCC_TAKEN];
+    uint32_t next_hits = block->succ_hits[VEMU_BLOCK_SUCC_NEXT];
+
+    /* Only ecall leaves a fall-through without a taken side */
+    if (taken == VEMU_BLOCK_NO_SUCC) {
+        return VEMU_BLOCK_NO_SUCC;
+    }
+
+    if (next == VEMU_BLOCK_NO_SUCC) {
+        return taken;
+    }
+
+    if (taken_hits == 0 && next_hits == 0) {
+        return VEMU_BLOCK_NO_SUCC;
+    }
+
+    return taken_hits > next_hits ? taken : next;
+}
+
+static bool vemu_trace_contains(vemu_block_t **blocks, uint32_t n, 
+                                uint32_t ip) {
+    for (uint32_t i = 0; i < n; i++) {
+        if (blocks[i]->ip == ip) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Lays out the hot path starting at head as one superblock. The path ends
+   where it returns to head, reaches an indirect jump, an ecall or a block 
+   that has not been translated yet, or grows too long. Returns NULL when 
+   the path would only cover head itself. */
+vemu_block_t *vemu_trace_form(vemu_block_cache_t *cache, vemu_block_t *head) {
+    vemu_block_t *blocks[VEMU_TRACE_MAX_BLOCKS];
+    uint32_t n_blocks = 0, n_ops = 0, n_exits = 0;
+
+    blocks[n_blocks++] = head;
+    n_ops += head->n_ops;
+
+    while (n_blocks < VEMU_TRACE_MAX_BLOCKS) {
+        vemu_block_t *last = blocks[n_blocks - 1];
+        uint32_t ip = vemu_trace_successor(last);
+
+        if (ip == VEMU_BLOCK_NO_SUCC 
+                || vemu_trace_contains(blocks, n_blocks, ip)) {
+            break;
+        }
+
+        vemu_block_t *next = vemu_block_cache_find(cache, ip);
+        if (next == NULL || n_ops + next->n_ops > VEMU_TRACE_MAX_OPS) {
+            break;
+        }
+
+        if (last->has_term) {
+            n_exits++;
+        }
+        blocks[n_blocks++] = next;
+        n_ops += next->n_ops;
+    }
+
+    if (n_blocks < 2) {
+        return NULL;
+    }
+
+    vemu_block_t *trace = vemu_block_alloc(n_ops);
+    if (trace == NULL) {
+        return NULL;
+    }
+
+    trace->exits = malloc(n_exits * sizeof(vemu_trace_exit_t));
+    if (trace->exits == NULL && n_exits > 0) {
+        vemu_block_free(trace);
+        return NULL;
+    }
+    trace->n_exits = n_exits;
+
+    uint32_t op = 0, exit = 0, n_instrs = 0;
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        vemu_block_t *block = blocks[i];
+
+        for (uint32_t j = 0; j < block->n_ops; j++) {
+            trace->ops[op++] = block->ops[j];
+        }
+        n_instrs += block->n_instrs;
+
+        if (i + 1 < n_blocks && block->has_term) {
+            trace->exits[exit++] = (vemu_trace_exit_t){
+                .end = op,
+                .term_ip = block->term_ip,
+                .next_ip = block->end,
+                .expect = blocks[i + 1]->ip,
+                .n_instrs = n_instrs,
+                .taken = 0,
+                .link = NULL,
+            };
+        }
+    }
+
+    vemu_block_t *last = blocks[n_blocks - 1];
+    trace->superblock = true;
+    trace->ip = head->ip;
+    trace->end = last->end;
+    trace->term_ip = last->term_ip;
+    trace->has_term = last->has_term;
+    trace->indirect = last->indirect;
+    trace->n_instrs = n_instrs;
+    for (size_t i = 0; i < 2; i++) {
+        trace->succ_ip[i] = last->succ_ip[i];
+    }
+
+    cache->traces++;
+
+    return trace;
+}
+
+uint64_t vemu_trace_side_exits(vemu_block_t *trace) {
+    uint64_t n = 0;
+
+    for (uint32_t i = 0; i < trace->n_exits; i++) {
+        n += trace->exits[i].taken;
+    }
+
+    return n;
+}
+
+/* Every entry retires the whole trace except where a side exit cut it 
+   short, so nothing has to be counted per instruction. */
+uint64_t vemu_trace_retired(vemu_block_t *trace) {
+    uint64_t n = trace->entries * trace->n_instrs;
+
+    for (uint32_t i = 0; i < trace->n_exits; i++) {
+        vemu_trace_exit_t *exit = &trace->exits[i];
+        n -= exit->taken * (trace->n_instrs - exit->n_instrs);
+    }
+
+    return n;
+}
+
+/* Whether any of the guest code the trace was built from lies in
+   [start, end). Its blocks run from the head or from where an exit 
+   expects to continue up to the branch of the next exit. */
+bool vemu_trace_overlaps(vemu_block_t *trace, uint32_t start, uint32_t end) {
+    uint32_t from = trace->ip;
+
+    for (uint32_t i = 0; i < trace->n_exits; i++) {
+        vemu_trace_exit_t *exit = &trace->exits[i];
+        if (from < end && exit->next_ip > start) {
+            return true;
+        }
+        from = exit->expect;
+    }
+
+    return from < end && trace->end > start;
+}
+
+static int vemu_trace_compare_retired(void const *a, void const *b) {
+    uint64_t x = vemu_trace_retired(*(vemu_block_t *const *)a);
+    uint64_t y = vemu_trace_retired(*(vemu_block_t *const *)b);
+
+    return (x < y) - (x > y);
+}
+
+void vemu_trace_print_stats(vemu_block_cache_t *cache, FILE *file, 
+                            uint64_t instret) {
+    uint64_t entries = cache->trace_entries;
+    uint64_t side_exits = cache->trace_side_exits;
+    uint64_t instrs = cache->trace_instrs;
+
+    vemu_block_t **live = malloc(cache->count * sizeof(vemu_block_t *));
+    uint32_t n_live = 0;
+
+    for (size_t i = 0; i <= cache->mask; i++) {
+        vemu_block_t *block = cache->slots[i];
+        if (block == NULL || block->trace == NULL) {
+            continue;
+        }
+
+        entries += block->trace->entries;
+        side_exits += vemu_trace_side_exits(block->trace);
+        instrs += vemu_trace_retired(block->trace);
+        if (live != NULL) {
+            live[n_live++] = block->trace;
+        }
+    }
+
+    fprintf(file, "traces:        %" PRIu64 " formed, %" PRIu64 
+            " entries, %" PRIu64 " side exits\n", 
+            cache->traces, entries, side_exits);
+    fprintf(file, "in traces:     %" PRIu64 " instructions (%.2f%%)\n", 
+            instrs, instret ? 100.0 * instrs / instret : 0);
+
+    if (live == NULL) {
+        return;
+    }
+
+    qsort(live, n_live, sizeof(*live), vemu_trace_compare_retired);
+
+    for (uint32_t i = 0; i < n_live && i < VEMU_TRACE_STATS_TOP; i++) {
+        vemu_block_t *trace = live[i];
+        uint64_t exits = vemu_trace_side_exits(trace);
+
+        fprintf(file, "  %08x:     %u instrs, %u exits, %" PRIu64 
+                " entries, %.2f%% left early, %" PRIu64 " instructions\n",
+                trace->ip, trace->n_instrs, trace->n_exits, trace->entries,
+                trace->entries ? 100.0 * exits / trace->entries : 0,
+                vemu_trace_retired(trace));
+    }
+
+    free(live);
+}
@@ -0,0 +1,1341 @@
+#include "vec.h"
+#include "ram.h"
+#include <inttypes.h>
+#include <string.h>
+
+/* The most bytes a register group holds */
+#define VEMU_VEC_GROUP      (8 * VEMU_CPU_VLENB)
+
+/* Registers hold elements in host byte order. On little-endian hosts
+   that is guest order, so unit-stride accesses are plain copies. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define VEMU_VEC_HOST_ORDER
+#endif
+
+static char const *vemu_vec_names[] = {
+    [VEMU_VEC_VSETVLI]      = "vsetvli",
+    [VEMU_VEC_VSETIVLI]     = "vsetivli",
+    [VEMU_VEC_VSETVL]       = "vsetvl",
+    [VEMU_VEC_VLE]          = "vle",
+    [VEMU_VEC_VSE]          = "vse",
+    [VEMU_VEC_VLSE]         = "vlse",
+    [VEMU_VEC_VSSE]         = "vsse",
+    [VEMU_VEC_VLXEI]        = "vluxei",
+    [VEMU_VEC_VSXEI]        = "vsuxei",
+    [VEMU_VEC_VLM]          = "vlm",
+    [VEMU_VEC_VSM]          = "vsm",
+    [VEMU_VEC_VLR]          = "vl",
+    [VEMU_VEC_VSR]          = "vs",
+    [VEMU_VEC_VADD]         = "vadd",
+    [VEMU_VEC_VSUB]         = "vsub",
+    [VEMU_VEC_VRSUB]        = "vrsub",
+    [VEMU_VEC_VAND]         = "vand",
+    [VEMU_VEC_VOR]          = "vor",
+    [VEMU_VEC_VXOR]         = "vxor",
+    [VEMU_VEC_VSLL]         = "vsll",
+    [VEMU_VEC_VSRL]         = "vsrl",
+    [VEMU_VEC_VSRA]         = "vsra",
+    [VEMU_VEC_VMINU]        = "vminu",
+    [VEMU_VEC_VMIN]         = "vmin",
+    [VEMU_VEC_VMAXU]        = "vmaxu",
+    [VEMU_VEC_VMAX]         = "vmax",
+    [VEMU_VEC_VMUL]         = "vmul",
+    [VEMU_VEC_VMACC]        = "vmacc",
+    [VEMU_VEC_VNMSAC]       = "vnmsac",
+    [VEMU_VEC_VMADD]        = "vmadd",
+    [VEMU_VEC_VNMSUB]       = "vnmsub",
+    [VEMU_VEC_VMSEQ]        = "vmseq",
+    [VEMU_VEC_VMSNE]        = "vmsne",
+    [VEMU_VEC_VMSLTU]       = "vmsltu",
+    [VEMU_VEC_VMSLT]        = "vmslt",
+    [VEMU_VEC_VMSLEU]       = "vmsleu",
+    [VEMU_VEC_VMSLE]        = "vmsle",
+    [VEMU_VEC_VMSGTU]       = "vmsgtu",
+    [VEMU_VEC_VMSGT]        = "vmsgt",
+    [VEMU_VEC_VREDSUM]      = "vredsum",
+    [VEMU_VEC_VREDAND]      = "vredand",
+    [VEMU_VEC_VREDOR]       = "vredor",
+    [VEMU_VEC_VREDXOR]      = "vredxor",
+    [VEMU_VEC_VREDMINU]     = "vredminu",
+    [VEMU_VEC_VREDMIN]      = "vredmin",
+    [VEMU_VEC_VREDMAXU]     = "vredmaxu",
+    [VEMU_VEC_VREDMAX]      = "vredmax",
+    [VEMU_VEC_VMANDN]       = "vmandn",
+    [VEMU_VEC_VMAND]        = "vmand",
+    [VEMU_VEC_VMOR]         = "vmor",
+    [VEMU_VEC_VMXOR]        = "vmxor",
+    [VEMU_VEC_VMORN]        = "vmorn",
+    [VEMU_VEC_VMNAND]       = "vmnand",
+    [VEMU_VEC_VMNOR]        = "vmnor",
+    [VEMU_VEC_VMXNOR]       = "vmxnor",
+    [VEMU_VEC_VMERGE]       = "vmerge",
+    [VEMU_VEC_VMV_V]        = "vmv.v",
+    [VEMU_VEC_VMV_NR]       = "vmv",
+    [VEMU_VEC_VMV_X_S]      = "vmv.x.s",
+    [VEMU_VEC_VMV_S_X]      = "vmv.s.x",
+    [VEMU_VEC_VCPOP]        = "vcpop.m",
+    [VEMU_VEC_VFIRST]       = "vfirst.m",
+    [VEMU_VEC_VID]          = "vid.v",
+    [VEMU_VEC_VSLIDEUP]     = "vslideup",
+    [VEMU_VEC_VSLIDEDOWN]   = "vslidedown",
+    [VEMU_VEC_VSLIDE1UP]    = "vslide1up",
+    [VEMU_VEC_VSLIDE1DOWN]  = "vslide1down",
+};
+
+/* Kernels for the element-wise ops, compares and reductions, one per
+   element width. They are plain loops that the compiler vectorizes, and
+   are built twice: for the baseline instruction set and, on x86-64, for
+   AVX2, which vemu_vec_kernels() picks when the host has it. Most of
+   the gain over a scalar guest loop is from doing a whole register
+   group per dispatch; AVX2 adds little over the baseline build. Operands
+   are a = vs2, b = vs1 or the scalar splat across a vector, and c = the
+   old vd; sa and sb are a and b as signed and bits is the element
+   width. */
+typedef uint8_t vemu_vec_u8_t __attribute__((may_alias));
+typedef uint16_t vemu_vec_u16_t __attribute__((may_alias));
+typedef uint32_t vemu_vec_u32_t __attribute__((may_alias));
+
+#define VEMU_VEC_ARITH(X, ...)                                              \
+    X(vadd,     a + b,                              __VA_ARGS__)            \
+    X(vsub,     a - b,                              __VA_ARGS__)            \
+    X(vrsub,    b - a,                              __VA_ARGS__)            \
+    X(vand,     a & b,                              __VA_ARGS__)            \
+    X(vor,      a | b,                              __VA_ARGS__)            \
+    X(vxor,     a ^ b,                              __VA_ARGS__)            \
+    X(vsll,     a << (b & (bits - 1)),              __VA_ARGS__)            \
+    X(vsrl,     a >> (b & (bits - 1)),              __VA_ARGS__)            \
+    X(vsra,     sa >> (b & (bits - 1)),             __VA_ARGS__)            \
+    X(vminu,    a < b ? a : b,                      __VA_ARGS__)            \
+    X(vmin,     sa < sb ? a : b,                    __VA_ARGS__)            \
+    X(vmaxu,    a < b ? b : a,                      __VA_ARGS__)            \
+    X(vmax,     sa < sb ? b : a,                    __VA_ARGS__)            \
+    X(vmul,     (uint32_t)a * b,                    __VA_ARGS__)            \
+    X(vmacc,    c + (uint32_t)a * b,                __VA_ARGS__)            \
+    X(vnmsac,   c - (uint32_t)a * b,                __VA_ARGS__)            \
+    X(vmadd,    (uint32_t)c * b + a,                __VA_ARGS__)            \
+    X(vnmsub,   a - (uint32_t)c * b,                __VA_ARGS__)
+
+#define VEMU_VEC_COMPARE(X, ...)                                            \
+    X(vmseq,    a == b,                             __VA_ARGS__)            \
+    X(vmsne,    a != b,                             __VA_ARGS__)            \
+    X(vmsltu,   a < b,                              __VA_ARGS__)            \
+    X(vmslt,    sa < sb,                            __VA_ARGS__)            \
+    X(vmsleu,   a <= b,                             __VA_ARGS__)            \
+    X(vmsle,    sa <= sb,                           __VA_ARGS__)            \
+    X(vmsgtu,   a > b,                              __VA_ARGS__)            \
+    X(vmsgt,    sa > sb,                            __VA_ARGS__)
+
+/* Reductions fold a into acc */
+#define VEMU_VEC_REDUCE(X, ...)                                             \
+    X(vredsum,  acc + a,                            __VA_ARGS__)            \
+    X(vredand,  acc & a,                            __VA_ARGS__)            \
+    X(vredor,   acc | a,                            __VA_ARGS__)            \
+    X(vredxor,  acc ^ a,                            __VA_ARGS__)            \
+    X(vredminu, a < acc ? a : acc,                  __VA_ARGS__)            \
+    X(vredmin,  sa < sacc ? a : acc,                __VA_ARGS__)            \
+    X(vredmaxu, a > acc ? a : acc,                  __VA_ARGS__)            \
+    X(vredmax,  sa > sacc ? a : acc,                __VA_ARGS__)
+
+#define VEMU_VEC_OPERANDS(W)                                                \
+    uint##W##_t a = pa[i], b = pb[i], c = pc[i];                            \
+    int##W##_t sa = (int##W##_t)a, sb = (int##W##_t)b;                      \
+    uint32_t const bits = W;                                                \
+    (void)c, (void)sa, (void)sb, (void)bits
+
+#define VEMU_VEC_ELEMENTWISE(name, expr, W, target, attr)                   \
+    attr static void vemu_vec_##name##_##W##_##target(                      \
+            void *restrict out, void const *va, void const *vb,             \
+            void const *vc, uint32_t n) {                                   \
+        vemu_vec_u##W##_t *d = out;                                         \
+        vemu_vec_u##W##_t const *pa = va, *pb = vb, *pc = vc;               \
+        for (uint32_t i = 0; i < n; i++) {                                  \
+            VEMU_VEC_OPERANDS(W);                                           \
+            d[i] = (uint##W##_t)(expr);                                     \
+        }                                                                   \
+    }
+
+/* Compares give one byte per element, 0 or 1 */
+#define VEMU_VEC_COMPARISON(name, expr, W, target, attr)                    \
+    attr static void vemu_vec_##name##_##W##_##target(                      \
+            void *restrict out, void const *va, void const *vb,             \
+            void const *vc, uint32_t n) {                                   \
+        uint8_t *d = out;                                                   \
+        vemu_vec_u##W##_t const *pa = va, *pb = vb, *pc = vc;               \
+        for (uint32_t i = 0; i < n; i++) {                                  \
+            VEMU_VEC_OPERANDS(W);                                           \
+            d[i] = (expr);                                                  \
+        }                                                                   \
+    }
+
+#define VEMU_VEC_REDUCTION(name, expr, W, target, attr)                     \
+    attr static uint32_t vemu_vec_##name##_##W##_##target(                  \
+            void const *va, uint32_t n, uint32_t init) {                    \
+        vemu_vec_u##W##_t const *pa = va;                                   \
+        uint##W##_t acc = (uint##W##_t)init;                                \
+        for (uint32_t i = 0; i < n; i++) {                                  \
+            uint##W##_t a = pa[i];                                          \
+            int##W##_t sa = (int##W##_t)a, sacc = (int##W##_t)acc;          \
+            (void)sa, (void)sacc;                                           \
+            acc = (uint##W##_t)(expr);                                      \
+        }                                                                   \
+        return acc;                                                         \
+    }
+
+#define VEMU_VEC_WIDTHS(LIST, X, target, attr)                              \
+    LIST(X, 8, target, attr)                                                \
+    LIST(X, 16, target, attr)                                               \
+    LIST(X, 32, target, attr)
+
+#define VEMU_VEC_KERNELS(target, attr)                                      \
+    VEMU_VEC_WIDTHS(VEMU_VEC_ARITH, VEMU_VEC_ELEMENTWISE, target, attr)     \
+    VEMU_VEC_WIDTHS(VEMU_VEC_COMPARE, VEMU_VEC_COMPARISON, target, attr)    \
+    VEMU_VEC_WIDTHS(VEMU_VEC_REDUCE, VEMU_VEC_REDUCTION, target, attr)
+
+typedef void (*vemu_vec_kernel_t)(void *restrict out, void const *a,
+                                  void const *b, void const *c, uint32_t n);
+
+typedef uint32_t (*vemu_vec_reduce_t)(void const *a, uint32_t n,
+                                      uint32_t init);
+
+/* Indexed by the op from VEMU_VEC_VADD or VEMU_VEC_VREDSUM on, and by
+   log2 of the element size in bytes */
+typedef struct {
+    vemu_vec_kernel_t elementwise[VEMU_VEC_VMSGT - VEMU_VEC_VADD + 1][3];
+    vemu_vec_reduce_t reduce[VEMU_VEC_VREDMAX - VEMU_VEC_VREDSUM + 1][3];
+} vemu_vec_kernels_t;
+
+#define VEMU_VEC_ENTRY(name, expr, target)                                  \
+    {                                                                       \
+        vemu_vec_##name##_8_##target,                                       \
+        vemu_vec_##name##_16_##target,                                      \
+        vemu_vec_##name##_32_##target,                                      \
+    },
+
+#define VEMU_VEC_TABLE(target)                                              \
+    static vemu_vec_kernels_t const vemu_vec_kernels_##target = {           \
+        .elementwise = {                                                    \
+            VEMU_VEC_ARITH(VEMU_VEC_ENTRY, target)                          \
+            VEMU_VEC_COMPARE(VEMU_VEC_ENTRY, target)                        \
+        },                                                                  \
+        .reduce = {                                                         \
+            VEMU_VEC_REDUCE(VEMU_VEC_ENTRY, target)                         \
+        },                                                                  \
+    };
+
+VEMU_VEC_KERNELS(generic, )
+VEMU_VEC_TABLE(generic)
+
+#ifdef __x86_64__
+VEMU_VEC_KERNELS(avx2, __attribute__((target("avx2"))))
+VEMU_VEC_TABLE(avx2)
+#endif
+
+static vemu_vec_kernels_t const *vemu_vec_kernels(void) {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) {
+        return &vemu_vec_kernels_avx2;
+    }
+#endif
+    return &vemu_vec_kernels_generic;
+}
+
+/* What vtype says, with sizes as log2: sew of the element size in bytes
+   and lmul of LMUL, which is negative for fractions */
+typedef struct {
+    uint32_t sew;
+    int32_t lmul;
+    uint32_t vlmax;
+} vemu_vec_config_t;
+
+/* Zve32x has no 64-bit elements, and LMUL must leave room for at least
+   one element of ELEN bits */
+static bool vemu_vec_config(uint32_t vtype, vemu_vec_config_t *c) {
+    uint32_t vlmul = vtype & VEMU_VEC_VLMUL;
+    uint32_t vsew = (vtype & VEMU_VEC_VSEW) >> VEMU_VEC_VSEW_SHIFT;
+
+    if (vtype > 0xFF || vsew > 2 || vlmul == 4) {
+        return false;
+    }
+
+    c->sew = vsew;
+    c->lmul = vlmul >= 5 ? (int32_t)vlmul - 8 : (int32_t)vlmul;
+    if ((int32_t)c->sew > 2 + c->lmul) {
+        return false;
+    }
+
+    uint32_t per_reg = VEMU_CPU_VLENB >> c->sew;
+    c->vlmax = c->lmul >= 0 ? per_reg << c->lmul : per_reg >> -c->lmul;
+    return true;
+}
+
+/* A group of 2^emul registers must start at a multiple of its size */
+static bool vemu_vec_aligned(uint32_t v, int32_t emul) {
+    return emul <= 0 || (v & ((1u << emul) - 1)) == 0;
+}
+
+static bool vemu_vec_bit(uint8_t const *v, uint32_t i) {
+    return (v[i / 8] >> (i % 8)) & 1;
+}
+
+static void vemu_vec_set_bit(uint8_t *v, uint32_t i, bool bit) {
+    v[i / 8] = (v[i / 8] & ~(1u << (i % 8))) | (uint32_t)bit << (i % 8);
+}
+
+static bool vemu_vec_active(vemu_cpu_t *cpu, bool vm, uint32_t i) {
+    return vm || vemu_vec_bit(cpu->vregs[0], i);
+}
+
+static uint32_t vemu_vec_get(uint8_t const *v, uint32_t i, uint32_t sew) {
+    switch (sew) {
+        case 0:
+            return v[i];
+
+        case 1: {
+            uint16_t half;
+            memcpy(&half, v + 2 * i, sizeof(half));
+            return half;
+        }
+
+        default: {
+            uint32_t word;
+            memcpy(&word, v + 4 * i, sizeof(word));
+            return word;
+        }
+    }
+}
+
+static void vemu_vec_set(uint8_t *v, uint32_t i, uint32_t sew,
+                         uint32_t value) {
+    switch (sew) {
+        case 0:
+            v[i] = value;
+            break;
+
+        case 1: {
+            uint16_t half = value;
+            memcpy(v + 2 * i, &half, sizeof(half));
+            break;
+        }
+
+        default:
+            memcpy(v + 4 * i, &value, sizeof(value));
+            break;
+    }
+}
+
+static uint32_t vemu_vec_sext(uint32_t value, uint32_t sew) {
+    uint32_t shift = 32 - (8u << sew);
+    return (uint32_t)((int32_t)(value << shift) >> shift);
+}
+
+static void vemu_vec_splat(uint8_t *v, uint32_t x, uint32_t sew,
+                           uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        vemu_vec_set(v, i, sew, x);
+    }
+}
+
+static uint32_t vemu_vec_setvl(vemu_cpu_t *cpu, uint32_t vtype,
+                               uint32_t avl, uint32_t mode) {
+    vemu_vec_config_t c;
+
+    if (!vemu_vec_config(vtype, &c)) {
+        cpu->vtype = VEMU_VEC_VILL;
+        cpu->vl = 0;
+    } else {
+        if (mode == VEMU_VEC_AVL_MAX) {
+            avl = UINT32_MAX;
+        } else if (mode == VEMU_VEC_AVL_KEEP) {
+            avl = cpu->vl;
+        }
+        cpu->vtype = vtype;
+        cpu->vl = avl < c.vlmax ? avl : c.vlmax;
+    }
+
+    cpu->vstart = 0;
+    return cpu->vl;
+}
+
+static inline void vemu_vec_check_store(vemu_cpu_t *cpu, uint32_t addr,
+                                        uint32_t len) {
+    if (vemu_smc_code_page(&cpu->smc, addr, len)) {
+        vemu_cpu_code_store(cpu, addr, len);
+    }
+}
+
+static void vemu_vec_load_element(uint8_t *ram, uint32_t addr, uint8_t *v,
+                                  uint32_t i, uint32_t eew) {
+    switch (eew) {
+        case 0:
+            v[i] = vemu_ram_load_byte(ram, addr);
+            break;
+
+        case 1:
+            vemu_vec_set(v, i, 1, vemu_ram_load_half(ram, addr));
+            break;
+
+        default:
+            vemu_vec_set(v, i, 2, vemu_ram_load_word(ram, addr));
+            break;
+    }
+}
+
+static void vemu_vec_store_element(uint8_t *ram, uint32_t addr,
+                                   uint8_t const *v, uint32_t i,
+                                   uint32_t eew) {
+    switch (eew) {
+        case 0:
+            vemu_ram_store_byte(ram, addr, v[i]);
+            break;
+
+        case 1:
+            vemu_ram_store_half(ram, addr, vemu_vec_get(v, i, 1));
+            break;
+
+        default:
+            vemu_ram_store_word(ram, addr, vemu_vec_get(v, i, 2));
+            break;
+    }
+}
+
+/* Elements start to end - 1 of eew at addr on, both ways. Translated
+   ranges go element by element, as their pages need not follow each
+   other in guest memory. */
+static void vemu_vec_load_range(vemu_cpu_t *cpu, uint32_t addr, uint8_t *v,
+                                uint32_t eew, uint32_t start, uint32_t end) {
+    uint8_t *ram = *cpu->ram;
+
+    if (vemu_mmu_on(&cpu->mmu)) {
+        for (uint32_t i = start; i < end; i++) {
+            uint32_t x = vemu_cpu_translate(cpu, addr + (i << eew), 
+                                            1u << eew, VEMU_MMU_LOAD);
+            vemu_vec_load_element(ram, x, v, i, eew);
+        }
+        return;
+    }
+
+#ifdef VEMU_VEC_HOST_ORDER
+    memcpy(v + (start << eew), ram + addr + (start << eew),
+           (end - start) << eew);
+#else
+    for (uint32_t i = start; i < end; i++) {
+        vemu_vec_load_element(ram, addr + (i << eew), v, i, eew);
+    }
+#endif
+}
+
+static void vemu_vec_store_range(vemu_cpu_t *cpu, uint32_t addr,
+                                 uint8_t const *v, uint32_t eew,
+                                 uint32_t start, uint32_t end) {
+    if (vemu_mmu_on(&cpu->mmu)) {
+        for (uint32_t i = start; i < end; i++) {
+            uint32_t x = vemu_cpu_translate(cpu, addr + (i << eew),
+                                            1u << eew, VEMU_MMU_STORE);
+            vemu_vec_store_element(*cpu->ram, x, v, i, eew);
+        }
+    } else {
+#ifdef VEMU_VEC_HOST_ORDER
+        memcpy(*cpu->ram + addr + (start << eew), v + (start << eew),
+               (end - start) << eew);
+#else
+        for (uint32_t i = start; i < end; i++) {
+            vemu_vec_store_element(*cpu->ram, addr + (i << eew), v, i, eew);
+        }
+#endif
+    }
+    vemu_vec_check_store(cpu, addr + (start << eew), (end - start) << eew);
+}
+
+/* Whole register loads and stores ignore vl and vtype */
+static void vemu_vec_whole(vemu_cpu_t *cpu, bool store, uint32_t v,
+                           uint32_t field, uint32_t addr) {
+    uint32_t eew = field & 0x3;
+    uint32_t n_regs = (field >> 2) + 1;
+    uint32_t end = (n_regs * VEMU_CPU_VLENB) >> eew;
+
+    if (!vemu_vec_aligned(v, __builtin_ctz(n_regs))) {
+        vemu_cpu_illegal(cpu);
+    }
+    if (cpu->vstart >= end) {
+        cpu->vstart = 0;
+        return;
+    }
+
+    if (store) {
+        vemu_vec_store_range(cpu, addr, cpu->vregs[v], eew, cpu->vstart, end);
+    } else {
+        vemu_vec_load_range(cpu, addr, cpu->vregs[v], eew, cpu->vstart, 
+                            end);
+    }
+    cpu->vstart = 0;
+}
+
+static bool vemu_vec_is_store(vemu_vec_opcode_t opcode) {
+    return opcode == VEMU_VEC_VSE || opcode == VEMU_VEC_VSSE
+        || opcode == VEMU_VEC_VSXEI || opcode == VEMU_VEC_VSM;
+}
+
+/* Unit-stride, strided and indexed loads and stores. Data elements are
+   eew wide in a group of 2^emul registers at vd; indices are SEW wide
+   for unit-stride and strided accesses, and the other way round for
+   indexed ones. */
+static void vemu_vec_memory(vemu_cpu_t *cpu, vemu_vec_config_t *c,
+                            vemu_vec_opcode_t opcode, uint32_t vd,
+                            uint32_t vs2, bool vm, uint32_t field,
+                            uint32_t x, uint32_t y) {
+    bool store = vemu_vec_is_store(opcode);
+    bool indexed = opcode == VEMU_VEC_VLXEI || opcode == VEMU_VEC_VSXEI;
+    uint32_t eew = indexed ? c->sew : field;
+    int32_t emul = (int32_t)field - (int32_t)c->sew + c->lmul;
+    uint32_t end = cpu->vl;
+    uint8_t *ram = *cpu->ram;
+
+    if (opcode == VEMU_VEC_VLM || opcode == VEMU_VEC_VSM) {
+        emul = 0;
+        end = (cpu->vl + 7) / 8;
+    }
+    if (emul < -3 || emul > 3
+            || !vemu_vec_aligned(indexed ? vs2 : vd, emul)
+            || !vemu_vec_aligned(indexed ? vd : vs2, c->lmul)
+            || (!vm && !store && vd == 0)) {
+        vemu_cpu_illegal(cpu);
+    }
+    if (cpu->vstart >= end) {
+        return;
+    }
+
+    uint8_t *v = cpu->vregs[vd];
+    bool unit = opcode == VEMU_VEC_VLE || opcode == VEMU_VEC_VSE
+             || opcode == VEMU_VEC_VLM || opcode == VEMU_VEC_VSM;
+
+    if (unit && vm) {
+        if (store) {
+            vemu_vec_store_range(cpu, x, v, eew, cpu->vstart, end);
+        } else {
+            vemu_vec_load_range(cpu, x, v, eew, cpu->vstart, end);
+        }
+        return;
+    }
+
+    for (uint32_t i = cpu->vstart; i < end; i++) {
+        if (!vemu_vec_active(cpu, vm, i)) {
+            continue;
+        }
+
+        uint32_t addr = unit ? x + (i << eew)
+                      : indexed ? x + vemu_vec_get(cpu->vregs[vs2], i, field)
+                      : x + i * y;
+        uint32_t at = vemu_cpu_data_addr(cpu, addr, 1u << eew,
+                                         store ? VEMU_MMU_STORE
+                                               : VEMU_MMU_LOAD);
+        if (store) {
+            vemu_vec_store_element(ram, at, v, i, eew);
+            vemu_vec_check_store(cpu, addr, 1u << eew);
+        } else {
+            vemu_vec_load_element(ram, at, v, i, eew);
+        }
+    }
+}
+
+/* Results go to a scratch group first, which lets the kernels assume
+   that their output aliases nothing, and masked-off elements keep what
+   they had */
+static void vemu_vec_arith(vemu_cpu_t *cpu, vemu_vec_config_t *c,
+                           vemu_vec_opcode_t opcode, uint32_t vd,
+                           uint32_t vs1, uint32_t vs2, bool vm,
+                           uint32_t form, uint32_t x) {
+    bool compare = opcode >= VEMU_VEC_VMSEQ;
+
+    if ((!compare && !vemu_vec_aligned(vd, c->lmul))
+            || !vemu_vec_aligned(vs2, c->lmul)
+            || (form == VEMU_VEC_VV && !vemu_vec_aligned(vs1, c->lmul))
+            || (!compare && !vm && vd == 0)) {
+        vemu_cpu_illegal(cpu);
+    }
+    if (cpu->vstart >= cpu->vl) {
+        return;
+    }
+
+    uint32_t start = cpu->vstart, n = cpu->vl - start;
+    uint32_t offset = start << c->sew;
+    uint8_t splat[VEMU_VEC_GROUP], result[VEMU_VEC_GROUP];
+    uint8_t const *b = cpu->vregs[vs1] + offset;
+
+    if (form != VEMU_VEC_VV) {
+        vemu_vec_splat(splat, x, c->sew, n);
+        b = splat;
+    }
+
+    vemu_vec_kernel_t kernel =
+        vemu_vec_kernels()->elementwise[opcode - VEMU_VEC_VADD][c->sew];
+    uint8_t const *a = cpu->vregs[vs2] + offset;
+    kernel(result, a, b, compare ? a : cpu->vregs[vd] + offset, n);
+
+    uint8_t *v = cpu->vregs[vd];
+    if (compare) {
+        for (uint32_t i = start; i < cpu->vl; i++) {
+            if (vemu_vec_active(cpu, vm, i)) {
+                vemu_vec_set_bit(v, i, result[i - start]);
+            }
+        }
+    } else if (vm) {
+        memcpy(v + offset, result, n << c->sew);
+    } else {
+        for (uint32_t i = start; i < cpu->vl; i++) {
+            if (vemu_vec_active(cpu, vm, i)) {
+                vemu_vec_set(v, i, c->sew,
+                             vemu_vec_get(result, i - start, c->sew));
+            }
+        }
+    }
+}
+
+/* Masked-off elements join in as the identity of the reduction */
+static void vemu_vec_reduce(vemu_cpu_t *cpu, vemu_vec_config_t *c,
+                            vemu_vec_opcode_t opcode, uint32_t vd,
+                            uint32_t vs1, uint32_t vs2, bool vm) {
+    if (!vemu_vec_aligned(vs2, c->lmul)) {
+        vemu_cpu_illegal(cpu);
+    }
+    if (cpu->vl == 0) {
+        return;
+    }
+
+    uint32_t ones = UINT32_MAX >> (32 - (8u << c->sew));
+    uint32_t identity = 0;
+    uint8_t const *a = cpu->vregs[vs2];
+    uint8_t masked[VEMU_VEC_GROUP];
+
+    switch (opcode) {
+        case VEMU_VEC_VREDAND:
+        case VEMU_VEC_VREDMINU:
+            identity = ones;
+            break;
+
+        case VEMU_VEC_VREDMIN:
+            identity = ones >> 1;
+            break;
+
+        case VEMU_VEC_VREDMAX:
+            identity = (ones >> 1) + 1;
+            break;
+
+        default:
+            break;
+    }
+
+    if (!vm) {
+        for (uint32_t i = 0; i < cpu->vl; i++) {
+            vemu_vec_set(masked, i, c->sew, vemu_vec_active(cpu, vm, i)
+                                            ? vemu_vec_get(a, i, c->sew)
+                                            : identity);
+        }
+        a = masked;
+    }
+
+    vemu_vec_reduce_t kernel =
+        vemu_vec_kernels()->reduce[opcode - VEMU_VEC_VREDSUM][c->sew];
+    uint32_t value = kernel(a, cpu->vl, vemu_vec_get(cpu->vregs[vs1], 0,
+                                                     c->sew));
+    vemu_vec_set(cpu->vregs[vd], 0, c->sew, value);
+}
+
+/* Bits vstart to vl - 1 of vd, a byte at a time */
+static void vemu_vec_mask_logical(vemu_cpu_t *cpu, vemu_vec_opcode_t opcode,
+                                  uint32_t vd, uint32_t vs1, uint32_t vs2) {
+    uint8_t *d = cpu->vregs[vd];
+    uint8_t const *a = cpu->vregs[vs2], *b = cpu->vregs[vs1];
+
+    for (uint32_t i = cpu->vstart / 8; i * 8 < cpu->vl; i++) {
+        uint32_t lo = i * 8 < cpu->vstart ? cpu->vstart - i * 8 : 0;
+        uint32_t hi = cpu->vl - i * 8 < 8 ? cpu->vl - i * 8 : 8;
+        uint32_t keep = ((1u << hi) - 1) & ~((1u << lo) - 1);
+        uint32_t value;
+
+        switch (opcode) {
+            case VEMU_VEC_VMANDN:   value = a[i] & ~b[i];       break;
+            case VEMU_VEC_VMAND:    value = a[i] & b[i];        break;
+            case VEMU_VEC_VMOR:     value = a[i] | b[i];        break;
+            case VEMU_VEC_VMXOR:    value = a[i] ^ b[i];        break;
+            case VEMU_VEC_VMORN:    value = a[i] | ~b[i];       break;
+            case VEMU_VEC_VMNAND:   value = ~(a[i] & b[i]);     break;
+            case VEMU_VEC_VMNOR:    value = ~(a[i] | b[i]);     break;
+            default:                value = ~(a[i] ^ b[i]);     break;
+        }
+
+        d[i] = (d[i] & ~keep) | (value & keep);
+    }
+}
+
+/* vmerge, vmv.v and the slides, all element by element. Slides up have
+   no overlap between vd and vs2 to worry about, and slides down read
+   ahead of what they write. */
+static void vemu_vec_move(vemu_cpu_t *cpu, vemu_vec_config_t *c,
+                          vemu_vec_opcode_t opcode, uint32_t vd,
+                          uint32_t vs1, uint32_t vs2, bool vm,
+                          uint32_t form, uint32_t x) {
+    bool slide_up = opcode == VEMU_VEC_VSLIDEUP
+                 || opcode == VEMU_VEC_VSLIDE1UP;
+    bool reads_vs2 = opcode != VEMU_VEC_VMV_V && opcode != VEMU_VEC_VID;
+
+    if (!vemu_vec_aligned(vd, c->lmul)
+            || (reads_vs2 && !vemu_vec_aligned(vs2, c->lmul))
+            || (form == VEMU_VEC_VV && !vemu_vec_aligned(vs1, c->lmul))
+            || (slide_up && vd == vs2)
+            || (!vm && vd == 0)) {
+        vemu_cpu_illegal(cpu);
+    }
+
+    uint8_t *d = cpu->vregs[vd];
+    uint8_t const *a = cpu->vregs[vs2], *b = cpu->vregs[vs1];
+    uint32_t sew = c->sew;
+    uint32_t start = cpu->vstart;
+
+    if (opcode == VEMU_VEC_VSLIDEUP && x > start) {
+        start = x < cpu->vl ? x : cpu->vl;
+    }
+
+    for (uint32_t i = start; i < cpu->vl; i++) {
+        if (!vemu_vec_active(cpu, vm || opcode == VEMU_VEC_VMERGE, i)) {
+            continue;
+        }
+
+        uint32_t value;
+        switch (opcode) {
+            case VEMU_VEC_VMERGE:
+            case VEMU_VEC_VMV_V:
+                value = form != VEMU_VEC_VV ? x : vemu_vec_get(b, i, sew);
+                if (opcode == VEMU_VEC_VMERGE
+                        && !vemu_vec_bit(cpu->vregs[0], i)) {
+                    value = vemu_vec_get(a, i, sew);
+                }
+                break;
+
+            case VEMU_VEC_VID:
+                value = i;
+                break;
+
+            case VEMU_VEC_VSLIDEUP:
+                value = vemu_vec_get(a, i - x, sew);
+                break;
+
+            case VEMU_VEC_VSLIDEDOWN:
+                value = x < c->vlmax - i ? vemu_vec_get(a, i + x, sew) : 0;
+                break;
+
+            case VEMU_VEC_VSLIDE1UP:
+                value = i == 0 ? x : vemu_vec_get(a, i - 1, sew);
+                break;
+
+            default:
+                value = i + 1 == cpu->vl ? x : vemu_vec_get(a, i + 1, sew);
+                break;
+        }
+        vemu_vec_set(d, i, sew, value);
+    }
+}
+
+/* vcpop.m and vfirst.m */
+static uint32_t vemu_vec_count(vemu_cpu_t *cpu, vemu_vec_opcode_t opcode,
+                               uint32_t vs2, bool vm) {
+    uint32_t count = 0;
+
+    for (uint32_t i = cpu->vstart; i < cpu->vl; i++) {
+        if (vemu_vec_active(cpu, vm, i) && vemu_vec_bit(cpu->vregs[vs2], i)) {
+            if (opcode == VEMU_VEC_VFIRST) {
+                return i;
+            }
+            count++;
+        }
+    }
+
+    return opcode == VEMU_VEC_VFIRST ? UINT32_MAX : count;
+}
+
+uint32_t vemu_vec_exec(vemu_cpu_t *cpu, uint32_t op, uint32_t x, uint32_t y) {
+    vemu_vec_opcode_t opcode = VEMU_VEC_OPCODE(op);
+    uint32_t vd = (op >> 8) & 0x1F;
+    uint32_t vs1 = (op >> 13) & 0x1F;
+    uint32_t vs2 = (op >> 18) & 0x1F;
+    bool vm = (op >> 23) & 1;
+    uint32_t field = op >> 24;
+    uint32_t res = 0;
+    vemu_vec_config_t c;
+
+    switch (opcode) {
+        case VEMU_VEC_VSETVLI:
+        case VEMU_VEC_VSETIVLI:
+            return vemu_vec_setvl(cpu, (op >> 8) & 0x7FF, x, field);
+
+        case VEMU_VEC_VSETVL:
+            return vemu_vec_setvl(cpu, y, x, field);
+
+        case VEMU_VEC_VLR:
+        case VEMU_VEC_VSR:
+            vemu_vec_whole(cpu, opcode == VEMU_VEC_VSR, vd, field, x);
+            return 0;
+
+        case VEMU_VEC_VMV_NR:
+            if (!vemu_vec_aligned(vd, __builtin_ctz(field))
+                    || !vemu_vec_aligned(vs2, __builtin_ctz(field))) {
+                vemu_cpu_illegal(cpu);
+            }
+            memmove(cpu->vregs[vd], cpu->vregs[vs2], field * VEMU_CPU_VLENB);
+            cpu->vstart = 0;
+            return 0;
+
+        default:
+            break;
+    }
+
+    if (!vemu_vec_config(cpu->vtype, &c)) {
+        vemu_cpu_illegal(cpu);
+    }
+
+    switch (opcode) {
+        case VEMU_VEC_VLE:
+        case VEMU_VEC_VSE:
+        case VEMU_VEC_VLSE:
+        case VEMU_VEC_VSSE:
+        case VEMU_VEC_VLXEI:
+        case VEMU_VEC_VSXEI:
+        case VEMU_VEC_VLM:
+        case VEMU_VEC_VSM:
+            vemu_vec_memory(cpu, &c, opcode, vd, vs2, vm, field, x, y);
+            break;
+
+        case VEMU_VEC_VREDSUM:
+        case VEMU_VEC_VREDAND:
+        case VEMU_VEC_VREDOR:
+        case VEMU_VEC_VREDXOR:
+        case VEMU_VEC_VREDMINU:
+        case VEMU_VEC_VREDMIN:
+        case VEMU_VEC_VREDMAXU:
+        case VEMU_VEC_VREDMAX:
+            vemu_vec_reduce(cpu, &c, opcode, vd, vs1, vs2, vm);
+            break;
+
+        case VEMU_VEC_VMANDN:
+        case VEMU_VEC_VMAND:
+        case VEMU_VEC_VMOR:
+        case VEMU_VEC_VMXOR:
+        case VEMU_VEC_VMORN:
+        case VEMU_VEC_VMNAND:
+        case VEMU_VEC_VMNOR:
+        case VEMU_VEC_VMXNOR:
+            vemu_vec_mask_logical(cpu, opcode, vd, vs1, vs2);
+            break;
+
+        case VEMU_VEC_VMERGE:
+        case VEMU_VEC_VMV_V:
+        case VEMU_VEC_VID:
+        case VEMU_VEC_VSLIDEUP:
+        case VEMU_VEC_VSLIDEDOWN:
+        case VEMU_VEC_VSLIDE1UP:
+        case VEMU_VEC_VSLIDE1DOWN:
+            vemu_vec_move(cpu, &c, opcode, vd, vs1, vs2, vm, field, x);
+            break;
+
+        case VEMU_VEC_VMV_X_S:
+            res = vemu_vec_sext(vemu_vec_get(cpu->vregs[vs2], 0, c.sew),
+                                c.sew);
+            break;
+
+        case VEMU_VEC_VMV_S_X:
+            if (cpu->vstart < cpu->vl) {
+                vemu_vec_set(cpu->vregs[vd], 0, c.sew, x);
+            }
+            break;
+
+        case VEMU_VEC_VCPOP:
+        case VEMU_VEC_VFIRST:
+            res = vemu_vec_count(cpu, opcode, vs2, vm);
+            break;
+
+        default:
+            vemu_vec_arith(cpu, &c, opcode, vd, vs1, vs2, vm, field, x);
+            break;
+    }
+
+    cpu->vstart = 0;
+    return res;
+}
+
+bool vemu_vec_is_csr(uint32_t csr) {
+    return csr == VEMU_CSR_VSTART || csr == VEMU_CSR_VL
+        || csr == VEMU_CSR_VTYPE || csr == VEMU_CSR_VLENB;
+}
+
+uint32_t vemu_vec_read_csr(vemu_cpu_t *cpu, uint32_t csr) {
+    switch (csr) {
+        case VEMU_CSR_VSTART:
+            return cpu->vstart;
+
+        case VEMU_CSR_VL:
+            return cpu->vl;
+
+        case VEMU_CSR_VTYPE:
+            return cpu->vtype;
+
+        default:
+            return VEMU_CPU_VLENB;
+    }
+}
+
+/* vstart is the only one of them that is not read-only, and holds
+   element indices up to VLMAX at the smallest SEW and largest LMUL */
+void vemu_vec_write_csr(vemu_cpu_t *cpu, uint32_t csr, uint32_t value) {
+    if (csr == VEMU_CSR_VSTART) {
+        cpu->vstart = value & (VEMU_VEC_GROUP - 1);
+    }
+}
+
+/* Operand forms and instructions of OP-V arithmetic by funct6. Shifts
+   and slides take their immediate unsigned. */
+#define VEMU_VEC_FORM_VV    0x1
+#define VEMU_VEC_FORM_VX    0x2
+#define VEMU_VEC_FORM_VI    0x4
+#define VEMU_VEC_FORM_UIMM  0x8
+#define VEMU_VEC_FORMS_ALL  (VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX | VEMU_VEC_FORM_VI)
+
+typedef struct {
+    uint8_t op;
+    uint8_t forms;
+} vemu_vec_funct6_t;
+
+static vemu_vec_funct6_t const vemu_vec_opi[64] = {
+    [0x00] = { VEMU_VEC_VADD,       VEMU_VEC_FORMS_ALL },
+    [0x02] = { VEMU_VEC_VSUB,       VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x03] = { VEMU_VEC_VRSUB,      VEMU_VEC_FORM_VX | VEMU_VEC_FORM_VI },
+    [0x04] = { VEMU_VEC_VMINU,      VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x05] = { VEMU_VEC_VMIN,       VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x06] = { VEMU_VEC_VMAXU,      VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x07] = { VEMU_VEC_VMAX,       VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x09] = { VEMU_VEC_VAND,       VEMU_VEC_FORMS_ALL },
+    [0x0A] = { VEMU_VEC_VOR,        VEMU_VEC_FORMS_ALL },
+    [0x0B] = { VEMU_VEC_VXOR,       VEMU_VEC_FORMS_ALL },
+    [0x0E] = { VEMU_VEC_VSLIDEUP,   VEMU_VEC_FORM_VX | VEMU_VEC_FORM_VI
+                                    | VEMU_VEC_FORM_UIMM },
+    [0x0F] = { VEMU_VEC_VSLIDEDOWN, VEMU_VEC_FORM_VX | VEMU_VEC_FORM_VI
+                                    | VEMU_VEC_FORM_UIMM },
+    [0x17] = { VEMU_VEC_VMERGE,     VEMU_VEC_FORMS_ALL },
+    [0x18] = { VEMU_VEC_VMSEQ,      VEMU_VEC_FORMS_ALL },
+    [0x19] = { VEMU_VEC_VMSNE,      VEMU_VEC_FORMS_ALL },
+    [0x1A] = { VEMU_VEC_VMSLTU,     VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x1B] = { VEMU_VEC_VMSLT,      VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x1C] = { VEMU_VEC_VMSLEU,     VEMU_VEC_FORMS_ALL },
+    [0x1D] = { VEMU_VEC_VMSLE,      VEMU_VEC_FORMS_ALL },
+    [0x1E] = { VEMU_VEC_VMSGTU,     VEMU_VEC_FORM_VX | VEMU_VEC_FORM_VI },
+    [0x1F] = { VEMU_VEC_VMSGT,      VEMU_VEC_FORM_VX | VEMU_VEC_FORM_VI },
+    [0x25] = { VEMU_VEC_VSLL,       VEMU_VEC_FORMS_ALL | VEMU_VEC_FORM_UIMM },
+    [0x27] = { VEMU_VEC_VMV_NR,     VEMU_VEC_FORM_VI },
+    [0x28] = { VEMU_VEC_VSRL,       VEMU_VEC_FORMS_ALL | VEMU_VEC_FORM_UIMM },
+    [0x29] = { VEMU_VEC_VSRA,       VEMU_VEC_FORMS_ALL | VEMU_VEC_FORM_UIMM },
+};
+
+/* The unary groups at 0x10 and 0x14 are told apart by vs1 or vs2 in
+   vemu_vec_decode_opm() */
+static vemu_vec_funct6_t const vemu_vec_opm[64] = {
+    [0x00] = { VEMU_VEC_VREDSUM,    VEMU_VEC_FORM_VV },
+    [0x01] = { VEMU_VEC_VREDAND,    VEMU_VEC_FORM_VV },
+    [0x02] = { VEMU_VEC_VREDOR,     VEMU_VEC_FORM_VV },
+    [0x03] = { VEMU_VEC_VREDXOR,    VEMU_VEC_FORM_VV },
+    [0x04] = { VEMU_VEC_VREDMINU,   VEMU_VEC_FORM_VV },
+    [0x05] = { VEMU_VEC_VREDMIN,    VEMU_VEC_FORM_VV },
+    [0x06] = { VEMU_VEC_VREDMAXU,   VEMU_VEC_FORM_VV },
+    [0x07] = { VEMU_VEC_VREDMAX,    VEMU_VEC_FORM_VV },
+    [0x0E] = { VEMU_VEC_VSLIDE1UP,  VEMU_VEC_FORM_VX },
+    [0x0F] = { VEMU_VEC_VSLIDE1DOWN, VEMU_VEC_FORM_VX },
+    [0x10] = { VEMU_VEC_VMV_X_S,    VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x14] = { VEMU_VEC_VID,        VEMU_VEC_FORM_VV },
+    [0x18] = { VEMU_VEC_VMANDN,     VEMU_VEC_FORM_VV },
+    [0x19] = { VEMU_VEC_VMAND,      VEMU_VEC_FORM_VV },
+    [0x1A] = { VEMU_VEC_VMOR,       VEMU_VEC_FORM_VV },
+    [0x1B] = { VEMU_VEC_VMXOR,      VEMU_VEC_FORM_VV },
+    [0x1C] = { VEMU_VEC_VMORN,      VEMU_VEC_FORM_VV },
+    [0x1D] = { VEMU_VEC_VMNAND,     VEMU_VEC_FORM_VV },
+    [0x1E] = { VEMU_VEC_VMNOR,      VEMU_VEC_FORM_VV },
+    [0x1F] = { VEMU_VEC_VMXNOR,     VEMU_VEC_FORM_VV },
+    [0x25] = { VEMU_VEC_VMUL,       VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x29] = { VEMU_VEC_VMADD,      VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x2B] = { VEMU_VEC_VNMSUB,     VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x2D] = { VEMU_VEC_VMACC,      VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+    [0x2F] = { VEMU_VEC_VNMSAC,     VEMU_VEC_FORM_VV | VEMU_VEC_FORM_VX },
+};
+
+/* Ops that write SEW-wide elements of vd, which must not be v0 when
+   they are masked */
+static bool vemu_vec_writes_elements(vemu_vec_opcode_t op) {
+    switch (op) {
+        case VEMU_VEC_VLE:
+        case VEMU_VEC_VLSE:
+        case VEMU_VEC_VLXEI:
+        case VEMU_VEC_VMERGE:
+        case VEMU_VEC_VID:
+        case VEMU_VEC_VSLIDEUP:
+        case VEMU_VEC_VSLIDEDOWN:
+        case VEMU_VEC_VSLIDE1UP:
+        case VEMU_VEC_VSLIDE1DOWN:
+            return true;
+
+        default:
+            return op >= VEMU_VEC_VADD && op <= VEMU_VEC_VNMSUB;
+    }
+}
+
+/* Whether a unary OPMVV or OPMVX instruction is one we have, and which.
+   Those that take no mask must have vm set. */
+static int vemu_vec_decode_unary(int op, uint32_t funct3, uint32_t vs1,
+                                 uint32_t vs2, uint32_t vm) {
+    bool mvx = funct3 == 6;
+
+    switch (op) {
+        case VEMU_VEC_VMV_X_S:
+            if (mvx) {
+                return vs2 == 0 && vm ? VEMU_VEC_VMV_S_X : -1;
+            }
+            if (vs1 == 0) {
+                return vm ? VEMU_VEC_VMV_X_S : -1;
+            }
+            return vs1 == 0x10 ? VEMU_VEC_VCPOP
+                 : vs1 == 0x11 ? VEMU_VEC_VFIRST : -1;
+
+        case VEMU_VEC_VID:
+            return vs1 == 0x11 && vs2 == 0 ? VEMU_VEC_VID : -1;
+
+        case VEMU_VEC_VMANDN:
+        case VEMU_VEC_VMAND:
+        case VEMU_VEC_VMOR:
+        case VEMU_VEC_VMXOR:
+        case VEMU_VEC_VMORN:
+        case VEMU_VEC_VMNAND:
+        case VEMU_VEC_VMNOR:
+        case VEMU_VEC_VMXNOR:
+            return vm ? op : -1;
+
+        default:
+            return op;
+    }
+}
+
+static void vemu_vec_decode_arith(uint32_t instr, vemu_decoded_t *dec) {
+    uint32_t vd = (instr >> 7) & 0x1F;
+    uint32_t funct3 = (instr >> 12) & 0x7;
+    uint32_t vs1 = (instr >> 15) & 0x1F;
+    uint32_t vs2 = (instr >> 20) & 0x1F;
+    uint32_t vm = (instr >> 25) & 1;
+    uint32_t funct6 = instr >> 26;
+    vemu_vec_funct6_t const *entry;
+    uint32_t form;
+
+    switch (funct3) {
+        case 0:
+        case 2:
+            form = VEMU_VEC_FORM_VV;
+            break;
+
+        case 3:
+            form = VEMU_VEC_FORM_VI;
+            break;
+
+        case 4:
+        case 6:
+            form = VEMU_VEC_FORM_VX;
+            break;
+
+        default:
+            return;
+    }
+
+    entry = funct3 == 2 || funct3 == 6 ? &vemu_vec_opm[funct6]
+                                       : &vemu_vec_opi[funct6];
+    if ((entry->forms & form) == 0) {
+        return;
+    }
+
+    int op = vemu_vec_decode_unary(entry->op, funct3, vs1, vs2, vm);
+    uint32_t field = form == VEMU_VEC_FORM_VV ? VEMU_VEC_VV
+                   : form == VEMU_VEC_FORM_VX ? VEMU_VEC_VX : VEMU_VEC_VI;
+
+    switch (op) {
+        case VEMU_VEC_VMERGE:
+            if (vm && vs2 != 0) {
+                return;
+            }
+            if (vm) {
+                op = VEMU_VEC_VMV_V;
+            }
+            break;
+
+        /* vmv<nr>r.v with nr - 1 in the immediate */
+        case VEMU_VEC_VMV_NR:
+            if (!vm || (vs1 != 0 && vs1 != 1 && vs1 != 3 && vs1 != 7)) {
+                return;
+            }
+            field = vs1 + 1;
+            break;
+
+        default:
+            break;
+    }
+    if (op < 0 || (!vm && vd == 0 && vemu_vec_writes_elements(op))) {
+        return;
+    }
+
+    dec->opcode = VEMU_OPCODE_VEC;
+    dec->rd = 0;
+    dec->rs1 = 0;
+    dec->rs2 = 0;
+    dec->imm = 0;
+
+    if (form == VEMU_VEC_FORM_VX) {
+        dec->rs1 = vs1;
+    } else if (form == VEMU_VEC_FORM_VI && op != VEMU_VEC_VMV_NR) {
+        dec->imm = entry->forms & VEMU_VEC_FORM_UIMM
+                   ? vs1 : (uint32_t)((int32_t)(vs1 << 27) >> 27);
+    }
+    if (op == VEMU_VEC_VMV_X_S || op == VEMU_VEC_VCPOP
+            || op == VEMU_VEC_VFIRST) {
+        dec->rd = vd;
+        vd = 0;
+    }
+    if (op >= VEMU_VEC_VMV_X_S && op <= VEMU_VEC_VID) {
+        vs1 = 0;
+    }
+
+    dec->imm2 = VEMU_VEC_OP(op, vd, form == VEMU_VEC_FORM_VV ? vs1 : 0, vs2,
+                            vm, field);
+}
+
+static void vemu_vec_decode_config(uint32_t instr, vemu_decoded_t *dec) {
+    uint32_t rd = (instr >> 7) & 0x1F;
+    uint32_t rs1 = (instr >> 15) & 0x1F;
+    uint32_t rs2 = (instr >> 20) & 0x1F;
+    uint32_t avl = rs1 != 0 ? VEMU_VEC_AVL_REG
+                 : rd != 0 ? VEMU_VEC_AVL_MAX : VEMU_VEC_AVL_KEEP;
+
+    dec->opcode = VEMU_OPCODE_VEC;
+    dec->rd = rd;
+    dec->rs1 = rs1;
+    dec->rs2 = 0;
+    dec->imm = 0;
+
+    if ((instr >> 31) == 0) {
+        dec->imm2 = VEMU_VEC_CONFIG(VEMU_VEC_VSETVLI, (instr >> 20) & 0x7FF,
+                                    avl);
+    } else if ((instr >> 30) == 0x3) {
+        dec->rs1 = 0;
+        dec->imm = rs1;
+        dec->imm2 = VEMU_VEC_CONFIG(VEMU_VEC_VSETIVLI, (instr >> 20) & 0x3FF,
+                                    VEMU_VEC_AVL_REG);
+    } else if ((instr >> 25) == 0x40) {
+        dec->rs2 = rs2;
+        dec->imm2 = VEMU_VEC_CONFIG(VEMU_VEC_VSETVL, 0, avl);
+    } else {
+        dec->opcode = VEMU_OPCODE_ILLEGAL;
+    }
+}
+
+/* Widths 0, 5 and 6 are elements of 8, 16 and 32 bits; Zve32x has no
+   64-bit ones. Segment accesses are left out. Fault-only-first loads
+   never fault here, so they are plain unit-stride loads. */
+static void vemu_vec_decode_memory(uint32_t instr, vemu_decoded_t *dec) {
+    bool store = (instr & 0x7F) == VEMU_OPCODE_R_STORE_FP;
+    uint32_t vd = (instr >> 7) & 0x1F;
+    uint32_t width = (instr >> 12) & 0x7;
+    uint32_t rs1 = (instr >> 15) & 0x1F;
+    uint32_t umop = (instr >> 20) & 0x1F;
+    uint32_t vm = (instr >> 25) & 1;
+    uint32_t mop = (instr >> 26) & 0x3;
+    uint32_t mew = (instr >> 28) & 1;
+    uint32_t nf = instr >> 29;
+    uint32_t eew = width == 0 ? 0 : width - 4;
+    uint32_t field = eew;
+    uint32_t rs2 = 0, vs2 = 0;
+    int op = -1;
+
+    if (mew || width == 7 || (nf != 0 && !(mop == 0 && umop == 0x08))) {
+        return;
+    }
+
+    switch (mop) {
+        case 0:
+            if (umop == 0x08 && vm && (nf & (nf + 1)) == 0
+                    && (!store || eew == 0)) {
+                op = store ? VEMU_VEC_VSR : VEMU_VEC_VLR;
+                field = eew | nf << 2;
+            } else if (umop == 0x0B && vm && eew == 0) {
+                op = store ? VEMU_VEC_VSM : VEMU_VEC_VLM;
+            } else if (umop == 0 || (umop == 0x10 && !store)) {
+                op = store ? VEMU_VEC_VSE : VEMU_VEC_VLE;
+            }
+            break;
+
+        case 2:
+            op = store ? VEMU_VEC_VSSE : VEMU_VEC_VLSE;
+            rs2 = umop;
+            break;
+
+        default:
+            op = store ? VEMU_VEC_VSXEI : VEMU_VEC_VLXEI;
+            vs2 = umop;
+            break;
+    }
+    if (op < 0 || (!store && !vm && vd == 0)) {
+        return;
+    }
+
+    dec->opcode = VEMU_OPCODE_VEC;
+    dec->rd = 0;
+    dec->rs1 = rs1;
+    dec->rs2 = rs2;
+    dec->imm = 0;
+    dec->imm2 = VEMU_VEC_OP(op, vd, 0, vs2, vm, field);
+}
+
+void vemu_vec_decode(uint32_t instr, vemu_decoded_t *dec) {
+    switch (instr & 0x7F) {
+        case VEMU_OPCODE_R_LOAD_FP:
+        case VEMU_OPCODE_R_STORE_FP:
+            vemu_vec_decode_memory(instr, dec);
+            break;
+
+        default:
+            if (((instr >> 12) & 0x7) == 7) {
+                vemu_vec_decode_config(instr, dec);
+            } else {
+                vemu_vec_decode_arith(instr, dec);
+            }
+            break;
+    }
+}
+
+void vemu_vec_disassemble(vemu_decoded_t *dec) {
+    static char const *const forms[] = { "vv", "vx", "vi" };
+    uint32_t op = dec->imm2;
+    vemu_vec_opcode_t opcode = VEMU_VEC_OPCODE(op);
+    char const *name = vemu_vec_names[opcode];
+    uint32_t vd = (op >> 8) & 0x1F;
+    uint32_t vs1 = (op >> 13) & 0x1F;
+    uint32_t vs2 = (op >> 18) & 0x1F;
+    bool vm = (op >> 23) & 1;
+    uint32_t field = op >> 24;
+    char const *mask = vm ? "" : ",v0.t";
+    char const *xd = vemu_register_name(dec->rd);
+    char const *xs1 = vemu_register_name(dec->rs1);
+    char const *xs2 = vemu_register_name(dec->rs2);
+
+    switch (opcode) {
+        case VEMU_VEC_VSETVLI:
+        case VEMU_VEC_VSETIVLI:
+            fprintf(stderr, "%s %s,", name, xd);
+            if (opcode == VEMU_VEC_VSETIVLI) {
+                fprintf(stderr, "%" PRIu32, dec->imm);
+            } else {
+                fprintf(stderr, "%s", xs1);
+            }
+            fprintf(stderr, ",0x%" PRIx32 "\n", (op >> 8) & 0x7FF);
+            break;
+
+        case VEMU_VEC_VSETVL:
+            fprintf(stderr, "%s %s,%s,%s\n", name, xd, xs1, xs2);
+            break;
+
+        case VEMU_VEC_VLE:
+        case VEMU_VEC_VSE:
+        case VEMU_VEC_VLSE:
+        case VEMU_VEC_VSSE:
+            fprintf(stderr, "%s%d.v v%" PRIu32 ",(%s)", name, 8 << field, vd,
+                    xs1);
+            if (opcode == VEMU_VEC_VLSE || opcode == VEMU_VEC_VSSE) {
+                fprintf(stderr, ",%s", xs2);
+            }
+            fprintf(stderr, "%s\n", mask);
+            break;
+
+        case VEMU_VEC_VLXEI:
+        case VEMU_VEC_VSXEI:
+            fprintf(stderr, "%s%d.v v%" PRIu32 ",(%s),v%" PRIu32 "%s\n", name,
+                    8 << field, vd, xs1, vs2, mask);
+            break;
+
+        case VEMU_VEC_VLM:
+        case VEMU_VEC_VSM:
+            fprintf(stderr, "%s.v v%" PRIu32 ",(%s)\n", name, vd, xs1);
+            break;
+
+        case VEMU_VEC_VLR:
+            fprintf(stderr, "%s%" PRIu32 "re%d.v v%" PRIu32 ",(%s)\n", name,
+                    (field >> 2) + 1, 8 << (field & 0x3), vd, xs1);
+            break;
+
+        case VEMU_VEC_VSR:
+            fprintf(stderr, "%s%" PRIu32 "r.v v%" PRIu32 ",(%s)\n", name,
+                    (field >> 2) + 1, vd, xs1);
+            break;
+
+        case VEMU_VEC_VMV_NR:
+            fprintf(stderr, "%s%" PRIu32 "r.v v%" PRIu32 ",v%" PRIu32 "\n",
+                    name, field, vd, vs2);
+            break;
+
+        case VEMU_VEC_VMV_X_S:
+            fprintf(stderr, "%s %s,v%" PRIu32 "\n", name, xd, vs2);
+            break;
+
+        case VEMU_VEC_VMV_S_X:
+            fprintf(stderr, "%s v%" PRIu32 ",%s\n", name, vd, xs1);
+            break;
+
+        case VEMU_VEC_VCPOP:
+        case VEMU_VEC_VFIRST:
+            fprintf(stderr, "%s %s,v%" PRIu32 "%s\n", name, xd, vs2, mask);
+            break;
+
+        case VEMU_VEC_VID:
+            fprintf(stderr, "%s v%" PRIu32 "%s\n", name, vd, mask);
+            break;
+
+        case VEMU_VEC_VMANDN:
+        case VEMU_VEC_VMAND:
+        case VEMU_VEC_VMOR:
+        case VEMU_VEC_VMXOR:
+        case VEMU_VEC_VMORN:
+        case VEMU_VEC_VMNAND:
+        case VEMU_VEC_VMNOR:
+        case VEMU_VEC_VMXNOR:
+            fprintf(stderr, "%s.mm v%" PRIu32 ",v%" PRIu32 ",v%" PRIu32 "\n",
+                    name, vd, vs2, vs1);
+            break;
+
+        /* Multiply-adds name vs1 or rs1 before vs2 */
+        default: {
+            bool ternary = opcode >= VEMU_VEC_VMACC
+                        && opcode <= VEMU_VEC_VNMSUB;
+            char src[16];
+
+            if (field == VEMU_VEC_VV) {
+                snprintf(src, sizeof(src), "v%" PRIu32, vs1);
+            } else if (field == VEMU_VEC_VX) {
+                snprintf(src, sizeof(src), "%s", xs1);
+            } else {
+                snprintf(src, sizeof(src), "%" PRId32, (int32_t)dec->imm);
+            }
+
+            fprintf(stderr, "%s.%s%s v%" PRIu32, name,
+                    opcode >= VEMU_VEC_VREDSUM && opcode <= VEMU_VEC_VREDMAX
+                    ? "vs" : opcode == VEMU_VEC_VMV_V ? forms[field] + 1
+                    : forms[field],
+                    opcode == VEMU_VEC_VMERGE ? "m" : "", vd);
+            if (opcode == VEMU_VEC_VMV_V) {
+                fprintf(stderr, ",%s\n", src);
+            } else if (ternary) {
+                fprintf(stderr, ",%s,v%" PRIu32 "%s\n", src, vs2, mask);
+            } else {
+                fprintf(stderr, ",v%" PRIu32 ",%s%s\n", vs2, src,
+                        opcode == VEMU_VEC_VMERGE ? ",v0" : mask);
+            }
+            break;
+        }
+    }
+}